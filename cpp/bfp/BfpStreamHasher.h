@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_bfp_BfpStreamHasher_H
+#define bitmunk_bfp_BfpStreamHasher_H
+
+#include "bitmunk/common/TypeDefinitions.h"
+#include "monarch/io/InputStream.h"
+
+namespace bitmunk
+{
+namespace bfp
+{
+
+/**
+ * A BfpStreamHasher is implemented by a Bfp that can generate a FileInfo's
+ * ID from a stream of the file's data instead of reading the file itself,
+ * so that the caller can share a single read of the file with other
+ * readers, ie: data inspectors.
+ *
+ * This interface is separate from Bfp so that the Bfp interface, which
+ * BFP libraries for the current BFP API version are built against, does
+ * not change. A caller checks whether a Bfp supports stream hashing with
+ * a dynamic_cast to BfpStreamHasher.
+ *
+ * @author Dave Longley
+ */
+class BfpStreamHasher
+{
+public:
+   /**
+    * Creates a new BfpStreamHasher.
+    */
+   BfpStreamHasher() {};
+
+   /**
+    * Destructs this BfpStreamHasher.
+    */
+   virtual ~BfpStreamHasher() {};
+
+   /**
+    * Sets a FileInfo's ID and content size from a stream of the file's data.
+    * The stream is read to its end but it is not closed.
+    *
+    * @param fi the FileInfo to update.
+    * @param is the stream with the file's data from its beginning.
+    *
+    * @return true if successful, false if an Exception occurred.
+    */
+   virtual bool setFileInfoIdFromStream(
+      bitmunk::common::FileInfo& fi, monarch::io::InputStream* is) = 0;
+};
+
+} // end namespace bfp
+} // end namespace bitmunk
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/common/ContentSink.h"
+
+#include <cstring>
+
+using namespace std;
+using namespace monarch::crypto;
+using namespace bitmunk::common;
+
+void ContentSink::append(const char* str)
+{
+   append(str, strlen(str));
+}
+
+void ContentSink::push_back(char c)
+{
+   append(&c, 1);
+}
+
+StringContentSink::StringContentSink(string& str) :
+   mString(str)
+{
+}
+
+StringContentSink::~StringContentSink()
+{
+}
+
+void StringContentSink::append(const char* b, unsigned int length)
+{
+   mString.append(b, length);
+}
+
+HashContentSink::HashContentSink(HashAlgorithm* hash) :
+   mLength(0)
+{
+   if(hash != NULL)
+   {
+      mHashes.push_back(hash);
+   }
+}
+
+HashContentSink::~HashContentSink()
+{
+}
+
+void HashContentSink::addHash(HashAlgorithm* hash)
+{
+   mHashes.push_back(hash);
+}
+
+void HashContentSink::append(const char* b, unsigned int length)
+{
+   for(vector<HashAlgorithm*>::iterator i = mHashes.begin();
+       i != mHashes.end(); ++i)
+   {
+      (*i)->update(b, length);
+   }
+   mLength += length;
+}
+
+uint64_t HashContentSink::getLength()
+{
+   return mLength;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_common_ContentSink_H
+#define bitmunk_common_ContentSink_H
+
+#include "monarch/crypto/HashAlgorithm.h"
+
+#include <string>
+#include <vector>
+
+namespace bitmunk
+{
+namespace common
+{
+
+/**
+ * A ContentSink receives the canonical content of an object that is to be
+ * hashed, signed, or verified. The Signer writes content to a ContentSink
+ * piece by piece so that the content never has to be built as a whole.
+ *
+ * @author Dave Longley
+ */
+class ContentSink
+{
+public:
+   /**
+    * Creates a new ContentSink.
+    */
+   ContentSink() {};
+
+   /**
+    * Destructs this ContentSink.
+    */
+   virtual ~ContentSink() {};
+
+   /**
+    * Appends some bytes to the content.
+    *
+    * @param b the bytes to append.
+    * @param length the number of bytes to append.
+    */
+   virtual void append(const char* b, unsigned int length) = 0;
+
+   /**
+    * Appends a null-terminated string to the content.
+    *
+    * @param str the string to append.
+    */
+   virtual void append(const char* str);
+
+   /**
+    * Appends a single character to the content.
+    *
+    * @param c the character to append.
+    */
+   virtual void push_back(char c);
+};
+
+/**
+ * A StringContentSink appends content to a string.
+ *
+ * @author Dave Longley
+ */
+class StringContentSink : public ContentSink
+{
+protected:
+   /**
+    * The string to append to.
+    */
+   std::string& mString;
+
+public:
+   /**
+    * Creates a new StringContentSink.
+    *
+    * @param str the string to append to.
+    */
+   StringContentSink(std::string& str);
+
+   /**
+    * Destructs this StringContentSink.
+    */
+   virtual ~StringContentSink();
+
+   /**
+    * Appends some bytes to the string.
+    *
+    * @param b the bytes to append.
+    * @param length the number of bytes to append.
+    */
+   virtual void append(const char* b, unsigned int length);
+   using ContentSink::append;
+};
+
+/**
+ * A HashContentSink updates one or more HashAlgorithms (MessageDigests or
+ * DigitalSignatures) with content as it is appended.
+ *
+ * @author Dave Longley
+ */
+class HashContentSink : public ContentSink
+{
+protected:
+   /**
+    * The HashAlgorithms to update.
+    */
+   std::vector<monarch::crypto::HashAlgorithm*> mHashes;
+
+   /**
+    * The number of bytes appended so far.
+    */
+   uint64_t mLength;
+
+public:
+   /**
+    * Creates a new HashContentSink.
+    *
+    * @param hash the first HashAlgorithm to update, NULL for none.
+    */
+   HashContentSink(monarch::crypto::HashAlgorithm* hash = NULL);
+
+   /**
+    * Destructs this HashContentSink.
+    */
+   virtual ~HashContentSink();
+
+   /**
+    * Adds another HashAlgorithm to update. It should be added before any
+    * content is appended.
+    *
+    * @param hash the HashAlgorithm to update.
+    */
+   virtual void addHash(monarch::crypto::HashAlgorithm* hash);
+
+   /**
+    * Updates the HashAlgorithms with some bytes.
+    *
+    * @param b the bytes to append.
+    * @param length the number of bytes to append.
+    */
+   virtual void append(const char* b, unsigned int length);
+   using ContentSink::append;
+
+   /**
+    * Gets the number of bytes appended so far.
+    *
+    * @return the number of bytes appended.
+    */
+   virtual uint64_t getLength();
+};
+
+} // end namespace common
+} // end namespace bitmunk
+#endif
@@ -1,16 +1,34 @@
 /*
- * Copyright (c) 2007-2009 Digital Bazaar, Inc. All rights reserved.
+ * Copyright (c) 2007-2010 Digital Bazaar, Inc. All rights reserved.
  */
 #include "bitmunk/common/PublicKeyCache.h"
 
+#include "monarch/rt/System.h"
+
+#include <cstring>
+
 using namespace std;
 using namespace monarch::crypto;
+using namespace monarch::rt;
 using namespace bitmunk::common;
 
-PublicKeyCache::PublicKeyCache(unsigned int capacity)
+#define PKC_STATE "bitmunk.common.PublicKeyCache."
+
+PublicKeyCache::PublicKeyCache(unsigned int capacity) :
+   mShardCapacity(0),
+   mNegativeTtl(10000),
+   mKeySource(NULL),
+   mMonitor(NULL)
 {
-   mCapacity = capacity;
-   mKeySource = NULL;
+   for(unsigned int i = 0; i < SHARD_COUNT; ++i)
+   {
+      Shard& shard = mShards[i];
+      shard.hits = shard.misses = shard.coalesced = 0;
+      shard.fetchCount = shard.fetchTime = 0;
+      shard.reportedHits = shard.reportedMisses = shard.reportedCoalesced = 0;
+      shard.reportedFetchCount = shard.reportedFetchTime = 0;
+   }
+   setCapacity(capacity);
 }
 
 PublicKeyCache::~PublicKeyCache()
@@ -20,26 +38,14 @@ PublicKeyCache::~PublicKeyCache()
 void PublicKeyCache::addPublicKey(
    UserId uid, ProfileId pid, PublicKeyRef& key, bool isDelegate)
 {
-   mCacheLock.lock();
-   {
-      // remove ids from map and list
-      IdPair p = make_pair(uid, pid);
-      mKeyMap.erase(p);
-      mIdList.remove(p);
-      
-      // add ids to map and front of list
-      mKeyMap[p] = make_pair(key, isDelegate);
-      mIdList.push_front(p);
-      
-      if(mIdList.size() > mCapacity)
-      {
-         // remove oldest (last in list) id pair
-         p = mIdList.back();
-         mIdList.pop_back();
-         mKeyMap.erase(p);
-      }
+   IdPair p = make_pair(uid, pid);
+   Shard& shard = getShard(p);
+   shard.lock.lock();
+   {
+      ExceptionRef e(NULL);
+      addEntry(shard, p, key, isDelegate, 0, e);
    }
-   mCacheLock.unlock();
+   shard.lock.unlock();
 }
 
 PublicKeyRef PublicKeyCache::getPublicKey(
@@ -47,63 +53,363 @@ PublicKeyRef PublicKeyCache::getPublicKey(
 {
    PublicKeyRef rval(NULL);
    bool delegate = false;
-   
-   mCacheLock.lock();
+   ExceptionRef e(NULL);
+
+   IdPair p = make_pair(uid, pid);
+   Shard& shard = getShard(p);
+   FetchRef fetch(NULL);
+   bool leader = false;
+   DynamicObject adjustment(NULL);
+   bool reportNow = false;
+
+   shard.lock.lock();
    {
-      IdPair p = make_pair(uid, pid);
-      KeyMap::iterator i = mKeyMap.find(p);
-      if(i != mKeyMap.end())
+      EntryMap::iterator i = shard.entries.find(p);
+      if(i != shard.entries.end() &&
+         i->second.expires != 0 &&
+         i->second.expires <= System::getCurrentMilliseconds())
       {
-         rval = i->second.first;
-         delegate = i->second.second;
+         // negative entry has expired
+         shard.lru.erase(i->second.lru);
+         shard.entries.erase(i);
+         i = shard.entries.end();
+      }
+
+      if(i != shard.entries.end())
+      {
+         // cache hit (possibly negative), mark as most recently used
+         rval = i->second.key;
+         delegate = i->second.isDelegate;
+         e = i->second.exception;
+         shard.lru.splice(shard.lru.begin(), shard.lru, i->second.lru);
+         ++shard.hits;
       }
       else if(mKeySource != NULL)
       {
-         // try to obtain public key from source
-         mCacheLock.unlock();
-         rval = mKeySource->getPublicKey(uid, pid, &delegate);
-         mCacheLock.lock();
+         ++shard.misses;
+
+         // join a fetch that is in flight or start a new one
+         FetchMap::iterator fi = shard.inFlight.find(p);
+         if(fi != shard.inFlight.end())
+         {
+            fetch = fi->second;
+            ++shard.coalesced;
+         }
+         else
+         {
+            fetch = new Fetch;
+            fetch->isDelegate = false;
+            fetch->done = false;
+            shard.inFlight[p] = fetch;
+            leader = true;
+         }
+      }
+      reportNow = takeReport(shard, false, adjustment);
+   }
+   shard.lock.unlock();
+
+   if(reportNow)
+   {
+      report(adjustment);
+   }
+
+   if(fetch.isNull())
+   {
+      // hit or no key source to fetch from
+   }
+   else if(leader)
+   {
+      // try to obtain public key from source without holding the lock
+      uint64_t start = System::getCurrentMilliseconds();
+      rval = mKeySource->getPublicKey(uid, pid, &delegate);
+      uint64_t now = System::getCurrentMilliseconds();
+      if(rval.isNull() && Exception::isSet())
+      {
+         e = Exception::get();
+      }
+
+      shard.lock.lock();
+      {
+         // add public key to cache, or a negative entry if the source
+         // says that the key does not exist, other failures may be
+         // transient so the next lookup fetches again
          if(!rval.isNull())
          {
-            // add public key to cache
-            addPublicKey(uid, pid, rval, delegate);
+            addEntry(shard, p, rval, delegate, 0, e);
+         }
+         else if(mNegativeTtl > 0 && isNotFound(e))
+         {
+            addEntry(shard, p, rval, false, now + mNegativeTtl, e);
          }
+
+         // wake up waiting threads
+         fetch->key = rval;
+         fetch->isDelegate = delegate;
+         fetch->exception = e;
+         fetch->done = true;
+         shard.inFlight.erase(p);
+         ++shard.fetchCount;
+         shard.fetchTime += (now - start);
+         shard.lock.notifyAll();
+
+         // a fetch is slow anyway, so report the shard's counters now
+         reportNow = takeReport(shard, true, adjustment);
+      }
+      shard.lock.unlock();
+
+      if(reportNow)
+      {
+         report(adjustment);
       }
    }
-   mCacheLock.unlock();
-   
+   else
+   {
+      // wait for the fetch in flight
+      shard.lock.lock();
+      while(!fetch->done)
+      {
+         shard.lock.wait();
+      }
+      shard.lock.unlock();
+      rval = fetch->key;
+      delegate = fetch->isDelegate;
+      e = fetch->exception;
+   }
+
+   // a key that could not be obtained reports why
+   if(rval.isNull() && !e.isNull())
+   {
+      Exception::set(e);
+   }
+
    // return whether or not public key belongs to a delegate
    if(isDelegate != NULL)
    {
       *isDelegate = delegate;
    }
-   
+
    return rval;
 }
 
 void PublicKeyCache::setCapacity(unsigned int capacity)
 {
-   mCacheLock.lock();
+   // divide capacity between shards, rounding up
+   unsigned int shardCapacity = (capacity + SHARD_COUNT - 1) / SHARD_COUNT;
+   mShardCapacity = shardCapacity;
+   for(unsigned int i = 0; i < SHARD_COUNT; ++i)
    {
-      mCapacity = capacity;
+      Shard& shard = mShards[i];
+      shard.lock.lock();
+      {
+         while(shard.entries.size() > shardCapacity)
+         {
+            shard.entries.erase(shard.lru.back());
+            shard.lru.pop_back();
+         }
+      }
+      shard.lock.unlock();
    }
-   mCacheLock.unlock();
+}
+
+void PublicKeyCache::setNegativeTtl(uint32_t ttl)
+{
+   mNegativeTtl = ttl;
 }
 
 void PublicKeyCache::setPublicKeySource(PublicKeySource* source)
 {
-   mCacheLock.lock();
+   mKeySource = source;
+}
+
+void PublicKeyCache::setStateMonitor(StateMonitor* monitor)
+{
+   // report counters to the old monitor, then only report new lookups
+   publishStats();
+
+   if(monitor != NULL)
+   {
+      DynamicObject si;
+      si[PKC_STATE "hits"]["init"] = (uint64_t)0;
+      si[PKC_STATE "misses"]["init"] = (uint64_t)0;
+      si[PKC_STATE "coalesced"]["init"] = (uint64_t)0;
+      si[PKC_STATE "fetches"]["init"] = (uint64_t)0;
+      si[PKC_STATE "fetchTime"]["init"] = (uint64_t)0;
+      if(!monitor->addStates(si))
+      {
+         // states already exist, keep counting from their current values
+         Exception::clear();
+      }
+   }
+   mMonitor = monitor;
+}
+
+void PublicKeyCache::publishStats()
+{
+   for(unsigned int i = 0; i < SHARD_COUNT; ++i)
+   {
+      Shard& shard = mShards[i];
+      DynamicObject adjustment(NULL);
+      bool reportNow;
+      shard.lock.lock();
+      {
+         reportNow = takeReport(shard, true, adjustment);
+      }
+      shard.lock.unlock();
+
+      if(reportNow)
+      {
+         report(adjustment);
+      }
+   }
+}
+
+DynamicObject PublicKeyCache::getStats()
+{
+   DynamicObject rval;
+
+   uint64_t entries = 0;
+   uint64_t hits = 0;
+   uint64_t misses = 0;
+   uint64_t coalesced = 0;
+   uint64_t fetches = 0;
+   uint64_t fetchTime = 0;
+   for(unsigned int i = 0; i < SHARD_COUNT; ++i)
    {
-      mKeySource = source;
+      Shard& shard = mShards[i];
+      shard.lock.lock();
+      {
+         entries += shard.entries.size();
+         hits += shard.hits;
+         misses += shard.misses;
+         coalesced += shard.coalesced;
+         fetches += shard.fetchCount;
+         fetchTime += shard.fetchTime;
+      }
+      shard.lock.unlock();
    }
-   mCacheLock.unlock();
+
+   rval["entries"] = entries;
+   rval["hits"] = hits;
+   rval["misses"] = misses;
+   rval["coalesced"] = coalesced;
+   rval["fetches"] = fetches;
+   rval["fetchTime"] = fetchTime;
+
+   return rval;
 }
 
 void PublicKeyCache::clear()
 {
-   mCacheLock.lock();
+   for(unsigned int i = 0; i < SHARD_COUNT; ++i)
+   {
+      Shard& shard = mShards[i];
+      shard.lock.lock();
+      {
+         shard.entries.clear();
+         shard.lru.clear();
+      }
+      shard.lock.unlock();
+   }
+}
+
+PublicKeyCache::Shard& PublicKeyCache::getShard(IdPair& p)
+{
+   // mix the ids so that a user's profiles spread across shards
+   uint64_t h = p.first * 31 + p.second;
+   h ^= (h >> 17);
+   return mShards[h % SHARD_COUNT];
+}
+
+void PublicKeyCache::addEntry(
+   Shard& shard, IdPair& p, PublicKeyRef& key,
+   bool isDelegate, uint64_t expires, ExceptionRef& e)
+{
+   EntryMap::iterator i = shard.entries.find(p);
+   if(i == shard.entries.end())
+   {
+      // add new entry to the front of the list
+      shard.lru.push_front(p);
+      i = shard.entries.insert(make_pair(p, Entry())).first;
+      i->second.lru = shard.lru.begin();
+   }
+   else
+   {
+      // move existing entry to the front of the list
+      shard.lru.splice(shard.lru.begin(), shard.lru, i->second.lru);
+   }
+   i->second.key = key;
+   i->second.isDelegate = isDelegate;
+   i->second.expires = expires;
+   i->second.exception = e;
+
+   // remove least recently used entries
+   while(shard.entries.size() > mShardCapacity)
+   {
+      shard.entries.erase(shard.lru.back());
+      shard.lru.pop_back();
+   }
+}
+
+bool PublicKeyCache::takeReport(
+   Shard& shard, bool force, DynamicObject& adjustment)
+{
+   bool rval = false;
+
+   uint64_t lookups =
+      (shard.hits - shard.reportedHits) +
+      (shard.misses - shard.reportedMisses);
+   if(force || lookups >= REPORT_INTERVAL)
+   {
+      if(mMonitor != NULL &&
+         (lookups > 0 || shard.fetchCount != shard.reportedFetchCount))
+      {
+         adjustment = DynamicObject();
+         adjustment[PKC_STATE "hits"] = shard.hits - shard.reportedHits;
+         adjustment[PKC_STATE "misses"] = shard.misses - shard.reportedMisses;
+         adjustment[PKC_STATE "coalesced"] =
+            shard.coalesced - shard.reportedCoalesced;
+         adjustment[PKC_STATE "fetches"] =
+            shard.fetchCount - shard.reportedFetchCount;
+         adjustment[PKC_STATE "fetchTime"] =
+            shard.fetchTime - shard.reportedFetchTime;
+         rval = true;
+      }
+
+      // without a monitor the counters are dropped
+      shard.reportedHits = shard.hits;
+      shard.reportedMisses = shard.misses;
+      shard.reportedCoalesced = shard.coalesced;
+      shard.reportedFetchCount = shard.fetchCount;
+      shard.reportedFetchTime = shard.fetchTime;
+   }
+
+   return rval;
+}
+
+void PublicKeyCache::report(DynamicObject& adjustment)
+{
+   StateMonitor* monitor = mMonitor;
+   if(monitor != NULL && !monitor->adjustStates(adjustment))
    {
-      mKeyMap.clear();
+      Exception::clear();
    }
-   mCacheLock.unlock();
+}
+
+bool PublicKeyCache::isNotFound(ExceptionRef& e)
+{
+   bool rval = false;
+
+   // check the exception and its causes
+   ExceptionRef cause = e;
+   while(!rval && !cause.isNull())
+   {
+      const char* type = cause->getType();
+      size_t length = strlen(type);
+      rval =
+         cause->getCode() == 404 ||
+         (length >= 8 && strcmp(type + length - 8, "NotFound") == 0);
+      cause = cause->getCause();
+   }
+
+   return rval;
 }
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2007-2008 Digital Bazaar, Inc.  All rights reserved.
+ * Copyright (c) 2007-2010 Digital Bazaar, Inc.  All rights reserved.
  */
 #ifndef bitmunk_common_PublicKeyCache_H
 #define bitmunk_common_PublicKeyCache_H
@@ -7,6 +7,7 @@
 #include "monarch/rt/ExclusiveLock.h"
 #include "monarch/crypto/PublicKey.h"
 #include "bitmunk/common/PublicKeySource.h"
+#include "bitmunk/common/StateMonitor.h"
 
 #include <map>
 #include <list>
@@ -18,60 +19,168 @@ namespace common
 
 /**
  * A PublicKeyCache is used to cache PublicKeys for quick retrieval.
- * 
+ *
+ * The cache is split into shards by <UserId,ProfileId> so that concurrent
+ * lookups for different keys rarely contend for the same lock. Each shard
+ * keeps its own least recently used list and evicts from it in constant
+ * time once its share of the capacity is reached.
+ *
+ * When a key is not cached, only one thread fetches it from the
+ * PublicKeySource. Other threads that want the same key while the fetch is
+ * in flight wait for its result. If the source reports that the key does not
+ * exist (a "not found" exception or one with a 404 code), a negative entry
+ * is cached for a short time so that repeated requests for an unknown key do
+ * not each cause a remote fetch. Other failures (ie: network or server
+ * errors) are not cached.
+ *
+ * If a StateMonitor is set, the cache reports the following states. Each
+ * shard only reports its counters after every REPORT_INTERVAL lookups and
+ * after every fetch, so that hits do not take the monitor's lock, call
+ * publishStats() to report all counters:
+ *
+ * bitmunk.common.PublicKeyCache.hits: lookups answered by the cache.
+ * bitmunk.common.PublicKeyCache.misses: lookups that had to fetch or wait.
+ * bitmunk.common.PublicKeyCache.coalesced: misses that waited for another
+ *    thread's fetch.
+ * bitmunk.common.PublicKeyCache.fetches: fetches from the key source.
+ * bitmunk.common.PublicKeyCache.fetchTime: total fetch time in milliseconds.
+ *
  * @author Dave Longley
  */
 class PublicKeyCache : public PublicKeySource
 {
 protected:
    /**
-    * A map of <UserId,ProfileId> pairs to <PublicKey,isDelegate> pairs.
+    * A <UserId,ProfileId> pair.
     */
    typedef std::pair<UserId, ProfileId> IdPair;
-   typedef std::pair<monarch::crypto::PublicKeyRef, bool> PublicKeyPair;
-   typedef std::map<IdPair, PublicKeyPair> KeyMap;
-   KeyMap mKeyMap;
-   
+   typedef std::list<IdPair> IdList;
+
    /**
-    * A list of <UserId,ProfileId> pairs that have PublicKeys in this cache,
-    * in the order they were added.
+    * A cached key. A negative entry has a NULL key, an expiration time, and
+    * the exception that was raised when the key could not be fetched.
     */
-   typedef std::list<IdPair> IdList;
-   IdList mIdList;
-   
+   struct Entry
+   {
+      monarch::crypto::PublicKeyRef key;
+      bool isDelegate;
+      uint64_t expires;
+      monarch::rt::ExceptionRef exception;
+      IdList::iterator lru;
+   };
+   typedef std::map<IdPair, Entry> EntryMap;
+
+   /**
+    * A fetch that is in flight.
+    */
+   struct Fetch
+   {
+      monarch::crypto::PublicKeyRef key;
+      bool isDelegate;
+      bool done;
+      monarch::rt::ExceptionRef exception;
+   };
+   typedef monarch::rt::Collectable<Fetch> FetchRef;
+   typedef std::map<IdPair, FetchRef> FetchMap;
+
+   /**
+    * A shard of the cache.
+    */
+   struct Shard
+   {
+      /**
+       * The cached entries.
+       */
+      EntryMap entries;
+
+      /**
+       * The cached ids, most recently used first.
+       */
+      IdList lru;
+
+      /**
+       * The fetches in flight.
+       */
+      FetchMap inFlight;
+
+      /**
+       * A lock for manipulating the shard, also used to wait for fetches.
+       */
+      monarch::rt::ExclusiveLock lock;
+
+      /**
+       * Statistics.
+       */
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t coalesced;
+      uint64_t fetchCount;
+      uint64_t fetchTime;
+
+      /**
+       * The statistics that have been reported to the StateMonitor.
+       */
+      uint64_t reportedHits;
+      uint64_t reportedMisses;
+      uint64_t reportedCoalesced;
+      uint64_t reportedFetchCount;
+      uint64_t reportedFetchTime;
+   };
+
+   /**
+    * The number of shards.
+    */
+   static const unsigned int SHARD_COUNT = 16;
+
+   /**
+    * The number of lookups in a shard between reports to the StateMonitor.
+    */
+   static const unsigned int REPORT_INTERVAL = 64;
+
+   /**
+    * The shards.
+    */
+   Shard mShards[SHARD_COUNT];
+
    /**
-    * The capacity for this cache.
+    * The capacity of each shard.
     */
-   unsigned int mCapacity;
-   
+   unsigned int mShardCapacity;
+
+   /**
+    * The number of milliseconds to cache a negative entry for.
+    */
+   uint32_t mNegativeTtl;
+
    /**
     * A PublicKeySource used to obtain PublicKeys when they cannot
-    * be found in this cache. 
+    * be found in this cache.
     */
    PublicKeySource* mKeySource;
-   
+
    /**
-    * A lock used for manipulation the cache.
+    * The StateMonitor to report to, NULL for none.
     */
-   monarch::rt::ExclusiveLock mCacheLock;
-   
+   StateMonitor* mMonitor;
+
 public:
    /**
     * Creates a new PublicKeyCache with the given capacity.
-    * 
+    *
     * @param capacity the maximum number of keys to store in this cache before
-    *                 removing the oldest key when adding a new one.
+    *                 removing the least recently used key when adding a new
+    *                 one.
     */
    PublicKeyCache(unsigned int capacity = 100);
-   
+
    /**
     * Destructs this PublicKeyCache.
     */
    virtual ~PublicKeyCache();
-   
+
    /**
     * Adds a PublicKey to this cache.
-    * 
+    *
     * @param uid the UserId associated with the PublicKey.
     * @param pid the ProfileId associated with the PublicKey.
     * @param key the PublicKey.
@@ -81,44 +190,141 @@ public:
    virtual void addPublicKey(
       UserId uid, ProfileId pid,
       monarch::crypto::PublicKeyRef& key, bool isDelegate);
-   
+
    /**
     * Gets a PublicKey from this cache.
-    * 
+    *
     * @param uid the UserId associated with the PublicKey.
     * @param pid the ProfileId associated with the PublicKey.
     * @param isDelegate to be set to true if the PublicKey belongs to
     *                   a delegate, false if not (NULL for don't care).
-    * 
+    *
     * @return the PublicKey or NULL if none could be obtained.
     */
    virtual monarch::crypto::PublicKeyRef getPublicKey(
       UserId uid, ProfileId pid, bool* isDelegate);
-   
+
    /**
-    * Sets the capacity for this cache. If the capacity of this cache is
-    * reached when trying to add a new public key to it, the public key
-    * that was added first (the oldest entry) will be removed to accomodate
+    * Sets the capacity for this cache. The capacity is divided between the
+    * shards of the cache, if a shard is full when trying to add a new public
+    * key to it, its least recently used key will be removed to accomodate
     * the new key.
-    * 
+    *
     * @param capacity the capacity for this cache.
     */
    virtual void setCapacity(unsigned int capacity);
-   
+
+   /**
+    * Sets the number of milliseconds that a key that could not be obtained
+    * from the PublicKey source is remembered as missing.
+    *
+    * @param ttl the time to live for negative entries, 0 to disable
+    *            negative caching.
+    */
+   virtual void setNegativeTtl(uint32_t ttl);
+
    /**
     * Sets the PublicKey source for this cache. This is the source that
     * PublicKeys will be retrieved from if they cannot be found in this
     * cache.
-    * 
+    *
     * @param source the PublicKeySource to retrieve keys from when they
     *               cannot be found in this cache.
     */
    virtual void setPublicKeySource(PublicKeySource* source);
-   
+
+   /**
+    * Sets the StateMonitor to report statistics to. The monitor's states
+    * for this cache are added when it is set. Any statistics that have not
+    * been reported to a previous monitor are reported to it first.
+    *
+    * @param monitor the StateMonitor to use, NULL for none.
+    */
+   virtual void setStateMonitor(StateMonitor* monitor);
+
+   /**
+    * Reports all statistics that have not been reported yet to the
+    * StateMonitor, if one is set.
+    */
+   virtual void publishStats();
+
+   /**
+    * Gets the statistics for this cache:
+    *
+    * {
+    *    "entries": the number of cached entries (including negative ones),
+    *    "hits": lookups answered by the cache,
+    *    "misses": lookups that had to fetch or wait for a fetch,
+    *    "coalesced": misses that waited for another thread's fetch,
+    *    "fetches": fetches from the key source,
+    *    "fetchTime": total fetch time in milliseconds
+    * }
+    *
+    * @return the statistics.
+    */
+   virtual monarch::rt::DynamicObject getStats();
+
    /**
     * Clears the cache.
     */
    virtual void clear();
+
+protected:
+   /**
+    * Gets the shard for a <UserId,ProfileId> pair.
+    *
+    * @param p the id pair.
+    *
+    * @return the shard.
+    */
+   virtual Shard& getShard(IdPair& p);
+
+   /**
+    * Adds an entry to a shard, replacing any existing entry for the same
+    * ids and evicting the least recently used entry if the shard is full.
+    * The shard lock must be held.
+    *
+    * @param shard the shard.
+    * @param p the id pair.
+    * @param key the PublicKey, NULL for a negative entry.
+    * @param isDelegate true if the PublicKey belongs to a delegate.
+    * @param expires the time the entry expires, 0 for never.
+    * @param e the exception for a negative entry.
+    */
+   virtual void addEntry(
+      Shard& shard, IdPair& p, monarch::crypto::PublicKeyRef& key,
+      bool isDelegate, uint64_t expires, monarch::rt::ExceptionRef& e);
+
+   /**
+    * Takes the statistics of a shard that have not been reported yet. The
+    * shard lock must be held.
+    *
+    * @param shard the shard.
+    * @param force true to take them regardless of how many lookups there
+    *              have been since the last report.
+    * @param adjustment to be set to the adjustment to report.
+    *
+    * @return true if there is an adjustment to report, false if not.
+    */
+   virtual bool takeReport(
+      Shard& shard, bool force, monarch::rt::DynamicObject& adjustment);
+
+   /**
+    * Reports an adjustment to the StateMonitor, if one is set.
+    *
+    * @param adjustment the adjustment.
+    */
+   virtual void report(monarch::rt::DynamicObject& adjustment);
+
+   /**
+    * Returns true if an exception from a PublicKeySource means that the key
+    * does not exist, rather than that it could not be fetched right now.
+    *
+    * @param e the exception.
+    *
+    * @return true if the key does not exist, false if not.
+    */
+   static bool isNotFound(monarch::rt::ExceptionRef& e);
 };
 
 } // end namespace common
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/common/SignatureCache.h"
+
+#include "monarch/crypto/AsymmetricKeyFactory.h"
+#include "monarch/crypto/MessageDigest.h"
+#include "monarch/util/Convert.h"
+
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+using namespace monarch::crypto;
+using namespace monarch::rt;
+using namespace monarch::util;
+using namespace bitmunk::common;
+
+SignatureCache::SignatureCache(unsigned int capacity) :
+   mCapacity(capacity),
+   mHits(0),
+   mMisses(0)
+{
+}
+
+SignatureCache::~SignatureCache()
+{
+}
+
+bool SignatureCache::verify(
+   PublicKeyRef& pkey,
+   const char* data, unsigned int length, const char* signature)
+{
+   bool rval;
+
+   // only the digest is needed to find a cached result
+   MessageDigest md;
+   md.start("SHA1");
+   md.update(data, length);
+   string digest = md.getDigest();
+
+   if(!getResult(pkey, digest.c_str(), signature, rval))
+   {
+      DigitalSignature ds(pkey);
+      ds.update(data, length);
+      rval = verifySignature(ds, signature);
+      addResult(pkey, digest.c_str(), signature, rval);
+   }
+
+   return rval;
+}
+
+bool SignatureCache::getResult(
+   PublicKeyRef& pkey, const char* digest, const char* signature,
+   bool& verified)
+{
+   bool rval = false;
+
+   mLock.lock();
+   {
+      if(mCapacity > 0)
+      {
+         EntryMap::iterator i = mEntries.find(
+            createKey(pkey, digest, signature));
+         if(i != mEntries.end())
+         {
+            // mark as most recently used
+            verified = i->second.verified;
+            mLru.splice(mLru.begin(), mLru, i->second.lru);
+            rval = true;
+         }
+      }
+      rval ? ++mHits : ++mMisses;
+   }
+   mLock.unlock();
+
+   return rval;
+}
+
+void SignatureCache::addResult(
+   PublicKeyRef& pkey, const char* digest, const char* signature,
+   bool verified)
+{
+   mLock.lock();
+   {
+      if(mCapacity > 0)
+      {
+         string key = createKey(pkey, digest, signature);
+         if(mEntries.find(key) == mEntries.end())
+         {
+            mLru.push_front(key);
+            Entry& entry = mEntries[key];
+            entry.verified = verified;
+            entry.lru = mLru.begin();
+            prune();
+         }
+      }
+   }
+   mLock.unlock();
+}
+
+void SignatureCache::setCapacity(unsigned int capacity)
+{
+   mLock.lock();
+   {
+      mCapacity = capacity;
+      prune();
+   }
+   mLock.unlock();
+}
+
+DynamicObject SignatureCache::getStats()
+{
+   DynamicObject rval;
+
+   mLock.lock();
+   {
+      rval["entries"] = (uint64_t)mEntries.size();
+      rval["hits"] = mHits;
+      rval["misses"] = mMisses;
+   }
+   mLock.unlock();
+
+   return rval;
+}
+
+void SignatureCache::clear()
+{
+   mLock.lock();
+   {
+      mEntries.clear();
+      mLru.clear();
+      mFingerprints.clear();
+   }
+   mLock.unlock();
+}
+
+string SignatureCache::createFingerprint(PublicKeyRef& pkey)
+{
+   AsymmetricKeyFactory afk;
+   string pem = afk.writePublicKeyToPem(pkey);
+
+   MessageDigest md;
+   md.start("SHA1");
+   md.update(pem.c_str(), pem.length());
+   return md.getDigest();
+}
+
+bool SignatureCache::verifySignature(
+   DigitalSignature& ds, const char* signature)
+{
+   bool rval = false;
+
+   // decode signature from hex to binary
+   unsigned int length = strlen(signature);
+   if(length > 0 && length <= MAX_SIGNATURE_LENGTH * 2)
+   {
+      char* decoded = (char*)malloc(length / 2 + 1);
+      unsigned int decodedLength = length;
+      if(Convert::hexToBytes(signature, length, decoded, decodedLength))
+      {
+         rval = ds.verify(decoded, decodedLength);
+      }
+      free(decoded);
+   }
+
+   return rval;
+}
+
+string SignatureCache::createKey(
+   PublicKeyRef& pkey, const char* digest, const char* signature)
+{
+   // find the key's fingerprint, the same keys are used over and over
+   FingerprintMap::iterator i = mFingerprints.find(&(*pkey));
+   if(i == mFingerprints.end())
+   {
+      if(mFingerprints.size() >= FINGERPRINT_CAPACITY)
+      {
+         mFingerprints.clear();
+      }
+      i = mFingerprints.insert(make_pair(&(*pkey), Fingerprint())).first;
+      i->second.key = pkey;
+      i->second.value = createFingerprint(pkey);
+   }
+
+   // key fingerprint + content digest + signature
+   string rval = i->second.value;
+   rval.push_back('|');
+   rval.append(digest);
+   rval.push_back('|');
+   rval.append(signature);
+   return rval;
+}
+
+void SignatureCache::prune()
+{
+   while(mEntries.size() > mCapacity)
+   {
+      mEntries.erase(mLru.back());
+      mLru.pop_back();
+   }
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_common_SignatureCache_H
+#define bitmunk_common_SignatureCache_H
+
+#include "monarch/crypto/DigitalSignature.h"
+#include "monarch/crypto/PublicKey.h"
+#include "monarch/rt/DynamicObject.h"
+#include "monarch/rt/ExclusiveLock.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+namespace bitmunk
+{
+namespace common
+{
+
+/**
+ * A SignatureCache remembers the results of signature verifications so
+ * that the same signed content does not have to be verified again when it
+ * is checked at several points along the way.
+ *
+ * A result is keyed by the fingerprint of the PublicKey, the digest of the
+ * signed content, and the signature itself, so a cached result can only be
+ * reused for exactly the same key, content, and signature. Once the cache
+ * reaches its capacity, the least recently used result is removed.
+ *
+ * The fingerprint of each PublicKey is remembered along with a reference to
+ * the key, so a key that is used again (ie: one from the PublicKeyCache) is
+ * only written out and hashed once. Callers should look up a result with
+ * getResult() before feeding content to a DigitalSignature, so that a hit
+ * only costs the content digest.
+ *
+ * @author Dave Longley
+ */
+class SignatureCache
+{
+protected:
+   /**
+    * A cached verification result.
+    */
+   struct Entry
+   {
+      bool verified;
+      std::list<std::string>::iterator lru;
+   };
+   typedef std::map<std::string, Entry> EntryMap;
+
+   /**
+    * The cached results.
+    */
+   EntryMap mEntries;
+
+   /**
+    * The cached keys, most recently used first.
+    */
+   std::list<std::string> mLru;
+
+   /**
+    * The fingerprints of recently used PublicKeys. The reference keeps the
+    * key alive so that its address cannot be reused by another key.
+    */
+   struct Fingerprint
+   {
+      monarch::crypto::PublicKeyRef key;
+      std::string value;
+   };
+   typedef std::map<monarch::crypto::PublicKey*, Fingerprint> FingerprintMap;
+   FingerprintMap mFingerprints;
+
+   /**
+    * The maximum number of results to cache, 0 to disable caching.
+    */
+   unsigned int mCapacity;
+
+   /**
+    * A lock for manipulating the cache.
+    */
+   monarch::rt::ExclusiveLock mLock;
+
+   /**
+    * Statistics.
+    */
+   uint64_t mHits;
+   uint64_t mMisses;
+
+public:
+   /**
+    * Creates a new SignatureCache with the given capacity.
+    *
+    * @param capacity the maximum number of results to cache.
+    */
+   SignatureCache(unsigned int capacity = 1024);
+
+   /**
+    * Destructs this SignatureCache.
+    */
+   virtual ~SignatureCache();
+
+   /**
+    * Verifies a hex-encoded signature on some data, using a cached result
+    * if the same signature on the same data has already been verified with
+    * the same key.
+    *
+    * @param pkey the PublicKey to verify with.
+    * @param data the signed data.
+    * @param length the length of the data.
+    * @param signature the hex-encoded signature (null-terminated).
+    *
+    * @return true if verified, false if not.
+    */
+   virtual bool verify(
+      monarch::crypto::PublicKeyRef& pkey,
+      const char* data, unsigned int length, const char* signature);
+
+   /**
+    * Gets the cached result of verifying a signature.
+    *
+    * @param pkey the PublicKey to verify with.
+    * @param digest the hex-encoded SHA-1 digest of the signed content.
+    * @param signature the hex-encoded signature (null-terminated).
+    * @param verified to be set to the cached result.
+    *
+    * @return true if a result was cached, false if not.
+    */
+   virtual bool getResult(
+      monarch::crypto::PublicKeyRef& pkey, const char* digest,
+      const char* signature, bool& verified);
+
+   /**
+    * Remembers the result of verifying a signature.
+    *
+    * @param pkey the PublicKey that was verified with.
+    * @param digest the hex-encoded SHA-1 digest of the signed content.
+    * @param signature the hex-encoded signature (null-terminated).
+    * @param verified the result.
+    */
+   virtual void addResult(
+      monarch::crypto::PublicKeyRef& pkey, const char* digest,
+      const char* signature, bool verified);
+
+   /**
+    * Sets the capacity of this cache, removing the least recently used
+    * results if there are too many.
+    *
+    * @param capacity the maximum number of results to cache, 0 to disable
+    *                 caching.
+    */
+   virtual void setCapacity(unsigned int capacity);
+
+   /**
+    * Gets the statistics for this cache:
+    *
+    * {
+    *    "entries": the number of cached results,
+    *    "hits": verifications answered by the cache,
+    *    "misses": verifications that had to be performed
+    * }
+    *
+    * @return the statistics.
+    */
+   virtual monarch::rt::DynamicObject getStats();
+
+   /**
+    * Clears the cache.
+    */
+   virtual void clear();
+
+   /**
+    * Creates the fingerprint of a PublicKey.
+    *
+    * @param pkey the PublicKey.
+    *
+    * @return the hex-encoded fingerprint.
+    */
+   static std::string createFingerprint(monarch::crypto::PublicKeyRef& pkey);
+
+   /**
+    * Checks a hex-encoded signature against a DigitalSignature that has been
+    * updated with the signed content. A signature longer than
+    * MAX_SIGNATURE_LENGTH bytes is not verified.
+    *
+    * @param ds the DigitalSignature.
+    * @param signature the hex-encoded signature (null-terminated).
+    *
+    * @return true if verified, false if not.
+    */
+   static bool verifySignature(
+      monarch::crypto::DigitalSignature& ds, const char* signature);
+
+   /**
+    * The maximum length of a signature in bytes (for a 16384-bit key).
+    */
+   static const unsigned int MAX_SIGNATURE_LENGTH = 2048;
+
+   /**
+    * The maximum number of PublicKey fingerprints to remember.
+    */
+   static const unsigned int FINGERPRINT_CAPACITY = 256;
+
+protected:
+   /**
+    * Creates the cache key for a verification. The cache lock must be held.
+    *
+    * @param pkey the PublicKey.
+    * @param digest the hex-encoded digest of the signed content.
+    * @param signature the hex-encoded signature.
+    *
+    * @return the cache key.
+    */
+   virtual std::string createKey(
+      monarch::crypto::PublicKeyRef& pkey,
+      const char* digest, const char* signature);
+
+   /**
+    * Removes the least recently used results until the cache is within its
+    * capacity. The cache lock must be held.
+    */
+   virtual void prune();
+};
+
+} // end namespace common
+} // end namespace bitmunk
+#endif
@@ -4,8 +4,13 @@
 #include "bitmunk/common/Signer.h"
 
 #include "monarch/crypto/DigitalSignature.h"
+#include "monarch/crypto/MessageDigest.h"
+#include "monarch/rt/System.h"
+#include "monarch/rt/Thread.h"
 #include "monarch/util/Convert.h"
 
+#include <vector>
+
 using namespace std;
 using namespace monarch::crypto;
 using namespace monarch::rt;
@@ -17,49 +22,75 @@ bool Signer::sign(ProfileRef& p, string& content, string& signature)
    bool rval;
 
    // create signature
-   DigitalSignature* ds = p->createSignature();
-   if(ds != NULL)
+   DigitalSignature* ds = createSignature(p);
+   if((rval = (ds != NULL)))
    {
       // update signature
       ds->update(content.c_str(), content.length());
+      signature = finishSignature(ds);
+   }
 
-      // get signature value
-      unsigned int length = ds->getValueLength();
-      char sig[length];
-      ds->getValue(sig, length);
-
-      // clean up signature
-      delete ds;
+   return rval;
+}
 
-      // hex-encode signature
-      signature = Convert::bytesToHex(sig, length);
-      rval = true;
-   }
-   else
+DigitalSignature* Signer::createSignature(ProfileRef& p)
+{
+   DigitalSignature* rval = p->createSignature();
+   if(rval == NULL)
    {
       ExceptionRef e = new Exception(
          "Could not sign data. Profile has no private key.",
          "bitmunk.common.MissingPrivateKey");
       Exception::set(e);
-      rval = false;
    }
 
    return rval;
 }
 
+string Signer::finishSignature(DigitalSignature* ds)
+{
+   // get signature value
+   unsigned int length = ds->getValueLength();
+   char sig[length];
+   ds->getValue(sig, length);
+
+   // clean up signature
+   delete ds;
+
+   // hex-encode signature
+   return Convert::bytesToHex(sig, length);
+}
+
+// the cache for verification results
+static SignatureCache sSignatureCache;
+
 bool Signer::verify(PublicKeyRef& pkey, string& content, const char* signature)
 {
    bool rval;
 
-   // create signature
-   DigitalSignature ds(pkey);
+   // verify signature (or get cached result)
+   if(!(rval = sSignatureCache.verify(
+      pkey, content.c_str(), content.length(), signature)))
+   {
+      ExceptionRef e = new Exception(
+         "Could not verify data. DigitalSignature could not be created.",
+         "bitmunk.common.BadPublicKey");
+      Exception::set(e);
+   }
 
-   // verify signature
-   ds.update(content.c_str(), content.length());
-   unsigned int length = strlen(signature);
-   char data[length];
-   Convert::hexToBytes(signature, length, data, length);
-   if(!(rval = ds.verify(data, length)))
+   return rval;
+}
+
+bool Signer::verify(
+   PublicKeyRef& pkey, const char* digest,
+   DigitalSignature& ds, const char* signature)
+{
+   bool rval;
+
+   // verify signature and remember the result
+   rval = SignatureCache::verifySignature(ds, signature);
+   sSignatureCache.addResult(pkey, digest, signature, rval);
+   if(!rval)
    {
       ExceptionRef e = new Exception(
          "Could not verify data. DigitalSignature could not be created.",
@@ -70,35 +101,40 @@ bool Signer::verify(PublicKeyRef& pkey, string& content, const char* signature)
    return rval;
 }
 
-void Signer::appendBasicMediaContent(Media& m, string& str)
+SignatureCache* Signer::getSignatureCache()
+{
+   return &sSignatureCache;
+}
+
+void Signer::appendBasicMediaContent(Media& m, ContentSink& sink)
 {
    // concatenation formula
    // ID + buyerId + expiration + type + owner ID + title +
    // release date + publicDomain + ccLicenses + distribution +
    // contributors
-   str.append(m["id"]->getString());
-   str.append(m["buyerId"]->getString());
-   str.append(m["expiration"]->getString());
-   str.append(m["type"]->getString());
-   str.append(m["ownerId"]->getString());
-   str.append(m["title"]->getString());
-   str.append(m["releaseDate"]->getString());
-   str.append(m["publicDomain"]->getString());
-   str.append(m["ccLicenses"]->getString());
-   str.append(m["distribution"]->getString());
+   sink.append(m["id"]->getString());
+   sink.append(m["buyerId"]->getString());
+   sink.append(m["expiration"]->getString());
+   sink.append(m["type"]->getString());
+   sink.append(m["ownerId"]->getString());
+   sink.append(m["title"]->getString());
+   sink.append(m["releaseDate"]->getString());
+   sink.append(m["publicDomain"]->getString());
+   sink.append(m["ccLicenses"]->getString());
+   sink.append(m["distribution"]->getString());
 
    // handle contributors
    m["contributors"]->setType(Map);
-   appendContributorsContent(m["contributors"], str);
+   appendContributorsContent(m["contributors"], sink);
 }
 
-void Signer::appendMediaContent(Media& m, string& str)
+void Signer::appendMediaContent(Media& m, ContentSink& sink)
 {
    // concatenation formula
    // basic media content +
    // (if collection): basic media content for each in collection in order
    // payees + dataPayees + licenseAmount + piecePayees
-   appendBasicMediaContent(m, str);
+   appendBasicMediaContent(m, sink);
 
    // if collection, append basic media contents for each in collection
    if(strcmp(m["type"]->getString(), "collection") == 0)
@@ -111,7 +147,7 @@ void Signer::appendMediaContent(Media& m, string& str)
          while(mi->hasNext())
          {
             Media& media = mi->next();
-            appendBasicMediaContent(media, str);
+            appendBasicMediaContent(media, sink);
          }
       }
    }
@@ -124,7 +160,7 @@ void Signer::appendMediaContent(Media& m, string& str)
       while(pi->hasNext())
       {
          Payee& p = pi->next();
-         appendPayeeContent(p, str);
+         appendPayeeContent(p, sink);
       }
 
       // handle payee rules
@@ -133,11 +169,11 @@ void Signer::appendMediaContent(Media& m, string& str)
       while(pi->hasNext())
       {
          PayeeRule& pr = pi->next();
-         appendPayeeRuleContent(pr, str);
+         appendPayeeRuleContent(pr, sink);
       }
 
       // handle license amount
-      str.append(m["licenseAmount"]->getString());
+      sink.append(m["licenseAmount"]->getString());
 
       // handle piece payees
       m["piecePayees"]->setType(Array);
@@ -145,12 +181,12 @@ void Signer::appendMediaContent(Media& m, string& str)
       while(pi->hasNext())
       {
          Payee& p = pi->next();
-         appendPayeeContent(p, str);
+         appendPayeeContent(p, sink);
       }
    }
 }
 
-void Signer::appendPayeeContent(Payee& p, string& str)
+void Signer::appendPayeeContent(Payee& p, ContentSink& sink)
 {
    // concatenation formula
    // depends on amountType and amountResolved:
@@ -165,14 +201,14 @@ void Signer::appendPayeeContent(Payee& p, string& str)
    // Other with amountResolved == false:
    // ID + amountType + amountResolved (1) + percentage + taxExempt (1/0)
    // + optional description
-   str.append(p["id"]->getString());
+   sink.append(p["id"]->getString());
 
    const char* amountType = p["amountType"]->getString();
-   str.append(amountType);
+   sink.append(amountType);
 
    if(strcmp(amountType, PAYEE_AMOUNT_TYPE_FLATFEE) == 0)
    {
-      str.append(p["amount"]->getString());
+      sink.append(p["amount"]->getString());
    }
    else
    {
@@ -180,16 +216,16 @@ void Signer::appendPayeeContent(Payee& p, string& str)
       if(p["amountResolved"]->getBoolean())
       {
          // payee resolved
-         str.push_back('1');
-         str.append(p["amount"]->getString());
+         sink.push_back('1');
+         sink.append(p["amount"]->getString());
       }
       else
       {
          // payee not resolved
-         str.push_back('0');
+         sink.push_back('0');
       }
 
-      str.append(p["percentage"]->getString());
+      sink.append(p["percentage"]->getString());
    }
 
    // FIXME: here for backwards compatibility
@@ -197,24 +233,25 @@ void Signer::appendPayeeContent(Payee& p, string& str)
    {
       p["taxExempt"] = p["nontaxable"];
    }
-   str.push_back(p["taxExempt"]->getBoolean() ? '1' : '0');
+   sink.push_back(p["taxExempt"]->getBoolean() ? '1' : '0');
 
    if(p->hasMember("description"))
    {
-      str.append(p["description"]->getString());
+      sink.append(p["description"]->getString());
    }
 }
 
-void Signer::appendPayeeRuleContent(PayeeRule& pr, string& str)
+void Signer::appendPayeeRuleContent(PayeeRule& pr, ContentSink& sink)
 {
    // concatenation formula
    // media ID + type + value
-   str.append(pr["mediaId"]->getString());
-   str.append(pr["type"]->getString());
-   str.append(pr["value"]->getString());
+   sink.append(pr["mediaId"]->getString());
+   sink.append(pr["type"]->getString());
+   sink.append(pr["value"]->getString());
 }
 
-void Signer::appendContributorsContent(DynamicObject& contributors, string& str)
+void Signer::appendContributorsContent(
+   DynamicObject& contributors, ContentSink& sink)
 {
    // concatenation formula
    // contributor type name +
@@ -227,24 +264,25 @@ void Signer::appendContributorsContent(DynamicObject& contributors, string& str)
    while(ti->hasNext())
    {
       DynamicObject& type = ti->next();
-      str.append(ti->getName());
+      sink.append(ti->getName());
 
       DynamicObjectIterator ci = type.getIterator();
       while(ci->hasNext())
       {
          DynamicObject& c = ci->next();
-         str.append(c["id"]->getString());
-         str.append(c["name"]->getString());
-         str.append(c["ownerId"]->getString());
-         str.append(c["role"]->getString());
-         str.append(c["roleId"]->getString());
-         str.append(c["description"]->getString());
-         str.append(c["type"]->getString());
+         sink.append(c["id"]->getString());
+         sink.append(c["name"]->getString());
+         sink.append(c["ownerId"]->getString());
+         sink.append(c["role"]->getString());
+         sink.append(c["roleId"]->getString());
+         sink.append(c["description"]->getString());
+         sink.append(c["type"]->getString());
       }
    }
 }
 
-void Signer::appendContractSectionContent(ContractSection& cs, string& str)
+void Signer::appendContractSectionContent(
+   ContractSection& cs, ContentSink& sink)
 {
    // concatenation formula:
    // buyer content + seller content + alpha negotiation terms + ware content
@@ -258,18 +296,18 @@ void Signer::appendContractSectionContent(ContractSection& cs, string& str)
    // add buyer details
    if(cs["buyer"]->hasMember("delegateId"))
    {
-      str.append(cs["buyer"]["delegateId"]->getString());
+      sink.append(cs["buyer"]["delegateId"]->getString());
    }
-   str.append(cs["buyer"]["profileId"]->getString());
-   str.append(cs["buyer"]["userId"]->getString());
-   str.append(cs["buyer"]["username"]->getString());
+   sink.append(cs["buyer"]["profileId"]->getString());
+   sink.append(cs["buyer"]["userId"]->getString());
+   sink.append(cs["buyer"]["username"]->getString());
 
    // add seller details
-   str.append(cs["seller"]["profileId"]->getString());
-   str.append(cs["seller"]["serverId"]->getString());
-   str.append(cs["seller"]["url"]->getString());
-   str.append(cs["seller"]["userId"]->getString());
-   str.append(cs["seller"]["username"]->getString());
+   sink.append(cs["seller"]["profileId"]->getString());
+   sink.append(cs["seller"]["serverId"]->getString());
+   sink.append(cs["seller"]["url"]->getString());
+   sink.append(cs["seller"]["userId"]->getString());
+   sink.append(cs["seller"]["username"]->getString());
 
    // add negotiation terms
    // FIXME: when we start using this, this code should ENFORCE
@@ -279,26 +317,26 @@ void Signer::appendContractSectionContent(ContractSection& cs, string& str)
    while(i->hasNext())
    {
       DynamicObject& next = i->next();
-      str.append(next->getString());
+      sink.append(next->getString());
    }
 
    // add ware content
-   appendWareContent(cs["ware"], str);
+   appendWareContent(cs["ware"], sink);
 }
 
-void Signer::appendWareContent(Ware& w, string& str)
+void Signer::appendWareContent(Ware& w, ContentSink& sink)
 {
    // concatenation formula
    // ID + media ID + fileInfos + payees
-   str.append(w["id"]->getString());
-   str.append(w["mediaId"]->getString());
+   sink.append(w["id"]->getString());
+   sink.append(w["mediaId"]->getString());
 
    w["fileInfos"]->setType(Array);
    DynamicObjectIterator i = w["fileInfos"].getIterator();
    while(i->hasNext())
    {
       FileInfo& fi = i->next();
-      appendFileInfoContent(fi, str);
+      appendFileInfoContent(fi, sink);
    }
 
    w["payees"]->setType(Array);
@@ -306,73 +344,73 @@ void Signer::appendWareContent(Ware& w, string& str)
    while(i->hasNext())
    {
       Payee& p = i->next();
-      appendPayeeContent(p, str);
+      appendPayeeContent(p, sink);
    }
 }
 
-void Signer::appendFileInfoContent(FileInfo& fi, string& str)
+void Signer::appendFileInfoContent(FileInfo& fi, ContentSink& sink)
 {
    // Note: Bitmunk < 3.2 (used ID + size + mediaId)
    // Bitmunk >= 3.2 uses (ID + contentSize + mediaId)
 
    // concatenation formula
    // ID + contentSize + mediaId
-   str.append(fi["id"]->getString());
-   str.append(fi["contentSize"]->getString());
-   str.append(fi["mediaId"]->getString());
+   sink.append(fi["id"]->getString());
+   sink.append(fi["contentSize"]->getString());
+   sink.append(fi["mediaId"]->getString());
 }
 
 void Signer::appendFilePieceContent(
-   const char* csHash, FileId fileId, FilePiece& fp, string& str)
+   const char* csHash, FileId fileId, FilePiece& fp, ContentSink& sink)
 {
    // concatenation formula
    // csHash + fileId + ciphered ("true"/"false") + index + size
    // + if(ciphered) open key data + encrypted piece key data
    // ciphered must be true for peerbuy and must be false for webbuy
-   str.append(csHash);
-   str.append(fileId);
-   str.append(fp["ciphered"]->getString());
-   str.append(fp["index"]->getString());
-   str.append(fp["size"]->getString());
+   sink.append(csHash);
+   sink.append(fileId);
+   sink.append(fp["ciphered"]->getString());
+   sink.append(fp["index"]->getString());
+   sink.append(fp["size"]->getString());
    if(fp["ciphered"]->getBoolean())
    {
-      str.append(fp["openKey"]["data"]->getString());
-      str.append(fp["pieceKey"]["data"]->getString());
+      sink.append(fp["openKey"]["data"]->getString());
+      sink.append(fp["pieceKey"]["data"]->getString());
    }
 }
 
-void Signer::appendAddressContent(Address& a, string& str)
+void Signer::appendAddressContent(Address& a, ContentSink& sink)
 {
    // concatenation formula
    // street + locality + region + postalCode + countryCode
-   str.append(a["street"]->getString());
-   str.append(a["locality"]->getString());
-   str.append(a["region"]->getString());
-   str.append(a["postalCode"]->getString());
-   str.append(a["countryCode"]->getString());
+   sink.append(a["street"]->getString());
+   sink.append(a["locality"]->getString());
+   sink.append(a["region"]->getString());
+   sink.append(a["postalCode"]->getString());
+   sink.append(a["countryCode"]->getString());
 }
 
-void Signer::appendCreditCardContent(CreditCard& c, string& str)
+void Signer::appendCreditCardContent(CreditCard& c, ContentSink& sink)
 {
    // concatenation formula
    // type + number + expMonth + expYear + cvm + Address
-   str.append(c["type"]->getString());
-   str.append(c["number"]->getString());
-   str.append(c["expMonth"]->getString());
-   str.append(c["expMonth"]->getString());
-   str.append(c["cvm"]->getString());
-   appendAddressContent(c["address"], str);
+   sink.append(c["type"]->getString());
+   sink.append(c["number"]->getString());
+   sink.append(c["expMonth"]->getString());
+   sink.append(c["expMonth"]->getString());
+   sink.append(c["cvm"]->getString());
+   appendAddressContent(c["address"], sink);
 }
 
-void Signer::appendDepositContent(Deposit& d, string& str)
+void Signer::appendDepositContent(Deposit& d, ContentSink& sink)
 {
    // concatenation formula
    // version 1:
    // type + date + (type relevant info) + payees + total
    // version 2:
    // type + date + gateway + (type relevant info) + payees + total
-   str.append(d["type"]->getString());
-   str.append(d["date"]->getString());
+   sink.append(d["type"]->getString());
+   sink.append(d["date"]->getString());
 
    // handle signature version
    if(d->hasMember("signatureVersion"))
@@ -380,14 +418,14 @@ void Signer::appendDepositContent(Deposit& d, string& str)
       uint32_t version = d["signatureVersion"]->getUInt32();
       if(version == 2)
       {
-         str.append(d["gateway"]->getString());
+         sink.append(d["gateway"]->getString());
       }
    }
 
    // FIXME: only supports credit cards for now
    if(strcmp(d["type"]->getString(), "creditcard") == 0)
    {
-      appendCreditCardContent(d["source"], str);
+      appendCreditCardContent(d["source"], sink);
    }
 
    d["payees"]->setType(Array);
@@ -395,24 +433,24 @@ void Signer::appendDepositContent(Deposit& d, string& str)
    while(i->hasNext())
    {
       Payee& p = i->next();
-      appendPayeeContent(p, str);
+      appendPayeeContent(p, sink);
    }
 
-   str.append(d["total"]->getString());
+   sink.append(d["total"]->getString());
 }
 
 bool Signer::signMedia(Media& m, ProfileRef& p)
 {
    bool rval;
 
-   // get concatenated media content
-   string content;
-   appendMediaContent(m, content);
-
-   // sign content
-   string signature;
-   if((rval = sign(p, content, signature)))
+   // sign media content as it is produced
+   DigitalSignature* ds = createSignature(p);
+   if((rval = (ds != NULL)))
    {
+      HashContentSink sink(ds);
+      appendMediaContent(m, sink);
+      string signature = finishSignature(ds);
+
       // store signature in Media
       m["signature"] = signature.c_str();
       m["signer"]["userId"] = p->getUserId();
@@ -437,12 +475,25 @@ bool Signer::verifyMedia(Media& m, PublicKeyRef& pkey)
    }
    else
    {
-      // get concatenated media content
-      string content;
-      appendMediaContent(m, content);
+      // serialize media content once into both the digest that keys the
+      // signature cache and the signature, the signature only has to be
+      // checked if it has not been verified on the same content before
+      MessageDigest md;
+      md.start("SHA1");
+      DigitalSignature ds(pkey);
+      HashContentSink sink(&md);
+      sink.addHash(&ds);
+      appendMediaContent(m, sink);
+      string digest = md.getDigest();
+      const char* signature = m["signature"]->getString();
+      bool verified;
+      if(!sSignatureCache.getResult(pkey, digest.c_str(), signature, verified))
+      {
+         verified = verify(pkey, digest.c_str(), ds, signature);
+      }
 
       // verify signature
-      if(!verify(pkey, content, m["signature"]->getString()))
+      if(!verified)
       {
          ExceptionRef e = new Exception(
             "Could not verify Media, the signature did not match.",
@@ -510,14 +561,14 @@ bool Signer::signContractSection(
 {
    bool rval;
 
-   // get concatenated contract section content
-   string content;
-   appendContractSectionContent(cs, content);
-
-   // sign content
-   string signature;
-   if((rval = sign(p, content, signature)))
+   // sign contract section content as it is produced
+   DigitalSignature* ds = createSignature(p);
+   if((rval = (ds != NULL)))
    {
+      HashContentSink sink(ds);
+      appendContractSectionContent(cs, sink);
+      string signature = finishSignature(ds);
+
       // store signature in ContractSection
       if(seller)
       {
@@ -562,12 +613,48 @@ bool Signer::verifyContractSection(
 
    if(rval)
    {
-      // get concatenated contract section content
-      string content;
-      appendContractSectionContent(cs, content);
+      // serialize contract section content once into the digest that keys
+      // the signature cache and both signatures, the signatures only have
+      // to be checked if they have not been verified on the same content
+      // before
+      MessageDigest md;
+      md.start("SHA1");
+      DigitalSignature sellerDs(sellerKey);
+      DigitalSignature* buyerDs = (buyerKey == NULL) ?
+         NULL : new DigitalSignature(*buyerKey);
+      HashContentSink sink(&md);
+      sink.addHash(&sellerDs);
+      if(buyerDs != NULL)
+      {
+         sink.addHash(buyerDs);
+      }
+      appendContractSectionContent(cs, sink);
+      string digest = md.getDigest();
+
+      // check the cache before verifying each signature
+      const char* sellerSignature = cs["sellerSignature"]->getString();
+      bool sellerVerified;
+      if(!sSignatureCache.getResult(
+         sellerKey, digest.c_str(), sellerSignature, sellerVerified))
+      {
+         sellerVerified = verify(
+            sellerKey, digest.c_str(), sellerDs, sellerSignature);
+      }
+      bool buyerVerified = true;
+      if(buyerDs != NULL)
+      {
+         const char* buyerSignature = cs["buyerSignature"]->getString();
+         if(!sSignatureCache.getResult(
+            *buyerKey, digest.c_str(), buyerSignature, buyerVerified))
+         {
+            buyerVerified = verify(
+               *buyerKey, digest.c_str(), *buyerDs, buyerSignature);
+         }
+         delete buyerDs;
+      }
 
       // verify seller's signature
-      if(!verify(sellerKey, content, cs["sellerSignature"]->getString()))
+      if(!sellerVerified)
       {
          // code 0 for seller signature failure
          ExceptionRef e = new Exception(
@@ -578,17 +665,14 @@ bool Signer::verifyContractSection(
       }
 
       // check buyer signature as appropriate
-      if(buyerKey != NULL)
+      if(!buyerVerified)
       {
-         if(!verify(*buyerKey, content, cs["buyerSignature"]->getString()))
-         {
-            // code 1 for buyer signature failure
-            ExceptionRef e = new Exception(
-               "Could not verify ContractSection, the buyer signature did "
-               "not match.", "bitmunk.common.VerifyContractSection", 1);
-            Exception::set(e);
-            rval = false;
-         }
+         // code 1 for buyer signature failure
+         ExceptionRef e = new Exception(
+            "Could not verify ContractSection, the buyer signature did "
+            "not match.", "bitmunk.common.VerifyContractSection", 1);
+         Exception::set(e);
+         rval = false;
       }
    }
 
@@ -600,14 +684,14 @@ bool Signer::signFilePiece(
 {
    bool rval;
 
-   // get concatenated file piece content
-   string content;
-   appendFilePieceContent(csHash, fileId, fp, content);
-
-   // sign content
-   string signature;
-   if((rval = sign(p, content, signature)))
+   // sign file piece content as it is produced
+   DigitalSignature* ds = createSignature(p);
+   if((rval = (ds != NULL)))
    {
+      HashContentSink sink(ds);
+      appendFilePieceContent(csHash, fileId, fp, sink);
+      string signature = finishSignature(ds);
+
       if(seller)
       {
          // store signature in FilePiece
@@ -646,12 +730,25 @@ bool Signer::verifyFilePiece(
    }
    else
    {
-      // get concatenated file piece content
-      string content;
-      appendFilePieceContent(csHash, fileId, fp, content);
+      // serialize file piece content once into both the digest that keys
+      // the signature cache and the signature, the signature only has to be
+      // checked if it has not been verified on the same content before
+      MessageDigest md;
+      md.start("SHA1");
+      DigitalSignature ds(pkey);
+      HashContentSink sink(&md);
+      sink.addHash(&ds);
+      appendFilePieceContent(csHash, fileId, fp, sink);
+      string digest = md.getDigest();
+      const char* signature = fp[sigKey]->getString();
+      bool verified;
+      if(!sSignatureCache.getResult(pkey, digest.c_str(), signature, verified))
+      {
+         verified = verify(pkey, digest.c_str(), ds, signature);
+      }
 
       // verify signature
-      if(!verify(pkey, content, fp[sigKey]->getString()))
+      if(!verified)
       {
          ExceptionRef e = new Exception(
             "Could not verify FilePiece, the signature did not match.",
@@ -666,19 +763,145 @@ bool Signer::verifyFilePiece(
    return rval;
 }
 
+namespace bitmunk
+{
+namespace common
+{
+
+/**
+ * A FilePieceVerifier verifies the signatures on a shared list of FilePieces,
+ * taking the next unverified piece until there are none left. Several
+ * verifiers may run on the same list at once.
+ */
+class FilePieceVerifier : public Runnable
+{
+public:
+   const char* csHash;
+   FileId fileId;
+   FilePieceList pieces;
+   PublicKeyRef pkey;
+   bool seller;
+   int next;
+   DynamicObject failed;
+   ExclusiveLock lock;
+
+   FilePieceVerifier() : next(0)
+   {
+      failed->setType(Array);
+   };
+   virtual ~FilePieceVerifier() {};
+   virtual void run()
+   {
+      int length = pieces->length();
+      bool done = false;
+      while(!done)
+      {
+         // get next piece to verify
+         int index;
+         lock.lock();
+         {
+            index = next++;
+         }
+         lock.unlock();
+
+         if(index >= length)
+         {
+            done = true;
+         }
+         else if(!Signer::verifyFilePiece(
+            csHash, fileId, pieces[index], pkey, seller))
+         {
+            // record failure, exceptions are per-thread so they are not kept
+            Exception::clear();
+            lock.lock();
+            {
+               failed->append() = index;
+            }
+            lock.unlock();
+         }
+      }
+   }
+};
+
+} // end namespace common
+} // end namespace bitmunk
+
+bool Signer::verifyFilePieces(
+   const char* csHash,
+   FileId fileId, FilePieceList& pieces, PublicKeyRef& pkey, bool seller,
+   unsigned int threads)
+{
+   bool rval = true;
+
+   FilePieceVerifier* verifier = new FilePieceVerifier();
+   RunnableRef r = verifier;
+   verifier->csHash = csHash;
+   verifier->fileId = fileId;
+   verifier->pieces = pieces;
+   verifier->pkey = pkey;
+   verifier->seller = seller;
+
+   // use one thread per core, but no more threads than pieces
+   if(threads == 0)
+   {
+      threads = System::getCpuCoreCount();
+   }
+   if(threads > (unsigned int)pieces->length())
+   {
+      threads = pieces->length();
+   }
+
+   // start extra threads, the current thread verifies too
+   vector<Thread*> started;
+   for(unsigned int i = 1; i < threads; ++i)
+   {
+      Thread* t = new Thread(r);
+      if(t->start())
+      {
+         started.push_back(t);
+      }
+      else
+      {
+         // fewer threads will do
+         Exception::clear();
+         delete t;
+      }
+   }
+   verifier->run();
+   for(vector<Thread*>::iterator i = started.begin(); i != started.end(); ++i)
+   {
+      (*i)->join();
+      delete *i;
+   }
+
+   if(verifier->failed->length() > 0)
+   {
+      ExceptionRef e = new Exception(
+         "Could not verify FilePieces, a signature did not match.",
+         "bitmunk.common.VerifyFilePiece");
+      e->getDetails()["seller"] = seller;
+      e->getDetails()["bfp"] = !seller;
+      e->getDetails()["failed"] = verifier->failed;
+      Exception::set(e);
+      rval = false;
+   }
+
+   return rval;
+}
+
 bool Signer::signDeposit(Deposit& d, ProfileRef& p)
 {
    bool rval;
 
-   // get concatenated deposit content
+   // sign deposit content as it is produced
    d["signatureVersion"] = 2;
-   string content;
-   appendDepositContent(d, content);
-
-   // sign content
-   string signature;
-   if((rval = sign(p, content, signature)))
+   DigitalSignature* ds = createSignature(p);
+   if((rval = (ds != NULL)))
    {
+      HashContentSink sink(ds);
+      appendDepositContent(d, sink);
+      string signature = finishSignature(ds);
+
       // store signature in Deposit
       d["signature"] = signature.c_str();
       d["signer"]["userId"] = p->getUserId();
@@ -708,12 +931,25 @@ bool Signer::verifyDeposit(Deposit& d, PublicKeyRef& pkey)
    }
    else
    {
-      // get concatenated deposit content
-      string content;
-      appendDepositContent(d, content);
+      // serialize deposit content once into both the digest that keys the
+      // signature cache and the signature, the signature only has to be
+      // checked if it has not been verified on the same content before
+      MessageDigest md;
+      md.start("SHA1");
+      DigitalSignature ds(pkey);
+      HashContentSink sink(&md);
+      sink.addHash(&ds);
+      appendDepositContent(d, sink);
+      string digest = md.getDigest();
+      const char* signature = d["signature"]->getString();
+      bool verified;
+      if(!sSignatureCache.getResult(pkey, digest.c_str(), signature, verified))
+      {
+         verified = verify(pkey, digest.c_str(), ds, signature);
+      }
 
       // verify signature
-      if(!verify(pkey, content, d["signature"]->getString()))
+      if(!verified)
       {
          ExceptionRef e = new Exception(
             "Could not verify Deposit, the signature did not match.",
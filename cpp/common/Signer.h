@@ -4,8 +4,12 @@
 #ifndef bitmunk_common_Signer_H
 #define bitmunk_common_Signer_H
 
+#include "bitmunk/common/ContentSink.h"
 #include "bitmunk/common/Profile.h"
+#include "bitmunk/common/SignatureCache.h"
 #include "bitmunk/common/TypeDefinitions.h"
+#include "monarch/crypto/DigitalSignature.h"
+#include "monarch/crypto/MessageDigest.h"
 
 namespace bitmunk
 {
@@ -36,7 +40,31 @@ public:
       std::string& content, std::string& signature);
    
    /**
-    * Verifies the signature on some content with the given PublicKey.
+    * Creates a DigitalSignature for signing content with the given Profile.
+    * Content can be written to the signature as it is produced, see
+    * HashContentSink.
+    * 
+    * @param p the profile to sign with.
+    * 
+    * @return the DigitalSignature (to be passed to finishSignature()) or
+    *         NULL if an exception occurred.
+    */
+   static monarch::crypto::DigitalSignature* createSignature(ProfileRef& p);
+   
+   /**
+    * Gets the hex-encoded value of a DigitalSignature created with
+    * createSignature() and frees it.
+    * 
+    * @param ds the DigitalSignature, it will be deleted.
+    * 
+    * @return the hex-encoded signature.
+    */
+   static std::string finishSignature(monarch::crypto::DigitalSignature* ds);
+   
+   /**
+    * Verifies the signature on some content with the given PublicKey. The
+    * result is remembered in the SignatureCache so that verifying the same
+    * signature on the same content again is cheap.
     * 
     * @param pkey the PublicKey to verify with.
     * @param content the content to verify the signature on.
@@ -48,118 +76,143 @@ public:
       monarch::crypto::PublicKeyRef& pkey,
       std::string& content, const char* signature);
    
+   /**
+    * Verifies the signature on some content that has already been written
+    * to a DigitalSignature, so that the content never has to be stored. The
+    * result is remembered in the SignatureCache. The cache should be checked
+    * with the content digest before the content is written to the
+    * DigitalSignature, see SignatureCache::getResult().
+    * 
+    * @param pkey the PublicKey the DigitalSignature was created with.
+    * @param digest the hex-encoded SHA-1 digest of the content.
+    * @param ds the DigitalSignature updated with the content.
+    * @param signature the hex-encoded signature (null-terminated).
+    * 
+    * @return true if verified, false if not.
+    */
+   static bool verify(
+      monarch::crypto::PublicKeyRef& pkey, const char* digest,
+      monarch::crypto::DigitalSignature& ds, const char* signature);
+   
+   /**
+    * Gets the SignatureCache that verification results are stored in.
+    * 
+    * @return the SignatureCache.
+    */
+   static SignatureCache* getSignatureCache();
+   
    /**
     * Appends the basic content for a Media that is to be signed to the
-    * passed string. This method is called by appendMediaContent().
+    * passed ContentSink. This method is called by appendMediaContent().
     * 
     * @param m the Media.
-    * @param str the string to append the content to.
+    * @param sink the ContentSink to write the content to.
     */
-   static void appendBasicMediaContent(Media& m, std::string& str);
+   static void appendBasicMediaContent(Media& m, ContentSink& sink);
    
    /**
     * Appends the content for a Media that is to be signed to the
-    * passed string. This method will call appendBasicMediaContent for
+    * passed ContentSink. This method will call appendBasicMediaContent for
     * itself and, if it is a collection, its contents.
     * 
     * @param m the Media.
-    * @param str the string to append the content to.
+    * @param sink the ContentSink to write the content to.
     */
-   static void appendMediaContent(Media& m, std::string& str);
+   static void appendMediaContent(Media& m, ContentSink& sink);
    
    /**
     * Appends the content for a Payee that is to be signed to the
-    * passed string.
+    * passed ContentSink.
     * 
     * @param p the Payee.
-    * @param str the string to append the content to.
+    * @param sink the ContentSink to write the content to.
     */
-   static void appendPayeeContent(Payee& p, std::string& str);
+   static void appendPayeeContent(Payee& p, ContentSink& sink);
    
    /**
     * Appends the content for a PayeeRule that is to be signed to the
-    * passed string.
+    * passed ContentSink.
     * 
     * @param pr the PayeeRule.
-    * @param str the string to append the content to.
+    * @param sink the ContentSink to write the content to.
     */
-   static void appendPayeeRuleContent(PayeeRule& pr, std::string& str);
+   static void appendPayeeRuleContent(PayeeRule& pr, ContentSink& sink);
    
    /**
     * Appends the content for a map of contributors (type->Array(Contributors)).
     * 
     * @param contributors the map of contributors.
-    * @param str the string to append the content to.
+    * @param sink the ContentSink to write the content to.
     */
    static void appendContributorsContent(
-      monarch::rt::DynamicObject& contributors, std::string& str);
+      monarch::rt::DynamicObject& contributors, ContentSink& sink);
    
    /**
     * Appends the content for a ContractSection that is to be signed to the
-    * passed string.
+    * passed ContentSink.
     * 
     * @param cs the ContractSection.
-    * @param str the string to append the content to.
+    * @param sink the ContentSink to write the content to.
     */
    static void appendContractSectionContent(
-      ContractSection& cs, std::string& str);
+      ContractSection& cs, ContentSink& sink);
    
    /**
     * Appends the content for a Ware that is to be signed to the
-    * passed string.
+    * passed ContentSink.
     * 
     * @param w the Ware.
-    * @param str the string to append the content to.
+    * @param sink the ContentSink to write the content to.
     */
-   static void appendWareContent(Ware& w, std::string& str);
+   static void appendWareContent(Ware& w, ContentSink& sink);
    
    /**
     * Appends the content for a FileInfo that is to be signed to the
-    * passed string.
+    * passed ContentSink.
     * 
     * @param fi the FileInfo.
-    * @param str the string to append the content to.
+    * @param sink the ContentSink to write the content to.
     */
-   static void appendFileInfoContent(FileInfo& fi, std::string& str);
+   static void appendFileInfoContent(FileInfo& fi, ContentSink& sink);
    
    /**
     * Appends the content for a FilePiece that is to be signed to the
-    * passed string.
+    * passed ContentSink.
     * 
     * @param csHash the hash of the contract section the piece is part of.
     * @param fileId the ID of the file the FilePiece is a part of.
     * @param fp the FilePiece.
-    * @param str the string to append the content to.
+    * @param sink the ContentSink to write the content to.
     */
    static void appendFilePieceContent(
-      const char* csHash, FileId fileId, FilePiece& fp, std::string& str);
+      const char* csHash, FileId fileId, FilePiece& fp, ContentSink& sink);
    
    /**
     * Appends the content for an Address that is to be signed to the
-    * passed string.
+    * passed ContentSink.
     * 
     * @param a the Address.
-    * @param str the string to append the content to.
+    * @param sink the ContentSink to write the content to.
     */
-   static void appendAddressContent(Address& a, std::string& str);
+   static void appendAddressContent(Address& a, ContentSink& sink);
    
    /**
     * Appends the content for a CreditCard that is to be signed to the
-    * passed string.
+    * passed ContentSink.
     * 
     * @param c the CreditCard.
-    * @param str the string to append the content to.
+    * @param sink the ContentSink to write the content to.
     */
-   static void appendCreditCardContent(CreditCard& c, std::string& str);
+   static void appendCreditCardContent(CreditCard& c, ContentSink& sink);
    
    /**
     * Appends the content for a Deposit that is to be signed to the
-    * passed string.
+    * passed ContentSink.
     * 
     * @param d the Deposit.
-    * @param str the string to append the content to.
+    * @param sink the ContentSink to write the content to.
     */
-   static void appendDepositContent(Deposit& d, std::string& str);
+   static void appendDepositContent(Deposit& d, ContentSink& sink);
    
    /**
     * Produces a signature for a Media. The signature will be
@@ -267,6 +320,29 @@ public:
       FileId fileId, FilePiece& fp, monarch::crypto::PublicKeyRef& pkey,
       bool seller);
    
+   /**
+    * Attempts to verify the signatures on a list of FilePieces that were all
+    * signed with the same key. The pieces are divided between several
+    * threads so that a large batch is verified using all available cores.
+    * 
+    * If any piece fails verification, the exception details contain a
+    * "failed" array with the indexes of the failed pieces in the list.
+    * 
+    * @param csHash the hash of the contract section the pieces are part of.
+    * @param fileId the ID of the file the FilePieces are a part of.
+    * @param pieces the FilePieces to verify the signatures on.
+    * @param pkey the PublicKey to verify the signatures with.
+    * @param seller true if verifying the seller, false if verifying the bfp.
+    * @param threads the number of threads to use, 0 for one per core.
+    * 
+    * @return true if successful, false if an Exception occurred.
+    */
+   static bool verifyFilePieces(
+      const char* csHash,
+      FileId fileId, FilePieceList& pieces,
+      monarch::crypto::PublicKeyRef& pkey, bool seller,
+      unsigned int threads = 0);
+   
    /**
     * Produces a signature for a Deposit. The signature will be
     * hex-encoded and stored in the Deposit.
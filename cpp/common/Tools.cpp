@@ -91,6 +91,8 @@ void Tools::populateKeyInfo(KeyInfo& ki, SymmetricKey* key)
 
 string Tools::getContractSectionHash(ContractSection& cs)
 {
+   string rval;
+
    // Note: This hash must ONLY contain information that a seller
    // has access to. For instance, it CANNOT include the contract's
    // transaction ID or a buyer's account ID.
@@ -104,13 +106,15 @@ string Tools::getContractSectionHash(ContractSection& cs)
    // The signature on a ContractSection has the same requirements listed
    // in the above note, so use its content method.
 
-   // use same algorithm as for signing contract section
-   string str;
-   Signer::appendContractSectionContent(cs, str);
+   // use same algorithm as for signing contract section, hashing the
+   // content as it is produced
    MessageDigest hash;
    hash.start("SHA1");
-   hash.update(str.c_str());
-   return hash.getDigest();
+   HashContentSink sink(&hash);
+   Signer::appendContractSectionContent(cs, sink);
+   rval = hash.getDigest();
+
+   return rval;
 }
 
 string Tools::createSellerServerKey(UserId sellerId, ServerId serverId)
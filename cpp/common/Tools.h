@@ -65,7 +65,8 @@ public:
 
    /**
     * Creates a hash that uniquely identifies the terms of the passed
-    * ContractSection.
+    * ContractSection. The terms are always hashed, any "hash" member the
+    * ContractSection already has is ignored.
     *
     * @param cs the ContractSection to get the hash for.
     *
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/common/TransferBuffer.h"
+
+#include "monarch/rt/Exception.h"
+
+#include <cstdlib>
+
+#ifdef WIN32
+#include <malloc.h>
+#endif
+
+using namespace monarch::rt;
+using namespace bitmunk::common;
+
+TransferBuffer::TransferBuffer() :
+   mBuffer(NULL),
+   mSize(0)
+{
+}
+
+TransferBuffer::~TransferBuffer()
+{
+   TransferBuffer::free();
+}
+
+bool TransferBuffer::allocate(int size)
+{
+   bool rval = true;
+
+   // clamp and round size up to alignment
+   size = (size < MIN_SIZE) ? MIN_SIZE : size;
+   size = (size > MAX_SIZE) ? MAX_SIZE : size;
+   size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+   if(mBuffer == NULL || mSize != size)
+   {
+      free();
+
+#ifdef WIN32
+      mBuffer = (char*)_aligned_malloc(size, ALIGNMENT);
+#else
+      void* ptr = NULL;
+      if(posix_memalign(&ptr, ALIGNMENT, size) == 0)
+      {
+         mBuffer = (char*)ptr;
+      }
+#endif
+
+      if(mBuffer == NULL)
+      {
+         ExceptionRef e = new Exception(
+            "Could not allocate transfer buffer.",
+            "bitmunk.common.TransferBuffer.OutOfMemory");
+         e->getDetails()["size"] = size;
+         Exception::set(e);
+         rval = false;
+      }
+      else
+      {
+         mSize = size;
+      }
+   }
+
+   return rval;
+}
+
+void TransferBuffer::free()
+{
+   if(mBuffer != NULL)
+   {
+#ifdef WIN32
+      _aligned_free(mBuffer);
+#else
+      ::free(mBuffer);
+#endif
+      mBuffer = NULL;
+      mSize = 0;
+   }
+}
+
+char* TransferBuffer::data()
+{
+   return mBuffer;
+}
+
+int TransferBuffer::size()
+{
+   return mSize;
+}
+
+int TransferBuffer::getConfiguredSize(DynamicObject& cfg)
+{
+   return (!cfg.isNull() && cfg->hasMember("transferBufferSize")) ?
+      cfg["transferBufferSize"]->getInt32() : DEFAULT_SIZE;
+}
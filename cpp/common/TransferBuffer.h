@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_common_TransferBuffer_H
+#define bitmunk_common_TransferBuffer_H
+
+#include "monarch/rt/DynamicObject.h"
+
+namespace bitmunk
+{
+namespace common
+{
+
+/**
+ * A TransferBuffer is a large, page-aligned buffer used to move file piece
+ * data between streams. Using a single large buffer per transfer instead of
+ * a small stack buffer drastically reduces the number of read/write calls
+ * (and, for chunked transfers, the number of chunks) made per megabyte.
+ *
+ * @author Dave Longley
+ */
+class TransferBuffer
+{
+public:
+   /**
+    * The default size for a transfer buffer.
+    */
+   static const int DEFAULT_SIZE = 65536;
+
+   /**
+    * The minimum and maximum sizes for a transfer buffer.
+    */
+   static const int MIN_SIZE = 2048;
+   static const int MAX_SIZE = 4194304;
+
+   /**
+    * The alignment of a transfer buffer.
+    */
+   static const int ALIGNMENT = 4096;
+
+protected:
+   /**
+    * The aligned buffer.
+    */
+   char* mBuffer;
+
+   /**
+    * The size of the buffer.
+    */
+   int mSize;
+
+public:
+   /**
+    * Creates a new TransferBuffer. The buffer is not allocated until
+    * allocate() is called.
+    */
+   TransferBuffer();
+
+   /**
+    * Destructs this TransferBuffer.
+    */
+   virtual ~TransferBuffer();
+
+   /**
+    * Allocates this buffer. If the buffer is already allocated with the
+    * given size then it is reused. The size will be clamped to
+    * [MIN_SIZE, MAX_SIZE] and rounded up to a multiple of ALIGNMENT.
+    *
+    * @param size the size for the buffer.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool allocate(int size = DEFAULT_SIZE);
+
+   /**
+    * Frees this buffer.
+    */
+   virtual void free();
+
+   /**
+    * Gets the data in this buffer.
+    *
+    * @return the data in this buffer.
+    */
+   virtual char* data();
+
+   /**
+    * Gets the size of this buffer.
+    *
+    * @return the size of this buffer.
+    */
+   virtual int size();
+
+   /**
+    * Gets the transfer buffer size from a module configuration, using the
+    * "transferBufferSize" member if present.
+    *
+    * @param cfg the module configuration.
+    *
+    * @return the transfer buffer size.
+    */
+   static int getConfiguredSize(monarch::rt::DynamicObject& cfg);
+};
+
+} // end namespace common
+} // end namespace bitmunk
+#endif
@@ -435,6 +435,7 @@ typedef monarch::rt::DynamicObjectIterator KeyInfoIterator;
  *    "index" : uint32,
  *    "path" : string,
  *    "size" : uint32,
+ *    "pieceSize" : uint32,
  *    "encrypted" : boolean,
  *    "openKey" : KeyInfo,
  *    "pieceKey" : KeyInfo,
@@ -442,15 +443,20 @@ typedef monarch::rt::DynamicObjectIterator KeyInfoIterator;
  *    "sellerSignature" : string,
  *    "sellerProfileId" : ProfileId (uint32),
  *    "bfpSignature" : string,
- *    "bfpId" : BfpId (uint32)
+ *    "bfpId" : BfpId (uint32),
+ *    "partial" : {"csHash" : string}
  * }
  *
- * @member index the index for the FilePiece relative to all other pieces.
+ * @member index the index for the FilePiece relative to all other pieces of
+ *              the same piece size.
  * @member path the file system path where the file for the piece resides.
  * @member size the size, in bytes, for the piece data (this may be the
  *              requested size -- which may be larger than the actual size).
  *              Also, a size of 0 indicates the piece takes up the full file
  *              size.
+ * @member pieceSize optional, the full piece size, in bytes, that the index
+ *                   is relative to if it is larger than the standard piece
+ *                   size (always a power of two multiple of it).
  * @member encrypted a boolean indicating if the piece is encrypted or not.
  * @member openKey a KeyInfo (only present when the piece key is sealed).
  * @member pieceKey a KeyInfo (for encrypting/decrypting a piece), its key
@@ -461,6 +467,9 @@ typedef monarch::rt::DynamicObjectIterator KeyInfoIterator;
  * @member sellerProfileId the seller's profile ID at the time of signing.
  * @member bfpSignature the bfp's hex-signature for the FilePiece.
  * @member bfpId the ID of the bfp used on the piece.
+ * @member partial optional, only used by a buyer when the file at the
+ *                 piece's path holds partially downloaded data, "csHash" is
+ *                 the hash of the contract section the data came from.
  */
 typedef monarch::rt::DynamicObject FilePiece;
 typedef monarch::rt::DynamicObjectIterator FilePieceIterator;
@@ -821,6 +830,7 @@ typedef monarch::rt::DynamicObjectIterator SellerPoolStatsIterator;
  *    "fileInfo" : FileInfo,
  *    "sellerDataSet" : ResourceSet (of SellerData),
  *    "pieceSize" : uint32,
+ *    "maxPieceSize" : uint32,
  *    "pieceCount" : uint32,
  *    "bfpId" : uint32,
  *    "referenceFile" : boolean,
@@ -831,6 +841,10 @@ typedef monarch::rt::DynamicObjectIterator SellerPoolStatsIterator;
  * @member fileInfo the info for the file the seller pool is for.
  * @member sellerDataSet a ResourceSet of SellerData for sellers in the pool.
  * @member pieceSize the minimum piece size.
+ * @member maxPieceSize optional, the largest piece size (a power of two
+ *                      multiple of pieceSize) that the SVA accepts for data
+ *                      purchases of the file, if not present then only
+ *                      pieces of pieceSize are accepted.
  * @member pieceCount the number of pieces in the file.
  * @member bfpId the ID of the bfp that must be used with the pool.
  * @member referenceFile flag that indicates that the seller pool is the
@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/data/MpegAudioFrameIndex.h"
+
+#include "monarch/rt/Exception.h"
+
+#include <cstring>
+
+using namespace std;
+using namespace monarch::rt;
+using namespace bitmunk::data;
+
+// the version of the encoded index
+#define INDEX_VERSION   2
+
+MpegAudioFrameIndex::MpegAudioFrameIndex() :
+   mFileSize(0),
+   mFileModified(0),
+   mFirstOffset(0),
+   mEndOffset(0)
+{
+}
+
+MpegAudioFrameIndex::~MpegAudioFrameIndex()
+{
+}
+
+void MpegAudioFrameIndex::clear()
+{
+   mFileSize = 0;
+   mFileModified = 0;
+   mFirstOffset = 0;
+   mEndOffset = 0;
+   mFrameLengths.clear();
+   mRuns.clear();
+   mGaps.clear();
+}
+
+void MpegAudioFrameIndex::addFrame(
+   uint64_t offset, uint32_t length, double audioLength)
+{
+   if(mFrameLengths.empty())
+   {
+      mFirstOffset = offset;
+   }
+   else if(offset > mEndOffset)
+   {
+      // record bytes skipped since the last frame
+      Gap gap;
+      gap.frame = mFrameLengths.size();
+      gap.bytes = offset - mEndOffset;
+      mGaps.push_back(gap);
+   }
+   mFrameLengths.push_back(length);
+   mEndOffset = offset + length;
+
+   if(!mRuns.empty() && mRuns.back().audioLength == audioLength)
+   {
+      ++mRuns.back().count;
+   }
+   else
+   {
+      Run run;
+      run.count = 1;
+      run.audioLength = audioLength;
+      mRuns.push_back(run);
+   }
+}
+
+void MpegAudioFrameIndex::setFileSize(uint64_t size)
+{
+   mFileSize = size;
+}
+
+uint64_t MpegAudioFrameIndex::getFileSize()
+{
+   return mFileSize;
+}
+
+void MpegAudioFrameIndex::setFileModified(uint64_t seconds)
+{
+   mFileModified = seconds;
+}
+
+uint64_t MpegAudioFrameIndex::getFileModified()
+{
+   return mFileModified;
+}
+
+uint32_t MpegAudioFrameIndex::getFrameCount()
+{
+   return mFrameLengths.size();
+}
+
+double MpegAudioFrameIndex::getAudioTime()
+{
+   // sum in frame order so the time matches a time parser's exactly
+   double rval = 0;
+   for(vector<Run>::iterator i = mRuns.begin(); i != mRuns.end(); ++i)
+   {
+      for(uint32_t n = 0; n < i->count; ++n)
+      {
+         rval += i->audioLength;
+      }
+   }
+   return rval;
+}
+
+bool MpegAudioFrameIndex::getRange(
+   double start, double end, uint64_t& offset, uint64_t& length)
+{
+   bool rval = false;
+
+   uint64_t position = mFirstOffset;
+   uint64_t rangeEnd = 0;
+   double time = 0;
+   vector<Gap>::iterator gap = mGaps.begin();
+   vector<Run>::iterator run = mRuns.begin();
+   uint32_t runFrames = 0;
+   uint32_t count = mFrameLengths.size();
+   for(uint32_t frame = 0; frame < count && time <= end; ++frame)
+   {
+      if(gap != mGaps.end() && gap->frame == frame)
+      {
+         position += gap->bytes;
+         ++gap;
+      }
+      if(runFrames == run->count)
+      {
+         ++run;
+         runFrames = 0;
+      }
+      ++runFrames;
+
+      // a frame is in the section if the time at its end is
+      time += run->audioLength;
+      if(time >= start && time <= end)
+      {
+         if(!rval)
+         {
+            offset = position;
+            rval = true;
+         }
+         rangeEnd = position + mFrameLengths[frame];
+      }
+      position += mFrameLengths[frame];
+   }
+
+   if(rval)
+   {
+      // the last frame may be truncated
+      if(mFileSize > 0 && rangeEnd > mFileSize)
+      {
+         rangeEnd = mFileSize;
+      }
+      length = rangeEnd - offset;
+   }
+
+   return rval;
+}
+
+/**
+ * Appends an unsigned integer to a byte array, most significant byte first.
+ *
+ * @param b the byte array.
+ * @param value the value to append.
+ * @param size the number of bytes to append.
+ */
+static void _putUInt(string& b, uint64_t value, int size)
+{
+   for(int i = size - 1; i >= 0; --i)
+   {
+      b.push_back((char)((value >> (i * 8)) & 0xff));
+   }
+}
+
+/**
+ * Reads an unsigned integer from a byte array, most significant byte first.
+ *
+ * @param b the byte array.
+ * @param length the number of bytes left in the array, updated on success.
+ * @param value to be set to the value.
+ * @param size the number of bytes to read.
+ *
+ * @return true if successful, false if there were not enough bytes.
+ */
+static bool _getUInt(
+   const unsigned char*& b, unsigned int& length, uint64_t& value, int size)
+{
+   bool rval = (length >= (unsigned int)size);
+   if(rval)
+   {
+      value = 0;
+      for(int i = 0; i < size; ++i)
+      {
+         value = (value << 8) | b[i];
+      }
+      b += size;
+      length -= size;
+   }
+   return rval;
+}
+
+string MpegAudioFrameIndex::encode()
+{
+   string b;
+   b.reserve(48 + mRuns.size() * 12 + mGaps.size() * 8 +
+      mFrameLengths.size() * 2);
+
+   _putUInt(b, INDEX_VERSION, 1);
+   _putUInt(b, mFileSize, 8);
+   _putUInt(b, mFileModified, 8);
+   _putUInt(b, mFirstOffset, 8);
+   _putUInt(b, mRuns.size(), 4);
+   for(vector<Run>::iterator i = mRuns.begin(); i != mRuns.end(); ++i)
+   {
+      // store the bits of the duration so it is restored exactly
+      uint64_t bits;
+      memcpy(&bits, &i->audioLength, 8);
+      _putUInt(b, i->count, 4);
+      _putUInt(b, bits, 8);
+   }
+   _putUInt(b, mGaps.size(), 4);
+   for(vector<Gap>::iterator i = mGaps.begin(); i != mGaps.end(); ++i)
+   {
+      _putUInt(b, i->frame, 4);
+      _putUInt(b, i->bytes, 4);
+   }
+   _putUInt(b, mFrameLengths.size(), 4);
+   for(vector<uint16_t>::iterator i = mFrameLengths.begin();
+       i != mFrameLengths.end(); ++i)
+   {
+      _putUInt(b, *i, 2);
+   }
+
+   return b;
+}
+
+bool MpegAudioFrameIndex::decode(const char* data, int size)
+{
+   bool rval = false;
+
+   clear();
+
+   unsigned int length = (size > 0) ? size : 0;
+   if(length > 0)
+   {
+      const unsigned char* b = (const unsigned char*)data;
+      uint64_t version;
+      uint64_t count;
+      rval =
+         _getUInt(b, length, version, 1) && version == INDEX_VERSION &&
+         _getUInt(b, length, mFileSize, 8) &&
+         _getUInt(b, length, mFileModified, 8) &&
+         _getUInt(b, length, mFirstOffset, 8) &&
+         _getUInt(b, length, count, 4);
+
+      uint32_t frames = 0;
+      for(uint64_t i = 0; rval && i < count; ++i)
+      {
+         uint64_t runCount;
+         uint64_t bits;
+         rval =
+            _getUInt(b, length, runCount, 4) && runCount > 0 &&
+            _getUInt(b, length, bits, 8);
+         if(rval)
+         {
+            Run run;
+            run.count = runCount;
+            memcpy(&run.audioLength, &bits, 8);
+            mRuns.push_back(run);
+            frames += runCount;
+         }
+      }
+
+      rval = rval && _getUInt(b, length, count, 4);
+      mEndOffset = mFirstOffset;
+      for(uint64_t i = 0; rval && i < count; ++i)
+      {
+         uint64_t frame;
+         uint64_t bytes;
+         rval =
+            _getUInt(b, length, frame, 4) &&
+            _getUInt(b, length, bytes, 4);
+         if(rval)
+         {
+            Gap gap;
+            gap.frame = frame;
+            gap.bytes = bytes;
+            mGaps.push_back(gap);
+            mEndOffset += bytes;
+         }
+      }
+
+      // the frame count must agree with the runs
+      rval = rval && _getUInt(b, length, count, 4) && count == frames;
+      for(uint64_t i = 0; rval && i < count; ++i)
+      {
+         uint64_t frameLength;
+         if((rval = _getUInt(b, length, frameLength, 2)))
+         {
+            mFrameLengths.push_back(frameLength);
+            mEndOffset += frameLength;
+         }
+      }
+   }
+
+   if(!rval)
+   {
+      clear();
+      ExceptionRef e = new Exception(
+         "Invalid MPEG audio frame index.",
+         "bitmunk.data.InvalidFrameIndex");
+      Exception::set(e);
+   }
+
+   return rval;
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_data_MpegAudioFrameIndex_H
+#define bitmunk_data_MpegAudioFrameIndex_H
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+
+namespace bitmunk
+{
+namespace data
+{
+
+/**
+ * An MpegAudioFrameIndex maps audio time to byte offsets in an MPEG audio
+ * file so that a section of the audio (ie: a sample) can be located without
+ * reading the file.
+ *
+ * The index is compact: frame lengths are stored in 2 bytes each, frame
+ * durations are run-length encoded (they only change with the sampling rate
+ * or layer) and the rare bytes between frames are stored as gaps.
+ *
+ * Frames are selected by time exactly as an MpegAudioTimeParser selects them:
+ * a frame is in a section if the audio time at the end of the frame is in
+ * the section.
+ *
+ * @author Dave Longley
+ */
+class MpegAudioFrameIndex
+{
+protected:
+   /**
+    * A run of frames with the same duration.
+    */
+   struct Run
+   {
+      uint32_t count;
+      double audioLength;
+   };
+
+   /**
+    * Bytes between the end of one frame and the start of the next.
+    */
+   struct Gap
+   {
+      uint32_t frame;
+      uint32_t bytes;
+   };
+
+   /**
+    * The size of the indexed file.
+    */
+   uint64_t mFileSize;
+
+   /**
+    * The modification time of the indexed file, in seconds.
+    */
+   uint64_t mFileModified;
+
+   /**
+    * The offset of the first frame.
+    */
+   uint64_t mFirstOffset;
+
+   /**
+    * The offset just past the last frame.
+    */
+   uint64_t mEndOffset;
+
+   /**
+    * The length of every frame.
+    */
+   std::vector<uint16_t> mFrameLengths;
+
+   /**
+    * The durations of the frames.
+    */
+   std::vector<Run> mRuns;
+
+   /**
+    * The gaps before frames, in frame order.
+    */
+   std::vector<Gap> mGaps;
+
+public:
+   /**
+    * Creates a new, empty MpegAudioFrameIndex.
+    */
+   MpegAudioFrameIndex();
+
+   /**
+    * Destructs this MpegAudioFrameIndex.
+    */
+   virtual ~MpegAudioFrameIndex();
+
+   /**
+    * Clears this index.
+    */
+   virtual void clear();
+
+   /**
+    * Adds the next frame to this index.
+    *
+    * @param offset the offset of the frame in the file.
+    * @param length the length of the frame in bytes (at most 65535).
+    * @param audioLength the audio time in the frame, in seconds.
+    */
+   virtual void addFrame(uint64_t offset, uint32_t length, double audioLength);
+
+   /**
+    * Sets the size of the indexed file, so that an index for an older
+    * version of a file can be detected.
+    *
+    * @param size the size of the file.
+    */
+   virtual void setFileSize(uint64_t size);
+
+   /**
+    * Gets the size of the indexed file.
+    *
+    * @return the size of the file.
+    */
+   virtual uint64_t getFileSize();
+
+   /**
+    * Sets the modification time of the indexed file, so that an index for
+    * an older version of a file of the same size can be detected.
+    *
+    * @param seconds the modification time of the file, in seconds.
+    */
+   virtual void setFileModified(uint64_t seconds);
+
+   /**
+    * Gets the modification time of the indexed file.
+    *
+    * @return the modification time of the file, in seconds.
+    */
+   virtual uint64_t getFileModified();
+
+   /**
+    * Gets the number of frames in this index.
+    *
+    * @return the number of frames.
+    */
+   virtual uint32_t getFrameCount();
+
+   /**
+    * Gets the amount of audio time, in seconds, in the indexed frames.
+    *
+    * @return the audio time.
+    */
+   virtual double getAudioTime();
+
+   /**
+    * Gets the contiguous byte range with the frames for a section of audio.
+    *
+    * @param start the start time in seconds.
+    * @param end the end time in seconds.
+    * @param offset to be set to the offset of the first frame in the section.
+    * @param length to be set to the number of bytes from the first frame to
+    *               the end of the last frame in the section.
+    *
+    * @return true if the section has frames, false if not.
+    */
+   virtual bool getRange(
+      double start, double end, uint64_t& offset, uint64_t& length);
+
+   /**
+    * Encodes this index as binary data for storage.
+    *
+    * @return the encoded index.
+    */
+   virtual std::string encode();
+
+   /**
+    * Decodes an index from binary data created by encode(). If the data is
+    * invalid, the index will be empty.
+    *
+    * @param data the encoded index.
+    * @param size the size of the encoded index.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool decode(const char* data, int size);
+};
+
+} // end namespace data
+} // end namespace bitmunk
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/data/MpegAudioFrameIndexInputStream.h"
+
+#include "monarch/data/id3v2/TagHeader.h"
+
+using namespace monarch::data::id3v2;
+using namespace monarch::data::mpeg;
+using namespace monarch::io;
+using namespace bitmunk::data;
+
+// larger than any mpeg audio frame
+#define BUFFER_SIZE 4096
+
+MpegAudioFrameIndexInputStream::MpegAudioFrameIndexInputStream(
+   InputStream* is, bool cleanup, MpegAudioFrameIndex* index) :
+   FilterInputStream(is, cleanup),
+   mIndex(index),
+   mBuffer(BUFFER_SIZE),
+   mPosition(0),
+   mSkipBytes(0),
+   mTagChecked(false),
+   mComplete(false)
+{
+   mIndex->clear();
+}
+
+MpegAudioFrameIndexInputStream::~MpegAudioFrameIndexInputStream()
+{
+}
+
+int MpegAudioFrameIndexInputStream::read(char* b, int length)
+{
+   int rval = mInputStream->read(b, length);
+   if(rval > 0)
+   {
+      update(b, rval, false);
+   }
+   else if(rval == 0 && !mComplete)
+   {
+      update(NULL, 0, true);
+      mIndex->setFileSize(mPosition);
+      mComplete = true;
+   }
+   return rval;
+}
+
+int64_t MpegAudioFrameIndexInputStream::skip(int64_t count)
+{
+   int64_t rval = 0;
+
+   // read skipped bytes so they are indexed
+   char b[BUFFER_SIZE];
+   int num = 1;
+   while(num > 0 && rval < count)
+   {
+      int64_t left = count - rval;
+      num = read(b, (left < BUFFER_SIZE) ? (int)left : BUFFER_SIZE);
+      if(num > 0)
+      {
+         rval += num;
+      }
+   }
+
+   return (num == -1) ? -1 : rval;
+}
+
+bool MpegAudioFrameIndexInputStream::isComplete()
+{
+   return mComplete;
+}
+
+void MpegAudioFrameIndexInputStream::update(
+   const char* b, int length, bool finish)
+{
+   bool done = false;
+   while(!done)
+   {
+      int n = mBuffer.put(b, length, false);
+      b += n;
+      length -= n;
+      done = (length == 0);
+      if(mBuffer.isFull() || (done && finish))
+      {
+         parse(done && finish);
+      }
+   }
+}
+
+void MpegAudioFrameIndexInputStream::parse(bool finish)
+{
+   while(!mBuffer.isEmpty() && (mBuffer.isFull() || finish))
+   {
+      int length = mBuffer.length();
+      if(mSkipBytes > 0)
+      {
+         // skip the rest of a tag or frame
+         int n = mBuffer.clear(
+            (mSkipBytes < (uint64_t)length) ? (int)mSkipBytes : length);
+         mSkipBytes -= n;
+         mPosition += n;
+      }
+      else if(!mTagChecked)
+      {
+         // skip an id3v2 tag at the front of the data
+         mTagChecked = true;
+         TagHeader header;
+         if(length >= TagHeader::sHeaderSize &&
+            header.convertFromBytes(mBuffer.data()))
+         {
+            mSkipBytes = header.getTagSize() + TagHeader::sHeaderSize;
+         }
+      }
+      else
+      {
+         mFrameParser.findFrame(mBuffer.data(), length);
+         AudioFrameHeader* header = mFrameParser.getLastHeader();
+         if(header == NULL)
+         {
+            // no frame, keep the last bytes in case they start a header
+            int n = finish ? length : length - 3;
+            mBuffer.clear(n);
+            mPosition += n;
+         }
+         else if(mFrameParser.getLastOffset() > 0)
+         {
+            // skip data before the frame
+            int n = mBuffer.clear(mFrameParser.getLastOffset());
+            mPosition += n;
+         }
+         else if(header->getFrameLength() <= 0)
+         {
+            // not a usable frame, skip its sync
+            mBuffer.clear(1);
+            ++mPosition;
+         }
+         else
+         {
+            // index frame and skip it
+            mIndex->addFrame(
+               mPosition, header->getFrameLength(), header->getAudioLength());
+            mSkipBytes = header->getFrameLength();
+         }
+      }
+   }
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_data_MpegAudioFrameIndexInputStream_H
+#define bitmunk_data_MpegAudioFrameIndexInputStream_H
+
+#include "bitmunk/data/MpegAudioFrameIndex.h"
+#include "bitmunk/data/MpegAudioFrameParser.h"
+#include "monarch/io/ByteBuffer.h"
+#include "monarch/io/FilterInputStream.h"
+
+namespace bitmunk
+{
+namespace data
+{
+
+/**
+ * An MpegAudioFrameIndexInputStream builds an MpegAudioFrameIndex for the
+ * data read through it, so that a file can be indexed while it is read for
+ * another purpose (ie: format detection). The data is passed through
+ * unchanged.
+ *
+ * Frames are found the way an MpegAudioTimeParser finds them after an
+ * Id3v2TagWriter has stripped any ID3v2 tag from the front of the data,
+ * except that data that is not a frame is skipped rather than treated as an
+ * error.
+ *
+ * @author Dave Longley
+ */
+class MpegAudioFrameIndexInputStream : public monarch::io::FilterInputStream
+{
+protected:
+   /**
+    * The index to build.
+    */
+   MpegAudioFrameIndex* mIndex;
+
+   /**
+    * An mpeg frame parser for finding frames.
+    */
+   MpegAudioFrameParser mFrameParser;
+
+   /**
+    * A buffer with data that has not been indexed yet.
+    */
+   monarch::io::ByteBuffer mBuffer;
+
+   /**
+    * The offset of the data in the buffer.
+    */
+   uint64_t mPosition;
+
+   /**
+    * The number of bytes to skip (the rest of a tag or frame).
+    */
+   uint64_t mSkipBytes;
+
+   /**
+    * True once the front of the data has been checked for an ID3v2 tag.
+    */
+   bool mTagChecked;
+
+   /**
+    * True once the end of the stream has been read.
+    */
+   bool mComplete;
+
+public:
+   /**
+    * Creates a new MpegAudioFrameIndexInputStream that reads from the passed
+    * InputStream.
+    *
+    * @param is the underlying InputStream to read from.
+    * @param cleanup true to clean up the passed InputStream when destructing,
+    *                false not to.
+    * @param index the index to build.
+    */
+   MpegAudioFrameIndexInputStream(
+      monarch::io::InputStream* is, bool cleanup,
+      MpegAudioFrameIndex* index);
+
+   /**
+    * Destructs this MpegAudioFrameIndexInputStream.
+    */
+   virtual ~MpegAudioFrameIndexInputStream();
+
+   /**
+    * Reads some bytes from the stream, indexing them.
+    *
+    * @param b the array of bytes to fill.
+    * @param length the maximum number of bytes to read into the buffer.
+    *
+    * @return the number of bytes read from the stream or 0 if the end of the
+    *         stream has been reached or -1 if an IO exception occurred.
+    */
+   virtual int read(char* b, int length);
+
+   /**
+    * Skips some bytes in the stream. The bytes are read so that they are
+    * indexed.
+    *
+    * @param count the number of bytes to skip.
+    *
+    * @return the actual number of bytes skipped, or -1 if an IO exception
+    *         occurred.
+    */
+   virtual int64_t skip(int64_t count);
+
+   /**
+    * Returns true once the whole stream has been read, so that the index is
+    * complete.
+    *
+    * @return true if the index is complete, false if not.
+    */
+   virtual bool isComplete();
+
+protected:
+   /**
+    * Indexes some data.
+    *
+    * @param b the data.
+    * @param length the number of bytes of data.
+    * @param finish true if the end of the stream has been reached.
+    */
+   virtual void update(const char* b, int length, bool finish);
+
+   /**
+    * Indexes the buffered data. Unless the end of the stream has been
+    * reached, only a full buffer is indexed so that a frame header is never
+    * split across reads.
+    *
+    * @param finish true if the end of the stream has been reached.
+    */
+   virtual void parse(bool finish);
+};
+
+} // end namespace data
+} // end namespace bitmunk
+#endif
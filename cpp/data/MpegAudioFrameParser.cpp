@@ -3,6 +3,12 @@
  */
 #include "bitmunk/data/MpegAudioFrameParser.h"
 
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace monarch::data::mpeg;
 using namespace bitmunk::data;
 
@@ -15,39 +21,27 @@ MpegAudioFrameParser::MpegAudioFrameParser()
 
 MpegAudioFrameParser::~MpegAudioFrameParser()
 {
-   if(mLastHeader != NULL)
-   {
-      delete mLastHeader;
-   }
 }
 
 void MpegAudioFrameParser::reset()
 {
-   if(mLastHeader != NULL)
-   {
-      delete mLastHeader;
-      
-      // no header, or offset found yet
-      mLastHeader = NULL;
-      mLastOffset = -1;
-   }
+   // no header, or offset found yet
+   mLastHeader = NULL;
+   mLastOffset = -1;
 }
 
 int MpegAudioFrameParser::parseFrame(const char* b, int length)
 {
    int rval = 0;
    
-   // create a header
-   AudioFrameHeader* header = new AudioFrameHeader();
-   
    // convert the header from the byte array and proceed if it is valid
-   if(header->convertFromBytes(b, length))
+   if(mHeader.convertFromBytes(b, length))
    {
       // valid header found
-      mLastHeader = header;
+      mLastHeader = &mHeader;
       
       // see how much data is needed to obtain the frame
-      int frameLength = header->getFrameLength();
+      int frameLength = mHeader.getFrameLength();
       if(length < frameLength)
       {
          // no frame found,
@@ -55,10 +49,59 @@ int MpegAudioFrameParser::parseFrame(const char* b, int length)
          rval = frameLength - length;
       }
    }
-   else
+   
+   return rval;
+}
+
+int MpegAudioFrameParser::findSync(const unsigned char* b, int length)
+{
+   int rval = -1;
+   int offset = 0;
+   
+#ifdef __SSE2__
+   // check 16 offsets at once, comparing the bytes at each offset to 255 and
+   // the bytes after them to 224 (all of the top 3 bits set), stopping where
+   // there are no longer 16 bytes after the offset to look ahead at
+   const __m128i ff = _mm_set1_epi8((char)0xff);
+   const __m128i e0 = _mm_set1_epi8((char)0xe0);
+   for(; rval == -1 && offset + 17 <= length; offset += 16)
+   {
+      __m128i first = _mm_loadu_si128((const __m128i*)(b + offset));
+      __m128i second = _mm_loadu_si128((const __m128i*)(b + offset + 1));
+      __m128i sync = _mm_and_si128(
+         _mm_cmpeq_epi8(first, ff),
+         _mm_cmpeq_epi8(_mm_and_si128(second, e0), e0));
+      int mask = _mm_movemask_epi8(sync);
+      if(mask != 0)
+      {
+         rval = offset + __builtin_ctz(mask);
+      }
+   }
+#endif
+   
+   // check remaining offsets, skipping straight to each 255 (memchr does
+   // not check one byte at a time), as the last byte can't start a sync
+   int end = length - 1;
+   while(rval == -1 && offset < end)
    {
-      // clean up header, it is invalid
-      delete header;
+      const unsigned char* p =
+         (const unsigned char*)memchr(b + offset, 0xff, end - offset);
+      if(p == NULL)
+      {
+         offset = end;
+      }
+      else
+      {
+         offset = p - b;
+         if(b[offset + 1] > 0xdf)
+         {
+            rval = offset;
+         }
+         else
+         {
+            ++offset;
+         }
+      }
    }
    
    return rval;
@@ -81,40 +124,15 @@ int MpegAudioFrameParser::findFrame(const char* b, int length)
    {
       // mpeg audio frames start with a header that has "frame sync" --
       // meaning the first byte is 255 and the second byte is greater than 223
-      // so use unsigned bytes to compare
-      const unsigned char* ub = (const unsigned char*)b;
-      
-      // go through the array one byte at a time searching for a frame header
-      // search until 1 minus offset + length as we look ahead 1 byte during
-      // the search
-      int end = length - 1;
-      for(int offset = 0; offset < end; ++offset)
+      int offset = findSync((const unsigned char*)b, length);
+      if(offset != -1)
       {
-         // if the byte after the current offset is not at least 224, we know
-         // we can skip two bytes of data in our search for a frame, and if the
-         // first byte is not 255, we know we can skip 1 byte
-         
-         // look ahead one byte
-         if(ub[offset + 1] > 0xdf)
+         // we have frame sync, so we may have a frame -- try to parse it
+         rval = parseFrame(b + offset, length - offset);
+         if(mLastHeader != NULL)
          {
-            // look at the current byte
-            if(ub[offset] == 0xff)
-            {
-               // we have frame sync, so we may have a frame -- try to parse it
-               rval = parseFrame(b + offset, end - offset + 1);
-               if(mLastHeader != NULL)
-               {
-                  // store last offset
-                  mLastOffset = offset;
-               }
-               break;
-            }
-         }
-         else
-         {
-            // we can skip an offset because the second byte can't possibly
-            // match a frame header's second byte
-            ++offset;
+            // store last offset
+            mLastOffset = offset;
          }
       }
    }
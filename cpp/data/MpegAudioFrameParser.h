@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2007-2008 Digital Bazaar, Inc.  All rights reserved.
+ * Copyright (c) 2007-2010 Digital Bazaar, Inc.  All rights reserved.
  */
 #ifndef bitmunk_data_MpegAudioFrameParser_H
 #define bitmunk_data_MpegAudioFrameParser_H
@@ -20,7 +20,14 @@ class MpegAudioFrameParser
 {
 protected:
    /**
-    * Stores the last MpegAudioFrameHeader that was found.
+    * The header that frames are parsed into, reused for every frame so that
+    * no memory is allocated while parsing.
+    */
+   monarch::data::mpeg::AudioFrameHeader mHeader;
+   
+   /**
+    * Stores the last MpegAudioFrameHeader that was found (the reused header
+    * if one was found, NULL if not).
     */
    monarch::data::mpeg::AudioFrameHeader* mLastHeader;
    
@@ -51,6 +58,18 @@ protected:
     */
    virtual int parseFrame(const char* b, int length);
    
+   /**
+    * Finds the first "frame sync" in the given byte array: a byte of 255
+    * followed by a byte greater than 223. Where SSE2 is available, 16
+    * positions are checked at once.
+    * 
+    * @param b the byte array to search.
+    * @param length the number of valid bytes in the byte array.
+    * 
+    * @return the offset of the first frame sync, -1 if there is none.
+    */
+   static int findSync(const unsigned char* b, int length);
+   
 public:
    /**
     * Creates a new MpegAudioFrameParser.
@@ -80,9 +99,10 @@ public:
    virtual int findFrame(const char* b, int length);
    
    /**
-    * Gets the last MpegAudioFrameHeader that was found.
+    * Gets the last MpegAudioFrameHeader that was found. The header is reused
+    * by the next call to findFrame().
     * 
-    * @return the last MpegAudioFrameHeader that was found.
+    * @return the last MpegAudioFrameHeader that was found, NULL if none.
     */
    virtual monarch::data::mpeg::AudioFrameHeader* getLastHeader();
    
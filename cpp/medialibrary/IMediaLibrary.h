@@ -5,6 +5,7 @@
 #define bitmunk_medialibrary_IMediaLibrary_H
 
 #include "bitmunk/common/TypeDefinitions.h"
+#include "bitmunk/data/MpegAudioFrameIndex.h"
 #include "bitmunk/medialibrary/IMediaLibraryExtension.h"
 #include "monarch/kernel/MicroKernelModuleApi.h"
 #include "monarch/sql/Connection.h"
@@ -71,10 +72,11 @@ public:
       bitmunk::common::UserId userId) = 0;
 
    /**
-    * Starts an asynchronous operation to sets the file ID and format details
-    * in a file info. If the media ID is not specified in the file info, an
-    * attempt will also be made to set it. Once the operation completes, an
-    * event will be fired that has the type:
+    * Queues an interactive scan to set the file ID and format details in a
+    * file info. Interactive scans are run before any queued bulk import
+    * scans. If the media ID is not specified in the file info, an attempt
+    * will also be made to set it. Once the scan completes, an event will be
+    * fired that has the type:
     *
     * "bitmunk.medialibrary.File.scanned" OR
     * "bitmunk.medialibrary.File.exception"
@@ -92,6 +94,43 @@ public:
       bitmunk::common::UserId userId, bitmunk::common::FileInfo& fi,
       bool update, monarch::rt::DynamicObject* userData = NULL) = 0;
 
+   /**
+    * Queues a bulk import of files into the media library. Each file is
+    * scanned as by scanFile() with update set to true, but only when no
+    * interactive scans are waiting, and the scanned files are added to the
+    * media library in batches. While the import runs, events are fired that
+    * have the type:
+    *
+    * "bitmunk.medialibrary.Import.progress" and, once every file has been
+    * processed, "bitmunk.medialibrary.Import.completed"
+    *
+    * The event details include the "importId", the "total", "completed" and
+    * "failed" numbers of files, and the "elapsed" and estimated "remaining"
+    * milliseconds. The usual scanned, exception and updated events are also
+    * fired for each file.
+    *
+    * @param userId the ID of the user that owns the files.
+    * @param files the FileInfos for the files, with at least their paths set.
+    * @param userData some user data to include in any event that is fired.
+    * @param importId to be set to the ID of the import, may be NULL.
+    *
+    * @return true if the import was queued, false if an exception occurred.
+    */
+   virtual bool importFiles(
+      bitmunk::common::UserId userId, bitmunk::common::FileInfoList& files,
+      monarch::rt::DynamicObject* userData = NULL,
+      uint64_t* importId = NULL) = 0;
+
+   /**
+    * Gets statistics for the queue of file scans and imports, with the
+    * numbers of queued "interactive" and "background" scans, running
+    * "workers", "imports" in progress, "scans" run and "batches" of
+    * imported files stored.
+    *
+    * @return the statistics.
+    */
+   virtual monarch::rt::DynamicObject getScanStats() = 0;
+
    /**
     * Adds or updates a file in the media library. If a media ID is specified
     * in the file info, then it will be used. If one is not specified, then an
@@ -135,6 +174,22 @@ public:
    virtual bool populateFile(
       bitmunk::common::UserId userId, bitmunk::common::FileInfo& fi,
       MediaLibraryId mlId = 0, monarch::sql::Connection* conn = NULL) = 0;
+
+   /**
+    * Gets the mpeg audio frame index for a file so that sections of its
+    * audio can be located without reading it. Files are indexed when they
+    * are scanned; a file that was added without being scanned, or that has
+    * changed since, is indexed and its index is stored.
+    *
+    * @param userId the ID of the user that owns the file.
+    * @param fi the FileInfo for the file, with its ID and path set.
+    * @param index the frame index to populate.
+    *
+    * @return true if successful, false on error.
+    */
+   virtual bool getFrameIndex(
+      bitmunk::common::UserId userId, bitmunk::common::FileInfo& fi,
+      bitmunk::data::MpegAudioFrameIndex& index) = 0;
 };
 
 } // end namespace medialibrary
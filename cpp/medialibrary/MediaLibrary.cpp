@@ -6,14 +6,18 @@
 #include "bitmunk/medialibrary/MediaLibrary.h"
 
 #include "bitmunk/data/FormatDetectorInputStream.h"
+#include "bitmunk/data/MpegAudioFrameIndexInputStream.h"
 #include "bitmunk/medialibrary/MediaLibraryModule.h"
 #include "monarch/data/json/JsonWriter.h"
 #include "monarch/event/ObserverDelegate.h"
 #include "monarch/io/FileInputStream.h"
-#include "monarch/rt/RunnableDelegate.h"
+#include "monarch/rt/System.h"
+#include "bitmunk/bfp/BfpStreamHasher.h"
 #include "bitmunk/bfp/IBfpModule.h"
 #include "bitmunk/common/Logging.h"
 
+#include <cstring>
+
 using namespace std;
 using namespace monarch::config;
 using namespace monarch::data;
@@ -44,6 +48,7 @@ using namespace bitmunk::medialibrary;
 MediaLibrary::MediaLibrary(Node* node) :
    mNode(node),
    mMediaLibraryDatabase(NULL),
+   mScanQueue(NULL),
    mFileUpdatedObserver(NULL)
 {
 }
@@ -71,6 +76,15 @@ bool MediaLibrary::initialize()
       }
       else
       {
+         // start scan queue
+         DynamicObject scanCfg;
+         if(cfg->hasMember("scanQueue"))
+         {
+            scanCfg = cfg["scanQueue"];
+         }
+         mScanQueue = new ScanQueue(this);
+         mScanQueue->initialize(mNode, scanCfg);
+
          // start handling file update events
          mFileUpdatedObserver = new ObserverDelegate<MediaLibrary>(
             this, &MediaLibrary::fileUpdated);
@@ -94,6 +108,13 @@ bool MediaLibrary::initialize()
 
 void MediaLibrary::cleanup()
 {
+   // stop scanning before the database is cleaned up
+   if(mScanQueue != NULL)
+   {
+      delete mScanQueue;
+      mScanQueue = NULL;
+   }
+
    // clean up the database
    if(mMediaLibraryDatabase != NULL)
    {
@@ -189,7 +210,7 @@ static bool _checkFile(File& file)
 void MediaLibrary::scanFile(
    UserId userId, FileInfo& fi, bool update, DynamicObject* userData)
 {
-   // run scan file operation asynchronously
+   // queue scan to run asynchronously
    DynamicObject d;
    BM_ID_SET(d["userId"], userId);
    d["fileInfo"] = fi.clone();
@@ -199,12 +220,9 @@ void MediaLibrary::scanFile(
       d["userData"] = *userData;
    }
 
-   RunnableRef r = new RunnableDelegate<MediaLibrary>(
-      this, &MediaLibrary::scanFile, d);
-   Operation op = r;
-   if(!mNode->runUserOperation(userId, op))
+   if(mScanQueue == NULL || !mScanQueue->addScan(d))
    {
-      // failed to run user op, send event including last exception
+      // failed to queue scan, send event including last exception
       Event e;
       e["type"] = ML_EVENT_FILE_EXCEPTION;
       e["details"]["userId"] = userId;
@@ -218,16 +236,61 @@ void MediaLibrary::scanFile(
    }
 }
 
-// a helper function to scan a file to get its format details and if its
-// media ID is not set, its media ID
-static bool _getFormatDetails(FileInfo& fi)
+bool MediaLibrary::importFiles(
+   UserId userId, FileInfoList& files, DynamicObject* userData,
+   uint64_t* importId)
 {
    bool rval = false;
 
-   // get format details and try to find embedded media in file
+   uint64_t id = 0;
+   if(mScanQueue == NULL)
+   {
+      ExceptionRef e = new Exception(
+         "Could not import files, the media library is not initialized.",
+         MEDIALIBRARY ".ImportFailed");
+      Exception::set(e);
+   }
+   else if((rval = mScanQueue->addImport(userId, files, userData, id)) &&
+      importId != NULL)
+   {
+      *importId = id;
+   }
+
+   return rval;
+}
+
+DynamicObject MediaLibrary::getScanStats()
+{
+   DynamicObject rval;
+   rval->setType(Map);
+
+   if(mScanQueue != NULL)
+   {
+      rval = mScanQueue->getStats();
+   }
+
+   return rval;
+}
+
+// a helper function to scan a file to get its format details, the details
+// from all recognizing inspectors are also returned so that they can be
+// searched for embedded media, if a stream hasher is given it generates the
+// file ID hash from the same read of the file
+static bool _getFormatDetails(
+   FileInfo& fi, MpegAudioFrameIndex& index, DynamicObject& details,
+   BfpStreamHasher* hasher)
+{
+   bool rval = false;
+
+   // get format details and try to find embedded media in file, indexing
+   // any mpeg audio frames in the same pass (the modification time is
+   // read first so a change made while indexing invalidates the index)
    File file(fi["path"]->getString());
+   uint64_t modified = file->getModifiedDate().getSeconds();
    FileInputStream* fis = new FileInputStream(file);
-   InspectorInputStream* iis = new InspectorInputStream(fis, true);
+   MpegAudioFrameIndexInputStream* mis =
+      new MpegAudioFrameIndexInputStream(fis, true, &index);
+   InspectorInputStream* iis = new InspectorInputStream(mis, true);
    FormatDetectorInputStream* fdis =
       new FormatDetectorInputStream(iis, true);
 
@@ -235,8 +298,11 @@ static bool _getFormatDetails(FileInfo& fi)
    fdis->getDataFormatInspector("bitmunk.data.MpegAudioDetector")->
       setKeepInspecting(true);
 
-   // detect format details
-   rval = fdis->detect();
+   // hash the data the inspectors see, then detect format details from
+   // any data the BFP did not read
+   bool hashed =
+      (hasher == NULL) || hasher->setFileInfoIdFromStream(fi, fdis);
+   rval = hashed && fdis->detect();
    if(rval)
    {
       if(!fdis->isFormatRecognized())
@@ -253,26 +319,19 @@ static bool _getFormatDetails(FileInfo& fi)
          // details to include in the file info ... or something.
 
          // get format details
-         DynamicObject details = fdis->getFormatDetails();
+         details = fdis->getFormatDetails();
          fi["formatDetails"] = details.first();
          fi["contentType"] = fi["formatDetails"]["contentType"]->getString();
 
-         // search format details for media ID if one hasn't been set
-         if(!BM_MEDIA_ID_VALID(BM_MEDIA_ID(fi["mediaId"])))
+         // only keep a complete index of an mp3
+         if(!mis->isComplete() ||
+            strcmp(fi["contentType"]->getString(), "audio/mpeg") != 0)
          {
-            bool mediaIdFound = false;
-            DynamicObjectIterator i = details.getIterator();
-            while(!mediaIdFound && i->hasNext())
-            {
-               DynamicObject& d = i->next();
-               if(d->hasMember("media") &&
-                  BM_MEDIA_ID_VALID(BM_MEDIA_ID(d["media"]["id"])))
-               {
-                  // media ID found
-                  BM_ID_SET(fi["mediaId"], BM_MEDIA_ID(d["media"]["id"]));
-                  mediaIdFound = true;
-               }
-            }
+            index.clear();
+         }
+         else
+         {
+            index.setFileModified(modified);
          }
       }
    }
@@ -280,7 +339,7 @@ static bool _getFormatDetails(FileInfo& fi)
    fdis->close();
    delete fdis;
 
-   if(!rval)
+   if(!rval && hashed)
    {
       ExceptionRef e = new Exception(
          "Could not detect file format details.",
@@ -288,14 +347,40 @@ static bool _getFormatDetails(FileInfo& fi)
       Exception::push(e);
 
       MO_CAT_DEBUG(BM_MEDIALIBRARY_CAT,
-         "Failed to detect file format details for file ID %s: %s",
-         BM_FILE_ID(fi["id"]),
+         "Failed to detect file format details for file '%s': %s",
+         fi["path"]->getString(),
          JsonWriter::writeToString(Exception::getAsDynamicObject()).c_str());
    }
 
    return rval;
 }
 
+// a helper function to set the extension, absolute path and size of a file
+static void _setFileDetails(File& file, FileInfo& fi)
+{
+   fi["extension"] = file->getExtension() + 1;
+   fi["path"] = file->getAbsolutePath();
+   fi["size"] = (uint64_t)file->getLength();
+}
+
+// a helper function to schedule a media library file updated event
+static void _sendFileUpdatedEvent(
+   Node* node, UserId userId, FileInfo& fi, MediaLibraryId mlId, bool isNew,
+   DynamicObject* userData)
+{
+   Event e;
+   e["type"] = MEDIALIBRARY ".File.updated";
+   e["details"]["mediaLibraryId"] = mlId;
+   e["details"]["fileInfo"] = fi.clone();
+   e["details"]["userId"] = userId;
+   e["details"]["isNew"] = isNew;
+   if(userData != NULL)
+   {
+      e["details"]["userData"] = *userData;
+   }
+   node->getEventController()->schedule(e);
+}
+
 bool MediaLibrary::updateFile(
    UserId userId, FileInfo& fi, DynamicObject* userData)
 {
@@ -322,9 +407,7 @@ bool MediaLibrary::updateFile(
       else
       {
          // update file extension and path (makes it absolute if it wasn't)
-         fi["extension"] = file->getExtension() + 1;
-         fi["path"] = file->getAbsolutePath();
-         fi["size"] = (uint64_t)file->getLength();
+         _setFileDetails(file, fi);
       }
    }
 
@@ -375,18 +458,7 @@ bool MediaLibrary::updateFile(
    // file WAS added to library
    else
    {
-      // schedule a media library file updated event
-      Event e;
-      e["type"] = MEDIALIBRARY ".File.updated";
-      e["details"]["mediaLibraryId"] = mlId;
-      e["details"]["fileInfo"] = fi.clone();
-      e["details"]["userId"] = userId;
-      e["details"]["isNew"] = isNew;
-      if(userData != NULL)
-      {
-         e["details"]["userData"] = *userData;
-      }
-      mNode->getEventController()->schedule(e);
+      _sendFileUpdatedEvent(mNode, userId, fi, mlId, isNew, userData);
    }
 
    return rval;
@@ -414,6 +486,58 @@ bool MediaLibrary::populateFile(
    return mMediaLibraryDatabase->populateFile(userId, fi, mlId, conn);
 }
 
+bool MediaLibrary::getFrameIndex(
+   UserId userId, FileInfo& fi, MpegAudioFrameIndex& index)
+{
+   bool rval = false;
+
+   // use the stored index unless the file has changed since it was indexed
+   File file(fi["path"]->getString());
+   uint64_t modified = file->getModifiedDate().getSeconds();
+   if(mMediaLibraryDatabase->populateFrameIndex(userId, fi, index) &&
+      index.getFileSize() == (uint64_t)file->getLength() &&
+      index.getFileModified() == modified)
+   {
+      rval = true;
+   }
+   else
+   {
+      Exception::clear();
+
+      // index the file
+      FileInputStream* fis = new FileInputStream(file);
+      MpegAudioFrameIndexInputStream mis(fis, true, &index);
+      rval = (mis.skip(file->getLength() + 1) != -1) && mis.isComplete();
+      mis.close();
+      index.setFileModified(modified);
+
+      if(rval && index.getFrameCount() == 0)
+      {
+         ExceptionRef e = new Exception(
+            "File has no MPEG audio frames.",
+            MEDIALIBRARY ".NoAudioFrames");
+         e->getDetails()["path"] = fi["path"]->getString();
+         Exception::set(e);
+         rval = false;
+      }
+      else if(rval)
+      {
+         if(!mMediaLibraryDatabase->updateFrameIndex(userId, fi, index))
+         {
+            // the index can still be used
+            MO_CAT_DEBUG(BM_MEDIALIBRARY_CAT,
+               "Failed to store frame index for file ID %s: %s",
+               BM_FILE_ID(fi["id"]),
+               JsonWriter::writeToString(
+                  Exception::getAsDynamicObject()).c_str());
+            Exception::clear();
+         }
+      }
+   }
+
+   return rval;
+}
+
 bool MediaLibrary::populateFileSet(
    UserId userId, DynamicObject& query, ResourceSet& fileSet, Connection* conn)
 {
@@ -574,13 +698,70 @@ static bool _findMediaId(Node* node, UserId userId, FileInfo& fi)
    return rval;
 }
 
-void MediaLibrary::scanFile(DynamicObject& d)
+// a helper function to set a file's media ID from the media embedded in the
+// file, if its media ID hasn't been set
+static void _setEmbeddedMediaId(FileInfo& fi, DynamicObject& details)
+{
+   if(!BM_MEDIA_ID_VALID(BM_MEDIA_ID(fi["mediaId"])))
+   {
+      bool mediaIdFound = false;
+      DynamicObjectIterator i = details.getIterator();
+      while(!mediaIdFound && i->hasNext())
+      {
+         DynamicObject& d = i->next();
+         if(d->hasMember("media") &&
+            BM_MEDIA_ID_VALID(BM_MEDIA_ID(d["media"]["id"])))
+         {
+            // media ID found
+            BM_ID_SET(fi["mediaId"], BM_MEDIA_ID(d["media"]["id"]));
+            mediaIdFound = true;
+         }
+      }
+   }
+}
+
+namespace bitmunk
+{
+namespace medialibrary
+{
+
+/**
+ * A FileIdHasher generates the file ID hash for a file using a BFP that
+ * reads the file itself. It runs as an operation while the scanning
+ * operation gets the file's format details, so both read the file at the
+ * same time and the reader that falls behind gets most of it from the OS
+ * file cache.
+ */
+class FileIdHasher : public Runnable
+{
+public:
+   Bfp* bfp;
+   FileInfo fi;
+   bool pass;
+   ExceptionRef exception;
+
+   FileIdHasher() : bfp(NULL), pass(false), exception(NULL) {};
+   virtual ~FileIdHasher() {};
+   virtual void run()
+   {
+      pass = bfp->setFileInfoId(fi);
+      if(!pass)
+      {
+         // exceptions are per-thread, keep it for the scanning thread
+         exception = Exception::get();
+      }
+   }
+};
+
+} // end namespace medialibrary
+} // end namespace bitmunk
+
+bool MediaLibrary::scanFile(DynamicObject& d, MpegAudioFrameIndex& index)
 {
    bool pass = false;
 
    UserId userId = BM_USER_ID(d["userId"]);
    FileInfo& fi = d["fileInfo"];
-   bool update = d["update"]->getBoolean();
 
    // run basic file checks
    File file(fi["path"]->getString());
@@ -591,19 +772,66 @@ void MediaLibrary::scanFile(DynamicObject& d)
       fi["path"] = file->getAbsolutePath();
       fi["size"] = (uint64_t)file->getLength();
 
-      // generate the file ID hash using the BFP
       // FIXME: get the latest bfp ID available somehow
+      uint64_t start = System::getCurrentMilliseconds();
+      DynamicObject details;
       Bfp* bfp = _acquireBfp(mNode, BFP_ID);
+      BfpStreamHasher* streamHasher = dynamic_cast<BfpStreamHasher*>(bfp);
+      bool onePass = (streamHasher != NULL);
+      if(onePass)
+      {
+         // generate the file ID hash and get format details in one pass
+         pass = _getFormatDetails(fi, index, details, streamHasher);
+      }
+      else if(bfp != NULL)
+      {
+         // generate the file ID hash in another operation, the hasher
+         // gets its own copy of the file info to update
+         FileIdHasher* hasher = new FileIdHasher();
+         RunnableRef r = hasher;
+         hasher->bfp = bfp;
+         hasher->fi = fi.clone();
+         Operation op = r;
+         mNode->runOperation(op);
+
+         // get format details while the file ID hash is generated
+         pass = _getFormatDetails(fi, index, details, NULL);
+         op->waitFor(false);
+         if(!hasher->pass)
+         {
+            // a hashing exception takes precedence
+            if(!hasher->exception.isNull())
+            {
+               Exception::set(hasher->exception);
+            }
+            pass = false;
+         }
+         else
+         {
+            fi["id"] = hasher->fi["id"];
+            fi["contentSize"] = hasher->fi["contentSize"];
+         }
+      }
       if(bfp != NULL)
       {
-         pass = bfp->setFileInfoId(fi);
          _releaseBfp(mNode, bfp);
       }
 
+      if(pass)
+      {
+         uint64_t time = System::getCurrentMilliseconds() - start;
+         MO_CAT_DEBUG(BM_MEDIALIBRARY_CAT,
+            "Scanned %" PRIu64 " bytes of file ID '%s' in %" PRIu64
+            " ms (%.2f MiB/s, %s)",
+            fi["size"]->getUInt64(), BM_FILE_ID(fi["id"]), time,
+            (time == 0) ? 0.0 :
+            fi["size"]->getUInt64() / 1048.576 / time,
+            onePass ? "one pass" : "concurrent hash");
+      }
+
       // if no media ID has been set on the file, try to find it via
       // bitmunk first, we trust it to be more accurate than embedded
-      // media data which will be added when we get the format details
-      // if we still haven't found a media ID by then
+      // media data
       if(pass &&
          (!fi->hasMember("mediaId") ||
           !BM_MEDIA_ID_VALID(BM_MEDIA_ID(fi["mediaId"]))))
@@ -612,8 +840,11 @@ void MediaLibrary::scanFile(DynamicObject& d)
          _findMediaId(mNode, userId, fi);
       }
 
-      // get format details
-      pass = pass && _getFormatDetails(fi);
+      // use embedded media if a media ID still hasn't been found
+      if(pass)
+      {
+         _setEmbeddedMediaId(fi, details);
+      }
    }
 
    if(pass)
@@ -628,17 +859,6 @@ void MediaLibrary::scanFile(DynamicObject& d)
          e["details"]["userData"] = d["userData"];
       }
       mNode->getEventController()->schedule(e);
-
-      // update file in medialibrary if requested
-      if(update)
-      {
-         DynamicObject userData(NULL);
-         if(d->hasMember("userData"))
-         {
-            userData = d["userData"];
-         }
-         updateFile(userId, fi, userData.isNull() ? NULL : &userData);
-      }
    }
    else
    {
@@ -654,6 +874,89 @@ void MediaLibrary::scanFile(DynamicObject& d)
       }
       mNode->getEventController()->schedule(e);
    }
+
+   return pass;
+}
+
+bool MediaLibrary::storeFile(
+   UserId userId, FileInfo& fi, MpegAudioFrameIndex& index,
+   DynamicObject* userData)
+{
+   bool rval = updateFile(userId, fi, userData);
+   if(rval && index.getFrameCount() > 0 &&
+      !mMediaLibraryDatabase->updateFrameIndex(userId, fi, index))
+   {
+      // the file will be indexed again when its index is needed
+      MO_CAT_DEBUG(BM_MEDIALIBRARY_CAT,
+         "Failed to store frame index for file ID %s: %s",
+         BM_FILE_ID(fi["id"]),
+         JsonWriter::writeToString(Exception::getAsDynamicObject()).c_str());
+      Exception::clear();
+   }
+
+   return rval;
+}
+
+void MediaLibrary::storeFiles(UserId userId, ScannedFileList& files)
+{
+   // store all files and their frame indexes in one transaction
+   bool rval = false;
+   vector<MediaLibraryId> mlIds(files.size(), 0);
+   vector<bool> isNew(files.size(), false);
+   Connection* c = getConnection(userId);
+   if(c != NULL)
+   {
+      if(c->begin())
+      {
+         rval = true;
+         for(size_t i = 0; rval && i < files.size(); ++i)
+         {
+            ScannedFile& sf = files[i];
+            File file(sf.fileInfo["path"]->getString());
+            _setFileDetails(file, sf.fileInfo);
+            bool added = false;
+            rval =
+               mMediaLibraryDatabase->updateFile(
+                  userId, sf.fileInfo, &mlIds[i], &added, c) &&
+               (sf.index.getFrameCount() == 0 ||
+                mMediaLibraryDatabase->updateFrameIndex(
+                   userId, sf.fileInfo, sf.index, c));
+            isNew[i] = added;
+         }
+         rval = rval ? c->commit() : c->rollback() && false;
+      }
+
+      c->close();
+   }
+
+   if(rval)
+   {
+      for(size_t i = 0; i < files.size(); ++i)
+      {
+         ScannedFile& sf = files[i];
+         sf.stored = true;
+         _sendFileUpdatedEvent(
+            mNode, userId, sf.fileInfo, mlIds[i], isNew[i],
+            sf.userData.isNull() ? NULL : &sf.userData);
+      }
+   }
+   else
+   {
+      MO_CAT_DEBUG(BM_MEDIALIBRARY_CAT,
+         "Failed to store a batch of %u files, storing them one at a time: %s",
+         (unsigned int)files.size(),
+         JsonWriter::writeToString(Exception::getAsDynamicObject()).c_str());
+      Exception::clear();
+
+      // store the files one at a time so only failures are reported
+      for(ScannedFileList::iterator i = files.begin(); i != files.end(); ++i)
+      {
+         i->stored = storeFile(
+            userId, i->fileInfo, i->index,
+            i->userData.isNull() ? NULL : &i->userData);
+         Exception::clear();
+      }
+   }
 }
 
 void MediaLibrary::fileUpdated(Event& e)
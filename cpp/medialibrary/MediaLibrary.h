@@ -8,6 +8,7 @@
 #include "bitmunk/common/TypeDefinitions.h"
 #include "bitmunk/medialibrary/IMediaLibrary.h"
 #include "bitmunk/medialibrary/MediaLibraryDatabase.h"
+#include "bitmunk/medialibrary/ScanQueue.h"
 
 namespace bitmunk
 {
@@ -40,6 +41,11 @@ protected:
     */
    MediaLibraryDatabase* mMediaLibraryDatabase;
 
+   /**
+    * The queue that runs file scans.
+    */
+   ScanQueue* mScanQueue;
+
    /**
     * Observer for the file updated event.
     */
@@ -113,10 +119,11 @@ public:
       bitmunk::common::UserId userId);
 
    /**
-    * Starts an asynchronous operation to sets the file ID and format details
-    * in a file info. If the media ID is not specified in the file info, an
-    * attempt will also be made to set it. Once the operation completes, an
-    * event will be fired that has the type:
+    * Queues an interactive scan to set the file ID and format details in a
+    * file info. Interactive scans are run before any queued bulk import
+    * scans. If the media ID is not specified in the file info, an attempt
+    * will also be made to set it. Once the scan completes, an event will be
+    * fired that has the type:
     *
     * "bitmunk.medialibrary.File.scanned" OR
     * "bitmunk.medialibrary.File.exception"
@@ -134,6 +141,31 @@ public:
       bitmunk::common::UserId userId, bitmunk::common::FileInfo& fi,
       bool update, monarch::rt::DynamicObject* userData = NULL);
 
+   /**
+    * Queues a bulk import of files into the media library. Each file is
+    * scanned as by scanFile() with update set to true, but in the
+    * background, and the scanned files are added in batches. Progress events
+    * are fired while the import runs, see ScanQueue.
+    *
+    * @param userId the ID of the user that owns the files.
+    * @param files the FileInfos for the files, with at least their paths set.
+    * @param userData some user data to include in any event that is fired.
+    * @param importId to be set to the ID of the import, may be NULL.
+    *
+    * @return true if the import was queued, false if an exception occurred.
+    */
+   virtual bool importFiles(
+      bitmunk::common::UserId userId, bitmunk::common::FileInfoList& files,
+      monarch::rt::DynamicObject* userData = NULL, uint64_t* importId = NULL);
+
+   /**
+    * Gets statistics for the queue of file scans and imports, see
+    * ScanQueue::getStats().
+    *
+    * @return the statistics.
+    */
+   virtual monarch::rt::DynamicObject getScanStats();
+
    /**
     * Adds or updates a file in the media library.
     *
@@ -175,6 +207,21 @@ public:
       bitmunk::common::UserId userId, bitmunk::common::FileInfo& fi,
       MediaLibraryId mlId = 0, monarch::sql::Connection* conn = NULL);
 
+   /**
+    * Gets the mpeg audio frame index for a file so that sections of its
+    * audio can be located without reading it. A file that has no index, or
+    * has changed since it was indexed, is indexed and its index is stored.
+    *
+    * @param userId the ID of the user that owns the file.
+    * @param fi the FileInfo for the file, with its ID and path set.
+    * @param index the frame index to populate.
+    *
+    * @return true if successful, false on error.
+    */
+   virtual bool getFrameIndex(
+      bitmunk::common::UserId userId, bitmunk::common::FileInfo& fi,
+      bitmunk::data::MpegAudioFrameIndex& index);
+
    /**
     * Populates a set of files from the media library that match the given
     * query parameters.
@@ -219,11 +266,45 @@ public:
 
 protected:
    /**
-    * Run in an operation to scan a file.
+    * Run by the scan queue to scan a file. Fires a scanned or exception
+    * event.
+    *
+    * @param d a DynamicObject with "fileInfo", "userId" and optional
+    *          "userData".
+    * @param index the frame index to populate while the file is scanned.
+    *
+    * @return true if the file was scanned, false if an exception occurred.
+    */
+   virtual bool scanFile(
+      monarch::rt::DynamicObject& d,
+      bitmunk::data::MpegAudioFrameIndex& index);
+
+   /**
+    * Adds or updates a scanned file and its frame index in the media
+    * library.
+    *
+    * @param userId the ID of the user that owns the file.
+    * @param fi the scanned FileInfo.
+    * @param index the file's frame index, empty if it has none.
+    * @param userData some user data to include in any event that is fired.
+    *
+    * @return true if the file was added, false if it could not be.
+    */
+   virtual bool storeFile(
+      bitmunk::common::UserId userId, bitmunk::common::FileInfo& fi,
+      bitmunk::data::MpegAudioFrameIndex& index,
+      monarch::rt::DynamicObject* userData);
+
+   /**
+    * Adds or updates a batch of scanned files in the media library using a
+    * single transaction. If the transaction fails, the files are added one
+    * at a time. Each file that is added has its "stored" flag set.
     *
-    * @param d a DynamicObject with "fileInfo" and "userId".
+    * @param userId the ID of the user that owns the files.
+    * @param files the scanned files.
     */
-   virtual void scanFile(monarch::rt::DynamicObject& d);
+   virtual void storeFiles(
+      bitmunk::common::UserId userId, ScannedFileList& files);
 
    /**
     * Called when a file is updated.
@@ -231,6 +312,8 @@ protected:
     * @param e the event.
     */
    virtual void fileUpdated(monarch::event::Event& e);
+
+   friend class ScanQueue;
 };
 
 } // end namespace medialibrary
@@ -11,11 +11,14 @@
 #include "monarch/data/json/JsonWriter.h"
 #include "monarch/sql/Row.h"
 #include "monarch/sql/Statement.h"
+#include "monarch/util/Convert.h"
 
 #include <algorithm>
+#include <vector>
 
 using namespace std;
 using namespace bitmunk::common;
+using namespace bitmunk::data;
 using namespace bitmunk::medialibrary;
 using namespace bitmunk::peruserdb;
 using namespace bitmunk::node;
@@ -24,10 +27,12 @@ using namespace monarch::data::json;
 using namespace monarch::io;
 using namespace monarch::rt;
 using namespace monarch::sql;
+using namespace monarch::util;
 
 #define MLDB_TABLE_FILES         "bitmunk_medialibrary_files"
 #define MLDB_TABLE_MEDIA         "bitmunk_medialibrary_media"
 #define MLDB_TABLE_CONTRIBUTORS  "bitmunk_medialibrary_contributors"
+#define MLDB_TABLE_FRAME_INDEXES "bitmunk_medialibrary_frame_indexes"
 #define MLDB_EXCEPTION           "bitmunk.medialibrary.MediaLibraryDatabase"
 #define MLDB_EXCEPTION_NOT_FOUND MLDB_EXCEPTION ".NotFound"
 
@@ -187,13 +192,30 @@ bool MediaLibraryDatabase::initializePerUserDatabase(
       rval = dbc->define(schema);
    }
 
+   // mpeg audio frame indexes table (separate from the files table so that
+   // indexes are not read with file infos and older databases gain it)
+   if(rval)
+   {
+      SchemaObject schema;
+      schema["table"] = MLDB_TABLE_FRAME_INDEXES;
+      schema["indices"]->append() = "UNIQUE(file_id)";
+
+      DatabaseClient::addSchemaColumn(schema,
+         "file_id", "TEXT", "id", String);
+      DatabaseClient::addSchemaColumn(schema,
+         "frame_index", "BLOB", "frameIndex", String);
+
+      rval = dbc->define(schema);
+   }
+
    // create tables if they do not exist
    if((rval = dbc->begin(conn)))
    {
       rval =
          dbc->create(MLDB_TABLE_FILES, true, conn) &&
          dbc->create(MLDB_TABLE_MEDIA, true, conn) &&
-         dbc->create(MLDB_TABLE_CONTRIBUTORS, true, conn);
+         dbc->create(MLDB_TABLE_CONTRIBUTORS, true, conn) &&
+         dbc->create(MLDB_TABLE_FRAME_INDEXES, true, conn);
 
       // create contributors insert trigger
       if(rval)
@@ -239,6 +261,20 @@ bool MediaLibraryDatabase::initializePerUserDatabase(
          rval = (s != NULL) && s->execute();
       }
 
+      // create frame indexes delete trigger
+      if(rval)
+      {
+         // this trigger will cascade file deletes to the frame indexes table
+         Statement* s = conn->prepare(
+            "CREATE TRIGGER IF NOT EXISTS fkd_file_id_frame_indexes "
+            "BEFORE DELETE ON " MLDB_TABLE_FILES " FOR EACH ROW "
+            "BEGIN "
+             "DELETE FROM " MLDB_TABLE_FRAME_INDEXES
+             " WHERE file_id=OLD.file_id;"
+            "END;");
+         rval = (s != NULL) && s->execute();
+      }
+
       // end transaction
       rval = dbc->end(conn, rval) && rval;
    }
@@ -538,6 +574,109 @@ bool MediaLibraryDatabase::populateFile(
    return rval;
 }
 
+bool MediaLibraryDatabase::updateFrameIndex(
+   UserId userId, FileInfo& fi, MpegAudioFrameIndex& index, Connection* conn)
+{
+   bool rval = false;
+
+   // get database connection
+   Connection* c = (conn == NULL ? getConnection(userId) : conn);
+   if(c != NULL)
+   {
+      // store the binary index as a blob
+      string encoded = index.encode();
+      Statement* s = c->prepare(
+         "REPLACE INTO " MLDB_TABLE_FRAME_INDEXES " (file_id,frame_index) "
+         "VALUES (:fileId,:frameIndex)");
+      rval =
+         (s != NULL) &&
+         s->setText(":fileId", BM_FILE_ID(fi["id"])) &&
+         s->setBlob(":frameIndex", encoded.data(), encoded.length()) &&
+         s->execute();
+
+      if(conn == NULL)
+      {
+         // close connection
+         c->close();
+      }
+   }
+
+   if(!rval)
+   {
+      ExceptionRef e = new Exception(
+         "Could not update frame index in media library database.",
+         MLDB_EXCEPTION ".UpdateFrameIndexException");
+      BM_ID_SET(e->getDetails()["fileId"], BM_FILE_ID(fi["id"]));
+      BM_ID_SET(e->getDetails()["userId"], userId);
+      Exception::push(e);
+   }
+
+   return rval;
+}
+
+bool MediaLibraryDatabase::populateFrameIndex(
+   UserId userId, FileInfo& fi, MpegAudioFrameIndex& index, Connection* conn)
+{
+   bool rval = false;
+
+   // get database connection
+   Connection* c = (conn == NULL ? getConnection(userId) : conn);
+   if(c != NULL)
+   {
+      // select frame index blob as hex
+      Statement* s = c->prepare(
+         "SELECT hex(frame_index) AS frame_index "
+         "FROM " MLDB_TABLE_FRAME_INDEXES " WHERE file_id=:fileId LIMIT 1");
+      if((s != NULL) &&
+         s->setText(":fileId", BM_FILE_ID(fi["id"])) &&
+         s->execute())
+      {
+         Row* row = s->fetch();
+         if(row == NULL)
+         {
+            ExceptionRef e = new Exception(
+               "Frame index not found in media library.",
+               MLDB_EXCEPTION_NOT_FOUND);
+            Exception::set(e);
+         }
+         else
+         {
+            string hex;
+            if(row->getText("frame_index", hex))
+            {
+               vector<char> bytes(hex.length() / 2 + 1);
+               unsigned int length = 0;
+               rval =
+                  Convert::hexToBytes(
+                     hex.c_str(), hex.length(), &bytes[0], length) &&
+                  index.decode(&bytes[0], length);
+            }
+
+            // finish out the result set
+            s->fetch();
+         }
+      }
+
+      if(conn == NULL)
+      {
+         // close connection
+         c->close();
+      }
+   }
+
+   if(!rval)
+   {
+      ExceptionRef e = new Exception(
+         "Failed to populate the media library frame index.",
+         MLDB_EXCEPTION ".FrameIndexPopulationFailure");
+      BM_ID_SET(e->getDetails()["userId"], userId);
+      BM_ID_SET(e->getDetails()["fileId"], BM_FILE_ID(fi["id"]));
+      Exception::push(e);
+   }
+
+   return rval;
+}
+
 /**
  * Common function to populate media data. This function should be called
  * inside a transaction to ensure data consistency. The passed connection
@@ -5,6 +5,7 @@
 #define bitmunk_medialibrary_MediaLibraryDatabase_H
 
 #include "bitmunk/common/TypeDefinitions.h"
+#include "bitmunk/data/MpegAudioFrameIndex.h"
 #include "bitmunk/medialibrary/IMediaLibrary.h"
 #include "bitmunk/peruserdb/IPerUserDBModule.h"
 #include "bitmunk/peruserdb/PerUserDatabase.h"
@@ -197,6 +198,37 @@ public:
       MediaLibraryId mlId = 0,
       monarch::sql::Connection* conn = NULL);
 
+   /**
+    * Inserts or replaces the mpeg audio frame index for a file.
+    *
+    * @param userId the ID of the user the file belongs to.
+    * @param fi the file info for the file, with its ID set.
+    * @param index the frame index for the file.
+    * @param conn the connection to use, NULL to open and close one.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool updateFrameIndex(
+      bitmunk::common::UserId userId, bitmunk::common::FileInfo& fi,
+      bitmunk::data::MpegAudioFrameIndex& index,
+      monarch::sql::Connection* conn = NULL);
+
+   /**
+    * Populates the mpeg audio frame index for a file.
+    *
+    * @param userId the ID of the user the file belongs to.
+    * @param fi the file info for the file, with its ID set.
+    * @param index the frame index to populate.
+    * @param conn the connection to use, NULL to open and close one.
+    *
+    * @return true if successful, false if an exception occurred (including
+    *         if the file has no frame index).
+    */
+   virtual bool populateFrameIndex(
+      bitmunk::common::UserId userId, bitmunk::common::FileInfo& fi,
+      bitmunk::data::MpegAudioFrameIndex& index,
+      monarch::sql::Connection* conn = NULL);
+
    /**
     * Retrieves the list of files that are stored in the database for the
     * given userId.
@@ -178,6 +178,43 @@ bool MediaLibraryService::initialize()
       }
    }
 
+   // imports
+   {
+      RestResourceHandlerRef imports = new RestResourceHandler();
+      addResource("/imports", imports);
+
+      // Imports many files into the media library in the background
+      // POST .../imports
+      {
+         // a nodeuser must be specified when using a media library service,
+         // and that user must be the same one that is using the service
+         Handler* handler = new Handler(
+            mNode, this, &MediaLibraryService::importFiles,
+            BtpAction::AuthRequired);
+         handler->setSameUserRequired(true);
+         ResourceHandler h = handler;
+
+         v::ValidatorRef qValidator = new v::Map(
+            "nodeuser", new v::Int(v::Int::Positive),
+            NULL);
+
+         v::ValidatorRef validator = new v::Map(
+            "files", new v::All(
+               new v::Type(Array),
+               new v::Min(1, "At least one file must be imported."),
+               new v::Each(new v::Map(
+                  "path", new v::Type(String),
+                  "mediaId", new v::Optional(
+                     new v::Int(v::Int::NonNegative)),
+                  NULL)),
+               NULL),
+            NULL);
+
+         imports->addHandler(
+            h, BtpMessage::Post, 0, &qValidator, &validator);
+      }
+   }
+
    // media
    {
       RestResourceHandlerRef media = new RestResourceHandler();
@@ -209,6 +246,7 @@ void MediaLibraryService::cleanup()
 {
    // remove resources
    removeResource("/files");
+   removeResource("/imports");
    removeResource("/media");
 }
 
@@ -254,6 +292,49 @@ bool MediaLibraryService::updateFile(
    return rval;
 }
 
+bool MediaLibraryService::importFiles(
+   BtpAction* action, DynamicObject& in, DynamicObject& out)
+{
+   bool rval = false;
+
+   UserId userId = action->getInMessage()->getUserId();
+
+   // only scan the given paths and media IDs
+   FileInfoList files;
+   files->setType(Array);
+   FileInfoIterator i = in["files"].getIterator();
+   while(i->hasNext())
+   {
+      FileInfo& next = i->next();
+      FileInfo fi;
+      fi["path"] = next["path"]->getString();
+      if(next->hasMember("mediaId"))
+      {
+         BM_ID_SET(fi["mediaId"], BM_MEDIA_ID(next["mediaId"]));
+      }
+      files->append(fi);
+   }
+
+   // return a 202 Accepted, the files are scanned and added asynchronously
+   uint64_t importId;
+   if((rval = mLibrary->importFiles(userId, files, NULL, &importId)))
+   {
+      action->getResponse()->getHeader()->setStatus(202, "Accepted");
+      out["importId"] = importId;
+      out["total"] = files->length();
+   }
+   else
+   {
+      ExceptionRef e = new Exception(
+         "The files could not be imported into the media library.",
+         MEDIALIBRARY_SERVICE ".ImportFailure");
+      e->getDetails()["userId"] = userId;
+      Exception::push(e);
+   }
+
+   return rval;
+}
+
 bool MediaLibraryService::removeFiles(
    BtpAction* action, DynamicObject& in, DynamicObject& out)
 {
@@ -80,6 +80,26 @@ public:
       bitmunk::protocol::BtpAction* action,
       monarch::rt::DynamicObject& in, monarch::rt::DynamicObject& out);
 
+   /**
+    * Imports many files into the media library.
+    *
+    * The files are scanned and added in the background, after any files
+    * added through updateFile(), and a 202 Accepted is returned with the
+    * "importId" and "total" number of files. Events of type:
+    * "bitmunk.medialibrary.Import.progress" will be generated while the
+    * import runs and "bitmunk.medialibrary.Import.completed" once every file
+    * has been processed, along with the usual events for each file.
+    *
+    * @param action the BtpAction.
+    * @param in the incoming DynamicObject with a "files" array.
+    * @param out the outgoing DynamicObject.
+    *
+    * @return true if successful, false if an Exception occurred.
+    */
+   virtual bool importFiles(
+      bitmunk::protocol::BtpAction* action,
+      monarch::rt::DynamicObject& in, monarch::rt::DynamicObject& out);
+
    /**
     * Removes one or more files from the media library that match the given
     * query.
@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/medialibrary/ScanQueue.h"
+
+#include "bitmunk/medialibrary/MediaLibrary.h"
+#include "bitmunk/medialibrary/MediaLibraryModule.h"
+#include "monarch/rt/System.h"
+
+using namespace std;
+using namespace monarch::event;
+using namespace monarch::modest;
+using namespace monarch::rt;
+using namespace bitmunk::common;
+using namespace bitmunk::data;
+using namespace bitmunk::medialibrary;
+using namespace bitmunk::node;
+
+#define MEDIALIBRARY "bitmunk.medialibrary"
+
+// events
+#define ML_EVENT_IMPORT_PROGRESS    MEDIALIBRARY ".Import.progress"
+#define ML_EVENT_IMPORT_COMPLETED   MEDIALIBRARY ".Import.completed"
+
+ScanQueue::Worker::Worker() :
+   queue(NULL),
+   slot(0)
+{
+}
+
+ScanQueue::Worker::~Worker()
+{
+}
+
+void ScanQueue::Worker::run()
+{
+   queue->work(slot);
+}
+
+ScanQueue::ScanQueue(MediaLibrary* library) :
+   mLibrary(library),
+   mNode(NULL),
+   mNextImportId(1),
+   mWorkers(0),
+   mBatchSize(100),
+   mProgressInterval(1000),
+   mRunning(false),
+   mScans(0),
+   mBatchesStored(0)
+{
+}
+
+ScanQueue::~ScanQueue()
+{
+   ScanQueue::cleanup();
+}
+
+void ScanQueue::initialize(Node* node, DynamicObject& cfg)
+{
+   mNode = node;
+
+   // use one worker per core, but no more than the disks can keep busy
+   uint32_t workers = System::getCpuCoreCount();
+   if(cfg->hasMember("disks"))
+   {
+      uint32_t perDisk = cfg->hasMember("workersPerDisk") ?
+         cfg["workersPerDisk"]->getUInt32() : 2;
+      uint32_t max = cfg["disks"]->getUInt32() * perDisk;
+      if(max > 0 && max < workers)
+      {
+         workers = max;
+      }
+   }
+   if(cfg->hasMember("maxWorkers") && cfg["maxWorkers"]->getUInt32() > 0)
+   {
+      workers = cfg["maxWorkers"]->getUInt32();
+   }
+   if(workers == 0)
+   {
+      workers = 1;
+   }
+   if(cfg->hasMember("batchSize"))
+   {
+      mBatchSize = cfg["batchSize"]->getUInt32();
+   }
+   if(cfg->hasMember("progressInterval"))
+   {
+      mProgressInterval = cfg["progressInterval"]->getUInt32();
+   }
+
+   MO_CAT_DEBUG(BM_MEDIALIBRARY_CAT,
+      "ScanQueue using %u workers, storing %u files per batch",
+      workers, mBatchSize);
+
+   mLock.lock();
+   {
+      mWorkerOps.assign(workers, Operation(NULL));
+      mWorkerBusy.assign(workers, false);
+      mRunning = true;
+   }
+   mLock.unlock();
+}
+
+void ScanQueue::cleanup()
+{
+   // drop queued scans and stop workers once their current scans finish
+   vector<Operation> ops;
+   mLock.lock();
+   {
+      mRunning = false;
+      mInteractive.clear();
+      mBackground.clear();
+      mImports.clear();
+      ops = mWorkerOps;
+      ops.insert(ops.end(), mExitingOps.begin(), mExitingOps.end());
+   }
+   mLock.unlock();
+
+   for(vector<Operation>::iterator i = ops.begin(); i != ops.end(); ++i)
+   {
+      if(!(*i).isNull())
+      {
+         (*i)->waitFor(false);
+      }
+   }
+
+   // store files scanned by the last workers
+   storeBatches();
+
+   mLock.lock();
+   {
+      mWorkerOps.clear();
+      mWorkerBusy.clear();
+      mExitingOps.clear();
+   }
+   mLock.unlock();
+}
+
+bool ScanQueue::addScan(DynamicObject& scan)
+{
+   bool rval;
+
+   mLock.lock();
+   {
+      if((rval = mRunning))
+      {
+         mInteractive.push_back(scan);
+         startWorkers();
+      }
+   }
+   mLock.unlock();
+
+   if(!rval)
+   {
+      ExceptionRef e = new Exception(
+         "Could not queue file scan, the media library is not running.",
+         MEDIALIBRARY ".ScanQueueStopped");
+      Exception::set(e);
+   }
+
+   return rval;
+}
+
+bool ScanQueue::addImport(
+   UserId userId, FileInfoList& files, DynamicObject* userData,
+   uint64_t& importId)
+{
+   bool rval = false;
+
+   mLock.lock();
+   {
+      if(mRunning && files->length() > 0)
+      {
+         importId = mNextImportId++;
+         Import& imp = mImports[importId];
+         imp.userId = userId;
+         imp.total = files->length();
+         imp.completed = 0;
+         imp.failed = 0;
+         imp.started = imp.lastProgress = System::getCurrentMilliseconds();
+         imp.userData = (userData != NULL) ? *userData : DynamicObject(NULL);
+
+         FileInfoIterator i = files.getIterator();
+         while(i->hasNext())
+         {
+            DynamicObject scan;
+            BM_ID_SET(scan["userId"], userId);
+            scan["fileInfo"] = i->next().clone();
+            scan["update"] = true;
+            scan["importId"] = importId;
+            if(userData != NULL)
+            {
+               scan["userData"] = *userData;
+            }
+            mBackground.push_back(scan);
+         }
+         startWorkers();
+         rval = true;
+      }
+   }
+   mLock.unlock();
+
+   if(!rval)
+   {
+      ExceptionRef e = new Exception(
+         "Could not queue file import.",
+         MEDIALIBRARY ".ImportFailed");
+      e->getDetails()["running"] = mRunning;
+      e->getDetails()["files"] = files->length();
+      Exception::set(e);
+   }
+
+   return rval;
+}
+
+DynamicObject ScanQueue::getStats()
+{
+   DynamicObject rval;
+
+   mLock.lock();
+   {
+      rval["interactive"] = (uint32_t)mInteractive.size();
+      rval["background"] = (uint32_t)mBackground.size();
+      rval["workers"] = mWorkers;
+      rval["imports"] = (uint32_t)mImports.size();
+      rval["scans"] = mScans;
+      rval["batches"] = mBatchesStored;
+   }
+   mLock.unlock();
+
+   return rval;
+}
+
+void ScanQueue::startWorkers()
+{
+   // forget exiting workers that have returned
+   list<Operation>::iterator i = mExitingOps.begin();
+   while(i != mExitingOps.end())
+   {
+      if((*i)->stopped())
+      {
+         i = mExitingOps.erase(i);
+      }
+      else
+      {
+         ++i;
+      }
+   }
+
+   size_t queued = mInteractive.size() + mBackground.size();
+   for(unsigned int slot = 0;
+       mWorkers < queued && slot < mWorkerBusy.size(); ++slot)
+   {
+      if(!mWorkerBusy[slot])
+      {
+         // the last worker in the slot may still be returning, keep its
+         // operation so that cleanup() waits for it
+         if(!mWorkerOps[slot].isNull() && !mWorkerOps[slot]->stopped())
+         {
+            mExitingOps.push_back(mWorkerOps[slot]);
+         }
+
+         // operation owns the worker
+         Worker* worker = new Worker();
+         worker->queue = this;
+         worker->slot = slot;
+         RunnableRef r = worker;
+         mWorkerOps[slot] = r;
+         mWorkerBusy[slot] = true;
+         ++mWorkers;
+         mNode->runOperation(mWorkerOps[slot]);
+      }
+   }
+}
+
+void ScanQueue::work(unsigned int slot)
+{
+   bool done = false;
+   while(!done)
+   {
+      // interactive scans take priority, files left in partial batches are
+      // stored once there are no scans left
+      DynamicObject scan(NULL);
+      bool flush = false;
+      mLock.lock();
+      {
+         if(!mInteractive.empty())
+         {
+            scan = mInteractive.front();
+            mInteractive.pop_front();
+         }
+         else if(!mBackground.empty())
+         {
+            scan = mBackground.front();
+            mBackground.pop_front();
+         }
+         else if(!mBatches.empty())
+         {
+            flush = true;
+         }
+         else
+         {
+            // free the slot while the lock is held so a scan queued from
+            // now on starts a new worker, the worker must not touch the
+            // queue once its slot is free
+            mWorkerBusy[slot] = false;
+            --mWorkers;
+            done = true;
+         }
+      }
+      mLock.unlock();
+
+      if(flush)
+      {
+         storeBatches();
+      }
+      else if(!done)
+      {
+         runScan(scan);
+      }
+   }
+}
+
+void ScanQueue::runScan(DynamicObject& scan)
+{
+   UserId userId = BM_USER_ID(scan["userId"]);
+   FileInfo& fi = scan["fileInfo"];
+   bool update = scan["update"]->getBoolean();
+   uint64_t importId = scan->hasMember("importId") ?
+      scan["importId"]->getUInt64() : 0;
+   DynamicObject userData(NULL);
+   if(scan->hasMember("userData"))
+   {
+      userData = scan["userData"];
+   }
+
+   MpegAudioFrameIndex index;
+   bool pass = mLibrary->scanFile(scan, index);
+   if(pass && update && importId != 0 && mBatchSize > 1)
+   {
+      // add the file to the user's batch, store the batch once it is full
+      // or once there are no more imports to fill it
+      ScannedFileList batch;
+      mLock.lock();
+      {
+         ++mScans;
+         ScannedFileList& pending = mBatches[userId];
+         pending.push_back(ScannedFile());
+         ScannedFile& sf = pending.back();
+         sf.fileInfo = fi;
+         sf.userData = userData;
+         sf.index = index;
+         sf.importId = importId;
+         sf.stored = false;
+         if(pending.size() >= mBatchSize || mBackground.empty())
+         {
+            batch.swap(pending);
+            mBatches.erase(userId);
+         }
+      }
+      mLock.unlock();
+
+      if(!batch.empty())
+      {
+         storeBatch(userId, batch);
+      }
+   }
+   else
+   {
+      mLock.lock();
+      {
+         ++mScans;
+      }
+      mLock.unlock();
+
+      if(pass && update)
+      {
+         pass = mLibrary->storeFile(
+            userId, fi, index, userData.isNull() ? NULL : &userData);
+      }
+      if(importId != 0)
+      {
+         fileCompleted(importId, pass);
+      }
+   }
+}
+
+void ScanQueue::storeBatch(UserId userId, ScannedFileList& batch)
+{
+   mLibrary->storeFiles(userId, batch);
+
+   mLock.lock();
+   {
+      ++mBatchesStored;
+   }
+   mLock.unlock();
+
+   for(ScannedFileList::iterator i = batch.begin(); i != batch.end(); ++i)
+   {
+      fileCompleted(i->importId, i->stored);
+   }
+}
+
+void ScanQueue::storeBatches()
+{
+   map<UserId, ScannedFileList> batches;
+   mLock.lock();
+   {
+      batches.swap(mBatches);
+   }
+   mLock.unlock();
+
+   for(map<UserId, ScannedFileList>::iterator i = batches.begin();
+       i != batches.end(); ++i)
+   {
+      storeBatch(i->first, i->second);
+   }
+}
+
+void ScanQueue::fileCompleted(uint64_t importId, bool success)
+{
+   Event e(NULL);
+
+   mLock.lock();
+   {
+      ImportMap::iterator i = mImports.find(importId);
+      if(i != mImports.end())
+      {
+         Import& imp = i->second;
+         ++imp.completed;
+         if(!success)
+         {
+            ++imp.failed;
+         }
+
+         uint64_t now = System::getCurrentMilliseconds();
+         bool completed = (imp.completed == imp.total);
+         if(completed || now - imp.lastProgress >= mProgressInterval)
+         {
+            // estimate the time left from the average time per file
+            uint64_t elapsed = now - imp.started;
+            e = Event();
+            e["type"] = completed ?
+               ML_EVENT_IMPORT_COMPLETED : ML_EVENT_IMPORT_PROGRESS;
+            BM_ID_SET(e["details"]["userId"], imp.userId);
+            e["details"]["importId"] = importId;
+            e["details"]["total"] = imp.total;
+            e["details"]["completed"] = imp.completed;
+            e["details"]["failed"] = imp.failed;
+            e["details"]["elapsed"] = elapsed;
+            e["details"]["remaining"] =
+               elapsed * (imp.total - imp.completed) / imp.completed;
+            if(!imp.userData.isNull())
+            {
+               e["details"]["userData"] = imp.userData;
+            }
+            imp.lastProgress = now;
+         }
+         if(completed)
+         {
+            mImports.erase(i);
+         }
+      }
+   }
+   mLock.unlock();
+
+   if(!e.isNull())
+   {
+      mNode->getEventController()->schedule(e);
+   }
+}
@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_medialibrary_ScanQueue_H
+#define bitmunk_medialibrary_ScanQueue_H
+
+#include "bitmunk/data/MpegAudioFrameIndex.h"
+#include "bitmunk/node/Node.h"
+#include "monarch/rt/ExclusiveLock.h"
+
+#include <list>
+#include <map>
+#include <vector>
+
+namespace bitmunk
+{
+namespace medialibrary
+{
+
+// forward declarations
+class MediaLibrary;
+
+/**
+ * A file that has been scanned and is waiting to be stored in a user's
+ * media library.
+ */
+struct ScannedFile
+{
+   /**
+    * The scanned file.
+    */
+   bitmunk::common::FileInfo fileInfo;
+
+   /**
+    * The user data to include in events, NULL for none.
+    */
+   monarch::rt::DynamicObject userData;
+
+   /**
+    * The file's mpeg audio frame index, empty if it has none.
+    */
+   bitmunk::data::MpegAudioFrameIndex index;
+
+   /**
+    * The import the file is part of.
+    */
+   uint64_t importId;
+
+   /**
+    * Set to true once the file has been stored.
+    */
+   bool stored;
+};
+typedef std::vector<ScannedFile> ScannedFileList;
+
+/**
+ * A ScanQueue runs the file scans for a MediaLibrary on a bounded number of
+ * worker operations.
+ *
+ * There are two queues of scans. Interactive scans (a single file added by
+ * a user) are always taken before background scans (the files of a bulk
+ * import), so that a large import does not delay them. Interactive scans
+ * are stored in the media library as soon as they complete.
+ *
+ * Background scans that succeed are stored in batches, one database
+ * transaction per batch, rather than one transaction per file. A batch is
+ * stored once it is full or once no more background scans are queued.
+ * Progress events are sent for each import at most once per progress
+ * interval, with an estimate of the time left, and a completed event is
+ * sent once all of its files have been scanned and stored:
+ *
+ * "bitmunk.medialibrary.Import.progress" and
+ * "bitmunk.medialibrary.Import.completed" with the details:
+ *
+ * {
+ *    "userId": the ID of the user,
+ *    "importId": the ID of the import,
+ *    "total": the number of files in the import,
+ *    "completed": the number of files that have been processed,
+ *    "failed": the number of files that could not be scanned or stored,
+ *    "elapsed": the milliseconds since the import started,
+ *    "remaining": the estimated milliseconds until the import completes,
+ *    "userData": the user data for the import (if any)
+ * }
+ *
+ * @author Dave Longley
+ */
+class ScanQueue
+{
+protected:
+   /**
+    * A worker takes scans from the queue until there are none left.
+    */
+   class Worker : public monarch::rt::Runnable
+   {
+   public:
+      /**
+       * The queue to work on.
+       */
+      ScanQueue* queue;
+
+      /**
+       * The index of this worker's slot.
+       */
+      unsigned int slot;
+
+   public:
+      /**
+       * Creates a new Worker.
+       */
+      Worker();
+
+      /**
+       * Destructs this Worker.
+       */
+      virtual ~Worker();
+
+      /**
+       * Runs scans.
+       */
+      virtual void run();
+   };
+
+   /**
+    * The state of a bulk import.
+    */
+   struct Import
+   {
+      bitmunk::common::UserId userId;
+      uint32_t total;
+      uint32_t completed;
+      uint32_t failed;
+      uint64_t started;
+      uint64_t lastProgress;
+      monarch::rt::DynamicObject userData;
+   };
+   typedef std::map<uint64_t, Import> ImportMap;
+
+   /**
+    * The MediaLibrary to scan files for.
+    */
+   MediaLibrary* mLibrary;
+
+   /**
+    * The Node to run workers on.
+    */
+   bitmunk::node::Node* mNode;
+
+   /**
+    * The queued scans, with "userId", "fileInfo", "update", and optional
+    * "userData" and "importId" members.
+    */
+   std::list<monarch::rt::DynamicObject> mInteractive;
+   std::list<monarch::rt::DynamicObject> mBackground;
+
+   /**
+    * The imports in progress.
+    */
+   ImportMap mImports;
+
+   /**
+    * The ID for the next import.
+    */
+   uint64_t mNextImportId;
+
+   /**
+    * The scanned files waiting to be stored, per user.
+    */
+   std::map<bitmunk::common::UserId, ScannedFileList> mBatches;
+
+   /**
+    * The operations for the worker slots and whether each slot has a running
+    * worker.
+    */
+   std::vector<monarch::modest::Operation> mWorkerOps;
+   std::vector<bool> mWorkerBusy;
+
+   /**
+    * The operations of workers that freed their slots but may not have
+    * returned yet, when their slots were given to new workers.
+    */
+   std::list<monarch::modest::Operation> mExitingOps;
+
+   /**
+    * The number of running workers.
+    */
+   uint32_t mWorkers;
+
+   /**
+    * The number of scanned files to store in one transaction.
+    */
+   uint32_t mBatchSize;
+
+   /**
+    * The minimum number of milliseconds between progress events for an
+    * import.
+    */
+   uint32_t mProgressInterval;
+
+   /**
+    * True while scans may be queued.
+    */
+   bool mRunning;
+
+   /**
+    * Statistics.
+    */
+   uint64_t mScans;
+   uint64_t mBatchesStored;
+
+   /**
+    * A lock for manipulating the queue.
+    */
+   monarch::rt::ExclusiveLock mLock;
+
+public:
+   /**
+    * Creates a new ScanQueue.
+    *
+    * @param library the MediaLibrary to scan files for.
+    */
+   ScanQueue(MediaLibrary* library);
+
+   /**
+    * Destructs this ScanQueue.
+    */
+   virtual ~ScanQueue();
+
+   /**
+    * Initializes this queue. By default, there is one worker per CPU core.
+    *
+    * @param node the Node to run workers on.
+    * @param cfg the configuration with optional "maxWorkers" (0 for one
+    *            per core), "disks" and "workersPerDisk" (to use no more
+    *            workers than the disks can keep busy), "batchSize" and
+    *            "progressInterval" (in milliseconds) members.
+    */
+   virtual void initialize(
+      bitmunk::node::Node* node, monarch::rt::DynamicObject& cfg);
+
+   /**
+    * Stops this queue. Queued scans are dropped, running scans are waited
+    * for and any scanned files are stored.
+    */
+   virtual void cleanup();
+
+   /**
+    * Queues an interactive scan.
+    *
+    * @param scan the scan with "userId", "fileInfo", "update", and optional
+    *             "userData" members.
+    *
+    * @return true if the scan was queued, false if an exception occurred.
+    */
+   virtual bool addScan(monarch::rt::DynamicObject& scan);
+
+   /**
+    * Queues background scans for a bulk import. The scanned files are
+    * stored in the media library.
+    *
+    * @param userId the ID of the user that owns the files.
+    * @param files the FileInfos for the files, with at least their paths set.
+    * @param userData some user data to include in any event that is fired.
+    * @param importId to be set to the ID of the import.
+    *
+    * @return true if the import was queued, false if an exception occurred.
+    */
+   virtual bool addImport(
+      bitmunk::common::UserId userId, bitmunk::common::FileInfoList& files,
+      monarch::rt::DynamicObject* userData, uint64_t& importId);
+
+   /**
+    * Gets statistics for this queue:
+    *
+    * {
+    *    "interactive": the number of queued interactive scans,
+    *    "background": the number of queued background scans,
+    *    "workers": the number of running workers,
+    *    "imports": the number of imports in progress,
+    *    "scans": the number of scans run,
+    *    "batches": the number of batches stored
+    * }
+    *
+    * @return the statistics.
+    */
+   virtual monarch::rt::DynamicObject getStats();
+
+protected:
+   /**
+    * Starts workers for queued scans, up to the maximum number of workers.
+    * The queue lock must be held.
+    */
+   virtual void startWorkers();
+
+   /**
+    * Runs queued scans until there are none left and stores any scanned
+    * files left in partial batches.
+    *
+    * @param slot the worker's slot.
+    */
+   virtual void work(unsigned int slot);
+
+   /**
+    * Runs a scan and stores the scanned file if requested.
+    *
+    * @param scan the scan.
+    */
+   virtual void runScan(monarch::rt::DynamicObject& scan);
+
+   /**
+    * Stores a batch of scanned files and records their progress.
+    *
+    * @param userId the ID of the user that owns the files.
+    * @param batch the scanned files.
+    */
+   virtual void storeBatch(
+      bitmunk::common::UserId userId, ScannedFileList& batch);
+
+   /**
+    * Stores all pending batches.
+    */
+   virtual void storeBatches();
+
+   /**
+    * Records that a file in an import has been processed, sending progress
+    * or completed events.
+    *
+    * @param importId the ID of the import.
+    * @param success true if the file was scanned and stored.
+    */
+   virtual void fileCompleted(uint64_t importId, bool success);
+
+   friend class Worker;
+};
+
+} // end namespace medialibrary
+} // end namespace bitmunk
+#endif
@@ -51,7 +51,15 @@ bool BtpServer::initialize(Config& cfg)
    // must use "ALL" to handle browsers that hit the api using earlier SSL
    // versions ... TLS is only required for BTP and not all SSL traffic to
    // the BtpServer must be BTP)
-   mSslContext = new SslContext("ALL", false);
+   ServerSslContext* ctx = new ServerSslContext("ALL");
+   mSslContext = ctx;
+
+   // cache sessions long enough for clients to resume them across their
+   // restarts
+   if(cfg->hasMember("sslSessionTimeout"))
+   {
+      ctx->setSessionTimeout(cfg["sslSessionTimeout"]->getUInt32());
+   }
 
    // setup certificate file and private key
    File certFile((FileImpl*)NULL);
@@ -157,6 +165,18 @@ bool BtpServer::initialize(Config& cfg)
 
       MO_CAT_INFO(BM_NODE_CAT, "Running services on domains: %s",
          JsonWriter::writeToString(mDefaultDomains, false, false).c_str());
+
+      // configure compression policy for btp services
+      if(cfg->hasMember("compression"))
+      {
+         mCompressionPolicy.configure(cfg["compression"]);
+      }
+
+      // configure content limits for btp services
+      if(cfg->hasMember("contentLimits"))
+      {
+         mContentLimits.configure(cfg["contentLimits"]);
+      }
    }
 
    if(rval)
@@ -265,6 +285,12 @@ bool BtpServer::addService(
 {
    bool rval = true;
 
+   // use server-wide compression policy
+   service->setCompressionPolicy(&mCompressionPolicy);
+
+   // use server-wide content limits
+   service->setContentLimits(&mContentLimits);
+
    if(initialize)
    {
       rval = service->initialize();
@@ -488,6 +514,31 @@ BtpServiceRef BtpServer::getService(
    return rval;
 }
 
+CompressionPolicy* BtpServer::getCompressionPolicy()
+{
+   return &mCompressionPolicy;
+}
+
+ContentLimits* BtpServer::getContentLimits()
+{
+   return &mContentLimits;
+}
+
+DynamicObject BtpServer::getSslSessionStats()
+{
+   DynamicObject rval;
+   if(mSslContext.isNull())
+   {
+      rval->setType(Map);
+   }
+   else
+   {
+      rval = static_cast<ServerSslContext*>(
+         &(*mSslContext))->getSessionStats();
+   }
+   return rval;
+}
+
 InternetAddressRef BtpServer::getHostAddress()
 {
    return mHostAddress;
@@ -6,6 +6,9 @@
 
 #include "bitmunk/node/Node.h"
 #include "bitmunk/protocol/BtpService.h"
+#include "bitmunk/protocol/CompressionPolicy.h"
+#include "bitmunk/protocol/ContentLimits.h"
+#include "bitmunk/protocol/ServerSslContext.h"
 #include "monarch/http/HttpConnectionServicer.h"
 #include "monarch/net/SocketDataPresenterList.h"
 #include "monarch/net/SslContext.h"
@@ -83,6 +86,16 @@ protected:
       DomainMap;
    DomainMap mServices;
 
+   /**
+    * The CompressionPolicy for all BtpServices.
+    */
+   bitmunk::protocol::CompressionPolicy mCompressionPolicy;
+
+   /**
+    * The ContentLimits for all BtpServices.
+    */
+   bitmunk::protocol::ContentLimits mContentLimits;
+
    /**
     * A lock for manipulating the BtpServices.
     */
@@ -183,6 +196,29 @@ public:
     */
    virtual monarch::net::InternetAddressRef getHostAddress();
 
+   /**
+    * Gets the CompressionPolicy used by all BtpServices, which includes
+    * statistics on compressed content.
+    *
+    * @return the CompressionPolicy.
+    */
+   virtual bitmunk::protocol::CompressionPolicy* getCompressionPolicy();
+
+   /**
+    * Gets the ContentLimits used by all BtpServices.
+    *
+    * @return the ContentLimits.
+    */
+   virtual bitmunk::protocol::ContentLimits* getContentLimits();
+
+   /**
+    * Gets statistics on how often clients resume their SSL sessions with
+    * this server.
+    *
+    * @return the SSL session statistics.
+    */
+   virtual monarch::rt::DynamicObject getSslSessionStats();
+
    /**
     * Adds an virtual host entry for the given profile.
     *
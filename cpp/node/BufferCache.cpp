@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/node/BufferCache.h"
+
+#include "bitmunk/node/Node.h"
+#include "monarch/crypto/MessageDigest.h"
+#include "monarch/data/json/JsonWriter.h"
+#include "monarch/io/File.h"
+#include "monarch/io/FileInputStream.h"
+#include "monarch/io/FileList.h"
+#include "monarch/io/FileOutputStream.h"
+#include "monarch/rt/System.h"
+
+using namespace std;
+using namespace monarch::crypto;
+using namespace monarch::data::json;
+using namespace monarch::io;
+using namespace monarch::rt;
+using namespace bitmunk::node;
+
+BufferCache::BufferCache(const char* extension, uint64_t maxAge) :
+   mExtension(extension),
+   mMaxMemorySize(0),
+   mMaxDiskSize(0),
+   mMaxAge(maxAge),
+   mMemoryUsed(0),
+   mDiskUsed(0),
+   mSpilling(0),
+   mHits(0),
+   mMisses(0),
+   mEvictions(0),
+   mExpirations(0),
+   mInvalidations(0)
+{
+}
+
+BufferCache::~BufferCache()
+{
+   BufferCache::clear();
+}
+
+void BufferCache::configure(DynamicObject& cfg)
+{
+   SpillList spills;
+
+   mLock.lock();
+   {
+      if(cfg->hasMember("maxMemorySize"))
+      {
+         mMaxMemorySize = cfg["maxMemorySize"]->getUInt64();
+      }
+      if(cfg->hasMember("maxDiskSize"))
+      {
+         mMaxDiskSize = cfg["maxDiskSize"]->getUInt64();
+      }
+      if(cfg->hasMember("maxAge"))
+      {
+         mMaxAge = cfg["maxAge"]->getUInt64();
+      }
+      enforceBudgets(spills);
+   }
+   mLock.unlock();
+
+   spillEntries(spills);
+}
+
+bool BufferCache::isCacheable(uint32_t size)
+{
+   bool rval;
+
+   mLock.lock();
+   {
+      rval = (size <= mMaxMemorySize);
+   }
+   mLock.unlock();
+
+   return rval;
+}
+
+bool BufferCache::get(
+   const char* key, const char* version, DynamicObject& info,
+   CacheBufferRef& data)
+{
+   bool rval = false;
+   SpillList spills;
+
+   mLock.lock();
+   {
+      // drop expired entries first so an expired buffer is a miss
+      enforceBudgets(spills);
+
+      EntryMap::iterator i = findEntry(key);
+      if(i != mEntries.end() && strcmp(i->second.version.c_str(), version) != 0)
+      {
+         // buffer was created from something that has since changed
+         removeEntry(i);
+         ++mInvalidations;
+      }
+      else if(i != mEntries.end())
+      {
+         Entry& e = i->second;
+         if(e.data.isNull())
+         {
+            // pin the entry and load it from disk without the lock, it is
+            // kept in memory while it is being used
+            e.loading = true;
+            string path = e.path;
+            uint32_t size = e.size;
+            mLock.unlock();
+            CacheBufferRef loaded = readEntry(path, size);
+            mLock.lock();
+            e.loading = false;
+            mLock.notifyAll();
+
+            if(loaded.isNull())
+            {
+               removeEntry(i);
+            }
+            else
+            {
+               File file(e.path.c_str());
+               file->remove();
+               e.data = loaded;
+               mDiskUsed -= e.size;
+               mMemoryUsed += e.size;
+               rval = true;
+            }
+         }
+         else
+         {
+            rval = true;
+         }
+
+         if(rval)
+         {
+            // share buffer and mark entry as most recently used
+            data = e.data;
+            info = e.info;
+            e.expires = System::getCurrentMilliseconds() + mMaxAge;
+            mLru.splice(mLru.begin(), mLru, e.lru);
+            enforceBudgets(spills);
+         }
+      }
+
+      rval ? ++mHits : ++mMisses;
+   }
+   mLock.unlock();
+
+   spillEntries(spills);
+
+   return rval;
+}
+
+void BufferCache::add(
+   const char* key, const char* version, DynamicObject& info,
+   CacheBufferRef& data, const char* directory)
+{
+   SpillList spills;
+
+   mLock.lock();
+   {
+      if((uint64_t)data->length() <= mMaxMemorySize)
+      {
+         // replace any existing entry
+         EntryMap::iterator i = findEntry(key);
+         if(i != mEntries.end())
+         {
+            removeEntry(i);
+         }
+
+         // determine path for the buffer if it is moved to disk
+         string path;
+         if(directory != NULL && strlen(directory) > 0)
+         {
+            purgeDirectory(directory);
+            MessageDigest md;
+            md.start("SHA1");
+            md.update(key);
+            string name = md.getDigest();
+            name.append(mExtension);
+            path = File::join(directory, name.c_str());
+         }
+
+         // add entry as most recently used
+         mLru.push_front(key);
+         Entry& e = mEntries[key];
+         e.version = version;
+         e.info = info;
+         e.data = data;
+         e.path = path;
+         e.size = data->length();
+         e.expires = System::getCurrentMilliseconds() + mMaxAge;
+         e.loading = false;
+         e.writing = false;
+         e.lru = mLru.begin();
+         mMemoryUsed += e.size;
+
+         enforceBudgets(spills);
+      }
+   }
+   mLock.unlock();
+
+   spillEntries(spills);
+}
+
+void BufferCache::remove(const char* key)
+{
+   mLock.lock();
+   {
+      EntryMap::iterator i = findEntry(key);
+      if(i != mEntries.end())
+      {
+         removeEntry(i);
+         ++mInvalidations;
+      }
+   }
+   mLock.unlock();
+}
+
+void BufferCache::clear()
+{
+   mLock.lock();
+   {
+      // wait for entries that are pinned
+      EntryMap::iterator i = mEntries.begin();
+      while(i != mEntries.end())
+      {
+         if(i->second.loading || i->second.writing)
+         {
+            mLock.wait();
+            i = mEntries.begin();
+         }
+         else
+         {
+            removeEntry(i++);
+         }
+      }
+   }
+   mLock.unlock();
+}
+
+DynamicObject BufferCache::getStats()
+{
+   DynamicObject rval;
+
+   mLock.lock();
+   {
+      rval["entries"] = (uint32_t)mEntries.size();
+      rval["memoryUsed"] = mMemoryUsed;
+      rval["diskUsed"] = mDiskUsed;
+      rval["hits"] = mHits;
+      rval["misses"] = mMisses;
+      rval["evictions"] = mEvictions;
+      rval["expirations"] = mExpirations;
+      rval["invalidations"] = mInvalidations;
+   }
+   mLock.unlock();
+
+   return rval;
+}
+
+BufferCache::EntryMap::iterator BufferCache::findEntry(const char* key)
+{
+   EntryMap::iterator rval = mEntries.find(key);
+   while(rval != mEntries.end() &&
+      (rval->second.loading || rval->second.writing))
+   {
+      mLock.wait();
+      rval = mEntries.find(key);
+   }
+   return rval;
+}
+
+void BufferCache::removeEntry(EntryMap::iterator i)
+{
+   Entry& e = i->second;
+   if(!e.data.isNull())
+   {
+      mMemoryUsed -= e.size;
+   }
+   else
+   {
+      File file(e.path.c_str());
+      file->remove();
+      mDiskUsed -= e.size;
+   }
+   mLru.erase(e.lru);
+   mEntries.erase(i);
+}
+
+void BufferCache::enforceBudgets(SpillList& spills)
+{
+   // Note: When an entry is removed, the iterator is first moved past it
+   // so that it remains valid. Pinned entries are skipped.
+
+   // entries expire in least recently used order, so drop them from the
+   // end of the list until one has not expired
+   list<string>::iterator li;
+   if(mMaxAge > 0)
+   {
+      uint64_t now = System::getCurrentMilliseconds();
+      bool expired = true;
+      li = mLru.end();
+      while(expired && li != mLru.begin())
+      {
+         EntryMap::iterator i = mEntries.find(*(--li));
+         Entry& e = i->second;
+         if((expired = (e.expires <= now)) && !e.loading && !e.writing)
+         {
+            ++li;
+            removeEntry(i);
+            ++mExpirations;
+         }
+      }
+   }
+
+   // select least recently used entries to move to disk (or drop them)
+   // until the memory budget is met, not counting entries that are
+   // already being moved
+   li = mLru.end();
+   while(mMemoryUsed - mSpilling > mMaxMemorySize && li != mLru.begin())
+   {
+      EntryMap::iterator i = mEntries.find(*(--li));
+      Entry& e = i->second;
+      if(!e.data.isNull() && !e.writing)
+      {
+         if(e.path.empty() || e.size > mMaxDiskSize)
+         {
+            ++li;
+            removeEntry(i);
+            ++mEvictions;
+         }
+         else
+         {
+            e.writing = true;
+            mSpilling += e.size;
+            Spill s;
+            s.key = i->first;
+            s.path = e.path;
+            s.data = e.data;
+            s.written = false;
+            spills.push_back(s);
+         }
+      }
+   }
+
+   // drop least recently used entries on disk until the disk budget is met
+   li = mLru.end();
+   while(mDiskUsed > mMaxDiskSize && li != mLru.begin())
+   {
+      EntryMap::iterator i = mEntries.find(*(--li));
+      if(i->second.data.isNull() && !i->second.loading)
+      {
+         ++li;
+         removeEntry(i);
+         ++mEvictions;
+      }
+   }
+}
+
+void BufferCache::spillEntries(SpillList& spills)
+{
+   while(!spills.empty())
+   {
+      // the entries are pinned, so their files are written without the lock
+      for(SpillList::iterator si = spills.begin(); si != spills.end(); ++si)
+      {
+         si->written = writeEntry(si->path, si->data);
+      }
+
+      mLock.lock();
+      {
+         for(SpillList::iterator si = spills.begin(); si != spills.end(); ++si)
+         {
+            EntryMap::iterator i = mEntries.find(si->key);
+            Entry& e = i->second;
+            e.writing = false;
+            mSpilling -= e.size;
+            if(si->written)
+            {
+               // the data is freed once no user of it is left
+               e.data.setNull();
+               mMemoryUsed -= e.size;
+               mDiskUsed += e.size;
+            }
+            else
+            {
+               removeEntry(i);
+               ++mEvictions;
+            }
+         }
+         mLock.notifyAll();
+
+         // the budgets may have been exceeded again while writing
+         spills.clear();
+         enforceBudgets(spills);
+      }
+      mLock.unlock();
+   }
+}
+
+bool BufferCache::writeEntry(const string& path, CacheBufferRef& data)
+{
+   bool rval;
+
+   File file(path.c_str());
+   FileOutputStream fos(file);
+   rval =
+      fos.write(data->data(), data->length()) &&
+      fos.finish();
+   fos.close();
+
+   if(!rval)
+   {
+      MO_CAT_ERROR(BM_NODE_CAT,
+         "Could not write cache file '%s': %s",
+         path.c_str(),
+         JsonWriter::writeToString(Exception::getAsDynamicObject()).c_str());
+      Exception::clear();
+      file->remove();
+   }
+
+   return rval;
+}
+
+CacheBufferRef BufferCache::readEntry(const string& path, uint32_t size)
+{
+   CacheBufferRef rval = new ByteBuffer(size);
+
+   File file(path.c_str());
+   FileInputStream fis(file);
+   while(rval->put(&fis) > 0);
+   fis.close();
+
+   if(rval->length() != (int)size)
+   {
+      MO_CAT_ERROR(BM_NODE_CAT,
+         "Could not read cache file '%s'.", path.c_str());
+      Exception::clear();
+      rval.setNull();
+   }
+
+   return rval;
+}
+
+void BufferCache::purgeDirectory(const char* directory)
+{
+   if(mPurgedDirectories.find(directory) == mPurgedDirectories.end())
+   {
+      mPurgedDirectories.insert(directory);
+
+      File dir(directory);
+      if(!dir->exists())
+      {
+         dir->mkdirs();
+      }
+      else
+      {
+         FileList files;
+         dir->listFiles(files);
+         IteratorRef<File> i = files->getIterator();
+         while(i->hasNext())
+         {
+            File& f = i->next();
+            if(strcmp(f->getExtension(), mExtension.c_str()) == 0)
+            {
+               f->remove();
+            }
+         }
+      }
+      Exception::clear();
+   }
+}
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_node_BufferCache_H
+#define bitmunk_node_BufferCache_H
+
+#include "monarch/io/ByteBuffer.h"
+#include "monarch/rt/Collectable.h"
+#include "monarch/rt/DynamicObject.h"
+#include "monarch/rt/ExclusiveLock.h"
+
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+
+namespace bitmunk
+{
+namespace node
+{
+
+// type definition for a reference counted cache buffer
+typedef monarch::rt::Collectable<monarch::io::ByteBuffer> CacheBufferRef;
+
+/**
+ * A BufferCache stores buffers of data under string keys within a memory
+ * budget and a disk budget. It is the storage behind the caches for data
+ * that is expensive to produce, ie: rendered samples and encoded pieces.
+ *
+ * Every buffer is stored with a version and some information about it. A
+ * buffer with a different version than the one requested is stale, it is
+ * removed from the cache and treated as a miss. Buffers may also expire
+ * once they have not been used for a maximum age.
+ *
+ * Buffers are kept in memory until the memory budget is exceeded, at which
+ * point the least recently used buffers are moved to disk. When the disk
+ * budget is exceeded, the least recently used buffers on disk are removed.
+ * Disk entries are only indexed in memory, any cache files left in a cache
+ * directory by a previous run are removed the first time the directory is
+ * used.
+ *
+ * Cached buffers are shared with the threads using them by reference, they
+ * are never copied. Files are read and written without holding the cache
+ * lock. An entry is pinned while its file is read or written so that it
+ * cannot be removed, and other requests for it wait until it is unpinned.
+ *
+ * @author Dave Longley
+ */
+class BufferCache
+{
+protected:
+   /**
+    * A cache entry. The data is either in memory or in a file. An entry
+    * that is loading is being read from its file, an entry that is writing
+    * is being moved to its file.
+    */
+   struct Entry
+   {
+      std::string version;
+      monarch::rt::DynamicObject info;
+      CacheBufferRef data;
+      std::string path;
+      uint32_t size;
+      uint64_t expires;
+      bool loading;
+      bool writing;
+      std::list<std::string>::iterator lru;
+   };
+   typedef std::map<std::string, Entry> EntryMap;
+   EntryMap mEntries;
+
+   /**
+    * An entry that is to be moved to disk once the cache lock is released.
+    */
+   struct Spill
+   {
+      std::string key;
+      std::string path;
+      CacheBufferRef data;
+      bool written;
+   };
+   typedef std::list<Spill> SpillList;
+
+   /**
+    * The keys for all entries, most recently used first.
+    */
+   std::list<std::string> mLru;
+
+   /**
+    * The directories that have been purged of stale cache files.
+    */
+   std::set<std::string> mPurgedDirectories;
+
+   /**
+    * The extension for cache files.
+    */
+   std::string mExtension;
+
+   /**
+    * The maximum number of bytes to store in memory.
+    */
+   uint64_t mMaxMemorySize;
+
+   /**
+    * The maximum number of bytes to store on disk.
+    */
+   uint64_t mMaxDiskSize;
+
+   /**
+    * The number of milliseconds an unused entry is kept, 0 for no limit.
+    */
+   uint64_t mMaxAge;
+
+   /**
+    * The bytes currently stored in memory and on disk.
+    */
+   uint64_t mMemoryUsed;
+   uint64_t mDiskUsed;
+
+   /**
+    * The bytes in memory that are being moved to disk.
+    */
+   uint64_t mSpilling;
+
+   /**
+    * Statistics.
+    */
+   uint64_t mHits;
+   uint64_t mMisses;
+   uint64_t mEvictions;
+   uint64_t mExpirations;
+   uint64_t mInvalidations;
+
+   /**
+    * A lock for manipulating the cache.
+    */
+   monarch::rt::ExclusiveLock mLock;
+
+public:
+   /**
+    * Creates a new BufferCache. The cache is disabled until it is
+    * configured.
+    *
+    * @param extension the extension for cache files, ie: ".sample".
+    * @param maxAge the default number of milliseconds an unused entry is
+    *               kept, 0 for no limit.
+    */
+   BufferCache(const char* extension, uint64_t maxAge);
+
+   /**
+    * Destructs this BufferCache, removing any cache files.
+    */
+   virtual ~BufferCache();
+
+   /**
+    * Configures this cache.
+    *
+    * @param cfg the configuration with optional "maxMemorySize" and
+    *            "maxDiskSize" members (in bytes) and "maxAge" member (in
+    *            milliseconds).
+    */
+   virtual void configure(monarch::rt::DynamicObject& cfg);
+
+   /**
+    * Returns true if a buffer of the given size could be cached.
+    *
+    * @param size the size of the buffer.
+    *
+    * @return true if the buffer could be cached, false if not.
+    */
+   virtual bool isCacheable(uint32_t size);
+
+   /**
+    * Gets a cached buffer.
+    *
+    * @param key the key for the buffer.
+    * @param version the version of the buffer that is wanted, a cached
+    *                buffer with any other version is removed.
+    * @param info to be set to the information stored with the buffer, which
+    *             must not be changed.
+    * @param data to be set to the cached data, which must not be changed.
+    *
+    * @return true if the buffer was found, false if not.
+    */
+   virtual bool get(
+      const char* key, const char* version, monarch::rt::DynamicObject& info,
+      CacheBufferRef& data);
+
+   /**
+    * Adds a buffer to the cache if it fits in the memory budget.
+    *
+    * @param key the key for the buffer.
+    * @param version the version of the buffer.
+    * @param info the information to store with the buffer, which must not
+    *             be changed once added.
+    * @param data the data, which must not be changed once added.
+    * @param directory the directory to store the buffer in if it is moved
+    *                  to disk, empty to never move it to disk.
+    */
+   virtual void add(
+      const char* key, const char* version, monarch::rt::DynamicObject& info,
+      CacheBufferRef& data, const char* directory);
+
+   /**
+    * Removes a cached buffer.
+    *
+    * @param key the key for the buffer.
+    */
+   virtual void remove(const char* key);
+
+   /**
+    * Removes all cached buffers.
+    */
+   virtual void clear();
+
+   /**
+    * Gets statistics for this cache:
+    *
+    * {
+    *    "entries": the number of cached buffers,
+    *    "memoryUsed": the bytes stored in memory,
+    *    "diskUsed": the bytes stored on disk,
+    *    "hits": buffers found in the cache,
+    *    "misses": buffers not found in the cache,
+    *    "evictions": buffers removed due to the budgets,
+    *    "expirations": buffers removed because they were not used in time,
+    *    "invalidations": buffers removed because they were stale
+    * }
+    *
+    * @return the statistics.
+    */
+   virtual monarch::rt::DynamicObject getStats();
+
+protected:
+   /**
+    * Finds an entry, waiting for it to be unpinned if its file is being
+    * read or written. The cache lock must be held.
+    *
+    * @param key the key for the entry.
+    *
+    * @return the entry, or the end of the entries if there is none.
+    */
+   virtual EntryMap::iterator findEntry(const char* key);
+
+   /**
+    * Removes an entry that is not pinned. The cache lock must be held.
+    *
+    * @param i the entry to remove.
+    */
+   virtual void removeEntry(EntryMap::iterator i);
+
+   /**
+    * Removes expired entries, then removes the least recently used entries
+    * or selects them to be moved to disk until the memory and disk budgets
+    * are met. Entries that are selected are pinned. The cache lock must be
+    * held.
+    *
+    * @param spills to be appended to with the entries to move to disk.
+    */
+   virtual void enforceBudgets(SpillList& spills);
+
+   /**
+    * Moves entries selected by enforceBudgets() to disk, repeating until
+    * the budgets are met. The cache lock must not be held.
+    *
+    * @param spills the entries to move to disk.
+    */
+   virtual void spillEntries(SpillList& spills);
+
+   /**
+    * Writes an entry's data to disk. The cache lock must not be held.
+    *
+    * @param path the path to the entry's file.
+    * @param data the entry's data.
+    *
+    * @return true if successful, false if not.
+    */
+   virtual bool writeEntry(const std::string& path, CacheBufferRef& data);
+
+   /**
+    * Reads an entry's data from disk. The cache lock must not be held.
+    *
+    * @param path the path to the entry's file.
+    * @param size the size of the entry's data.
+    *
+    * @return the data or NULL if it could not be read.
+    */
+   virtual CacheBufferRef readEntry(const std::string& path, uint32_t size);
+
+   /**
+    * Removes cache files left in a directory by a previous run, once per
+    * directory. The cache lock must be held.
+    *
+    * @param directory the directory.
+    */
+   virtual void purgeDirectory(const char* directory);
+};
+
+} // end namespace node
+} // end namespace bitmunk
+#endif
@@ -5,11 +5,16 @@
 
 #include "bitmunk/node/BtpServer.h"
 #include "bitmunk/node/Node.h"
+#include "monarch/data/json/JsonWriter.h"
+#include "monarch/util/StringTools.h"
 
 using namespace std;
 using namespace monarch::config;
+using namespace monarch::data::json;
+using namespace monarch::http;
 using namespace monarch::net;
 using namespace monarch::rt;
+using namespace monarch::util;
 using namespace bitmunk::common;
 using namespace bitmunk::protocol;
 using namespace bitmunk::node;
@@ -21,10 +26,52 @@ Messenger::Messenger(Node* node, Config& cfg) :
 {
    mBitmunkUrl = new Url(cfg["bitmunkUrl"]->getString());
    mSecureBitmunkUrl = new Url(cfg["secureBitmunkUrl"]->getString());
+
+   // configure keep-alive connection pool
+   if(cfg->hasMember("connectionPool"))
+   {
+      mClient.getConnectionPool()->configure(cfg["connectionPool"]);
+   }
+
+   // configure cache for objects read from bitmunk
+   if(cfg->hasMember("responseCache"))
+   {
+      mResponseCache.configure(cfg["responseCache"]);
+   }
+
+   // configure ssl session cache, loading sessions saved before a restart
+   if(cfg->hasMember("sslSessionCache"))
+   {
+      Config& sc = cfg["sslSessionCache"];
+      PersistentSslSessionCache* cache =
+         mClient.getPersistentSslSessionCache();
+      cache->configure(sc);
+      if(sc->hasMember("file") &&
+         !(mNode->getConfigManager()->expandBitmunkHomePath(
+            sc["file"]->getString(), mSslSessionFile) &&
+         cache->load(mSslSessionFile.c_str())))
+      {
+         // sessions are only an optimization, so start without them
+         MO_CAT_WARNING(BM_NODE_CAT,
+            "Could not load SSL sessions: %s",
+            JsonWriter::writeToString(
+               Exception::getAsDynamicObject()).c_str());
+         Exception::clear();
+      }
+   }
 }
 
 Messenger::~Messenger()
 {
+   if(mSslSessionFile.length() > 0 &&
+      !mClient.getPersistentSslSessionCache()->save(mSslSessionFile.c_str()))
+   {
+      MO_CAT_WARNING(BM_NODE_CAT,
+         "Could not save SSL sessions: %s",
+         JsonWriter::writeToString(
+            Exception::getAsDynamicObject()).c_str());
+      Exception::clear();
+   }
 }
 
 string Messenger::getSelfUrl(bool ssl)
@@ -210,6 +257,7 @@ bool Messenger::putToBitmunk(
    std::string str = getBitmunkUrl()->toString();
    str.append(url->toString());
    Url u(str.c_str());
+   invalidateBitmunkUrl(url);
    return exchange(
       1, BtpMessage::Put, &u, &out, in, userId, agentId, headers, timeout);
 }
@@ -221,6 +269,7 @@ bool Messenger::putSecureToBitmunk(
    std::string str = getSecureBitmunkUrl()->toString();
    str.append(url->toString());
    Url u(str.c_str());
+   invalidateBitmunkUrl(url);
    return exchange(
       1, BtpMessage::Put, &u, &out, in, userId, agentId, headers, timeout);
 }
@@ -240,6 +289,7 @@ bool Messenger::postToBitmunk(
    std::string str = getBitmunkUrl()->toString();
    str.append(url->toString());
    Url u(str.c_str());
+   invalidateBitmunkUrl(url);
    return exchange(
       1, BtpMessage::Post, &u, out, in, userId, agentId, headers, timeout);
 }
@@ -251,6 +301,7 @@ bool Messenger::postSecureToBitmunk(
    std::string str = getSecureBitmunkUrl()->toString();
    str.append(url->toString());
    Url u(str.c_str());
+   invalidateBitmunkUrl(url);
    return exchange(
       1, BtpMessage::Post, &u, out, in, userId, agentId, headers, timeout);
 }
@@ -267,22 +318,16 @@ bool Messenger::getFromBitmunk(
    Url* url, DynamicObject& in, UserId userId, UserId agentId,
    DynamicObject* headers, uint32_t timeout)
 {
-   std::string str = getBitmunkUrl()->toString();
-   str.append(url->toString());
-   Url u(str.c_str());
-   return exchange(
-      0, BtpMessage::Get, &u, NULL, &in, userId, agentId, headers, timeout);
+   return getCachedFromBitmunk(
+      false, url, in, userId, agentId, headers, timeout);
 }
 
 bool Messenger::getSecureFromBitmunk(
    Url* url, DynamicObject& in, UserId userId, UserId agentId,
    DynamicObject* headers, uint32_t timeout)
 {
-   std::string str = getSecureBitmunkUrl()->toString();
-   str.append(url->toString());
-   Url u(str.c_str());
-   return exchange(
-      1, BtpMessage::Get, &u, NULL, &in, userId, agentId, headers, timeout);
+   return getCachedFromBitmunk(
+      true, url, in, userId, agentId, headers, timeout);
 }
 
 bool Messenger::deleteResource(
@@ -300,6 +345,7 @@ bool Messenger::deleteFromBitmunk(
    std::string str = getBitmunkUrl()->toString();
    str.append(url->toString());
    Url u(str.c_str());
+   invalidateBitmunkUrl(url);
    return exchange(
       0, BtpMessage::Delete, &u, NULL, in, userId, agentId, headers, timeout);
 }
@@ -311,6 +357,7 @@ bool Messenger::deleteSecureFromBitmunk(
    std::string str = getSecureBitmunkUrl()->toString();
    str.append(url->toString());
    Url u(str.c_str());
+   invalidateBitmunkUrl(url);
    return exchange(
       1, BtpMessage::Delete, &u, NULL, in, userId, agentId, headers, timeout);
 }
@@ -319,3 +366,108 @@ inline BtpClient* Messenger::getBtpClient()
 {
    return &mClient;
 }
+
+ResponseCache* Messenger::getResponseCache()
+{
+   return &mResponseCache;
+}
+
+/**
+ * A BitmunkFetcher gets an object from Bitmunk for the response cache.
+ */
+class BitmunkFetcher : public ResponseFetcher
+{
+protected:
+   Messenger* mMessenger;
+   UserId mPeerId;
+   Url* mUrl;
+   UserId mUserId;
+   UserId mAgentId;
+   uint32_t mTimeout;
+
+public:
+   BitmunkFetcher(
+      Messenger* messenger, UserId peerId, Url* url,
+      UserId userId, UserId agentId, uint32_t timeout) :
+      mMessenger(messenger),
+      mPeerId(peerId),
+      mUrl(url),
+      mUserId(userId),
+      mAgentId(agentId),
+      mTimeout(timeout)
+   {
+   };
+   virtual ~BitmunkFetcher() {};
+
+   virtual bool fetch(
+      DynamicObject& headers, DynamicObject& in, HttpResponseHeader& header)
+   {
+      bool rval;
+
+      // save the response header for its status and caching fields
+      BtpMessage msgOut;
+      msgOut.setType(BtpMessage::Get);
+      msgOut.getCustomHeaders() = headers;
+      BtpMessage msgIn;
+      msgIn.setDynamicObject(in);
+      msgIn.setSaveHeaders(true);
+      rval = mMessenger->exchange(
+         mPeerId, mUrl, &msgOut, &msgIn, mUserId, mAgentId, mTimeout);
+      if(rval)
+      {
+         HttpResponseHeader* saved = msgIn.getResponseHeader();
+         header.setStatus(
+            saved->getStatusCode(), saved->getStatusMessage());
+         saved->writeTo(&header);
+      }
+
+      return rval;
+   };
+};
+
+bool Messenger::getCachedFromBitmunk(
+   bool secure, Url* url, DynamicObject& in, UserId userId, UserId agentId,
+   DynamicObject* headers, uint32_t timeout)
+{
+   bool rval;
+
+   std::string str = secure ?
+      getSecureBitmunkUrl()->toString() : getBitmunkUrl()->toString();
+   str.append(url->toString());
+   Url u(str.c_str());
+
+   // custom headers may change the response, so do not cache it
+   if(!mResponseCache.isEnabled() ||
+      (headers != NULL && (*headers)->length() > 0))
+   {
+      rval = exchange(
+         secure ? 1 : 0, BtpMessage::Get, &u, NULL, &in,
+         userId, agentId, headers, timeout);
+   }
+   else
+   {
+      // responses may vary by user, so key on the url and the users
+      string key = StringTools::format("%s %" PRIu64 ":%" PRIu64,
+         url->toString().c_str(), userId, agentId);
+      BitmunkFetcher fetcher(
+         this, secure ? 1 : 0, &u, userId, agentId, timeout);
+      rval = mResponseCache.get(key.c_str(), in, &fetcher);
+   }
+
+   return rval;
+}
+
+void Messenger::invalidateBitmunkUrl(Url* url)
+{
+   if(mResponseCache.isEnabled())
+   {
+      // invalidate the resource regardless of query or user
+      string prefix = url->toString();
+      string::size_type query = prefix.find('?');
+      if(query != string::npos)
+      {
+         prefix.erase(query);
+      }
+      mResponseCache.invalidate(prefix.c_str());
+   }
+}
@@ -4,6 +4,7 @@
 #ifndef bitmunk_node_Messenger_H
 #define bitmunk_node_Messenger_H
 
+#include "bitmunk/node/ResponseCache.h"
 #include "bitmunk/protocol/BtpClient.h"
 #include "monarch/config/ConfigManager.h"
 
@@ -43,6 +44,16 @@ protected:
     */
    bitmunk::protocol::BtpClient mClient;
 
+   /**
+    * The file to save SSL sessions to, empty not to save them.
+    */
+   std::string mSslSessionFile;
+
+   /**
+    * The cache for objects read from Bitmunk.
+    */
+   ResponseCache mResponseCache;
+
 public:
    /**
     * Creates a new Messenger for the passed Node.
@@ -53,7 +64,7 @@ public:
    Messenger(Node* node, monarch::config::Config& cfg);
 
    /**
-    * Destructs this Messenger.
+    * Destructs this Messenger, saving its SSL sessions if configured to.
     */
    virtual ~Messenger();
 
@@ -440,6 +451,46 @@ public:
     * @return this Messengers's BtpClient.
     */
    virtual bitmunk::protocol::BtpClient* getBtpClient();
+
+   /**
+    * Gets the cache for objects read from Bitmunk. If it is enabled, gets
+    * from Bitmunk without custom headers are answered from the cache when
+    * possible and identical concurrent gets share one request. Puts, posts,
+    * and deletes to Bitmunk invalidate the cached objects for their url.
+    *
+    * @return the response cache.
+    */
+   virtual ResponseCache* getResponseCache();
+
+protected:
+   /**
+    * Gets an object from Bitmunk through the response cache.
+    *
+    * @param secure true to use the secure Bitmunk url, false not to.
+    * @param url the relative url to be appended to the Bitmunk url.
+    * @param in the object to receive.
+    * @param userId the ID of the user making the btp-authenticated call, 0 to
+    *               use no btp-authentication.
+    * @param agentId the ID of the agent that will sign the message or 0 to
+    *                use the passed user ID as the agent ID for a
+    *                btp-authenticated call.
+    * @param headers any extra headers to add to the request.
+    * @param timeout the timeout in seconds.
+    *
+    * @return true if successful, false if an exception occurred or was
+    *         received.
+    */
+   virtual bool getCachedFromBitmunk(
+      bool secure, monarch::net::Url* url, monarch::rt::DynamicObject& in,
+      bitmunk::common::UserId userId, bitmunk::common::UserId agentId,
+      monarch::rt::DynamicObject* headers, uint32_t timeout);
+
+   /**
+    * Invalidates any cached objects read from a Bitmunk url.
+    *
+    * @param url the relative url that was changed.
+    */
+   virtual void invalidateBitmunkUrl(monarch::net::Url* url);
 };
 
 // typedef for reference counted Messenger
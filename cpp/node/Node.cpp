@@ -135,7 +135,12 @@ bool Node::initialize()
          mBtpServer->initialize(cfg) &&
          btpc->getSslContext()->setVerifyCAs(&caFile, NULL) &&
          mEventHandler.initialize();
-      if(!rval)
+      if(rval)
+      {
+         // report public key cache statistics through the node monitor
+         mPublicKeyCache.setStateMonitor(&mMonitor);
+      }
+      else
       {
          // failed to initialize, clean up node
          cleanup();
@@ -149,6 +154,7 @@ void Node::cleanup()
 {
    mEventHandler.cleanup();
    mBtpServer->cleanup();
+   mPublicKeyCache.setStateMonitor(NULL);
    mMonitor.removeAll();
    mMessenger.setNull();
    mPublicKeyCache.clear();
@@ -19,9 +19,8 @@ using namespace monarch::net;
 using namespace monarch::rt;
 using namespace monarch::util;
 
-NodeService::NodeService(
-   Node* node, const char* path, bool dynamicResources) :
-   BtpService(path, dynamicResources)
+NodeService::NodeService(Node* node, const char* path) :
+   BtpService(path)
 {
    mNode = node;
    mExceptionTypeBlockList->setType(Array);
@@ -38,10 +38,8 @@ public:
     *
     * @param node the associated Node.
     * @param path the path this servicer handles requests for.
-    * @param dynamicResources true to allow dynamic adding/removing of
-    *                         resources, false not to.
     */
-   NodeService(Node* node, const char* path, bool dynamicResources = false);
+   NodeService(Node* node, const char* path);
 
    /**
     * Destructs this NodeService.
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#define __STDC_FORMAT_MACROS
+
+#include "bitmunk/node/PieceCache.h"
+
+using namespace std;
+using namespace monarch::rt;
+using namespace bitmunk::common;
+using namespace bitmunk::node;
+
+// pieces are never stale, they are keyed on everything they depend on
+#define PIECE_VERSION ""
+
+PieceCache::PieceCache() :
+   BufferCache(".piece", 600000)
+{
+}
+
+PieceCache::~PieceCache()
+{
+}
+
+bool PieceCache::getPiece(
+   const char* key, FilePiece& fp, CacheBufferRef& data)
+{
+   bool rval;
+
+   DynamicObject info;
+   if((rval = get(key, PIECE_VERSION, info, data)))
+   {
+      fp.merge(info, false);
+   }
+
+   return rval;
+}
+
+void PieceCache::addPiece(
+   const char* key, FilePiece& fp, CacheBufferRef& data,
+   const char* directory)
+{
+   DynamicObject info = fp.clone();
+   add(key, PIECE_VERSION, info, data, directory);
+}
+
+string PieceCache::createKey(
+   UserId sellerId, const char* csHash, FileId fileId, BfpId bfpId,
+   uint32_t index, uint32_t size)
+{
+   // key is "<sellerId>|<csHash>|<fileId>|<bfpId>|<index>|<size>"
+   char tmp[22];
+   snprintf(tmp, 22, "%" PRIu64, sellerId);
+   string key = tmp;
+   key.push_back('|');
+   key.append(csHash);
+   key.push_back('|');
+   key.append(fileId);
+   snprintf(tmp, 22, "|%" PRIu32, bfpId);
+   key.append(tmp);
+   snprintf(tmp, 22, "|%" PRIu32, index);
+   key.append(tmp);
+   snprintf(tmp, 22, "|%" PRIu32, size);
+   key.append(tmp);
+   return key;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_node_PieceCache_H
+#define bitmunk_node_PieceCache_H
+
+#include "bitmunk/common/TypeDefinitions.h"
+#include "bitmunk/node/BufferCache.h"
+
+namespace bitmunk
+{
+namespace node
+{
+
+/**
+ * A PieceCache stores the encoded output of a bfp for file pieces that have
+ * already been sent so that repeated requests for the same piece (ie: a
+ * buyer retrying a piece or re-requesting it from a resumed download) do
+ * not have to redo the expensive watermark and encryption transform.
+ *
+ * The bfp output for a piece depends on the contract section it is sold
+ * under (the watermark and the keys are both tied to it), so a piece is
+ * keyed by its seller, contract section hash, file, bfp, index and piece
+ * size. Cached output therefore cannot be shared between buyers, it only
+ * serves the same buyer's retries and resumes. Those follow the original
+ * request closely, so entries expire once they have not been used for the
+ * maximum age (10 minutes by default) and the budgets only need to cover
+ * the pieces in flight.
+ *
+ * Pieces are stored in a BufferCache, so they are shared with the threads
+ * sending them by reference and moved to and from disk without holding the
+ * cache lock.
+ *
+ * @author Dave Longley
+ */
+class PieceCache : public BufferCache
+{
+public:
+   /**
+    * Creates a new PieceCache. The cache is disabled until it is configured.
+    */
+   PieceCache();
+
+   /**
+    * Destructs this PieceCache, removing any cached piece files.
+    */
+   virtual ~PieceCache();
+
+   /**
+    * Gets a cached piece.
+    *
+    * @param key the key for the piece.
+    * @param fp the FilePiece to populate with the cached bfp output
+    *           information (size, bfp signature, and keys).
+    * @param data to be set to the cached piece data, which must not be
+    *             changed.
+    *
+    * @return true if the piece was found, false if not.
+    */
+   virtual bool getPiece(
+      const char* key, bitmunk::common::FilePiece& fp, CacheBufferRef& data);
+
+   /**
+    * Adds a piece to the cache if it fits in the memory budget.
+    *
+    * @param key the key for the piece.
+    * @param fp the FilePiece with the bfp output information.
+    * @param data the piece data, which must not be changed once added.
+    * @param directory the directory to store the piece in if it is moved
+    *                  to disk, empty to never move it to disk.
+    */
+   virtual void addPiece(
+      const char* key, bitmunk::common::FilePiece& fp, CacheBufferRef& data,
+      const char* directory);
+
+   /**
+    * Creates the key for a piece.
+    *
+    * @param sellerId the ID of the seller.
+    * @param csHash the hash of the contract section the piece is sold under.
+    * @param fileId the ID of the file.
+    * @param bfpId the ID of the bfp.
+    * @param index the index of the piece.
+    * @param size the standard piece size.
+    *
+    * @return the key.
+    */
+   static std::string createKey(
+      bitmunk::common::UserId sellerId, const char* csHash,
+      bitmunk::common::FileId fileId, bitmunk::common::BfpId bfpId,
+      uint32_t index, uint32_t size);
+};
+
+} // end namespace node
+} // end namespace bitmunk
+#endif
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/node/ResponseCache.h"
+
+#include "monarch/rt/System.h"
+
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+using namespace monarch::http;
+using namespace monarch::rt;
+using namespace bitmunk::node;
+
+ResponseCache::ResponseCache() :
+   mEnabled(false),
+   mGeneration(0),
+   mCapacity(256),
+   mTtl(5000),
+   mMaxTtl(60000),
+   mHits(0),
+   mMisses(0),
+   mCoalesced(0),
+   mFetches(0),
+   mRevalidated(0)
+{
+}
+
+ResponseCache::~ResponseCache()
+{
+}
+
+void ResponseCache::configure(DynamicObject& cfg)
+{
+   mLock.lock();
+   {
+      if(cfg->hasMember("enabled"))
+      {
+         mEnabled = cfg["enabled"]->getBoolean();
+      }
+      if(cfg->hasMember("capacity"))
+      {
+         mCapacity = cfg["capacity"]->getUInt32();
+      }
+      if(cfg->hasMember("ttl"))
+      {
+         mTtl = cfg["ttl"]->getUInt32();
+      }
+      if(cfg->hasMember("maxTtl"))
+      {
+         mMaxTtl = cfg["maxTtl"]->getUInt32();
+      }
+
+      // remove least recently used entries
+      while(mEntries.size() > mCapacity)
+      {
+         removeEntry(mEntries.find(mLru.back()));
+      }
+   }
+   mLock.unlock();
+}
+
+bool ResponseCache::isEnabled()
+{
+   return mEnabled;
+}
+
+bool ResponseCache::get(
+   const char* key, DynamicObject& in, ResponseFetcher* fetcher)
+{
+   bool rval = false;
+
+   string k = key;
+   FetchRef fetch(NULL);
+   bool hit = false;
+   bool leader = false;
+   DynamicObject stale(NULL);
+   string etag;
+   uint64_t generation = 0;
+
+   mLock.lock();
+   {
+      EntryMap::iterator i = mEntries.find(k);
+      if(i != mEntries.end() &&
+         i->second.expires > System::getCurrentMilliseconds())
+      {
+         // cache hit, mark as most recently used
+         in = i->second.object.clone();
+         mLru.splice(mLru.begin(), mLru, i->second.lru);
+         ++mHits;
+         hit = true;
+      }
+      else
+      {
+         ++mMisses;
+
+         // join a fetch that is in flight or start a new one
+         FetchMap::iterator fi = mInFlight.find(k);
+         if(fi != mInFlight.end())
+         {
+            fetch = fi->second;
+            ++mCoalesced;
+         }
+         else
+         {
+            fetch = new Fetch;
+            fetch->done = false;
+            fetch->success = false;
+            mInFlight[k] = fetch;
+            leader = true;
+            generation = mGeneration;
+
+            // revalidate a stale response with its etag
+            if(i != mEntries.end() && i->second.etag.length() > 0)
+            {
+               stale = i->second.object;
+               etag = i->second.etag;
+            }
+         }
+      }
+   }
+   mLock.unlock();
+
+   if(hit)
+   {
+      rval = true;
+   }
+   else if(leader)
+   {
+      // fetch without holding the lock
+      DynamicObject headers;
+      headers->setType(Map);
+      if(etag.length() > 0)
+      {
+         headers["If-None-Match"] = etag.c_str();
+      }
+      HttpResponseHeader header;
+      rval = fetcher->fetch(headers, in, header);
+      ExceptionRef e(NULL);
+      if(!rval)
+      {
+         e = Exception::get();
+      }
+
+      mLock.lock();
+      {
+         ++mFetches;
+         if(rval && generation != mGeneration)
+         {
+            // the response may predate an invalidation, use it but do not
+            // cache it
+            if(header.getStatusCode() == 304 && !stale.isNull())
+            {
+               ++mRevalidated;
+               in = stale.clone();
+            }
+         }
+         else if(rval)
+         {
+            bool store = true;
+            uint64_t now = System::getCurrentMilliseconds();
+            uint64_t expires = now + getTtl(header, store);
+            if(header.getStatusCode() == 304 && !stale.isNull())
+            {
+               // not modified, reuse stale response
+               ++mRevalidated;
+               in = stale.clone();
+               if(store)
+               {
+                  addEntry(k, stale, etag, expires);
+               }
+            }
+            else if(header.getStatusCode() == 200 && store)
+            {
+               // store new response, only keep it stale if it has an etag
+               header.getField("ETag", etag);
+               if(etag.length() > 0 || expires > now)
+               {
+                  DynamicObject object = in.clone();
+                  addEntry(k, object, etag, expires);
+               }
+            }
+            else
+            {
+               // response must not be reused
+               EntryMap::iterator i = mEntries.find(k);
+               if(i != mEntries.end())
+               {
+                  removeEntry(i);
+               }
+            }
+         }
+
+         // wake up waiting threads (with their own copy so the caller may
+         // change its response)
+         fetch->object = rval ? in.clone() : in;
+         fetch->success = rval;
+         fetch->exception = e;
+         fetch->done = true;
+         mInFlight.erase(k);
+         mLock.notifyAll();
+      }
+      mLock.unlock();
+   }
+   else
+   {
+      // wait for the fetch in flight
+      mLock.lock();
+      while(!fetch->done)
+      {
+         mLock.wait();
+      }
+      mLock.unlock();
+
+      rval = fetch->success;
+      if(rval)
+      {
+         in = fetch->object.clone();
+      }
+      else if(!fetch->exception.isNull())
+      {
+         Exception::set(fetch->exception);
+      }
+   }
+
+   return rval;
+}
+
+void ResponseCache::invalidate(const char* prefix)
+{
+   size_t length = strlen(prefix);
+   bool boundary = (length > 0 && prefix[length - 1] == '/');
+   mLock.lock();
+   {
+      // keys with the prefix are contiguous, only remove those where the
+      // prefix ends on a path segment boundary
+      EntryMap::iterator i = mEntries.lower_bound(prefix);
+      while(i != mEntries.end() &&
+            strncmp(i->first.c_str(), prefix, length) == 0)
+      {
+         char next = i->first.c_str()[length];
+         if(boundary ||
+            next == '\0' || next == '/' || next == '?' || next == ' ')
+         {
+            removeEntry(i++);
+         }
+         else
+         {
+            ++i;
+         }
+      }
+
+      // responses being fetched now may predate the change
+      ++mGeneration;
+   }
+   mLock.unlock();
+}
+
+DynamicObject ResponseCache::getStats()
+{
+   DynamicObject rval;
+
+   mLock.lock();
+   {
+      uint64_t gets = mHits + mMisses;
+      rval["entries"] = (uint64_t)mEntries.size();
+      rval["hits"] = mHits;
+      rval["misses"] = mMisses;
+      rval["coalesced"] = mCoalesced;
+      rval["fetches"] = mFetches;
+      rval["revalidated"] = mRevalidated;
+      rval["hitRatio"] = (gets == 0) ?
+         0.0 : (double)(mHits + mCoalesced) / gets;
+   }
+   mLock.unlock();
+
+   return rval;
+}
+
+void ResponseCache::clear()
+{
+   mLock.lock();
+   {
+      mEntries.clear();
+      mLru.clear();
+      ++mGeneration;
+   }
+   mLock.unlock();
+}
+
+uint64_t ResponseCache::getTtl(HttpResponseHeader& header, bool& store)
+{
+   uint64_t rval = mTtl;
+
+   string cc;
+   if(header.getField("Cache-Control", cc))
+   {
+      const char* maxAge = strstr(cc.c_str(), "max-age=");
+      if(strstr(cc.c_str(), "no-store") != NULL)
+      {
+         store = false;
+         rval = 0;
+      }
+      else if(strstr(cc.c_str(), "no-cache") != NULL)
+      {
+         // may only be reused after revalidation
+         rval = 0;
+      }
+      else if(maxAge != NULL)
+      {
+         rval = strtoull(maxAge + 8, NULL, 10) * 1000;
+      }
+   }
+
+   return (rval > mMaxTtl) ? mMaxTtl : rval;
+}
+
+void ResponseCache::addEntry(
+   const string& key, DynamicObject& object,
+   const string& etag, uint64_t expires)
+{
+   EntryMap::iterator i = mEntries.find(key);
+   if(i == mEntries.end())
+   {
+      // add new entry to the front of the list
+      mLru.push_front(key);
+      i = mEntries.insert(make_pair(key, Entry())).first;
+      i->second.lru = mLru.begin();
+   }
+   else
+   {
+      // move existing entry to the front of the list
+      mLru.splice(mLru.begin(), mLru, i->second.lru);
+   }
+   i->second.object = object;
+   i->second.etag = etag;
+   i->second.expires = expires;
+
+   // remove least recently used entries
+   while(mEntries.size() > mCapacity)
+   {
+      removeEntry(mEntries.find(mLru.back()));
+   }
+}
+
+void ResponseCache::removeEntry(EntryMap::iterator i)
+{
+   mLru.erase(i->second.lru);
+   mEntries.erase(i);
+}
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_node_ResponseCache_H
+#define bitmunk_node_ResponseCache_H
+
+#include "monarch/http/HttpResponseHeader.h"
+#include "monarch/rt/Collectable.h"
+#include "monarch/rt/DynamicObject.h"
+#include "monarch/rt/ExclusiveLock.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+namespace bitmunk
+{
+namespace node
+{
+
+/**
+ * A ResponseFetcher fetches a response for a ResponseCache when it is not
+ * cached or must be revalidated.
+ *
+ * @author Dave Longley
+ */
+class ResponseFetcher
+{
+public:
+   /**
+    * Destructs this ResponseFetcher.
+    */
+   virtual ~ResponseFetcher() {};
+
+   /**
+    * Fetches a response.
+    *
+    * @param headers extra headers to send with the request (ie:
+    *                "If-None-Match").
+    * @param in the object to populate with the response.
+    * @param header the header to populate with the response header.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool fetch(
+      monarch::rt::DynamicObject& headers,
+      monarch::rt::DynamicObject& in,
+      monarch::http::HttpResponseHeader& header) = 0;
+};
+
+/**
+ * A ResponseCache is a read-through cache of the objects returned by GET
+ * requests, so that subsystems that read the same resources within seconds
+ * of one another share a single request.
+ *
+ * A response is fresh for its Cache-Control max-age or, if it has none, for
+ * a default time to live. A response with "no-store" is never cached and one
+ * with "no-cache" is cached only to be revalidated. Once a response is stale,
+ * it is revalidated with its ETag, if it has one, and reused if the response
+ * is "304 Not Modified".
+ *
+ * When a response must be fetched, only one thread fetches it. Other threads
+ * that want the same response while the fetch is in flight wait for its
+ * result, whether or not the response can be cached.
+ *
+ * @author Dave Longley
+ */
+class ResponseCache
+{
+protected:
+   typedef std::list<std::string> KeyList;
+
+   /**
+    * A cached response.
+    */
+   struct Entry
+   {
+      monarch::rt::DynamicObject object;
+      std::string etag;
+      uint64_t expires;
+      KeyList::iterator lru;
+   };
+   typedef std::map<std::string, Entry> EntryMap;
+
+   /**
+    * A fetch that is in flight.
+    */
+   struct Fetch
+   {
+      monarch::rt::DynamicObject object;
+      bool done;
+      bool success;
+      monarch::rt::ExceptionRef exception;
+   };
+   typedef monarch::rt::Collectable<Fetch> FetchRef;
+   typedef std::map<std::string, FetchRef> FetchMap;
+
+   /**
+    * True if responses are cached and coalesced.
+    */
+   bool mEnabled;
+
+   /**
+    * The cached responses.
+    */
+   EntryMap mEntries;
+
+   /**
+    * The cached keys, most recently used first.
+    */
+   KeyList mLru;
+
+   /**
+    * The fetches in flight.
+    */
+   FetchMap mInFlight;
+
+   /**
+    * The number of invalidations so far, a response fetched while an
+    * invalidation happened may be out of date so it is not cached.
+    */
+   uint64_t mGeneration;
+
+   /**
+    * The maximum number of cached responses.
+    */
+   unsigned int mCapacity;
+
+   /**
+    * The milliseconds a response without a max-age is fresh for.
+    */
+   uint32_t mTtl;
+
+   /**
+    * The maximum milliseconds any response is fresh for.
+    */
+   uint32_t mMaxTtl;
+
+   /**
+    * A lock for manipulating the cache, also used to wait for fetches.
+    */
+   monarch::rt::ExclusiveLock mLock;
+
+   /**
+    * Statistics.
+    */
+   uint64_t mHits;
+   uint64_t mMisses;
+   uint64_t mCoalesced;
+   uint64_t mFetches;
+   uint64_t mRevalidated;
+
+public:
+   /**
+    * Creates a new, disabled ResponseCache.
+    */
+   ResponseCache();
+
+   /**
+    * Destructs this ResponseCache.
+    */
+   virtual ~ResponseCache();
+
+   /**
+    * Configures this cache.
+    *
+    * @param cfg the configuration with optional "enabled", "capacity",
+    *            "ttl" and "maxTtl" (in milliseconds) members.
+    */
+   virtual void configure(monarch::rt::DynamicObject& cfg);
+
+   /**
+    * Returns true if this cache is enabled.
+    *
+    * @return true if enabled, false if not.
+    */
+   virtual bool isEnabled();
+
+   /**
+    * Gets a response from this cache or, if it is not fresh, from the
+    * passed fetcher.
+    *
+    * @param key the key for the response, which must identify the resource
+    *            and everything else the response may vary by (ie: user).
+    * @param in to be set to a copy of the response.
+    * @param fetcher the fetcher to use if the response must be fetched.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool get(
+      const char* key, monarch::rt::DynamicObject& in,
+      ResponseFetcher* fetcher);
+
+   /**
+    * Removes all cached responses for a resource and the resources below it
+    * (ie: after a resource is changed). A key matches if it starts with the
+    * prefix followed by a path segment boundary ('/', '?', ' ' or the end
+    * of the key), so "/media/12" is not removed by the prefix "/media/1".
+    * Responses that are being fetched are not cached.
+    *
+    * @param prefix the prefix.
+    */
+   virtual void invalidate(const char* prefix);
+
+   /**
+    * Gets the statistics for this cache:
+    *
+    * {
+    *    "entries": the number of cached responses,
+    *    "hits": gets answered by the cache,
+    *    "misses": gets that had to fetch or wait for a fetch,
+    *    "coalesced": misses that waited for another thread's fetch,
+    *    "fetches": fetches made,
+    *    "revalidated": fetches answered by "304 Not Modified",
+    *    "hitRatio": the ratio of gets that did not cause a fetch
+    * }
+    *
+    * @return the statistics.
+    */
+   virtual monarch::rt::DynamicObject getStats();
+
+   /**
+    * Clears the cache.
+    */
+   virtual void clear();
+
+protected:
+   /**
+    * Gets the number of milliseconds a response is fresh for.
+    *
+    * @param header the response header.
+    * @param store to be set to false if the response must not be stored.
+    *
+    * @return the milliseconds the response is fresh for.
+    */
+   virtual uint64_t getTtl(
+      monarch::http::HttpResponseHeader& header, bool& store);
+
+   /**
+    * Adds an entry, replacing any existing entry for the same key and
+    * evicting the least recently used entries if the cache is full. The lock
+    * must be held.
+    *
+    * @param key the key.
+    * @param object the response.
+    * @param etag the ETag of the response, empty for none.
+    * @param expires the time the response becomes stale.
+    */
+   virtual void addEntry(
+      const std::string& key, monarch::rt::DynamicObject& object,
+      const std::string& etag, uint64_t expires);
+
+   /**
+    * Removes an entry. The lock must be held.
+    *
+    * @param i the entry.
+    */
+   virtual void removeEntry(EntryMap::iterator i);
+};
+
+} // end namespace node
+} // end namespace bitmunk
+#endif
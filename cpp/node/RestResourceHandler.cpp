@@ -78,9 +78,7 @@ RestResourceHandler::HandlerMap::iterator RestResourceHandler::findHandler(
 {
    HandlerMap::iterator hmi;
 
-   DynamicObject paramDyno;
-   action->getResourceParams(paramDyno);
-   int paramCount = paramDyno->length();
+   int paramCount = action->getResourceParamCount();
    hmi = mHandlers.find(paramCount);
    if(hmi == mHandlers.end())
    {
@@ -166,8 +164,9 @@ void RestResourceHandler::handleAction(
             if(pass && !info.contentValidator.isNull())
             {
                DynamicObject content;
-               action->receiveContent(content);
-               pass = info.contentValidator->isValid(content);
+               pass =
+                  action->receiveContent(content) &&
+                  info.contentValidator->isValid(content);
             }
 
             if(pass)
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#define __STDC_FORMAT_MACROS
+
+#include "bitmunk/node/SampleCache.h"
+
+#include "monarch/crypto/MessageDigest.h"
+
+using namespace std;
+using namespace monarch::crypto;
+using namespace monarch::io;
+using namespace monarch::rt;
+using namespace bitmunk::common;
+using namespace bitmunk::node;
+
+SampleCache::SampleCache() :
+   BufferCache(".sample", 0)
+{
+}
+
+SampleCache::~SampleCache()
+{
+}
+
+bool SampleCache::getSample(
+   const char* key, const char* version, string& etag, SampleBufferRef& data)
+{
+   bool rval;
+
+   DynamicObject info;
+   if((rval = get(key, version, info, data)))
+   {
+      etag = info["etag"]->getString();
+   }
+
+   return rval;
+}
+
+void SampleCache::addSample(
+   const char* key, const char* version, const char* etag,
+   SampleBufferRef& data, const char* directory)
+{
+   DynamicObject info;
+   info["etag"] = etag;
+   add(key, version, info, data, directory);
+}
+
+string SampleCache::createKey(UserId userId, MediaId mediaId, FileId fileId)
+{
+   // key is "<userId>|<mediaId>|<fileId>"
+   char tmp[44];
+   snprintf(tmp, 44, "%" PRIu64 "|%" PRIu64 "|", userId, mediaId);
+   string key = tmp;
+   key.append(fileId);
+   return key;
+}
+
+string SampleCache::createETag(ByteBuffer& data)
+{
+   MessageDigest md;
+   md.start("MD5");
+   md.update(data.data(), data.length());
+   string etag = "\"";
+   etag.append(md.getDigest());
+   etag.push_back('"');
+   return etag;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_node_SampleCache_H
+#define bitmunk_node_SampleCache_H
+
+#include "bitmunk/common/TypeDefinitions.h"
+#include "bitmunk/node/BufferCache.h"
+
+namespace bitmunk
+{
+namespace node
+{
+
+// type definition for a reference counted sample buffer
+typedef CacheBufferRef SampleBufferRef;
+
+/**
+ * A SampleCache stores fully rendered samples (the sample frames of a file
+ * with a new ID3v2 tag) so that repeated requests for a sample, including
+ * range requests from players that seek, do not have to read and parse the
+ * file again.
+ *
+ * Every sample is stored with a version that describes what it was rendered
+ * from (ie: the media's sample range and the file's size and modification
+ * date). A sample with a different version than the one requested is stale,
+ * it is removed from the cache and treated as a miss. Every sample also has
+ * an ETag created from its content so that clients can revalidate it.
+ *
+ * Samples are stored in a BufferCache, so they are shared with the threads
+ * sending them by reference and moved to and from disk without holding the
+ * cache lock.
+ *
+ * @author Dave Longley
+ */
+class SampleCache : public BufferCache
+{
+public:
+   /**
+    * Creates a new SampleCache. The cache is disabled until it is
+    * configured.
+    */
+   SampleCache();
+
+   /**
+    * Destructs this SampleCache, removing any cached sample files.
+    */
+   virtual ~SampleCache();
+
+   /**
+    * Gets a cached sample.
+    *
+    * @param key the key for the sample.
+    * @param version the version of the sample that is wanted, a cached
+    *                sample with any other version is removed.
+    * @param etag to be set to the ETag of the cached sample.
+    * @param data to be set to the cached sample data, which must not be
+    *             changed.
+    *
+    * @return true if the sample was found, false if not.
+    */
+   virtual bool getSample(
+      const char* key, const char* version, std::string& etag,
+      SampleBufferRef& data);
+
+   /**
+    * Adds a sample to the cache if it fits in the memory budget.
+    *
+    * @param key the key for the sample.
+    * @param version the version of the sample.
+    * @param etag the ETag for the sample.
+    * @param data the sample data, which must not be changed once added.
+    * @param directory the directory to store the sample in if it is moved
+    *                  to disk, empty to never move it to disk.
+    */
+   virtual void addSample(
+      const char* key, const char* version, const char* etag,
+      SampleBufferRef& data, const char* directory);
+
+   /**
+    * Creates the key for a sample.
+    *
+    * @param userId the ID of the user that owns the file.
+    * @param mediaId the ID of the media.
+    * @param fileId the ID of the file.
+    *
+    * @return the key.
+    */
+   static std::string createKey(
+      bitmunk::common::UserId userId, bitmunk::common::MediaId mediaId,
+      bitmunk::common::FileId fileId);
+
+   /**
+    * Creates a strong ETag for sample data. The same data always has the
+    * same ETag, so it remains valid after the sample is rendered again.
+    *
+    * @param data the sample data.
+    *
+    * @return the quoted ETag.
+    */
+   static std::string createETag(monarch::io::ByteBuffer& data);
+};
+
+} // end namespace node
+} // end namespace bitmunk
+#endif
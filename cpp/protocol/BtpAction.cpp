@@ -4,6 +4,7 @@
 #include "bitmunk/protocol/BtpAction.h"
 
 #include "bitmunk/common/Logging.h"
+#include "bitmunk/protocol/DynoBinaryWriter.h"
 #include "monarch/data/json/JsonWriter.h"
 
 #include <cctype>
@@ -172,6 +173,38 @@ bool BtpAction::receiveContent(DynamicObject& dyno)
    return rval;
 }
 
+bool BtpAction::receiveContentElements(DynoElementHandler* handler)
+{
+   bool rval = true;
+
+   if(!mContentReceived)
+   {
+      if(mRequest->getHeader()->hasContent())
+      {
+         rval = mInMessage.receiveContentElements(mRequest, handler);
+      }
+      mContentReceived = true;
+   }
+   else if(!mContent.isNull())
+   {
+      // handle elements of previously received content
+      if(mContent->getType() != Array)
+      {
+         ExceptionRef e = new Exception(
+            "Content is not an array.", "bitmunk.protocol.InvalidContent");
+         Exception::set(e);
+         rval = false;
+      }
+      DynamicObjectIterator i = mContent.getIterator();
+      while(rval && i->hasNext())
+      {
+         rval = handler->handleElement(i->next());
+      }
+   }
+
+   return rval;
+}
+
 bool BtpAction::sendResult()
 {
    bool rval = true;
@@ -246,7 +279,13 @@ bool BtpAction::sendResult(DynamicObject& dyno)
       {
          if(mRequest->getHeader()->getField("Accept", contentType))
          {
-            if(strstr(contentType.c_str(), "text/xml") != NULL)
+            if(strstr(
+               contentType.c_str(), DynoBinaryWriter::sContentType) != NULL)
+            {
+               // peer supports compact binary
+               contentType = DynoBinaryWriter::sContentType;
+            }
+            else if(strstr(contentType.c_str(), "text/xml") != NULL)
             {
                contentType = "text/xml";
             }
@@ -293,7 +332,15 @@ bool BtpAction::sendException(ExceptionRef& e, bool client)
       // set status code if necessary
       if(mResponse->getHeader()->getStatusCode() == 0)
       {
-         if(client)
+         if(e->getCode() == 413)
+         {
+            // set 413 Request Entity Too Large, the rest of the content
+            // was not received so the connection cannot be reused
+            mResponse->getHeader()->setStatus(
+               413, "Request Entity Too Large");
+            mResponse->getHeader()->setField("Connection", "close");
+         }
+         else if(client)
          {
             // set 400 Bad Request
             mResponse->getHeader()->setStatus(400, "Bad Request");
@@ -309,7 +356,13 @@ bool BtpAction::sendException(ExceptionRef& e, bool client)
       string contentType;
       if(mRequest->getHeader()->getField("Accept", contentType))
       {
-         if(strstr(contentType.c_str(), "text/xml") != NULL)
+         if(strstr(
+            contentType.c_str(), DynoBinaryWriter::sContentType) != NULL)
+         {
+            // peer supports compact binary
+            contentType = DynoBinaryWriter::sContentType;
+         }
+         else if(strstr(contentType.c_str(), "text/xml") != NULL)
          {
             contentType = "text/xml";
          }
@@ -380,6 +433,25 @@ bool BtpAction::getResourceParams(DynamicObject& params)
    return rval;
 }
 
+int BtpAction::getResourceParamCount()
+{
+   if(mResourceParams.isNull())
+   {
+      // parse params
+      Url url(mResource);
+      DynamicObject d;
+      mResourceParams = d;
+      url.getTokenizedPath(mResourceParams, mBaseResourcePath);
+   }
+
+   return mResourceParams->length();
+}
+
+void BtpAction::setResourceParams(DynamicObject& params)
+{
+   mResourceParams = params;
+}
+
 bool BtpAction::getResourceQuery(DynamicObject& vars, bool asArrays)
 {
    bool rval;
@@ -169,6 +169,18 @@ public:
     */
    virtual bool receiveContent(monarch::rt::DynamicObject& dyno);
 
+   /**
+    * Receives the content for this action, which must be an array, and
+    * passes each of its elements to a handler as soon as it is received, so
+    * that large batches are handled without holding all of them in memory.
+    * The content is not kept, so it cannot be received again.
+    *
+    * @param handler the handler for each element.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool receiveContentElements(DynoElementHandler* handler);
+
    /**
     * Sends only the response header with no content.
     *
@@ -226,6 +238,23 @@ public:
     */
    virtual bool getResourceParams(monarch::rt::DynamicObject& params);
 
+   /**
+    * Gets the number of resource parameters that occur after a base path for
+    * the resource, without copying them.
+    *
+    * @return the number of resource parameters.
+    */
+   virtual int getResourceParamCount();
+
+   /**
+    * Sets the resource parameters that occur after a base path for the
+    * resource, if they have already been parsed (ie: when the resource was
+    * routed).
+    *
+    * @param params the decoded resource parameters.
+    */
+   virtual void setResourceParams(monarch::rt::DynamicObject& params);
+
    /**
     * Gets the resource's query variables.
     *
@@ -27,8 +27,9 @@ BtpClient::BtpClient() :
    // create client ssl context ("TLS" is most secure and recent SSL)
    mSslContext = new SslContext("TLS", true);
 
-   // create ssl session cache
-   mSslSessionCache = new SslSessionCache(50);
+   // create ssl session cache (it can be saved to resume sessions after
+   // a restart)
+   mSslSessionCache = new PersistentSslSessionCache(50);
 }
 
 BtpClient::~BtpClient()
@@ -116,6 +117,78 @@ HttpConnection* BtpClient::createConnection(
    return hc;
 }
 
+HttpConnection* BtpClient::getConnection(
+   UserId userId, Url* url, uint32_t timeout, bool* reused)
+{
+   HttpConnection* hc = mConnectionPool.getConnection(userId, url);
+   if(reused != NULL)
+   {
+      *reused = (hc != NULL);
+   }
+
+   if(hc == NULL)
+   {
+      // no idle connection available, create a new one
+      hc = createConnection(userId, url, timeout);
+   }
+   else
+   {
+      // reset timeouts and throttlers, they may have been changed when
+      // the connection was last used
+      uint32_t to = timeout * 1000;
+      hc->setReadTimeout(to);
+      hc->setWriteTimeout(to);
+      hc->setBandwidthThrottler(getBandwidthThrottler(true), true);
+      hc->setBandwidthThrottler(getBandwidthThrottler(false), false);
+   }
+
+   return hc;
+}
+
+/**
+ * Checks to see if a response permits its connection to be kept alive.
+ *
+ * @param response the response to check.
+ *
+ * @return true if the connection may be kept alive, false if not.
+ */
+static bool _isKeepAlive(HttpResponse* response)
+{
+   bool rval = false;
+
+   // keep-alive is the default for HTTP/1.1 but not on error
+   HttpResponseHeader* header = response->getHeader();
+   if(strcmp(header->getVersion(), "HTTP/1.1") == 0 &&
+      header->getStatusCode() < 400)
+   {
+      // check connection field for "close"
+      string connection;
+      header->getField("Connection", connection);
+      for(string::iterator i = connection.begin(); i != connection.end(); ++i)
+      {
+         *i = tolower(*i);
+      }
+      rval = (strstr(connection.c_str(), "close") == NULL);
+   }
+
+   return rval;
+}
+
+void BtpClient::releaseConnection(
+   UserId userId, Url* url, HttpConnection* hc, HttpResponse* response)
+{
+   if(response != NULL && !hc->isClosed() && _isKeepAlive(response))
+   {
+      // give idle connection to pool for reuse
+      mConnectionPool.addConnection(userId, url, hc);
+   }
+   else
+   {
+      hc->close();
+      delete hc;
+   }
+}
+
 bool BtpClient::sendMessage(
    Url* url,
    BtpMessage* out, HttpRequest* request,
@@ -128,43 +201,54 @@ bool BtpClient::sendMessage(
    {
       if(in != NULL)
       {
-         // receive response header
-         if((rval = response->receiveHeader()))
-         {
-            // check response security
-            rval = checkResponseSecurity(url, request, response, in);
-         }
+         // receive response
+         rval = receiveMessage(url, request, in, response);
+      }
+   }
 
-         // receive response content
-         if(rval)
-         {
-            // check response code
-            bool responseError = !checkResponseCode(response);
+   return rval;
+}
 
-            if(in->getSecurityStatus() != BtpMessage::Breach)
-            {
-               if(responseError)
-               {
-                  rval = in->receiveContent(response);
-               }
-            }
-            else
-            {
-               // set exception
-               ExceptionRef e = new Exception(
-                  "Message security breach.",
-                  "bitmunk.protocol.Security");
-               e->getDetails()["resource"] = url->toString().c_str();
-               responseError ? Exception::push(e) : Exception::set(e);
-               rval = false;
-            }
+bool BtpClient::receiveMessage(
+   Url* url, HttpRequest* request, BtpMessage* in, HttpResponse* response)
+{
+   bool rval;
 
-            if(responseError)
-            {
-               rval = false;
-            }
+   // receive response header
+   if((rval = response->receiveHeader()))
+   {
+      // check response security
+      rval = checkResponseSecurity(url, request, response, in);
+   }
+
+   // receive response content
+   if(rval)
+   {
+      // check response code
+      bool responseError = !checkResponseCode(response);
+
+      if(in->getSecurityStatus() != BtpMessage::Breach)
+      {
+         if(responseError)
+         {
+            rval = in->receiveContent(response);
          }
       }
+      else
+      {
+         // set exception
+         ExceptionRef e = new Exception(
+            "Message security breach.",
+            "bitmunk.protocol.Security");
+         e->getDetails()["resource"] = url->toString().c_str();
+         responseError ? Exception::push(e) : Exception::set(e);
+         rval = false;
+      }
+
+      if(responseError)
+      {
+         rval = false;
+      }
    }
 
    return rval;
@@ -175,36 +259,76 @@ bool BtpClient::exchange(
 {
    bool rval = false;
 
-   // create connection
-   HttpConnection* hc = createConnection(userId, url, timeout);
-   if(hc != NULL)
+   // ask to keep the connection alive so it can be reused
+   if(!out->getCustomHeaders()->hasMember("Connection"))
+   {
+      out->getCustomHeaders()["Connection"] = "keep-alive";
+   }
+
+   // a reused connection may have been closed by the peer while it was
+   // idle, so if the exchange fails on one, retry once with a new
+   // connection, but only for requests that are safe to send twice, the
+   // peer may have acted on a request before the connection failed
+   bool idempotent =
+      (out->getType() == BtpMessage::Get ||
+       out->getType() == BtpMessage::Head) &&
+      out->getContentSource() == NULL;
+   bool retry = true;
+   while(retry)
    {
-      // create request and response
-      HttpRequest* request = hc->createRequest();
-      HttpResponse* response = request->createResponse();
+      retry = false;
 
-      // send message
-      if((rval = sendMessage(url, out, request, in, response)))
+      // get connection
+      bool reused = false;
+      HttpConnection* hc = getConnection(userId, url, timeout, &reused);
+      if(hc != NULL)
       {
-         if(in != NULL)
+         // create request and response
+         HttpRequest* request = hc->createRequest();
+         HttpResponse* response = request->createResponse();
+
+         // send message
+         bool received = false;
+         if((rval = sendMessage(url, out, request, in, response)))
          {
-            // receive response content
-            rval = in->receiveContent(response);
+            if(in != NULL)
+            {
+               // receive response content
+               received = rval = in->receiveContent(response);
+            }
+         }
+         else if(reused && idempotent)
+         {
+            // retry if the failure was an IO error on the reused connection
+            ExceptionRef e = Exception::get();
+            retry = (!e.isNull() &&
+               strncmp(e->getType(), "monarch.", 8) == 0);
+            if(retry)
+            {
+               MO_CAT_DEBUG(BM_PROTOCOL_CAT,
+                  "BtpClient reused connection failed, retrying: %s",
+                  url->toString().c_str());
+               Exception::clear();
+            }
          }
-      }
 
-      // disconnect
-      hc->close();
+         // keep connection alive if response was fully received
+         releaseConnection(userId, url, hc, received ? response : NULL);
 
-      // clean up
-      delete hc;
-      delete request;
-      delete response;
+         // clean up
+         delete request;
+         delete response;
+      }
    }
 
    return rval;
 }
 
+BtpConnectionPool* BtpClient::getConnectionPool()
+{
+   return &mConnectionPool;
+}
+
 SslContextRef& BtpClient::getSslContext()
 {
    return mSslContext;
@@ -215,6 +339,11 @@ SslSessionCacheRef& BtpClient::getSslSessionCache()
    return mSslSessionCache;
 }
 
+PersistentSslSessionCache* BtpClient::getPersistentSslSessionCache()
+{
+   return static_cast<PersistentSslSessionCache*>(&(*mSslSessionCache));
+}
+
 void BtpClient::setBandwidthThrottler(BandwidthThrottler* bt, bool read)
 {
    (read) ? mReadThrottler = bt : mWriteThrottler = bt;
@@ -4,7 +4,9 @@
 #ifndef bitmunk_protocol_BtpClient_H
 #define bitmunk_protocol_BtpClient_H
 
+#include "bitmunk/protocol/BtpConnectionPool.h"
 #include "bitmunk/protocol/BtpMessage.h"
+#include "bitmunk/protocol/PersistentSslSessionCache.h"
 #include "monarch/http/HttpClient.h"
 #include "monarch/net/SslSessionCache.h"
 #include "monarch/net/Url.h"
@@ -43,6 +45,11 @@ protected:
     */
    monarch::net::SslSessionCacheRef mSslSessionCache;
 
+   /**
+    * The pool of idle keep-alive connections.
+    */
+   BtpConnectionPool mConnectionPool;
+
 public:
    /**
     * Creates a new BtpClient.
@@ -66,6 +73,38 @@ public:
       bitmunk::common::UserId userId,
       monarch::net::Url* url, uint32_t timeout = 30);
 
+   /**
+    * Gets a connection to a url, reusing an idle keep-alive connection to
+    * the same peer if one is available. The returned connection must either
+    * be deleted by the caller or given back via releaseConnection().
+    *
+    * @param userId the user ID of the peer to talk to, 0 to do non-peer.
+    * @param url the url to connect to.
+    * @param timeout the timeout in seconds (0 for no timeout).
+    * @param reused set to true if the connection was reused, NULL to ignore.
+    *
+    * @return the connection or NULL if an exception occurred.
+    */
+   virtual monarch::http::HttpConnection* getConnection(
+      bitmunk::common::UserId userId,
+      monarch::net::Url* url, uint32_t timeout = 30, bool* reused = NULL);
+
+   /**
+    * Releases a connection that was obtained via getConnection(). If the
+    * response that was last received on the connection permits it, and its
+    * content has been fully received, the connection will be kept alive
+    * for reuse. Otherwise it will be closed and deleted.
+    *
+    * @param userId the user ID of the peer the connection is to.
+    * @param url the url the connection was made to.
+    * @param hc the connection to release.
+    * @param response the last response received on the connection, NULL if
+    *           none was fully received (the connection will be closed).
+    */
+   virtual void releaseConnection(
+      bitmunk::common::UserId userId, monarch::net::Url* url,
+      monarch::http::HttpConnection* hc, monarch::http::HttpResponse* response);
+
    /**
     * Sends the passed BtpMessage using the given HttpRequest. The response
     * header will be received with the passed HttpResponse. If the response
@@ -87,6 +126,28 @@ public:
       BtpMessage* out, monarch::http::HttpRequest* request,
       BtpMessage* in, monarch::http::HttpResponse* response);
 
+   /**
+    * Receives a response to a BtpMessage that was previously sent using the
+    * given HttpRequest. The response header will be received with the
+    * passed HttpResponse. If the response header indicates that an exception
+    * occurred, the exception will also be received, otherwise the response
+    * body will not be received by this call.
+    *
+    * This method allows a caller to send a message, wait for the response
+    * to become available without blocking (ie: via an IOMonitor), and then
+    * receive the response.
+    *
+    * @param url the url the request was sent to.
+    * @param request the HttpRequest the message was sent with.
+    * @param in the BtpMessage to receive.
+    * @param response the HttpResponse to receive a response with.
+    *
+    * @return true if successful, false if not.
+    */
+   virtual bool receiveMessage(
+      monarch::net::Url* url, monarch::http::HttpRequest* request,
+      BtpMessage* in, monarch::http::HttpResponse* response);
+
    /**
     * Sends the passed BtpMessage to the given Url. If there is a BTP response,
     * the passed BtpMessage "in" will be populated and its content
@@ -99,6 +160,11 @@ public:
     * If the incoming message is not NULL, it should have its content sink set
     * via setContent() or setContentSink().
     *
+    * An idle keep-alive connection is used if one is available. If a GET or
+    * HEAD request fails on one, it is retried once with a new connection.
+    * Other requests are never resent since the peer may already have acted
+    * on them.
+    *
     * @param userId the ID of the bitmunk user to talk to, 0 for none.
     * @param url the url to send the message to.
     * @param out the outgoing request message.
@@ -113,6 +179,13 @@ public:
       monarch::net::Url* url, BtpMessage* out, BtpMessage* in,
       uint32_t timeout = 30);
 
+   /**
+    * Gets this BtpClient's pool of idle keep-alive connections.
+    *
+    * @return this BtpClient's connection pool.
+    */
+   virtual BtpConnectionPool* getConnectionPool();
+
    /**
     * Gets this BtpClient's SSL context.
     *
@@ -127,6 +200,14 @@ public:
     */
    virtual monarch::net::SslSessionCacheRef& getSslSessionCache();
 
+   /**
+    * Gets this BtpClient's SSL session cache as a cache that can be
+    * configured, saved, and loaded.
+    *
+    * @return this BtpClient's persistent SSL session cache.
+    */
+   virtual PersistentSslSessionCache* getPersistentSslSessionCache();
+
    /**
     * Sets a BandwidthThrottler for all new connections made by
     * this BtpClient.
@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#define __STDC_FORMAT_MACROS
+
+#include "bitmunk/protocol/BtpConnectionPool.h"
+
+#include "bitmunk/common/Logging.h"
+#include "monarch/net/SocketTools.h"
+#include "monarch/rt/System.h"
+
+#ifndef WIN32
+#include <poll.h>
+#endif
+
+using namespace std;
+using namespace monarch::http;
+using namespace monarch::net;
+using namespace monarch::rt;
+using namespace bitmunk::common;
+using namespace bitmunk::protocol;
+
+BtpConnectionPool::BtpConnectionPool() :
+   mIdleCount(0),
+   mMaxIdlePerPeer(4),
+   mMaxIdle(100),
+   mMaxIdleTime(30000),
+   mHits(0),
+   mMisses(0),
+   mEvictions(0),
+   mStale(0)
+{
+}
+
+BtpConnectionPool::~BtpConnectionPool()
+{
+   BtpConnectionPool::clear();
+}
+
+void BtpConnectionPool::configure(DynamicObject& cfg)
+{
+   mLock.lock();
+   {
+      if(cfg->hasMember("maxIdlePerPeer"))
+      {
+         mMaxIdlePerPeer = cfg["maxIdlePerPeer"]->getUInt32();
+      }
+      if(cfg->hasMember("maxIdle"))
+      {
+         mMaxIdle = cfg["maxIdle"]->getUInt32();
+      }
+      if(cfg->hasMember("maxIdleTime"))
+      {
+         mMaxIdleTime = cfg["maxIdleTime"]->getUInt32();
+      }
+   }
+   mLock.unlock();
+}
+
+HttpConnection* BtpConnectionPool::getConnection(UserId userId, Url* url)
+{
+   HttpConnection* rval = NULL;
+
+   string key = createKey(userId, url);
+   uint64_t now = System::getCurrentMilliseconds();
+
+   mLock.lock();
+   {
+      // clean up old connections first
+      evict(now);
+
+      IdleMap::iterator i = mIdleConnections.find(key);
+      if(i != mIdleConnections.end())
+      {
+         // use most recently used connection that is still open
+         while(rval == NULL && !i->second.empty())
+         {
+            HttpConnection* hc = i->second.front().connection;
+            i->second.pop_front();
+            --mIdleCount;
+            if(isStale(hc))
+            {
+               ++mStale;
+               closeConnection(hc);
+            }
+            else
+            {
+               rval = hc;
+            }
+         }
+         if(i->second.empty())
+         {
+            mIdleConnections.erase(i);
+         }
+      }
+
+      (rval == NULL) ? ++mMisses : ++mHits;
+   }
+   mLock.unlock();
+
+   if(rval != NULL)
+   {
+      MO_CAT_DEBUG(BM_PROTOCOL_CAT,
+         "BtpConnectionPool reusing keep-alive connection to: %s",
+         key.c_str());
+   }
+
+   return rval;
+}
+
+void BtpConnectionPool::addConnection(
+   UserId userId, Url* url, HttpConnection* hc)
+{
+   string key = createKey(userId, url);
+   uint64_t now = System::getCurrentMilliseconds();
+
+   mLock.lock();
+   {
+      if(mMaxIdlePerPeer == 0 || mMaxIdle == 0)
+      {
+         // pooling disabled
+         closeConnection(hc);
+      }
+      else
+      {
+         // add connection as most recently used
+         IdleConnection ic;
+         ic.connection = hc;
+         ic.idleSince = now;
+         IdleList& list = mIdleConnections[key];
+         list.push_front(ic);
+         ++mIdleCount;
+
+         // enforce per-peer limit
+         while(list.size() > mMaxIdlePerPeer)
+         {
+            closeConnection(list.back().connection);
+            list.pop_back();
+            --mIdleCount;
+            ++mEvictions;
+         }
+
+         // enforce total limit by evicting the oldest idle connections
+         evict(now);
+         while(mIdleCount > mMaxIdle)
+         {
+            IdleMap::iterator oldest = mIdleConnections.end();
+            for(IdleMap::iterator i = mIdleConnections.begin();
+                i != mIdleConnections.end(); ++i)
+            {
+               if(oldest == mIdleConnections.end() ||
+                  i->second.back().idleSince <
+                  oldest->second.back().idleSince)
+               {
+                  oldest = i;
+               }
+            }
+            closeConnection(oldest->second.back().connection);
+            oldest->second.pop_back();
+            --mIdleCount;
+            ++mEvictions;
+            if(oldest->second.empty())
+            {
+               mIdleConnections.erase(oldest);
+            }
+         }
+      }
+   }
+   mLock.unlock();
+}
+
+void BtpConnectionPool::evictIdleConnections()
+{
+   mLock.lock();
+   {
+      evict(System::getCurrentMilliseconds());
+   }
+   mLock.unlock();
+}
+
+void BtpConnectionPool::clear()
+{
+   mLock.lock();
+   {
+      for(IdleMap::iterator i = mIdleConnections.begin();
+          i != mIdleConnections.end(); ++i)
+      {
+         for(IdleList::iterator ii = i->second.begin();
+             ii != i->second.end(); ++ii)
+         {
+            closeConnection(ii->connection);
+         }
+      }
+      mIdleConnections.clear();
+      mIdleCount = 0;
+   }
+   mLock.unlock();
+}
+
+DynamicObject BtpConnectionPool::getStats()
+{
+   DynamicObject rval;
+
+   mLock.lock();
+   {
+      rval["idle"] = mIdleCount;
+      rval["hits"] = mHits;
+      rval["misses"] = mMisses;
+      rval["evictions"] = mEvictions;
+      rval["stale"] = mStale;
+   }
+   mLock.unlock();
+
+   return rval;
+}
+
+string BtpConnectionPool::createKey(UserId userId, Url* url)
+{
+   // key is "<userId>|<scheme>://<host>:<port>"
+   char uid[22];
+   snprintf(uid, 22, "%" PRIu64, userId);
+   string key = uid;
+   key.push_back('|');
+   key.append(url->getScheme());
+   key.append("://");
+   key.append(url->getHostAndPort());
+   return key;
+}
+
+bool BtpConnectionPool::isStale(HttpConnection* hc)
+{
+   bool rval = hc->isClosed();
+   if(!rval)
+   {
+      // an idle connection should have nothing to read, if it is readable
+      // then the peer has closed it (or sent something unexpected)
+      int fd = hc->getSocket()->getFileDescriptor();
+#ifdef WIN32
+      // windows select() takes a count of sockets, not the highest one
+      fd_set rfds;
+      FD_ZERO(&rfds);
+      FD_SET(fd, &rfds);
+      rval = (SocketTools::select(fd + 1, &rfds, NULL, NULL, 0) != 0);
+      if(rval)
+      {
+         Exception::clear();
+      }
+#else
+      // use poll() since select() cannot check descriptors >= FD_SETSIZE
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      rval = (poll(&pfd, 1, 0) != 0);
+#endif
+   }
+   return rval;
+}
+
+void BtpConnectionPool::closeConnection(HttpConnection* hc)
+{
+   hc->close();
+   delete hc;
+}
+
+void BtpConnectionPool::evict(uint64_t now)
+{
+   if(mMaxIdleTime > 0)
+   {
+      for(IdleMap::iterator i = mIdleConnections.begin();
+          i != mIdleConnections.end();)
+      {
+         // oldest connections are at the back of each list
+         IdleList& list = i->second;
+         while(!list.empty() && now - list.back().idleSince > mMaxIdleTime)
+         {
+            closeConnection(list.back().connection);
+            list.pop_back();
+            --mIdleCount;
+            ++mEvictions;
+         }
+
+         if(list.empty())
+         {
+            mIdleConnections.erase(i++);
+         }
+         else
+         {
+            ++i;
+         }
+      }
+   }
+}
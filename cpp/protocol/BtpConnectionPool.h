@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_protocol_BtpConnectionPool_H
+#define bitmunk_protocol_BtpConnectionPool_H
+
+#include "bitmunk/common/TypeDefinitions.h"
+#include "monarch/http/HttpConnection.h"
+#include "monarch/net/Url.h"
+#include "monarch/rt/ExclusiveLock.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+namespace bitmunk
+{
+namespace protocol
+{
+
+/**
+ * A BtpConnectionPool stores idle keep-alive connections so that they can
+ * be reused for subsequent requests to the same peer. This allows
+ * back-to-back requests (ie: file piece requests to the same seller) to skip
+ * the TCP connect and SSL handshake.
+ *
+ * Connections are keyed by the peer's user ID and the scheme, host, and
+ * port of the url that was connected to. A limited number of idle
+ * connections are kept per key and idle connections that have not been used
+ * for a configurable amount of time are evicted.
+ *
+ * @author Dave Longley
+ */
+class BtpConnectionPool
+{
+protected:
+   /**
+    * An idle connection.
+    */
+   struct IdleConnection
+   {
+      monarch::http::HttpConnection* connection;
+      uint64_t idleSince;
+   };
+
+   /**
+    * A map of key to the list of idle connections for that key, most
+    * recently used connection first.
+    */
+   typedef std::list<IdleConnection> IdleList;
+   typedef std::map<std::string, IdleList> IdleMap;
+   IdleMap mIdleConnections;
+
+   /**
+    * The total number of idle connections.
+    */
+   uint32_t mIdleCount;
+
+   /**
+    * The maximum number of idle connections per peer.
+    */
+   uint32_t mMaxIdlePerPeer;
+
+   /**
+    * The maximum number of idle connections in total.
+    */
+   uint32_t mMaxIdle;
+
+   /**
+    * The maximum amount of time, in milliseconds, that a connection may be
+    * idle before it is evicted.
+    */
+   uint32_t mMaxIdleTime;
+
+   /**
+    * Statistics.
+    */
+   uint64_t mHits;
+   uint64_t mMisses;
+   uint64_t mEvictions;
+   uint64_t mStale;
+
+   /**
+    * A lock for manipulating the pool.
+    */
+   monarch::rt::ExclusiveLock mLock;
+
+public:
+   /**
+    * Creates a new BtpConnectionPool.
+    */
+   BtpConnectionPool();
+
+   /**
+    * Destructs this BtpConnectionPool, closing any idle connections.
+    */
+   virtual ~BtpConnectionPool();
+
+   /**
+    * Configures this pool.
+    *
+    * @param cfg the configuration with optional "maxIdlePerPeer",
+    *            "maxIdle" and "maxIdleTime" (in milliseconds) members.
+    */
+   virtual void configure(monarch::rt::DynamicObject& cfg);
+
+   /**
+    * Gets an idle connection to the given peer url. The returned connection
+    * must either be deleted by the caller or given back to the pool via
+    * addConnection().
+    *
+    * @param userId the ID of the peer user, 0 for non-peer.
+    * @param url the url to get a connection to.
+    *
+    * @return the connection or NULL if none was available.
+    */
+   virtual monarch::http::HttpConnection* getConnection(
+      bitmunk::common::UserId userId, monarch::net::Url* url);
+
+   /**
+    * Adds an idle connection to this pool. If the pool is full for the peer,
+    * its least recently used connection will be closed.
+    *
+    * @param userId the ID of the peer user, 0 for non-peer.
+    * @param url the url the connection was made to.
+    * @param hc the connection to add, the pool takes ownership of it.
+    */
+   virtual void addConnection(
+      bitmunk::common::UserId userId, monarch::net::Url* url,
+      monarch::http::HttpConnection* hc);
+
+   /**
+    * Closes and removes all connections that have been idle for too long.
+    */
+   virtual void evictIdleConnections();
+
+   /**
+    * Closes and removes all idle connections.
+    */
+   virtual void clear();
+
+   /**
+    * Gets statistics for this pool:
+    *
+    * {
+    *    "idle": total number of idle connections,
+    *    "hits": connections reused,
+    *    "misses": requests for connections where none were idle,
+    *    "evictions": idle connections closed due to age or limits,
+    *    "stale": idle connections found closed by the peer
+    * }
+    *
+    * @return the statistics.
+    */
+   virtual monarch::rt::DynamicObject getStats();
+
+protected:
+   /**
+    * Gets the key for the given peer and url.
+    *
+    * @param userId the ID of the peer user.
+    * @param url the url.
+    *
+    * @return the key.
+    */
+   static std::string createKey(
+      bitmunk::common::UserId userId, monarch::net::Url* url);
+
+   /**
+    * Checks to see if an idle connection has been closed (or has had data
+    * sent on it) by its peer.
+    *
+    * @param hc the connection to check.
+    *
+    * @return true if the connection is stale, false if it can be reused.
+    */
+   static bool isStale(monarch::http::HttpConnection* hc);
+
+   /**
+    * Closes and deletes a connection.
+    *
+    * @param hc the connection.
+    */
+   static void closeConnection(monarch::http::HttpConnection* hc);
+
+   /**
+    * Removes connections that have been idle for too long. The pool lock
+    * must be held.
+    *
+    * @param now the current time in milliseconds.
+    */
+   virtual void evict(uint64_t now);
+};
+
+} // end namespace protocol
+} // end namespace bitmunk
+#endif
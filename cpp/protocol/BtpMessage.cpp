@@ -6,7 +6,11 @@
 #include "bitmunk/protocol/BtpMessage.h"
 
 #include "bitmunk/common/Logging.h"
+#include "bitmunk/common/Signer.h"
 #include "bitmunk/protocol/BtpTrailer.h"
+#include "bitmunk/protocol/DynoBinaryReader.h"
+#include "bitmunk/protocol/DynoBinaryWriter.h"
+#include "bitmunk/protocol/LimitedOutputStream.h"
 #include "monarch/crypto/DigitalSignatureInputStream.h"
 #include "monarch/crypto/DigitalSignatureOutputStream.h"
 #include "monarch/data/DynamicObjectInputStream.h"
@@ -17,11 +21,14 @@
 #include "monarch/data/xml/XmlWriter.h"
 #include "monarch/compress/gzip/Gzipper.h"
 #include "monarch/io/ByteArrayOutputStream.h"
+#include "monarch/io/FilterInputStream.h"
 #include "monarch/io/MutatorInputStream.h"
 #include "monarch/io/MutatorOutputStream.h"
 #include "monarch/util/Convert.h"
 #include "monarch/util/Timer.h"
 
+#include <algorithm>
+
 using namespace std;
 using namespace monarch::compress::deflate;
 using namespace monarch::compress::gzip;
@@ -37,6 +44,164 @@ using namespace monarch::util;
 using namespace bitmunk::common;
 using namespace bitmunk::protocol;
 
+/**
+ * A PrefixInputStream reads a prefix that was already read from an
+ * InputStream (to sample it) before reading the rest of the InputStream.
+ */
+class PrefixInputStream : public FilterInputStream
+{
+protected:
+   ByteBuffer* mPrefix;
+
+public:
+   PrefixInputStream(ByteBuffer* prefix, InputStream* is) :
+      FilterInputStream(is, false),
+      mPrefix(prefix)
+   {
+   };
+
+   virtual ~PrefixInputStream()
+   {
+   };
+
+   virtual int read(char* b, int length)
+   {
+      return mPrefix->isEmpty() ?
+         mInputStream->read(b, length) : mPrefix->get(b, length);
+   };
+};
+
+namespace bitmunk
+{
+namespace protocol
+{
+
+/**
+ * A SampledObjectOutputStream buffers the start of an object's content
+ * until there is enough of it for the CompressionPolicy to decide whether
+ * to compress it. Then it sends the message header and streams the rest of
+ * the content, so only that much of the content is ever buffered.
+ */
+class SampledObjectOutputStream : public OutputStream
+{
+protected:
+   BtpMessage* mMessage;
+   HttpConnection* mConnection;
+   HttpHeader* mHeader;
+   int mSampleSize;
+   ByteBuffer mBuffer;
+   OutputStreamRef mOutputStream;
+   bool mStarted;
+
+public:
+   SampledObjectOutputStream(
+      BtpMessage* message, HttpConnection* hc, HttpHeader* header) :
+      mMessage(message),
+      mConnection(hc),
+      mHeader(header),
+      mSampleSize(message->mCompressionPolicy->getSampleSize()),
+      mBuffer(max(
+         mSampleSize, (int)message->mCompressionPolicy->getMinSize())),
+      mStarted(false)
+   {
+   };
+
+   virtual ~SampledObjectOutputStream()
+   {
+   };
+
+   virtual bool write(const char* b, int length)
+   {
+      bool rval = true;
+
+      if(!mStarted)
+      {
+         // buffer content until the buffer is full
+         int n = min(length, mBuffer.freeSpace());
+         mBuffer.put(b, n, false);
+         b += n;
+         length -= n;
+         if(mBuffer.isFull())
+         {
+            rval = start(false);
+         }
+      }
+
+      if(rval && length > 0 && !mOutputStream.isNull())
+      {
+         rval = mOutputStream->write(b, length);
+      }
+
+      return rval;
+   };
+
+   virtual bool finish()
+   {
+      // the whole content fit in the buffer if it was not started yet
+      bool rval = mStarted || start(true);
+      if(rval && !mOutputStream.isNull())
+      {
+         rval = mOutputStream->finish();
+      }
+      return rval;
+   };
+
+   virtual void close()
+   {
+      if(!mOutputStream.isNull())
+      {
+         mOutputStream->close();
+      }
+   };
+
+protected:
+   /**
+    * Applies the compression policy to the buffered content, sends the
+    * header, and writes out the buffered content.
+    *
+    * @param complete true if the buffer has all of the content.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   bool start(bool complete)
+   {
+      bool rval;
+
+      mStarted = true;
+
+      // a complete body is sampled as a whole so that its size is checked,
+      // otherwise a prefix is sampled if sampling is enabled
+      int level;
+      if(complete)
+      {
+         level = mMessage->applyCompressionPolicy(
+            mHeader, mBuffer.data(), mBuffer.length(), true);
+      }
+      else if(mSampleSize > 0)
+      {
+         level = mMessage->applyCompressionPolicy(
+            mHeader, mBuffer.data(), mSampleSize, false);
+      }
+      else
+      {
+         level = mMessage->applyCompressionPolicy(mHeader, NULL, 0, false);
+      }
+
+      if((rval = mMessage->sendHeader(
+         mConnection, mHeader, level, mOutputStream, mMessage->mTrailer)) &&
+         !mOutputStream.isNull() && mBuffer.length() > 0)
+      {
+         rval = mOutputStream->write(mBuffer.data(), mBuffer.length());
+      }
+      mBuffer.clear();
+
+      return rval;
+   };
+};
+
+} // end namespace protocol
+} // end namespace bitmunk
+
 BtpMessage::BtpMessage() :
    mType(Undefined),
    mSecurityStatus(Unchecked),
@@ -44,6 +209,7 @@ BtpMessage::BtpMessage() :
    mAgentUserId(0),
    mAgentProfileId(0),
    mPublicKeySource(NULL),
+   mCompressionPolicy(NULL),
    mContentType(NULL),
    mContentSource(NULL),
    mContentSink(NULL),
@@ -54,6 +220,9 @@ BtpMessage::BtpMessage() :
    mRequestHeader(NULL),
    mResponseHeader(NULL)
 {
+   // no content limits by default
+   mContentLimits.maxLength = 0;
+   mContentLimits.maxDepth = 0;
 }
 
 BtpMessage::~BtpMessage()
@@ -155,9 +324,6 @@ void BtpMessage::checkHeaderSecurity(HttpHeader* header)
             }
             else
             {
-               // create digital signature for verification
-               DigitalSignature ds(publicKey);
-
                // create header-sig data by concatenating start line and host
                string data;
                string host;
@@ -168,10 +334,11 @@ void BtpMessage::checkHeaderSecurity(HttpHeader* header)
                   header->getField("Host", host);
                }
                data.append(host);
-               ds.update(data.c_str(), data.length());
 
-               // verify signature
-               if(verifySignature(&ds, hs))
+               // verify signature, the same agent often signs the same
+               // request more than once so the result may be cached
+               if(Signer::getSignatureCache()->verify(
+                  publicKey, data.c_str(), data.length(), hs.c_str()))
                {
                   setSecurityStatus(BtpMessage::Secure);
                }
@@ -268,16 +435,28 @@ void BtpMessage::setupRequestHeader(Url* url, HttpRequestHeader* header)
    header->setField("User-Agent", "BtpClient/1.0");
    header->setField("Accept-Encoding", "deflate, gzip");
 
-   // add accept for json if not found
+   // add accept for binary and json if not found (peers that do not
+   // support the binary format will respond with json)
    if(!header->hasField("Accept"))
    {
-      header->setField("Accept", "application/json");
+      string accept = DynoBinaryWriter::sContentType;
+      accept.append(", application/json");
+      header->setField("Accept", accept.c_str());
    }
 }
 
 bool BtpMessage::sendHeader(
    HttpConnection* hc, HttpHeader* header,
    OutputStreamRef& os, HttpTrailerRef& trailer)
+{
+   // apply compression policy to header (no content sample is available)
+   int level = applyCompressionPolicy(header, NULL, 0, false);
+   return sendHeader(hc, header, level, os, trailer);
+}
+
+bool BtpMessage::sendHeader(
+   HttpConnection* hc, HttpHeader* header, int level,
+   OutputStreamRef& os, HttpTrailerRef& trailer)
 {
    bool rval;
 
@@ -311,23 +490,10 @@ bool BtpMessage::sendHeader(
       OutputStream* out = hc->getBodyOutputStream(header, &(*mTrailer));
 
       // use deflating/gzip if available
-      string contentEncoding;
-      if(header->getField("Content-Encoding", contentEncoding))
+      MutationAlgorithm* compressor = createCompressor(header, level);
+      if(compressor != NULL)
       {
-         if(strstr(contentEncoding.c_str(), "deflate") != NULL)
-         {
-            // create deflater to deflate content
-            Deflater* def = new Deflater();
-            def->startDeflating(-1, false);
-            out = new MutatorOutputStream(out, true, def, true);
-         }
-         else if(strstr(contentEncoding.c_str(), "gzip") != NULL)
-         {
-            // create gzipper to deflate content
-            Gzipper* gzipper = new Gzipper();
-            gzipper->startCompressing();
-            out = new MutatorOutputStream(out, true, gzipper, true);
-         }
+         out = new MutatorOutputStream(out, true, compressor, true);
       }
 
       if(ds != NULL)
@@ -393,17 +559,7 @@ bool BtpMessage::receiveContent(HttpRequest* request)
    bool rval = true;
 
    // update message type
-   BtpMessage::Type type = BtpMessage::Undefined;
-   HttpRequestHeader* header = request->getHeader();
-   if(header->hasField("X-Method-Override"))
-   {
-      type = stringToType(header->getFieldValue("X-Method-Override").c_str());
-   }
-   if(type == BtpMessage::Undefined)
-   {
-      type = stringToType(header->getMethod());
-   }
-   setType(type);
+   setTypeFromHeader(request->getHeader());
 
    // check to see if there is content to receive
    int64_t length = 0;
@@ -435,6 +591,12 @@ bool BtpMessage::receiveContent(HttpResponse* response)
 {
    bool rval = true;
 
+   // save received header (ie: for its status and caching fields)
+   if(mSaveHeaders)
+   {
+      saveHeader(response->getHeader());
+   }
+
    // check to see if there is content to receive
    int64_t length = 0;
    response->getHeader()->getField("Content-Length", length);
@@ -486,6 +648,63 @@ bool BtpMessage::receiveContent(HttpResponse* response)
    return rval;
 }
 
+bool BtpMessage::receiveContentElements(
+   HttpRequest* request, DynoElementHandler* handler)
+{
+   bool rval = true;
+
+   // update message type
+   setTypeFromHeader(request->getHeader());
+
+   // check to see if there is content to receive
+   HttpConnection* hc = request->getConnection();
+   HttpRequestHeader* header = request->getHeader();
+   int64_t length = 0;
+   header->getField("Content-Length", length);
+   if(length != 0 || header->hasField("Transfer-Encoding"))
+   {
+      DynoContentType type;
+      if((rval = checkContentType(header, type, false)))
+      {
+         if(type == Json)
+         {
+            // handle elements as they are parsed
+            DynoElementOutputStream deos(handler);
+            LimitedOutputStream los(
+               &deos, false,
+               mContentLimits.maxLength, mContentLimits.maxDepth);
+            rval =
+               checkContentLength(header) &&
+               receiveContentStream(hc, header, &los) &&
+               deos.finish();
+         }
+         else
+         {
+            // receive whole object, then handle its elements
+            DynamicObject dyno;
+            if((rval = receiveContentObject(hc, header, dyno)))
+            {
+               if(dyno->getType() != Array)
+               {
+                  ExceptionRef e = new Exception(
+                     "Content is not an array.",
+                     "bitmunk.protocol.InvalidContent");
+                  Exception::set(e);
+                  rval = false;
+               }
+               DynamicObjectIterator i = dyno.getIterator();
+               while(rval && i->hasNext())
+               {
+                  rval = handler->handleElement(i->next());
+               }
+            }
+         }
+      }
+   }
+
+   return rval;
+}
+
 void BtpMessage::getContentReceiveStream(
    HttpRequest* request,
    InputStreamRef& is, HttpTrailerRef& trailer, DigitalSignatureRef& ds)
@@ -562,6 +781,22 @@ PublicKeySource* BtpMessage::getPublicKeySource()
    return mPublicKeySource;
 }
 
+void BtpMessage::setCompressionPolicy(CompressionPolicy* policy)
+{
+   mCompressionPolicy = policy;
+}
+
+CompressionPolicy* BtpMessage::getCompressionPolicy()
+{
+   return mCompressionPolicy;
+}
+
+void BtpMessage::setContentLimits(uint64_t maxLength, int maxDepth)
+{
+   mContentLimits.maxLength = maxLength;
+   mContentLimits.maxDepth = maxDepth;
+}
+
 void BtpMessage::setContentType(const char* contentType)
 {
    if(mContentType != NULL)
@@ -782,6 +1017,12 @@ bool BtpMessage::checkContentType(
       {
          type = Form;
       }
+      else if(strncmp(
+         contentType.c_str(), DynoBinaryWriter::sContentType,
+         strlen(DynoBinaryWriter::sContentType)) == 0)
+      {
+         type = Binary;
+      }
    }
 
    if(type == Invalid)
@@ -921,21 +1162,29 @@ void BtpMessage::addHeaders(HttpHeader* header, DigitalSignature* ds)
 
    if(mSaveHeaders)
    {
-      HttpHeader* save;
-      if(header->getType() == HttpHeader::Response)
-      {
-         // save response header
-         save = getRequestHeader();
-      }
-      else
-      {
-         // save request header
-         save = getResponseHeader();
-      }
+      saveHeader(header);
+   }
+}
 
-      save->clearFields();
-      header->writeTo(save);
+void BtpMessage::saveHeader(HttpHeader* header)
+{
+   HttpHeader* save;
+   if(header->getType() == HttpHeader::Response)
+   {
+      // save response header, including its status
+      HttpResponseHeader* response = static_cast<HttpResponseHeader*>(header);
+      getResponseHeader()->setStatus(
+         response->getStatusCode(), response->getStatusMessage());
+      save = getResponseHeader();
+   }
+   else
+   {
+      // save request header
+      save = getRequestHeader();
    }
+
+   save->clearFields();
+   header->writeTo(save);
 }
 
 bool BtpMessage::verifySignature(DigitalSignature* ds, std::string& signature)
@@ -957,10 +1206,101 @@ bool BtpMessage::verifySignature(DigitalSignature* ds, std::string& signature)
    return rval;
 }
 
+int BtpMessage::applyCompressionPolicy(
+   HttpHeader* header, const char* sample, int length, bool complete)
+{
+   int rval = -1;
+
+   if(mCompressionPolicy != NULL && header->hasField("Content-Encoding"))
+   {
+      // check content-type and length, then sample
+      if(!mCompressionPolicy->checkHeader(header, rval, sample != NULL) ||
+         (sample != NULL &&
+          !mCompressionPolicy->checkSample(sample, length, complete, rval)))
+      {
+         // content is not worth compressing
+         header->removeField("Content-Encoding");
+         rval = -1;
+      }
+   }
+
+   return rval;
+}
+
+MutationAlgorithm* BtpMessage::createCompressor(HttpHeader* header, int level)
+{
+   MutationAlgorithm* rval = NULL;
+
+   string contentEncoding;
+   if(header->getField("Content-Encoding", contentEncoding))
+   {
+      if(mCompressionPolicy != NULL)
+      {
+         // policy compressors keep statistics
+         rval = mCompressionPolicy->createCompressor(
+            contentEncoding.c_str(), level);
+      }
+      else if(strstr(contentEncoding.c_str(), "deflate") != NULL)
+      {
+         // create deflater to deflate content
+         Deflater* def = new Deflater();
+         def->startDeflating(level, false);
+         rval = def;
+      }
+      else if(strstr(contentEncoding.c_str(), "gzip") != NULL)
+      {
+         // create gzipper to deflate content
+         Gzipper* gzipper = new Gzipper();
+         gzipper->startCompressing(level);
+         rval = gzipper;
+      }
+   }
+
+   return rval;
+}
+
 bool BtpMessage::sendHeaderAndStream(
    HttpConnection* hc, HttpHeader* header, InputStream* is)
 {
-   bool rval;
+   bool rval = true;
+
+   // sample the content to decide whether or not to compress it
+   int level = -1;
+   ByteBuffer sample;
+   PrefixInputStream pis(&sample, is);
+   if(is != NULL && mCompressionPolicy != NULL &&
+      header->hasField("Content-Encoding"))
+   {
+      // read sample (stop at the end of the content)
+      int num = 1;
+      sample.resize(mCompressionPolicy->getSampleSize());
+      while(num > 0 && sample.length() < sample.capacity())
+      {
+         num = is->read(
+            sample.data() + sample.length(),
+            sample.capacity() - sample.length());
+         if(num > 0)
+         {
+            sample.extend(num);
+         }
+      }
+
+      if(num < 0)
+      {
+         // reading failed
+         rval = false;
+      }
+      else
+      {
+         level = applyCompressionPolicy(
+            header, sample.data(), sample.length(), num == 0);
+         is = &pis;
+      }
+   }
+   else
+   {
+      level = applyCompressionPolicy(header, NULL, 0, false);
+   }
 
    // create digital signature if a profile is set
    DigitalSignature* ds = NULL;
@@ -979,10 +1319,13 @@ bool BtpMessage::sendHeaderAndStream(
    }
 
    // add btp headers
-   addHeaders(header, ds);
+   if(rval)
+   {
+      addHeaders(header, ds);
+   }
 
    // send header
-   if((rval = hc->sendHeader(header)))
+   if(rval && (rval = hc->sendHeader(header)))
    {
       // print out header
       MO_CAT_DEBUG(BM_PROTOCOL_CAT,
@@ -996,25 +1339,11 @@ bool BtpMessage::sendHeaderAndStream(
       {
          // use deflating/gzip if available
          MutatorInputStream mis(is, false, NULL, false);
-         string contentEncoding;
-         if(header->getField("Content-Encoding", contentEncoding))
+         MutationAlgorithm* compressor = createCompressor(header, level);
+         if(compressor != NULL)
          {
-            if(strstr(contentEncoding.c_str(), "deflate") != NULL)
-            {
-               // create deflater to deflate content
-               Deflater* def = new Deflater();
-               def->startDeflating(-1, false);
-               mis.setAlgorithm(def, true);
-               is = &mis;
-            }
-            else if(strstr(contentEncoding.c_str(), "gzip") != NULL)
-            {
-               // create gzipper to deflate content
-               Gzipper* gzipper = new Gzipper();
-               gzipper->startCompressing();
-               mis.setAlgorithm(gzipper, true);
-               is = &mis;
-            }
+            mis.setAlgorithm(compressor, true);
+            is = &mis;
          }
 
          // send body
@@ -1054,71 +1383,76 @@ bool BtpMessage::sendHeaderAndObject(
    DynoContentType type;
    if((rval = checkContentType(header, type, true)))
    {
-      // send header
+      // create dynamic object writer according to data format
+      DynamicObjectWriter* writer = NULL;
+      if(type == Json)
+      {
+         writer = new JsonWriter();
+      }
+      else if(type == Xml)
+      {
+         writer = new XmlWriter();
+      }
+      else if(type == Binary)
+      {
+         writer = new DynoBinaryWriter();
+      }
+      if(writer != NULL)
+      {
+         writer->setCompact(true);
+      }
+
+      // if the content might be compressed, the header is only sent once
+      // enough of the content has been written for the compression policy
+      // to check its size and sample it
       OutputStreamRef os;
-      if((rval = sendHeader(hc, header, os, mTrailer)))
+      if(mCompressionPolicy != NULL && header->hasField("Content-Encoding"))
       {
-         if(!os.isNull())
-         {
-            // create dynamic object writer according to data format
-            if(type != Form)
-            {
-               DynamicObjectWriter* writer;
-               if(type == Json)
-               {
-                  writer = new JsonWriter();
-               }
-               else
-               {
-                  writer = new XmlWriter();
-               }
-               writer->setCompact(true);
+         os = new SampledObjectOutputStream(this, hc, header);
+      }
+      else
+      {
+         int level = applyCompressionPolicy(header, NULL, 0, false);
+         rval = sendHeader(hc, header, level, os, mTrailer);
+      }
 
-               // write message
-               Timer timer;
-               timer.start();
-               hc->setContentBytesWritten(0);
-               if((rval = writer->write(dyno, &(*os)) && os->finish()))
-               {
-                  // log send time
-                  MO_CAT_DEBUG(BM_PROTOCOL_CAT,
-                     "BtpMessage sent object content to %s:%i, "
-                     "%" PRIu64 " bytes in %" PRIu64 " ms.",
-                     hc->getRemoteAddress()->getAddress(),
-                     hc->getRemoteAddress()->getPort(),
-                     hc->getContentBytesWritten(),
-                     timer.getElapsedMilliseconds());
-               }
+      if(rval && !os.isNull())
+      {
+         // write message
+         Timer timer;
+         timer.start();
+         hc->setContentBytesWritten(0);
+         if(writer != NULL)
+         {
+            rval = writer->write(dyno, &(*os));
+         }
+         else
+         {
+            // write out x-www-form-urlencoded data
+            string form = Url::formEncode(dyno);
+            rval = os->write(form.c_str(), form.length());
+         }
 
-               // close output stream
-               os->close();
+         if(rval && (rval = os->finish()))
+         {
+            // log send time
+            MO_CAT_DEBUG(BM_PROTOCOL_CAT,
+               "BtpMessage sent object content to %s:%i, "
+               "%" PRIu64 " bytes in %" PRIu64 " ms.",
+               hc->getRemoteAddress()->getAddress(),
+               hc->getRemoteAddress()->getPort(),
+               hc->getContentBytesWritten(),
+               timer.getElapsedMilliseconds());
+         }
 
-               // cleanup writer
-               delete writer;
-            }
-            else
-            {
-               // write out x-www-form-urlencoded data
-               string form = Url::formEncode(dyno).c_str();
-               Timer timer;
-               timer.start();
-               if((rval = os->write(form.c_str(), form.length()) &&
-                  os->finish()))
-               {
-                  // log send time
-                  MO_CAT_DEBUG(BM_PROTOCOL_CAT,
-                     "BtpMessage sent object content to %s:%i, "
-                     "%" PRIu64 " bytes in %" PRIu64 " ms.",
-                     hc->getRemoteAddress()->getAddress(),
-                     hc->getRemoteAddress()->getPort(),
-                     hc->getContentBytesWritten(),
-                     timer.getElapsedMilliseconds());
-               }
+         // close output stream
+         os->close();
+      }
 
-               // close output stream
-               os->close();
-            }
-         }
+      // cleanup writer
+      if(writer != NULL)
+      {
+         delete writer;
       }
    }
 
@@ -1240,14 +1574,30 @@ bool BtpMessage::receiveContentObject(
          {
             reader = new JsonReader();
          }
+         else if(type == Binary)
+         {
+            reader = new DynoBinaryReader();
+         }
          else
          {
             reader = new XmlReader();
          }
 
+         // limit the nesting of binary content as it is parsed, JSON
+         // nesting is limited before it is parsed
+         if(type == Binary)
+         {
+            ((DynoBinaryReader*)reader)->setMaxDepth(
+               mContentLimits.maxDepth);
+         }
+
          // use dynamic object output stream as content sink
          DynamicObjectOutputStream doos(dyno, reader, true);
-         if((rval = receiveContentStream(hc, header, &doos)))
+         LimitedOutputStream los(
+            &doos, false, mContentLimits.maxLength,
+            (type == Json) ? mContentLimits.maxDepth : 0);
+         if((rval = checkContentLength(header) &&
+            receiveContentStream(hc, header, &los)))
          {
             doos.close();
          }
@@ -1257,7 +1607,9 @@ bool BtpMessage::receiveContentObject(
          // read content as a string and parse as x-www-form-urlencoded data
          ByteBuffer b(512);
          ByteArrayOutputStream baos(&b, true);
-         if((rval = receiveContentStream(hc, header, &baos)))
+         LimitedOutputStream los(&baos, false, mContentLimits.maxLength, 0);
+         if((rval = checkContentLength(header) &&
+            receiveContentStream(hc, header, &los)))
          {
             b.putByte('\0', 1, true);
             Url::formDecode(dyno, b.data());
@@ -1268,6 +1620,38 @@ bool BtpMessage::receiveContentObject(
    return rval;
 }
 
+bool BtpMessage::checkContentLength(HttpHeader* header)
+{
+   bool rval = true;
+
+   // compressed content may still exceed the limit once it is inflated
+   int64_t length = 0;
+   if(mContentLimits.maxLength > 0 &&
+      header->getField("Content-Length", length) &&
+      length > 0 && (uint64_t)length > mContentLimits.maxLength)
+   {
+      ContentLimits::setTooLargeException(
+         "Content is too large.", "maxLength", mContentLimits.maxLength);
+      rval = false;
+   }
+
+   return rval;
+}
+
+void BtpMessage::setTypeFromHeader(HttpRequestHeader* header)
+{
+   BtpMessage::Type type = BtpMessage::Undefined;
+   if(header->hasField("X-Method-Override"))
+   {
+      type = stringToType(header->getFieldValue("X-Method-Override").c_str());
+   }
+   if(type == BtpMessage::Undefined)
+   {
+      type = stringToType(header->getMethod());
+   }
+   setType(type);
+}
+
 void BtpMessage::getContentReceiveStream(
    HttpConnection* hc, HttpHeader* header,
    InputStreamRef& is, HttpTrailerRef& trailer, DigitalSignatureRef& ds)
@@ -9,6 +9,9 @@
 #include "monarch/net/Url.h"
 #include "bitmunk/common/Profile.h"
 #include "bitmunk/common/PublicKeySource.h"
+#include "bitmunk/protocol/CompressionPolicy.h"
+#include "bitmunk/protocol/ContentLimits.h"
+#include "bitmunk/protocol/DynoElementOutputStream.h"
 #include "monarch/crypto/DigitalSignature.h"
 #include "monarch/http/HttpConnection.h"
 #include "monarch/http/HttpRequest.h"
@@ -20,6 +23,9 @@ namespace bitmunk
 namespace protocol
 {
 
+// forward declarations
+class SampledObjectOutputStream;
+
 /**
  * A BtpMessage is a message that uses the BTP (Bitmunk Transfer Protocol).
  * 
@@ -33,6 +39,11 @@ namespace protocol
  * the particular service, or, if an error occurs, the type of object/document
  * will be an exception.
  * 
+ * Peers may also exchange DynamicObjects in the compact binary format
+ * written by a DynoBinaryWriter. A client advertises support for it in its
+ * Accept header and a service only responds with it if it was advertised;
+ * otherwise JSON is used.
+ * 
  * A BtpMessage can be sent with or without authentication/integrity security.
  * A secure message includes authentication and non-repudiation measures via
  * digital signatures.
@@ -158,7 +169,7 @@ public:
     */
    enum DynoContentType
    {
-      Invalid, Json, Xml, Form
+      Invalid, Json, Xml, Form, Binary
    };
    
 protected:
@@ -197,6 +208,17 @@ protected:
     */
    bitmunk::common::PublicKeySource* mPublicKeySource;
    
+   /**
+    * The CompressionPolicy for outgoing content, NULL to compress whenever a
+    * Content-Encoding is set.
+    */
+   CompressionPolicy* mCompressionPolicy;
+   
+   /**
+    * The limits for incoming content received into DynamicObjects.
+    */
+   ContentLimits::Limits mContentLimits;
+   
    /**
     * The content type to use with this message.
     */
@@ -397,6 +419,25 @@ public:
     */
    virtual bool receiveContent(monarch::http::HttpResponse* response);
    
+   /**
+    * Receives the content of this message using the passed request, which
+    * must be a JSON array (or any other content type with an array), and
+    * passes each element to a handler as soon as it has been received. JSON
+    * is parsed as it arrives, so only one element is held in memory at a
+    * time. It is assumed that the header for the passed request has already
+    * been received.
+    * 
+    * A btp security check will be run on any received content, but only
+    * once all of it has been received (and handled).
+    * 
+    * @param request the request to receive the message content with.
+    * @param handler the handler for each element.
+    * 
+    * @return true if successful, false if an Exception occurred.
+    */
+   virtual bool receiveContentElements(
+      monarch::http::HttpRequest* request, DynoElementHandler* handler);
+   
    /**
     * Gets a stream to manually receive the content of this message, after the
     * header has already been received.
@@ -556,6 +597,35 @@ public:
     */
    virtual bitmunk::common::PublicKeySource* getPublicKeySource();
    
+   /**
+    * Sets the CompressionPolicy for this message. When an outgoing header
+    * has a Content-Encoding, the policy decides whether the content is
+    * actually compressed and at which level. If the policy decides not to
+    * compress the content, the Content-Encoding is removed from the header.
+    * 
+    * @param policy the CompressionPolicy to use, NULL to always compress.
+    */
+   virtual void setCompressionPolicy(CompressionPolicy* policy);
+   
+   /**
+    * Gets the CompressionPolicy for this message.
+    * 
+    * @return the CompressionPolicy for this message, NULL if none is set.
+    */
+   virtual CompressionPolicy* getCompressionPolicy();
+   
+   /**
+    * Sets the limits for incoming content that is received into a
+    * DynamicObject or handled element by element. Content that exceeds a
+    * limit is rejected as soon as it does with a
+    * "bitmunk.protocol.ContentTooLarge" exception (code 413). By default
+    * there are no limits.
+    * 
+    * @param maxLength the maximum decoded content length, 0 for no limit.
+    * @param maxDepth the maximum nesting depth, 0 for no limit.
+    */
+   virtual void setContentLimits(uint64_t maxLength, int maxDepth);
+   
    /**
     * Sets the content-type to use with this message.
     * 
@@ -633,7 +703,9 @@ public:
    virtual monarch::http::HttpTrailerRef& getTrailer();
    
    /**
-    * Sets whether or not headers should be saved for this message.
+    * Sets whether or not headers should be saved for this message. Headers
+    * are saved when they are sent and, for responses, when they are
+    * received.
     * 
     * @param save true to save headers, false not to.
     */
@@ -697,6 +769,14 @@ protected:
    virtual void addHeaders(
       monarch::http::HttpHeader* header, monarch::crypto::DigitalSignature* ds);
    
+   /**
+    * Saves a copy of the passed header as this message's request or
+    * response header, according to its type.
+    * 
+    * @param header the header to save.
+    */
+   virtual void saveHeader(monarch::http::HttpHeader* header);
+   
    /**
     * Verifies the passed DigitalSignature against the passed hex-encoded
     * signature.
@@ -709,6 +789,51 @@ protected:
    virtual bool verifySignature(
       monarch::crypto::DigitalSignature* ds, std::string& signature);
    
+   /**
+    * Applies this message's CompressionPolicy to an outgoing header with a
+    * Content-Encoding, removing the Content-Encoding if the content should
+    * not be compressed.
+    * 
+    * @param header the outgoing header.
+    * @param sample a prefix of the content, NULL if none is available.
+    * @param length the length of the prefix.
+    * @param complete true if the prefix is the entire content.
+    * 
+    * @return the compression level to use.
+    */
+   virtual int applyCompressionPolicy(
+      monarch::http::HttpHeader* header,
+      const char* sample, int length, bool complete);
+   
+   /**
+    * Creates the compressor for the Content-Encoding of an outgoing header.
+    * 
+    * @param header the outgoing header.
+    * @param level the compression level to use.
+    * 
+    * @return the compressor (to be freed by the caller) or NULL if the
+    *         header has no supported Content-Encoding.
+    */
+   virtual monarch::io::MutationAlgorithm* createCompressor(
+      monarch::http::HttpHeader* header, int level);
+   
+   /**
+    * Sends the header for this message like sendHeader() does, except that
+    * the CompressionPolicy has already been applied to the header.
+    * 
+    * @param hc the connection to send the message over.
+    * @param header the header to use with the message.
+    * @param level the compression level to use.
+    * @param os the body OutputStreamRef to be set.
+    * @param trailer the HttpTrailerRef to be set.
+    * 
+    * @return true if successful, false if an Exception occurred.
+    */
+   virtual bool sendHeader(
+      monarch::http::HttpConnection* hc, monarch::http::HttpHeader* header,
+      int level, monarch::io::OutputStreamRef& os,
+      monarch::http::HttpTrailerRef& trailer);
+   
    /**
     * Sends this message in its entirety (header and content) over the
     * passed connection, using the passed header and content source
@@ -782,6 +907,25 @@ protected:
       monarch::http::HttpConnection* hc, monarch::http::HttpHeader* header,
       monarch::rt::DynamicObject& dyno);
    
+   /**
+    * Checks the Content-Length of a header against this message's content
+    * limits, so that content which is too large can be rejected before it
+    * is received.
+    * 
+    * @param header the previously received header.
+    * 
+    * @return true if the content may be received, false if not (with an
+    *         exception set).
+    */
+   virtual bool checkContentLength(monarch::http::HttpHeader* header);
+   
+   /**
+    * Sets the type of this message from a received request header.
+    * 
+    * @param header the request header.
+    */
+   virtual void setTypeFromHeader(monarch::http::HttpRequestHeader* header);
+   
    /**
     * Gets a stream to manually receive the content of this message, after the
     * header has already been received.
@@ -806,6 +950,8 @@ protected:
       monarch::http::HttpConnection* hc, monarch::http::HttpHeader* header,
       monarch::io::InputStreamRef& is, monarch::http::HttpTrailerRef& trailer,
       monarch::crypto::DigitalSignatureRef& ds);
+   
+   friend class SampledObjectOutputStream;
 };
 
 } // end namespace protocol
@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/protocol/BtpRouteTrie.h"
+
+#include "monarch/net/Url.h"
+
+#include <cstring>
+
+using namespace std;
+using namespace monarch::net;
+using namespace monarch::rt;
+using namespace bitmunk::protocol;
+
+BtpRouteTrie::BtpRouteTrie() :
+   mRoot(new Node),
+   mSize(0)
+{
+   mRoot->path = "/";
+}
+
+BtpRouteTrie::~BtpRouteTrie()
+{
+   freeNode(mRoot);
+}
+
+BtpRouteTrie* BtpRouteTrie::clone()
+{
+   BtpRouteTrie* rval = new BtpRouteTrie();
+   freeNode(rval->mRoot);
+   rval->mRoot = copyNode(mRoot);
+   rval->mSize = mSize;
+   return rval;
+}
+
+void BtpRouteTrie::add(const char* path, BtpActionHandlerRef& handler)
+{
+   // walk segments, creating nodes as needed
+   Node* node = mRoot;
+   const char* start = path;
+   while(*start != 0)
+   {
+      // skip slash
+      if(*start == '/')
+      {
+         ++start;
+         continue;
+      }
+
+      const char* end = strchr(start, '/');
+      if(end == NULL)
+      {
+         end = start + strlen(start);
+      }
+      string name(start, end - start);
+      ChildMap::iterator i = node->children.find(name.c_str());
+      if(i != node->children.end())
+      {
+         node = i->second;
+      }
+      else
+      {
+         Node* child = new Node;
+         child->name = name;
+         child->path.assign(path, end - path);
+         node->children.insert(make_pair(child->name.c_str(), child));
+         node = child;
+      }
+      start = end;
+   }
+
+   if(node->handler.isNull())
+   {
+      ++mSize;
+   }
+   node->handler = handler;
+}
+
+BtpActionHandlerRef BtpRouteTrie::remove(const char* path)
+{
+   BtpActionHandlerRef rval;
+
+   // copy path so segments can be terminated in place
+   int length = strlen(path);
+   char tmp[length + 1];
+   strcpy(tmp, path);
+
+   // find node, keeping track of its ancestors
+   Node* nodes[length + 1];
+   int depth = 0;
+   nodes[0] = mRoot;
+   char* rest = tmp;
+   char* seg;
+   while(nodes[depth] != NULL && (seg = nextSegment(rest)) != NULL)
+   {
+      ChildMap::iterator i = nodes[depth]->children.find(seg);
+      Node* next = (i != nodes[depth]->children.end()) ? i->second : NULL;
+      nodes[++depth] = next;
+   }
+
+   if(nodes[depth] != NULL && !nodes[depth]->handler.isNull())
+   {
+      rval = nodes[depth]->handler;
+      nodes[depth]->handler.setNull();
+      --mSize;
+
+      // prune nodes that no longer lead to any handler
+      for(; depth > 0 &&
+          nodes[depth]->handler.isNull() &&
+          nodes[depth]->children.empty(); --depth)
+      {
+         nodes[depth - 1]->children.erase(nodes[depth]->name.c_str());
+         delete nodes[depth];
+      }
+   }
+
+   return rval;
+}
+
+bool BtpRouteTrie::find(const char* resource, Route& route)
+{
+   // copy path (without query) so segments can be terminated in place
+   const char* query = strchr(resource, '?');
+   int length = (query == NULL) ? strlen(resource) : query - resource;
+   char tmp[length + 1];
+   memcpy(tmp, resource, length);
+   tmp[length] = 0;
+
+   // walk segments, remembering the deepest node with a handler
+   Node* node = mRoot;
+   Node* best = mRoot->handler.isNull() ? NULL : mRoot;
+   char* rest = tmp;
+   char* bestRest = tmp;
+   while(node != NULL && *rest != 0)
+   {
+      if(*rest == '/')
+      {
+         ++rest;
+         continue;
+      }
+
+      char* end = strchr(rest, '/');
+      char c = 0;
+      if(end != NULL)
+      {
+         c = *end;
+         *end = 0;
+      }
+      ChildMap::iterator i = node->children.find(rest);
+      if(end != NULL)
+      {
+         *end = c;
+      }
+
+      if(i == node->children.end())
+      {
+         node = NULL;
+      }
+      else
+      {
+         node = i->second;
+         rest = (end == NULL) ? rest + strlen(rest) : end;
+         if(!node->handler.isNull())
+         {
+            best = node;
+            bestRest = rest;
+         }
+      }
+   }
+
+   // get decoded path parameters after the matched path
+   route.params = DynamicObject();
+   route.params->setType(Array);
+   if(best == NULL)
+   {
+      route.handler.setNull();
+      route.path = NULL;
+   }
+   else
+   {
+      route.handler = best->handler;
+      route.path = best->path.c_str();
+      char* seg;
+      while((seg = nextSegment(bestRest)) != NULL)
+      {
+         route.params->append() = Url::decode(seg).c_str();
+      }
+   }
+
+   return best != NULL;
+}
+
+int BtpRouteTrie::size()
+{
+   return mSize;
+}
+
+void BtpRouteTrie::getPaths(DynamicObject& paths)
+{
+   paths->setType(Array);
+   collectPaths(mRoot, paths);
+}
+
+char* BtpRouteTrie::nextSegment(char*& str)
+{
+   char* rval = NULL;
+
+   // skip slashes
+   while(*str == '/')
+   {
+      ++str;
+   }
+
+   if(*str != 0)
+   {
+      // terminate segment and advance past it
+      rval = str;
+      char* end = strchr(str, '/');
+      if(end == NULL)
+      {
+         str += strlen(str);
+      }
+      else
+      {
+         *end = 0;
+         str = end + 1;
+      }
+   }
+
+   return rval;
+}
+
+BtpRouteTrie::Node* BtpRouteTrie::copyNode(Node* node)
+{
+   Node* rval = new Node;
+   rval->name = node->name;
+   rval->path = node->path;
+   rval->handler = node->handler;
+   for(ChildMap::iterator i = node->children.begin();
+       i != node->children.end(); ++i)
+   {
+      Node* child = copyNode(i->second);
+      rval->children.insert(make_pair(child->name.c_str(), child));
+   }
+   return rval;
+}
+
+void BtpRouteTrie::freeNode(Node* node)
+{
+   for(ChildMap::iterator i = node->children.begin();
+       i != node->children.end(); ++i)
+   {
+      freeNode(i->second);
+   }
+   delete node;
+}
+
+void BtpRouteTrie::collectPaths(Node* node, DynamicObject& paths)
+{
+   if(!node->handler.isNull())
+   {
+      paths->append() = node->path.c_str();
+   }
+   for(ChildMap::iterator i = node->children.begin();
+       i != node->children.end(); ++i)
+   {
+      collectPaths(i->second, paths);
+   }
+}
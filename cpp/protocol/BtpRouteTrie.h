@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_protocol_BtpRouteTrie_H
+#define bitmunk_protocol_BtpRouteTrie_H
+
+#include "bitmunk/protocol/BtpActionHandler.h"
+#include "monarch/util/StringTools.h"
+
+#include <map>
+#include <string>
+
+namespace bitmunk
+{
+namespace protocol
+{
+
+/**
+ * A BtpRouteTrie maps normalized resource paths to BtpActionHandlers, one
+ * path segment per level. A request path is resolved to the handler for its
+ * longest registered prefix, along with the remaining path segments as
+ * resource parameters, in a single pass over the path.
+ *
+ * A BtpRouteTrie is not thread-safe. A BtpService never changes a
+ * BtpRouteTrie once it has been published to request threads: it changes
+ * a clone() and then swaps it in.
+ *
+ * @author Dave Longley
+ */
+class BtpRouteTrie
+{
+public:
+   /**
+    * A resolved route.
+    */
+   struct Route
+   {
+      /**
+       * The handler for the route, NULL if none was found.
+       */
+      BtpActionHandlerRef handler;
+
+      /**
+       * The registered path that matched (owned by the trie).
+       */
+      const char* path;
+
+      /**
+       * The decoded path segments that follow the registered path.
+       */
+      monarch::rt::DynamicObject params;
+   };
+
+protected:
+   /**
+    * A path segment.
+    */
+   struct Node;
+   typedef std::map<const char*, Node*, monarch::util::StringComparator>
+      ChildMap;
+   struct Node
+   {
+      std::string name;
+      std::string path;
+      BtpActionHandlerRef handler;
+      ChildMap children;
+   };
+
+   /**
+    * The root node, for the path "/".
+    */
+   Node* mRoot;
+
+   /**
+    * The number of registered paths.
+    */
+   int mSize;
+
+public:
+   /**
+    * Creates a new, empty BtpRouteTrie.
+    */
+   BtpRouteTrie();
+
+   /**
+    * Destructs this BtpRouteTrie.
+    */
+   virtual ~BtpRouteTrie();
+
+   /**
+    * Creates a deep copy of this BtpRouteTrie that shares its handlers.
+    *
+    * @return the copy, to be freed by the caller.
+    */
+   virtual BtpRouteTrie* clone();
+
+   /**
+    * Adds a handler for a normalized path, replacing any existing handler.
+    *
+    * @param path the normalized path (starting with, but not ending with,
+    *             a slash, unless it is "/").
+    * @param handler the BtpActionHandler for the path.
+    */
+   virtual void add(const char* path, BtpActionHandlerRef& handler);
+
+   /**
+    * Removes the handler for a normalized path.
+    *
+    * @param path the normalized path.
+    *
+    * @return the removed BtpActionHandler, NULL if none.
+    */
+   virtual BtpActionHandlerRef remove(const char* path);
+
+   /**
+    * Resolves a normalized resource, which may include a query, to the
+    * handler for its longest registered prefix.
+    *
+    * @param resource the normalized resource.
+    * @param route the Route to populate.
+    *
+    * @return true if a handler was found, false if not.
+    */
+   virtual bool find(const char* resource, Route& route);
+
+   /**
+    * Gets the number of registered paths.
+    *
+    * @return the number of registered paths.
+    */
+   virtual int size();
+
+   /**
+    * Gets all registered paths.
+    *
+    * @param paths the array to append the paths to.
+    */
+   virtual void getPaths(monarch::rt::DynamicObject& paths);
+
+protected:
+   /**
+    * Finds the next segment in a path and terminates it in place.
+    *
+    * @param str the path, to be advanced past the segment.
+    *
+    * @return the next segment, NULL if there are none left.
+    */
+   static char* nextSegment(char*& str);
+
+   /**
+    * Copies a node and its children.
+    *
+    * @param node the node to copy.
+    *
+    * @return the copy.
+    */
+   static Node* copyNode(Node* node);
+
+   /**
+    * Frees a node and its children.
+    *
+    * @param node the node to free.
+    */
+   static void freeNode(Node* node);
+
+   /**
+    * Appends the registered paths of a node and its children.
+    *
+    * @param node the node.
+    * @param paths the array to append the paths to.
+    */
+   static void collectPaths(Node* node, monarch::rt::DynamicObject& paths);
+};
+
+} // end namespace protocol
+} // end namespace bitmunk
+#endif
@@ -16,23 +16,26 @@ using namespace monarch::net;
 using namespace monarch::rt;
 using namespace monarch::util;
 
-BtpService::BtpService(const char* path, bool dynamicResources) :
+BtpService::BtpService(const char* path) :
    HttpRequestServicer(path),
    mRequestModifier(NULL),
+   mRoutes(new BtpRouteTrie()),
    mReadThrottler(NULL),
    mWriteThrottler(NULL),
-   mDynamicResources(dynamicResources),
+   mCompressionPolicy(NULL),
+   mContentLimits(NULL),
    mAllowHttp1(false)
 {
 }
 
 BtpService::~BtpService()
 {
-   // clean up all action names
-   for(HandlerMap::iterator i = mActionHandlers.begin();
-       i != mActionHandlers.end(); ++i)
+   // clean up all routes
+   delete mRoutes;
+   for(list<BtpRouteTrie*>::iterator i = mRetiredRoutes.begin();
+       i != mRetiredRoutes.end(); ++i)
    {
-      free((char*)i->first);
+      delete *i;
    }
 }
 
@@ -48,27 +51,23 @@ HttpRequestModifier* BtpService::getRequestModifier()
 
 void BtpService::addResource(const char* resource, BtpActionHandlerRef& handler)
 {
-   if(mDynamicResources)
-   {
-      mResourceLock.lockExclusive();
-   }
-
    // append resource to btp service path
    int length = strlen(getPath()) + strlen(resource);
    char fullPath[length + 1];
    sprintf(fullPath, "%s%s", getPath(), resource);
 
    // normalize full path
-   char* normalized = (char*)malloc(length + 2);
+   char normalized[length + 2];
    HttpRequestServicer::normalizePath(fullPath, normalized);
 
-   // add full path entry to map
-   mActionHandlers.insert(make_pair(normalized, handler));
-
-   if(mDynamicResources)
+   // add full path entry to a copy of the routes
+   mResourceLock.lock();
    {
-      mResourceLock.unlockExclusive();
+      BtpRouteTrie* routes = getRoutes()->clone();
+      routes->add(normalized, handler);
+      swapRoutes(routes);
    }
+   mResourceLock.unlock();
 
    MO_CAT_DEBUG(BM_PROTOCOL_CAT,
       "Added BTP resource: %s", (const char*)normalized);
@@ -78,11 +77,6 @@ BtpActionHandlerRef BtpService::removeResource(const char* resource)
 {
    BtpActionHandlerRef rval;
 
-   if(mDynamicResources)
-   {
-      mResourceLock.lockExclusive();
-   }
-
    // append resource to btp service path
    int length = strlen(getPath()) + strlen(resource);
    char fullPath[length + 1];
@@ -92,18 +86,21 @@ BtpActionHandlerRef BtpService::removeResource(const char* resource)
    char normalized[length + 2];
    HttpRequestServicer::normalizePath(fullPath, normalized);
 
-   HandlerMap::iterator i = mActionHandlers.find(normalized);
-   if(i != mActionHandlers.end())
-   {
-      free((char*)i->first);
-      rval = i->second;
-      mActionHandlers.erase(i);
-   }
-
-   if(mDynamicResources)
+   // remove full path entry from a copy of the routes
+   mResourceLock.lock();
    {
-      mResourceLock.unlockExclusive();
+      BtpRouteTrie* routes = getRoutes()->clone();
+      rval = routes->remove(normalized);
+      if(rval.isNull())
+      {
+         delete routes;
+      }
+      else
+      {
+         swapRoutes(routes);
+      }
    }
+   mResourceLock.unlock();
 
    if(!rval.isNull())
    {
@@ -114,61 +111,15 @@ BtpActionHandlerRef BtpService::removeResource(const char* resource)
    return rval;
 }
 
-void BtpService::findHandler(char* resource, BtpActionHandlerRef& h)
+bool BtpService::findRoute(const char* resource, BtpRouteTrie::Route& route)
 {
-   h.setNull();
-
-   // strip any query
-   if(resource != NULL)
-   {
-      char* end = strrchr(resource, '?');
-      if(end != NULL)
-      {
-         end[0] = 0;
-      }
-   }
-
-   if(mDynamicResources)
-   {
-      mResourceLock.lockShared();
-   }
-
-   // try to find action handler for resource
-   HandlerMap::iterator i;
-   while(h.isNull() && resource != NULL)
-   {
-      i = mActionHandlers.find(resource);
-      if(i != mActionHandlers.end())
-      {
-         h = i->second;
-      }
-      else if(strlen(resource) > 1)
-      {
-         // try to find handler for parent resource
-         char* end = strrchr(resource, '/');
-         if(end != NULL)
-         {
-            // if parent is root (end == resource), set resource to "/"
-            // if parent is not root, clear last slash
-            end[(end == resource) ? 1 : 0] = 0;
-         }
-         else
-         {
-            // no resource left to search
-            resource = NULL;
-         }
-      }
-      else
-      {
-         // no resource left to search
-         resource = NULL;
-      }
-   }
+   // routes are never changed once published
+   return getRoutes()->find(resource, route);
+}
 
-   if(mDynamicResources)
-   {
-      mResourceLock.unlockShared();
-   }
+void BtpService::getResources(DynamicObject& resources)
+{
+   getRoutes()->getPaths(resources);
 }
 
 void BtpService::serviceRequest(
@@ -273,6 +224,26 @@ inline BandwidthThrottler* BtpService::getBandwidthThrottler(bool read)
    return (read ? mReadThrottler : mWriteThrottler);
 }
 
+void BtpService::setCompressionPolicy(CompressionPolicy* policy)
+{
+   mCompressionPolicy = policy;
+}
+
+CompressionPolicy* BtpService::getCompressionPolicy()
+{
+   return mCompressionPolicy;
+}
+
+void BtpService::setContentLimits(ContentLimits* limits)
+{
+   mContentLimits = limits;
+}
+
+ContentLimits* BtpService::getContentLimits()
+{
+   return mContentLimits;
+}
+
 inline void BtpService::setAllowHttp1(bool allow)
 {
    mAllowHttp1 = allow;
@@ -289,14 +260,19 @@ bool BtpService::setKeepAlive(BtpAction* action)
    bool keepAlive =
       strcmp(action->getRequest()->getHeader()->getVersion(), "HTTP/1.1") == 0;
 
+   // check connection tokens (ie: "keep-alive, TE" or "close, TE")
    string connection;
    if(action->getRequest()->getHeader()->getField("Connection", connection))
    {
-      if(strcasecmp(connection.c_str(), "close") == 0)
+      for(string::iterator i = connection.begin(); i != connection.end(); ++i)
+      {
+         *i = tolower(*i);
+      }
+      if(strstr(connection.c_str(), "close") != NULL)
       {
          keepAlive = false;
       }
-      else if(strcasecmp(connection.c_str(), "keep-alive") == 0)
+      else if(strstr(connection.c_str(), "keep-alive") != NULL)
       {
          keepAlive = true;
       }
@@ -315,26 +291,65 @@ BtpAction* BtpService::createAction(
 {
    BtpAction* rval = NULL;
 
-   // normalize request resource and find handler
+   // normalize request resource and route it
    const char* path = request->getHeader()->getPath();
    char resource[strlen(path) + 2];
    HttpRequestServicer::normalizePath(path, resource);
-   char res[strlen(resource) + 1];
-   strcpy(res, resource);
-   findHandler(resource, handler);
+   BtpRouteTrie::Route route;
+   findRoute(resource, route);
+   handler = route.handler;
 
    // create action
-   rval = new BtpAction(res);
+   rval = new BtpAction(resource);
 
-   // set base resource
+   // set base resource and the params routing parsed
    if(!handler.isNull())
    {
-      rval->setBaseResourcePath(resource);
+      rval->setBaseResourcePath(route.path);
+      rval->setResourceParams(route.params);
    }
 
    // set request in action
    rval->setRequest(request);
 
+   // set compression policy for responses
+   rval->getOutMessage()->setCompressionPolicy(mCompressionPolicy);
+
+   // set content limits for the resource
+   if(mContentLimits != NULL)
+   {
+      ContentLimits::Limits limits;
+      mContentLimits->getLimits(resource, limits);
+      rval->getInMessage()->setContentLimits(
+         limits.maxLength, limits.maxDepth);
+   }
+
+   return rval;
+}
+
+void BtpService::swapRoutes(BtpRouteTrie* routes)
+{
+   // the old routes may still be in use by request threads so they are
+   // kept until destruction (resources are typically only changed on
+   // init/cleanup)
+   mRoutesLock.lockExclusive();
+   {
+      mRetiredRoutes.push_back(mRoutes);
+      mRoutes = routes;
+   }
+   mRoutesLock.unlockExclusive();
+}
+
+BtpRouteTrie* BtpService::getRoutes()
+{
+   BtpRouteTrie* rval;
+
+   mRoutesLock.lockShared();
+   {
+      rval = mRoutes;
+   }
+   mRoutesLock.unlockShared();
+
    return rval;
 }
 
@@ -4,12 +4,17 @@
 #ifndef bitmunk_protocol_BtpService_H
 #define bitmunk_protocol_BtpService_H
 
+#include "monarch/rt/ExclusiveLock.h"
 #include "monarch/rt/SharedLock.h"
-#include "monarch/util/StringTools.h"
 #include "monarch/http/HttpRequestModifier.h"
 #include "monarch/http/HttpRequestServicer.h"
 #include "bitmunk/common/PublicKeySource.h"
 #include "bitmunk/protocol/BtpActionHandler.h"
+#include "bitmunk/protocol/BtpRouteTrie.h"
+#include "bitmunk/protocol/CompressionPolicy.h"
+#include "bitmunk/protocol/ContentLimits.h"
+
+#include <list>
 
 namespace bitmunk
 {
@@ -30,6 +35,11 @@ namespace protocol
  * If a more complex response is required, the BtpAction provides access to its
  * internal BtpMessage, HttpRequest, and HttpResponse.
  *
+ * Resources are routed through a BtpRouteTrie that is never changed once
+ * request threads can see it. Adding or removing a resource changes a copy
+ * of the trie and then swaps it in, so routing a request only holds a shared
+ * lock long enough to read the current trie.
+ *
  * @author Dave Longley
  */
 class BtpService : public monarch::http::HttpRequestServicer
@@ -41,12 +51,20 @@ protected:
    monarch::http::HttpRequestModifier* mRequestModifier;
 
    /**
-    * A map of action names to BtpActionHandlerRefs.
+    * The current routes from full resource paths to BtpActionHandlerRefs.
+    */
+   BtpRouteTrie* mRoutes;
+
+   /**
+    * A lock for publishing and reading the current routes.
     */
-   typedef std::map<
-      const char*, BtpActionHandlerRef, monarch::util::StringComparator>
-      HandlerMap;
-   HandlerMap mActionHandlers;
+   monarch::rt::SharedLock mRoutesLock;
+
+   /**
+    * Routes that have been replaced but may still be in use by request
+    * threads, freed when this service is destructed.
+    */
+   std::list<BtpRouteTrie*> mRetiredRoutes;
 
    /**
     * The BandwidthThrottler used for reading content with this service.
@@ -59,14 +77,19 @@ protected:
    monarch::net::BandwidthThrottler* mWriteThrottler;
 
    /**
-    * A flag to allow dynamic adding/removing of resources.
+    * The CompressionPolicy for content sent by this service.
+    */
+   CompressionPolicy* mCompressionPolicy;
+
+   /**
+    * The ContentLimits for content received by this service.
     */
-   bool mDynamicResources;
+   ContentLimits* mContentLimits;
 
    /**
-    * A lock for manipulating resources.
+    * A lock for adding/removing resources.
     */
-   monarch::rt::SharedLock mResourceLock;
+   monarch::rt::ExclusiveLock mResourceLock;
 
    /**
     * A flag to allow HTTP/1.0 non-secure requests.
@@ -81,11 +104,11 @@ public:
     *
     * Requests will be scanned for BtpActions according to the BTP protocol.
     *
+    * Resources may be added and removed while servicing requests.
+    *
     * @param path the path this servicer handles requests for.
-    * @param dynamicResources true to allow dynamic adding/removing of
-    *                         resources, false not to.
     */
-   BtpService(const char* path, bool dynamicResources = false);
+   BtpService(const char* path);
 
    /**
     * Destructs this BtpService.
@@ -150,13 +173,22 @@ public:
    virtual BtpActionHandlerRef removeResource(const char* resource);
 
    /**
-    * Gets the BtpActionHandler for the given resource, NULL if none
-    * exists.
+    * Routes a normalized resource, which may include a query, to the
+    * BtpActionHandler for its longest matching resource.
+    *
+    * @param resource the normalized resource to route.
+    * @param route the Route to populate.
+    *
+    * @return true if a handler was found, false if not.
+    */
+   virtual bool findRoute(const char* resource, BtpRouteTrie::Route& route);
+
+   /**
+    * Gets the full paths of the resources of this service.
     *
-    * @param resource the resource to action to get the handler for.
-    * @param h the reference to update, set to NULL if none exists.
+    * @param resources the array to append the paths to.
     */
-   virtual void findHandler(char* resource, BtpActionHandlerRef& h);
+   virtual void getResources(monarch::rt::DynamicObject& resources);
 
    /**
     * Services the passed HttpRequest. The header for the request has already
@@ -192,6 +224,38 @@ public:
     */
    virtual monarch::net::BandwidthThrottler* getBandwidthThrottler(bool read);
 
+   /**
+    * Sets the CompressionPolicy for this BtpService. It will be used to
+    * decide whether or not to compress the content of its responses.
+    *
+    * @param policy the CompressionPolicy to use, NULL to compress whenever
+    *               the client accepts it.
+    */
+   virtual void setCompressionPolicy(CompressionPolicy* policy);
+
+   /**
+    * Gets the CompressionPolicy for this BtpService.
+    *
+    * @return the CompressionPolicy for this BtpService, NULL if none is set.
+    */
+   virtual CompressionPolicy* getCompressionPolicy();
+
+   /**
+    * Sets the ContentLimits for this BtpService. They will be used to limit
+    * the size of the content of its requests that is received into
+    * DynamicObjects.
+    *
+    * @param limits the ContentLimits to use, NULL for no limits.
+    */
+   virtual void setContentLimits(ContentLimits* limits);
+
+   /**
+    * Gets the ContentLimits for this BtpService.
+    *
+    * @return the ContentLimits for this BtpService, NULL if none are set.
+    */
+   virtual ContentLimits* getContentLimits();
+
    /**
     * Sets whether or not this BtpService allows non-secure http/1.0
     * requests.
@@ -233,6 +297,21 @@ protected:
    virtual BtpAction* createAction(
       monarch::http::HttpRequest* request, BtpActionHandlerRef& handler);
 
+   /**
+    * Swaps in new routes. The resource lock must be held.
+    *
+    * @param routes the new routes to use.
+    */
+   virtual void swapRoutes(BtpRouteTrie* routes);
+
+   /**
+    * Gets the current routes. The returned routes must not be changed, they
+    * remain valid until this service is destructed.
+    *
+    * @return the current routes.
+    */
+   virtual BtpRouteTrie* getRoutes();
+
    /**
     * Sets the location for a created resource and automatically sets the
     * status to 201 "Created."
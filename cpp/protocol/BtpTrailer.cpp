@@ -40,3 +40,8 @@ void BtpTrailer::update(int64_t contentLength)
       setField("Btp-Content-Signature", data.c_str());
    }
 }
+
+DigitalSignature* BtpTrailer::getSignature()
+{
+   return mSignature;
+}
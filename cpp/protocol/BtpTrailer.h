@@ -49,6 +49,16 @@ public:
     * @param contentLength the length of the content that was sent or received.
     */
    virtual void update(int64_t contentLength);
+
+   /**
+    * Gets the DigitalSignature this trailer obtains its signature data from.
+    * Data that is not part of the content, such as the part of a resumed
+    * transfer that was sent earlier, may be added to the signature with it
+    * before any content is sent or received.
+    *
+    * @return the DigitalSignature, NULL if the content is not secure.
+    */
+   virtual monarch::crypto::DigitalSignature* getSignature();
 };
 
 } // end namespace protocol
@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/protocol/CompressionPolicy.h"
+
+#include "monarch/compress/deflate/Deflater.h"
+#include "monarch/compress/gzip/Gzipper.h"
+#include "monarch/io/ByteBuffer.h"
+
+#include <cstring>
+#include <ctime>
+
+using namespace std;
+using namespace monarch::compress::deflate;
+using namespace monarch::compress::gzip;
+using namespace monarch::http;
+using namespace monarch::io;
+using namespace monarch::rt;
+using namespace bitmunk::protocol;
+
+// the largest number of steps to take compressing a sample
+#define MAX_SAMPLE_STEPS 64
+
+namespace bitmunk
+{
+namespace protocol
+{
+
+/**
+ * A MeteredCompressor wraps a compression algorithm and reports how many
+ * bytes it consumed and produced and how long it took to its policy when
+ * it is destroyed.
+ */
+class MeteredCompressor : public MutationAlgorithm
+{
+protected:
+   CompressionPolicy* mPolicy;
+   MutationAlgorithm* mAlgorithm;
+   uint64_t mIn;
+   uint64_t mOut;
+   uint64_t mTime;
+
+public:
+   MeteredCompressor(CompressionPolicy* policy, MutationAlgorithm* algorithm) :
+      mPolicy(policy),
+      mAlgorithm(algorithm),
+      mIn(0),
+      mOut(0),
+      mTime(0)
+   {
+   };
+
+   virtual ~MeteredCompressor()
+   {
+      mPolicy->addCompressed(mIn, mOut, mTime);
+      delete mAlgorithm;
+   };
+
+   virtual MutationAlgorithm::Result mutateData(
+      ByteBuffer* src, ByteBuffer* dst, bool finish)
+   {
+      int srcLength = src->length();
+      int dstLength = dst->length();
+      uint64_t start = CompressionPolicy::getThreadCpuTime();
+      MutationAlgorithm::Result rval =
+         mAlgorithm->mutateData(src, dst, finish);
+      mTime += CompressionPolicy::getThreadCpuTime() - start;
+      if(src->length() < srcLength)
+      {
+         mIn += srcLength - src->length();
+      }
+      if(dst->length() > dstLength)
+      {
+         mOut += dst->length() - dstLength;
+      }
+      return rval;
+   };
+};
+
+} // end namespace protocol
+} // end namespace bitmunk
+
+CompressionPolicy::CompressionPolicy() :
+   mMinSize(1024),
+   mLevel(-1),
+   mSampleSize(4096),
+   mMaxRatio(0.9),
+   mCompressed(0),
+   mSkippedByRule(0),
+   mSkippedBySize(0),
+   mSkippedBySample(0),
+   mBytesIn(0),
+   mBytesOut(0),
+   mCpuTime(0)
+{
+   // already-compressed content is not worth compressing again
+   addRule("audio/", false, -1);
+   addRule("video/", false, -1);
+   addRule("image/", false, -1);
+   addRule("application/octet-stream", false, -1);
+   addRule("application/zip", false, -1);
+   addRule("application/x-gzip", false, -1);
+   addRule("application/ogg", false, -1);
+
+   // everything else (ie: json, xml, text) is
+   addRule("*", true, -1);
+}
+
+CompressionPolicy::~CompressionPolicy()
+{
+}
+
+void CompressionPolicy::configure(DynamicObject& cfg)
+{
+   mLock.lock();
+   {
+      if(cfg->hasMember("minSize"))
+      {
+         mMinSize = cfg["minSize"]->getUInt32();
+      }
+      if(cfg->hasMember("level"))
+      {
+         mLevel = cfg["level"]->getInt32();
+      }
+      if(cfg->hasMember("sampleSize"))
+      {
+         mSampleSize = cfg["sampleSize"]->getUInt32();
+      }
+      if(cfg->hasMember("maxRatio"))
+      {
+         mMaxRatio = cfg["maxRatio"]->getDouble();
+      }
+      if(cfg->hasMember("rules"))
+      {
+         // configured rules take precedence over the defaults
+         RuleList defaults = mRules;
+         mRules.clear();
+         DynamicObjectIterator i = cfg["rules"].getIterator();
+         while(i->hasNext())
+         {
+            DynamicObject& rule = i->next();
+            addRule(
+               rule["type"]->getString(),
+               !rule->hasMember("compress") || rule["compress"]->getBoolean(),
+               rule->hasMember("level") ? rule["level"]->getInt32() : -1);
+         }
+         mRules.insert(mRules.end(), defaults.begin(), defaults.end());
+      }
+   }
+   mLock.unlock();
+}
+
+bool CompressionPolicy::checkHeader(
+   HttpHeader* header, int& level, bool sampled)
+{
+   bool rval = true;
+
+   string type;
+   header->getField("Content-Type", type);
+   int64_t contentLength = -1;
+   bool hasLength = header->getField("Content-Length", contentLength);
+
+   mLock.lock();
+   {
+      // find first matching rule
+      RuleList::iterator i = mRules.begin();
+      for(; i != mRules.end(); ++i)
+      {
+         if(i->type == "*" ||
+            strncmp(type.c_str(), i->type.c_str(), i->type.length()) == 0)
+         {
+            break;
+         }
+      }
+
+      // check size if known, a body of unknown type is only compressed if
+      // it will be sampled
+      if((i != mRules.end() && !i->compress) ||
+         (!sampled && type.length() == 0))
+      {
+         rval = false;
+         ++mSkippedByRule;
+      }
+      else if(hasLength && contentLength < mMinSize)
+      {
+         rval = false;
+         ++mSkippedBySize;
+      }
+      else
+      {
+         level = (i != mRules.end() && i->level != -1) ? i->level : mLevel;
+      }
+   }
+   mLock.unlock();
+
+   return rval;
+}
+
+bool CompressionPolicy::checkSample(
+   const char* b, int length, bool complete, int level)
+{
+   bool rval = true;
+
+   uint32_t minSize;
+   double maxRatio;
+   mLock.lock();
+   {
+      minSize = mMinSize;
+      maxRatio = mMaxRatio;
+   }
+   mLock.unlock();
+
+   if(complete && length < (int)minSize)
+   {
+      // the whole body was sampled and it is too small
+      rval = false;
+      mLock.lock();
+      ++mSkippedBySize;
+      mLock.unlock();
+   }
+   else
+   {
+      // compress sample
+      Deflater def;
+      def.startDeflating(level, false);
+      ByteBuffer src(length);
+      src.put(b, length, false);
+      ByteBuffer dst(length + 64);
+      MutationAlgorithm::Result result = MutationAlgorithm::NeedsData;
+      for(int steps = 0;
+          steps < MAX_SAMPLE_STEPS &&
+          result != MutationAlgorithm::CompleteAppend &&
+          result != MutationAlgorithm::CompleteTruncate &&
+          result != MutationAlgorithm::Error; ++steps)
+      {
+         result = def.mutateData(&src, &dst, true);
+      }
+
+      // only compress if the sample shrank enough
+      if(result == MutationAlgorithm::Error ||
+         dst.length() > length * maxRatio)
+      {
+         rval = false;
+         mLock.lock();
+         ++mSkippedBySample;
+         mLock.unlock();
+      }
+   }
+
+   return rval;
+}
+
+uint32_t CompressionPolicy::getSampleSize()
+{
+   uint32_t rval;
+
+   mLock.lock();
+   {
+      rval = mSampleSize;
+   }
+   mLock.unlock();
+
+   return rval;
+}
+
+uint32_t CompressionPolicy::getMinSize()
+{
+   uint32_t rval;
+
+   mLock.lock();
+   {
+      rval = mMinSize;
+   }
+   mLock.unlock();
+
+   return rval;
+}
+
+MutationAlgorithm* CompressionPolicy::createCompressor(
+   const char* encoding, int level)
+{
+   MutationAlgorithm* rval = NULL;
+
+   if(strstr(encoding, "deflate") != NULL)
+   {
+      // create deflater to deflate content
+      Deflater* def = new Deflater();
+      def->startDeflating(level, false);
+      rval = new MeteredCompressor(this, def);
+   }
+   else if(strstr(encoding, "gzip") != NULL)
+   {
+      // create gzipper to deflate content
+      Gzipper* gzipper = new Gzipper();
+      gzipper->startCompressing(level);
+      rval = new MeteredCompressor(this, gzipper);
+   }
+
+   return rval;
+}
+
+void CompressionPolicy::addCompressed(
+   uint64_t in, uint64_t out, uint64_t cpuTime)
+{
+   mLock.lock();
+   {
+      ++mCompressed;
+      mBytesIn += in;
+      mBytesOut += out;
+      mCpuTime += cpuTime;
+   }
+   mLock.unlock();
+}
+
+DynamicObject CompressionPolicy::getStats()
+{
+   DynamicObject rval;
+
+   mLock.lock();
+   {
+      rval["compressed"] = mCompressed;
+      rval["skippedByRule"] = mSkippedByRule;
+      rval["skippedBySize"] = mSkippedBySize;
+      rval["skippedBySample"] = mSkippedBySample;
+      rval["bytesIn"] = mBytesIn;
+      rval["bytesOut"] = mBytesOut;
+      rval["bytesSaved"] = (mBytesIn > mBytesOut) ?
+         mBytesIn - mBytesOut : (uint64_t)0;
+      rval["cpuTime"] = mCpuTime;
+   }
+   mLock.unlock();
+
+   return rval;
+}
+
+uint64_t CompressionPolicy::getThreadCpuTime()
+{
+   // only the current thread's cpu time is counted, so time spent waiting
+   // to be scheduled or blocked on the connection is not
+   struct timespec now;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+   return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void CompressionPolicy::addRule(const char* type, bool compress, int level)
+{
+   Rule rule;
+   rule.type = type;
+   rule.compress = compress;
+   rule.level = level;
+   mRules.push_back(rule);
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_protocol_CompressionPolicy_H
+#define bitmunk_protocol_CompressionPolicy_H
+
+#include "monarch/http/HttpHeader.h"
+#include "monarch/io/MutationAlgorithm.h"
+#include "monarch/rt/DynamicObject.h"
+#include "monarch/rt/ExclusiveLock.h"
+
+#include <string>
+#include <vector>
+
+namespace bitmunk
+{
+namespace protocol
+{
+
+/**
+ * A CompressionPolicy decides whether or not the body of a BtpMessage that
+ * a peer is willing to receive compressed (via Accept-Encoding) is actually
+ * worth compressing.
+ *
+ * The decision is made in three steps:
+ *
+ * 1. The Content-Type of the body is matched against a list of rules. The
+ *    first rule whose type is a prefix of the Content-Type (or whose type is
+ *    "*") decides whether the body may be compressed and at which level.
+ *    Already-compressed types like audio and video are never compressed.
+ * 2. A body whose Content-Length is known and below the minimum size is not
+ *    compressed.
+ * 3. If a prefix of the body is available, it is compressed as a sample and
+ *    the body is only compressed if the sample shrinks enough.
+ *
+ * The policy also keeps statistics on how many bytes compression saved and
+ * how much time it took.
+ *
+ * @author Dave Longley
+ */
+class CompressionPolicy
+{
+protected:
+   /**
+    * A compression rule for a content type.
+    */
+   struct Rule
+   {
+      std::string type;
+      bool compress;
+      int level;
+   };
+   typedef std::vector<Rule> RuleList;
+
+   /**
+    * The rules, in order of precedence.
+    */
+   RuleList mRules;
+
+   /**
+    * The minimum content length to compress.
+    */
+   uint32_t mMinSize;
+
+   /**
+    * The default compression level (-1 for zlib's default).
+    */
+   int mLevel;
+
+   /**
+    * The number of bytes to sample, 0 to disable sampling.
+    */
+   uint32_t mSampleSize;
+
+   /**
+    * The maximum ratio of compressed sample size to sample size that makes
+    * a body worth compressing.
+    */
+   double mMaxRatio;
+
+   /**
+    * A lock for the configuration and the statistics.
+    */
+   monarch::rt::ExclusiveLock mLock;
+
+   /**
+    * Statistics.
+    */
+   uint64_t mCompressed;
+   uint64_t mSkippedByRule;
+   uint64_t mSkippedBySize;
+   uint64_t mSkippedBySample;
+   uint64_t mBytesIn;
+   uint64_t mBytesOut;
+   uint64_t mCpuTime;
+
+public:
+   /**
+    * Creates a new CompressionPolicy with the default rules.
+    */
+   CompressionPolicy();
+
+   /**
+    * Destructs this CompressionPolicy.
+    */
+   virtual ~CompressionPolicy();
+
+   /**
+    * Configures this policy.
+    *
+    * @param cfg the configuration with optional "minSize", "level",
+    *            "sampleSize", "maxRatio" and "rules" members. Each rule is
+    *            an object with a "type" (Content-Type prefix or "*"), a
+    *            "compress" flag, and an optional "level". Configured rules
+    *            take precedence over the default rules.
+    */
+   virtual void configure(monarch::rt::DynamicObject& cfg);
+
+   /**
+    * Checks the Content-Type and Content-Length of a header to determine
+    * whether its body may be compressed. If the body will not be sampled,
+    * a body without a Content-Type is not compressed because nothing is
+    * known about it (it may be, for instance, an encrypted file piece).
+    *
+    * @param header the header with the body's Content-Type and
+    *               Content-Length (if known).
+    * @param level to be set to the compression level to use.
+    * @param sampled true if the body will be sampled, false if not.
+    *
+    * @return true if the body may be compressed, false if not.
+    */
+   virtual bool checkHeader(
+      monarch::http::HttpHeader* header, int& level, bool sampled = true);
+
+   /**
+    * Compresses a prefix of a body to determine whether the whole body is
+    * worth compressing.
+    *
+    * @param b the prefix of the body.
+    * @param length the length of the prefix.
+    * @param complete true if the prefix is the whole body.
+    * @param level the compression level.
+    *
+    * @return true if the body should be compressed, false if not.
+    */
+   virtual bool checkSample(
+      const char* b, int length, bool complete, int level);
+
+   /**
+    * Gets the number of bytes of a body to pass to checkSample().
+    *
+    * @return the sample size, 0 if sampling is disabled.
+    */
+   virtual uint32_t getSampleSize();
+
+   /**
+    * Gets the minimum content length to compress.
+    *
+    * @return the minimum content length.
+    */
+   virtual uint32_t getMinSize();
+
+   /**
+    * Creates the compressor for a Content-Encoding. The compressor records
+    * its statistics in this policy.
+    *
+    * @param encoding the Content-Encoding ("deflate" or "gzip").
+    * @param level the compression level.
+    *
+    * @return the compressor (to be freed by the caller) or NULL if the
+    *         encoding is not supported.
+    */
+   virtual monarch::io::MutationAlgorithm* createCompressor(
+      const char* encoding, int level);
+
+   /**
+    * Adds the statistics for a compressed body.
+    *
+    * @param in the number of bytes before compression.
+    * @param out the number of bytes after compression.
+    * @param cpuTime the cpu time spent compressing, in microseconds.
+    */
+   virtual void addCompressed(uint64_t in, uint64_t out, uint64_t cpuTime);
+
+   /**
+    * Gets the statistics for this policy:
+    *
+    * {
+    *    "compressed": bodies compressed,
+    *    "skippedByRule": bodies not compressed due to their content type,
+    *    "skippedBySize": bodies not compressed because they were too small,
+    *    "skippedBySample": bodies not compressed because a sample of them
+    *       did not compress,
+    *    "bytesIn": bytes before compression,
+    *    "bytesOut": bytes after compression,
+    *    "bytesSaved": bytes saved by compression,
+    *    "cpuTime": cpu time spent compressing, in microseconds
+    * }
+    *
+    * @return the statistics.
+    */
+   virtual monarch::rt::DynamicObject getStats();
+
+   /**
+    * Gets the cpu time used by the current thread in microseconds, for
+    * timing compression.
+    *
+    * @return the cpu time used by the current thread in microseconds.
+    */
+   static uint64_t getThreadCpuTime();
+
+protected:
+   /**
+    * Adds a rule to the end of the rule list.
+    *
+    * @param type the content type prefix, "*" for any.
+    * @param compress true to compress, false not to.
+    * @param level the compression level.
+    */
+   virtual void addRule(const char* type, bool compress, int level);
+};
+
+} // end namespace protocol
+} // end namespace bitmunk
+#endif
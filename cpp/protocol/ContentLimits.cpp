@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/protocol/ContentLimits.h"
+
+#include "monarch/rt/Exception.h"
+
+#include <cstring>
+
+using namespace std;
+using namespace monarch::rt;
+using namespace bitmunk::protocol;
+
+ContentLimits::ContentLimits()
+{
+   // 16 MiB bodies, 64 levels of nesting
+   mDefaults.maxLength = 16 * 1024 * 1024;
+   mDefaults.maxDepth = 64;
+}
+
+ContentLimits::~ContentLimits()
+{
+}
+
+/**
+ * Updates limits from a configuration.
+ *
+ * @param cfg the configuration.
+ * @param limits the limits to update.
+ */
+static void configureLimits(DynamicObject& cfg, ContentLimits::Limits& limits)
+{
+   if(cfg->hasMember("maxLength"))
+   {
+      limits.maxLength = cfg["maxLength"]->getUInt64();
+   }
+   if(cfg->hasMember("maxDepth"))
+   {
+      limits.maxDepth = cfg["maxDepth"]->getInt32();
+   }
+}
+
+void ContentLimits::configure(DynamicObject& cfg)
+{
+   configureLimits(cfg, mDefaults);
+   if(cfg->hasMember("resources"))
+   {
+      // resources inherit any default they don't override
+      mResources.clear();
+      DynamicObjectIterator i = cfg["resources"].getIterator();
+      while(i->hasNext())
+      {
+         DynamicObject& next = i->next();
+         Limits limits = mDefaults;
+         configureLimits(next, limits);
+         mResources[i->getName()] = limits;
+      }
+   }
+}
+
+void ContentLimits::getLimits(const char* resource, Limits& limits)
+{
+   limits = mDefaults;
+
+   if(!mResources.empty())
+   {
+      // strip any query
+      const char* query = strchr(resource, '?');
+      string path = (query == NULL) ?
+         string(resource) : string(resource, query - resource);
+
+      // find longest configured parent path
+      bool found = false;
+      while(!found && !path.empty())
+      {
+         LimitsMap::iterator i = mResources.find(path);
+         if(i != mResources.end())
+         {
+            limits = i->second;
+            found = true;
+         }
+         else
+         {
+            string::size_type slash = path.rfind('/');
+            if(slash == string::npos || path.length() == 1)
+            {
+               path.clear();
+            }
+            else
+            {
+               path.erase((slash == 0) ? 1 : slash);
+            }
+         }
+      }
+   }
+}
+
+void ContentLimits::setTooLargeException(
+   const char* msg, const char* limit, uint64_t value)
+{
+   ExceptionRef e = new Exception(
+      msg, "bitmunk.protocol.ContentTooLarge", 413);
+   e->getDetails()[limit] = value;
+   Exception::set(e);
+}
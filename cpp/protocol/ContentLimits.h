@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_protocol_ContentLimits_H
+#define bitmunk_protocol_ContentLimits_H
+
+#include "monarch/rt/DynamicObject.h"
+
+#include <map>
+#include <string>
+
+namespace bitmunk
+{
+namespace protocol
+{
+
+/**
+ * ContentLimits are the largest bodies that BtpServices will receive into
+ * DynamicObjects, per resource. A body is limited by its (decoded) length and
+ * by how deeply its maps and arrays are nested. A body that exceeds a limit
+ * is rejected as soon as it does, without reading the rest of it, and the
+ * client is sent a 413 "Request Entity Too Large".
+ *
+ * The limits for a resource are those of its longest configured parent
+ * path, or the defaults if no parent path is configured. The defaults (16 MiB
+ * and 64 levels of nesting unless configured otherwise) therefore apply to
+ * every resource, a resource that must accept larger bodies has to be
+ * configured with higher limits or with 0 for no limit. Content received as
+ * a stream (ie: file uploads) is not limited.
+ *
+ * @author Dave Longley
+ */
+class ContentLimits
+{
+public:
+   /**
+    * The limits for a resource, 0 for no limit.
+    */
+   struct Limits
+   {
+      uint64_t maxLength;
+      int maxDepth;
+   };
+
+protected:
+   /**
+    * The default limits.
+    */
+   Limits mDefaults;
+
+   /**
+    * The limits for configured resources.
+    */
+   typedef std::map<std::string, Limits> LimitsMap;
+   LimitsMap mResources;
+
+public:
+   /**
+    * Creates new ContentLimits with the default limits.
+    */
+   ContentLimits();
+
+   /**
+    * Destructs these ContentLimits.
+    */
+   virtual ~ContentLimits();
+
+   /**
+    * Configures these limits.
+    *
+    * @param cfg the configuration with optional "maxLength" and "maxDepth"
+    *            defaults and an optional "resources" map of full resource
+    *            paths to objects with "maxLength" and/or "maxDepth".
+    */
+   virtual void configure(monarch::rt::DynamicObject& cfg);
+
+   /**
+    * Gets the limits for a resource.
+    *
+    * @param resource the normalized resource, which may include a query.
+    * @param limits to be set to the limits.
+    */
+   virtual void getLimits(const char* resource, Limits& limits);
+
+   /**
+    * Sets an exception for content that exceeds a limit.
+    *
+    * @param msg the exception message.
+    * @param limit the name of the limit that was exceeded.
+    * @param value the value of the limit.
+    */
+   static void setTooLargeException(
+      const char* msg, const char* limit, uint64_t value);
+};
+
+} // end namespace protocol
+} // end namespace bitmunk
+#endif
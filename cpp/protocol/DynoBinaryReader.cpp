@@ -0,0 +1,356 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/protocol/DynoBinaryReader.h"
+
+#include "bitmunk/protocol/ContentLimits.h"
+#include "bitmunk/protocol/DynoBinaryWriter.h"
+#include "monarch/rt/Exception.h"
+
+#include <cstring>
+
+using namespace std;
+using namespace monarch::io;
+using namespace monarch::rt;
+using namespace bitmunk::protocol;
+
+// the size of the chunks to read input in
+#define READ_SIZE 4096
+
+// the largest string length accepted
+#define MAX_STRING_LENGTH 0x7fffffff
+
+DynoBinaryReader::DynoBinaryReader() :
+   mDynamicObject(NULL),
+   mBuffer(READ_SIZE * 2),
+   mHeaderRead(false),
+   mDone(false),
+   mMaxDepth(0)
+{
+}
+
+DynoBinaryReader::~DynoBinaryReader()
+{
+}
+
+void DynoBinaryReader::start(DynamicObject& dyno)
+{
+   mDynamicObject = dyno;
+   mStack.clear();
+   mBuffer.clear();
+   mHeaderRead = false;
+   mDone = false;
+}
+
+bool DynoBinaryReader::read(InputStream* is)
+{
+   bool rval = true;
+
+   char b[READ_SIZE];
+   int num = 0;
+   while(rval && (num = is->read(b, READ_SIZE)) > 0)
+   {
+      mBuffer.put(b, num, true);
+      rval = parse();
+   }
+
+   return rval && num == 0;
+}
+
+bool DynoBinaryReader::finish()
+{
+   bool rval = mDone;
+
+   if(!rval)
+   {
+      setFormatException("Incomplete binary DynamicObject.");
+   }
+
+   mDynamicObject.setNull();
+   mStack.clear();
+   mBuffer.clear();
+
+   return rval;
+}
+
+void DynoBinaryReader::setMaxDepth(int depth)
+{
+   mMaxDepth = depth;
+}
+
+bool DynoBinaryReader::parse()
+{
+   int rval = 1;
+
+   const unsigned char* b = (const unsigned char*)mBuffer.data();
+   int length = mBuffer.length();
+   int pos = 0;
+
+   // check magic header
+   if(!mHeaderRead && length >= 4)
+   {
+      if(memcmp(b, DynoBinaryWriter::sMagic, 4) != 0)
+      {
+         setFormatException("Invalid binary DynamicObject header.");
+         rval = -1;
+      }
+      else
+      {
+         pos = 4;
+         mHeaderRead = true;
+      }
+   }
+
+   while(rval == 1 && mHeaderRead && pos < length)
+   {
+      if(mDone)
+      {
+         setFormatException("Trailing data after binary DynamicObject.");
+         rval = -1;
+      }
+      else
+      {
+         // map members are preceded by their keys
+         bool isMap = !mStack.empty() && mStack.back().dyno->getType() == Map;
+         int start = pos;
+         string key;
+         DynamicObject value(NULL);
+         uint64_t count = 0;
+         rval = isMap ? parseString(b, length, pos, key) : 1;
+         if(rval == 1)
+         {
+            rval = parseValue(b, length, pos, value, count);
+         }
+
+         if(rval == 0)
+         {
+            // wait for the rest of the value
+            pos = start;
+         }
+         else if(rval == 1 && mMaxDepth > 0 && !value.isNull() &&
+            (value->getType() == Map || value->getType() == Array) &&
+            (int)mStack.size() >= mMaxDepth)
+         {
+            ContentLimits::setTooLargeException(
+               "Content is nested too deeply.", "maxDepth", mMaxDepth);
+            rval = -1;
+         }
+         else if(rval == 1 && mStack.empty())
+         {
+            // the top-level value must be a map or an array
+            if(value.isNull() ||
+               (value->getType() != Map && value->getType() != Array))
+            {
+               setFormatException(
+                  "Binary DynamicObject must be a Map or an Array.");
+               rval = -1;
+            }
+            else
+            {
+               mDynamicObject->setType(value->getType());
+               mDynamicObject->clear();
+               value = mDynamicObject;
+            }
+         }
+         else if(rval == 1)
+         {
+            // add value to its container
+            Container& c = mStack.back();
+            if(isMap)
+            {
+               c.dyno[key.c_str()] = value;
+            }
+            else
+            {
+               c.dyno->append() = value;
+            }
+            --c.remaining;
+         }
+
+         if(rval == 1)
+         {
+            // read members of a non-empty map or array next
+            if(count > 0)
+            {
+               Container c;
+               c.dyno = value;
+               c.remaining = count;
+               mStack.push_back(c);
+            }
+
+            // finish completed maps and arrays
+            while(!mStack.empty() && mStack.back().remaining == 0)
+            {
+               mStack.pop_back();
+            }
+            mDone = mStack.empty();
+         }
+      }
+   }
+
+   // discard parsed input
+   mBuffer.clear(pos);
+
+   return rval != -1;
+}
+
+int DynoBinaryReader::parseValue(
+   const unsigned char* b, int length, int& pos,
+   DynamicObject& value, uint64_t& count)
+{
+   int rval = 0;
+
+   if(pos < length)
+   {
+      int p = pos + 1;
+      uint64_t v;
+      switch(b[pos])
+      {
+         case DynoBinaryWriter::TagNull:
+            value.setNull();
+            rval = 1;
+            break;
+         case DynoBinaryWriter::TagFalse:
+         case DynoBinaryWriter::TagTrue:
+            value = DynamicObject();
+            value = (b[pos] == DynoBinaryWriter::TagTrue);
+            rval = 1;
+            break;
+         case DynoBinaryWriter::TagInt32:
+            if((rval = parseVarint(b, length, p, v)) == 1)
+            {
+               value = DynamicObject();
+               value = (int32_t)((uint32_t)(v >> 1) ^ -(uint32_t)(v & 1));
+            }
+            break;
+         case DynoBinaryWriter::TagUInt32:
+            if((rval = parseVarint(b, length, p, v)) == 1)
+            {
+               value = DynamicObject();
+               value = (uint32_t)v;
+            }
+            break;
+         case DynoBinaryWriter::TagInt64:
+            if((rval = parseVarint(b, length, p, v)) == 1)
+            {
+               value = DynamicObject();
+               value = (int64_t)((v >> 1) ^ -(v & 1));
+            }
+            break;
+         case DynoBinaryWriter::TagUInt64:
+            if((rval = parseVarint(b, length, p, v)) == 1)
+            {
+               value = DynamicObject();
+               value = v;
+            }
+            break;
+         case DynoBinaryWriter::TagDouble:
+            if(length - p >= 8)
+            {
+               uint64_t bits = 0;
+               for(int i = 0; i < 8; ++i)
+               {
+                  bits |= (uint64_t)b[p + i] << (i * 8);
+               }
+               double d;
+               memcpy(&d, &bits, 8);
+               p += 8;
+               value = DynamicObject();
+               value = d;
+               rval = 1;
+            }
+            break;
+         case DynoBinaryWriter::TagString:
+         {
+            string str;
+            if((rval = parseString(b, length, p, str)) == 1)
+            {
+               value = DynamicObject();
+               value = str.c_str();
+            }
+            break;
+         }
+         case DynoBinaryWriter::TagMap:
+         case DynoBinaryWriter::TagArray:
+            if((rval = parseVarint(b, length, p, count)) == 1)
+            {
+               value = DynamicObject();
+               value->setType(
+                  (b[pos] == DynoBinaryWriter::TagMap) ? Map : Array);
+            }
+            break;
+         default:
+            setFormatException("Invalid binary DynamicObject value tag.");
+            rval = -1;
+            break;
+      }
+
+      if(rval == 1)
+      {
+         pos = p;
+      }
+   }
+
+   return rval;
+}
+
+int DynoBinaryReader::parseVarint(
+   const unsigned char* b, int length, int& pos, uint64_t& value)
+{
+   int rval = 0;
+
+   value = 0;
+   for(int i = 0; rval == 0 && pos + i < length; ++i)
+   {
+      if(i == 10)
+      {
+         setFormatException("Invalid binary DynamicObject varint.");
+         rval = -1;
+      }
+      else
+      {
+         value |= (uint64_t)(b[pos + i] & 0x7f) << (i * 7);
+         if((b[pos + i] & 0x80) == 0)
+         {
+            pos += i + 1;
+            rval = 1;
+         }
+      }
+   }
+
+   return rval;
+}
+
+int DynoBinaryReader::parseString(
+   const unsigned char* b, int length, int& pos, string& str)
+{
+   int p = pos;
+   uint64_t len;
+   int rval = parseVarint(b, length, p, len);
+   if(rval == 1)
+   {
+      if(len > MAX_STRING_LENGTH)
+      {
+         setFormatException("Invalid binary DynamicObject string length.");
+         rval = -1;
+      }
+      else if((uint64_t)(length - p) < len)
+      {
+         // wait for the rest of the string
+         rval = 0;
+      }
+      else
+      {
+         str.assign((const char*)b + p, len);
+         pos = p + len;
+      }
+   }
+
+   return rval;
+}
+
+void DynoBinaryReader::setFormatException(const char* msg)
+{
+   ExceptionRef e = new Exception(msg, "bitmunk.protocol.InvalidBinaryFormat");
+   Exception::set(e);
+}
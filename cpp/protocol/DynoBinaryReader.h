@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_protocol_DynoBinaryReader_H
+#define bitmunk_protocol_DynoBinaryReader_H
+
+#include "monarch/data/DynamicObjectReader.h"
+#include "monarch/io/ByteBuffer.h"
+
+#include <string>
+#include <vector>
+
+namespace bitmunk
+{
+namespace protocol
+{
+
+/**
+ * A DynoBinaryReader reads a DynamicObject that was written in the binary
+ * format produced by a DynoBinaryWriter.
+ *
+ * Input may be passed to read() in arbitrarily sized pieces. Complete values
+ * are added to the DynamicObject as soon as they arrive, so only a partial
+ * value (at most one string) is ever buffered.
+ *
+ * @author Dave Longley
+ */
+class DynoBinaryReader : public monarch::data::DynamicObjectReader
+{
+protected:
+   /**
+    * A Map or Array that is being read.
+    */
+   struct Container
+   {
+      monarch::rt::DynamicObject dyno;
+      uint64_t remaining;
+   };
+   typedef std::vector<Container> ContainerStack;
+
+   /**
+    * The Maps and Arrays being read, innermost last.
+    */
+   ContainerStack mStack;
+
+   /**
+    * The DynamicObject to populate.
+    */
+   monarch::rt::DynamicObject mDynamicObject;
+
+   /**
+    * Buffered input that has not been parsed yet.
+    */
+   monarch::io::ByteBuffer mBuffer;
+
+   /**
+    * True once the magic header has been read.
+    */
+   bool mHeaderRead;
+
+   /**
+    * True once the top-level value has been read.
+    */
+   bool mDone;
+
+   /**
+    * The maximum nesting depth of Maps and Arrays, 0 for no limit.
+    */
+   int mMaxDepth;
+
+public:
+   /**
+    * Creates a new DynoBinaryReader.
+    */
+   DynoBinaryReader();
+
+   /**
+    * Destructs this DynoBinaryReader.
+    */
+   virtual ~DynoBinaryReader();
+
+   /**
+    * Starts reading into a DynamicObject.
+    *
+    * @param dyno the DynamicObject to populate.
+    */
+   virtual void start(monarch::rt::DynamicObject& dyno);
+
+   /**
+    * Reads more input from an InputStream.
+    *
+    * @param is the InputStream to read from.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool read(monarch::io::InputStream* is);
+
+   /**
+    * Finishes reading, ensuring the whole DynamicObject was read.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool finish();
+
+   /**
+    * Sets the maximum nesting depth of Maps and Arrays. Input that is nested
+    * more deeply causes a "bitmunk.protocol.ContentTooLarge" exception.
+    *
+    * @param depth the maximum depth, 0 for no limit.
+    */
+   virtual void setMaxDepth(int depth);
+
+protected:
+   /**
+    * Parses as many complete values from the buffer as possible.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool parse();
+
+   /**
+    * Parses the next value, if it is complete. For a Map or Array, only its
+    * tag and count are parsed, its members follow as separate values.
+    *
+    * @param b the buffered input.
+    * @param length the length of the buffered input.
+    * @param pos the position to parse at, to be advanced past the value.
+    * @param value to be set to the new value.
+    * @param count to be set to the number of members of a Map or Array.
+    *
+    * @return 1 if parsed, 0 if more input is needed, -1 if an exception
+    *         occurred.
+    */
+   virtual int parseValue(
+      const unsigned char* b, int length, int& pos,
+      monarch::rt::DynamicObject& value, uint64_t& count);
+
+   /**
+    * Parses a varint.
+    *
+    * @param b the buffered input.
+    * @param length the length of the buffered input.
+    * @param pos the position to parse at, to be advanced past the varint.
+    * @param value to be set to the varint.
+    *
+    * @return 1 if parsed, 0 if more input is needed, -1 if an exception
+    *         occurred.
+    */
+   virtual int parseVarint(
+      const unsigned char* b, int length, int& pos, uint64_t& value);
+
+   /**
+    * Parses a length-prefixed string.
+    *
+    * @param b the buffered input.
+    * @param length the length of the buffered input.
+    * @param pos the position to parse at, to be advanced past the string.
+    * @param str to be set to the string.
+    *
+    * @return 1 if parsed, 0 if more input is needed, -1 if an exception
+    *         occurred.
+    */
+   virtual int parseString(
+      const unsigned char* b, int length, int& pos, std::string& str);
+
+   /**
+    * Sets an exception for invalid input.
+    *
+    * @param msg the exception message.
+    */
+   virtual void setFormatException(const char* msg);
+};
+
+} // end namespace protocol
+} // end namespace bitmunk
+#endif
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/protocol/DynoBinaryWriter.h"
+
+#include <cstring>
+
+using namespace std;
+using namespace monarch::io;
+using namespace monarch::rt;
+using namespace bitmunk::protocol;
+
+// the number of buffered bytes that causes a flush
+#define FLUSH_SIZE 4096
+
+const char* DynoBinaryWriter::sContentType = "application/x-bitmunk-dyno";
+const char DynoBinaryWriter::sMagic[4] = {'B', 'D', 'O', 1};
+
+DynoBinaryWriter::DynoBinaryWriter() :
+   mBuffer(FLUSH_SIZE * 2),
+   mOutputStream(NULL)
+{
+}
+
+DynoBinaryWriter::~DynoBinaryWriter()
+{
+}
+
+bool DynoBinaryWriter::write(DynamicObject& dyno, OutputStream* os)
+{
+   bool rval;
+
+   mOutputStream = os;
+   mBuffer.clear();
+   mBuffer.put(sMagic, 4, true);
+   rval = writeValue(dyno) && flush(true);
+   mOutputStream = NULL;
+
+   return rval;
+}
+
+void DynoBinaryWriter::setCompact(bool compact)
+{
+   // always compact
+}
+
+bool DynoBinaryWriter::writeValue(DynamicObject& dyno)
+{
+   bool rval = true;
+
+   if(dyno.isNull())
+   {
+      mBuffer.putByte(TagNull, 1, true);
+   }
+   else
+   {
+      switch(dyno->getType())
+      {
+         case Boolean:
+            mBuffer.putByte(dyno->getBoolean() ? TagTrue : TagFalse, 1, true);
+            break;
+         case Int32:
+         {
+            int32_t v = dyno->getInt32();
+            mBuffer.putByte(TagInt32, 1, true);
+            writeVarint(((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+            break;
+         }
+         case UInt32:
+            mBuffer.putByte(TagUInt32, 1, true);
+            writeVarint(dyno->getUInt32());
+            break;
+         case Int64:
+         {
+            int64_t v = dyno->getInt64();
+            mBuffer.putByte(TagInt64, 1, true);
+            writeVarint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+            break;
+         }
+         case UInt64:
+            mBuffer.putByte(TagUInt64, 1, true);
+            writeVarint(dyno->getUInt64());
+            break;
+         case Double:
+         {
+            double d = dyno->getDouble();
+            uint64_t bits;
+            memcpy(&bits, &d, 8);
+            char b[8];
+            for(int i = 0; i < 8; ++i)
+            {
+               b[i] = (char)(bits >> (i * 8));
+            }
+            mBuffer.putByte(TagDouble, 1, true);
+            mBuffer.put(b, 8, true);
+            break;
+         }
+         case String:
+            mBuffer.putByte(TagString, 1, true);
+            writeString(dyno->getString());
+            break;
+         case Map:
+         {
+            mBuffer.putByte(TagMap, 1, true);
+            writeVarint(dyno->length());
+            DynamicObjectIterator i = dyno.getIterator();
+            while(rval && i->hasNext())
+            {
+               DynamicObject& next = i->next();
+               writeString(i->getName());
+               rval = writeValue(next);
+            }
+            break;
+         }
+         case Array:
+         {
+            mBuffer.putByte(TagArray, 1, true);
+            writeVarint(dyno->length());
+            DynamicObjectIterator i = dyno.getIterator();
+            while(rval && i->hasNext())
+            {
+               rval = writeValue(i->next());
+            }
+            break;
+         }
+      }
+   }
+
+   return rval && flush(false);
+}
+
+void DynoBinaryWriter::writeVarint(uint64_t value)
+{
+   char b[10];
+   int length = 0;
+   do
+   {
+      b[length] = (char)(value & 0x7f);
+      value >>= 7;
+      if(value != 0)
+      {
+         b[length] |= 0x80;
+      }
+      ++length;
+   }
+   while(value != 0);
+   mBuffer.put(b, length, true);
+}
+
+void DynoBinaryWriter::writeString(const char* str)
+{
+   int length = strlen(str);
+   writeVarint(length);
+   mBuffer.put(str, length, true);
+}
+
+bool DynoBinaryWriter::flush(bool force)
+{
+   bool rval = true;
+
+   if(mBuffer.length() >= FLUSH_SIZE || (force && !mBuffer.isEmpty()))
+   {
+      rval = mOutputStream->write(mBuffer.data(), mBuffer.length());
+      mBuffer.clear();
+   }
+
+   return rval;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_protocol_DynoBinaryWriter_H
+#define bitmunk_protocol_DynoBinaryWriter_H
+
+#include "monarch/data/DynamicObjectWriter.h"
+#include "monarch/io/ByteBuffer.h"
+
+namespace bitmunk
+{
+namespace protocol
+{
+
+/**
+ * A DynoBinaryWriter writes a DynamicObject out in a compact binary format
+ * that is faster to produce and parse than JSON. It is used by BtpMessages
+ * that are exchanged with peers that accept the binary content-type.
+ *
+ * The format starts with the 4 byte magic "BDO" followed by the version
+ * (1). It is followed by a single value, where each value is a tag byte and
+ * a payload:
+ *
+ * Null, False, True: no payload.
+ * Int32, Int64: a zig-zag encoded varint.
+ * UInt32, UInt64: a varint.
+ * Double: 8 bytes, IEEE 754, little-endian.
+ * String: a varint length followed by the bytes of the string.
+ * Map: a varint count followed by count key/value pairs, where each key is
+ *      encoded like a String payload (without a tag).
+ * Array: a varint count followed by count values.
+ *
+ * Varints are unsigned LEB128 (7 bits per byte, least significant first).
+ *
+ * @author Dave Longley
+ */
+class DynoBinaryWriter : public monarch::data::DynamicObjectWriter
+{
+public:
+   /**
+    * The content-type for the binary format.
+    */
+   static const char* sContentType;
+
+   /**
+    * The value tags.
+    */
+   enum Tag
+   {
+      TagNull = 0, TagFalse, TagTrue, TagInt32, TagUInt32, TagInt64,
+      TagUInt64, TagDouble, TagString, TagMap, TagArray
+   };
+
+   /**
+    * The magic header, including the version.
+    */
+   static const char sMagic[4];
+
+protected:
+   /**
+    * A buffer for output, flushed to the output stream as it fills up.
+    */
+   monarch::io::ByteBuffer mBuffer;
+
+   /**
+    * The current output stream.
+    */
+   monarch::io::OutputStream* mOutputStream;
+
+public:
+   /**
+    * Creates a new DynoBinaryWriter.
+    */
+   DynoBinaryWriter();
+
+   /**
+    * Destructs this DynoBinaryWriter.
+    */
+   virtual ~DynoBinaryWriter();
+
+   /**
+    * Writes a DynamicObject to an OutputStream.
+    *
+    * @param dyno the DynamicObject to write.
+    * @param os the OutputStream to write to.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool write(
+      monarch::rt::DynamicObject& dyno, monarch::io::OutputStream* os);
+
+   /**
+    * Does nothing, the binary format is always compact.
+    *
+    * @param compact ignored.
+    */
+   virtual void setCompact(bool compact);
+
+protected:
+   /**
+    * Writes a value to the buffer, flushing it as it fills up.
+    *
+    * @param dyno the value to write.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool writeValue(monarch::rt::DynamicObject& dyno);
+
+   /**
+    * Writes a varint to the buffer.
+    *
+    * @param value the value to write.
+    */
+   virtual void writeVarint(uint64_t value);
+
+   /**
+    * Writes a length-prefixed string to the buffer.
+    *
+    * @param str the string to write.
+    */
+   virtual void writeString(const char* str);
+
+   /**
+    * Flushes the buffer to the output stream if it is full enough.
+    *
+    * @param force true to flush any buffered bytes.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool flush(bool force);
+};
+
+} // end namespace protocol
+} // end namespace bitmunk
+#endif
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/protocol/DynoElementOutputStream.h"
+
+#include "monarch/data/json/JsonReader.h"
+#include "monarch/io/ByteArrayInputStream.h"
+#include "monarch/rt/Exception.h"
+
+#include <cctype>
+
+using namespace monarch::data::json;
+using namespace monarch::io;
+using namespace monarch::rt;
+using namespace bitmunk::protocol;
+
+DynoElementOutputStream::DynoElementOutputStream(DynoElementHandler* handler) :
+   mHandler(handler),
+   mElement(1024),
+   mDepth(0),
+   mStarted(false),
+   mDone(false),
+   mInString(false),
+   mEscape(false),
+   mCount(0)
+{
+}
+
+DynoElementOutputStream::~DynoElementOutputStream()
+{
+}
+
+bool DynoElementOutputStream::write(const char* b, int length)
+{
+   bool rval = true;
+
+   for(int i = 0; rval && i < length; ++i)
+   {
+      char c = b[i];
+      if(mInString)
+      {
+         // copy string, watching for its end
+         mElement.putByte(c, 1, true);
+         if(mEscape)
+         {
+            mEscape = false;
+         }
+         else if(c == '\\')
+         {
+            mEscape = true;
+         }
+         else if(c == '"')
+         {
+            mInString = false;
+         }
+      }
+      else if(mDepth == 0)
+      {
+         // only whitespace may surround the top-level array
+         if(c == '[' && !mStarted)
+         {
+            mStarted = true;
+            mDepth = 1;
+            mElement.clear();
+            mElement.putByte('[', 1, true);
+         }
+         else if(!isspace(c))
+         {
+            setFormatException(mDone ?
+               "Trailing data after JSON array." :
+               "Content is not a JSON array.");
+            rval = false;
+         }
+      }
+      else if(mDepth == 1 && (c == ',' || c == ']'))
+      {
+         // element complete
+         rval = handleElement(c == ']');
+         if(c == ']')
+         {
+            mDepth = 0;
+            mDone = true;
+         }
+      }
+      else if(mDepth > 1 || !isspace(c))
+      {
+         // copy element, tracking nesting
+         mElement.putByte(c, 1, true);
+         if(c == '"')
+         {
+            mInString = true;
+         }
+         else if(c == '{' || c == '[')
+         {
+            ++mDepth;
+         }
+         else if(c == '}' || c == ']')
+         {
+            --mDepth;
+         }
+      }
+   }
+
+   return rval;
+}
+
+bool DynoElementOutputStream::finish()
+{
+   bool rval = mDone;
+
+   if(!rval)
+   {
+      setFormatException("Incomplete JSON array.");
+   }
+
+   return rval;
+}
+
+uint32_t DynoElementOutputStream::getCount()
+{
+   return mCount;
+}
+
+bool DynoElementOutputStream::handleElement(bool end)
+{
+   bool rval = true;
+
+   // "[" alone means there was no element, which is only valid for an
+   // empty array (ie: not "[1,,2]" or "[1,]")
+   if(mElement.length() == 1)
+   {
+      if(!end || mCount > 0)
+      {
+         setFormatException("Empty JSON array element.");
+         rval = false;
+      }
+   }
+   else
+   {
+      // parse element as a single-element array
+      mElement.putByte(']', 1, true);
+      DynamicObject array;
+      JsonReader reader;
+      ByteArrayInputStream bais(&mElement);
+      reader.start(array);
+      rval = reader.read(&bais) && reader.finish();
+      if(rval && array->length() != 1)
+      {
+         setFormatException("Invalid JSON array element.");
+         rval = false;
+      }
+      if(rval)
+      {
+         ++mCount;
+         rval = mHandler->handleElement(array[0]);
+      }
+   }
+
+   // reset for next element
+   mElement.clear();
+   mElement.putByte('[', 1, true);
+
+   return rval;
+}
+
+void DynoElementOutputStream::setFormatException(const char* msg)
+{
+   ExceptionRef e = new Exception(msg, "bitmunk.protocol.InvalidJsonArray");
+   Exception::set(e);
+}
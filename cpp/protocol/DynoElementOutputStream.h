@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_protocol_DynoElementOutputStream_H
+#define bitmunk_protocol_DynoElementOutputStream_H
+
+#include "monarch/io/ByteBuffer.h"
+#include "monarch/io/OutputStream.h"
+#include "monarch/rt/DynamicObject.h"
+
+namespace bitmunk
+{
+namespace protocol
+{
+
+/**
+ * A DynoElementHandler handles the elements of an array one at a time as
+ * they are received.
+ *
+ * @author Dave Longley
+ */
+class DynoElementHandler
+{
+public:
+   /**
+    * Destructs this DynoElementHandler.
+    */
+   virtual ~DynoElementHandler() {};
+
+   /**
+    * Handles the next element of an array.
+    *
+    * @param element the element.
+    *
+    * @return true to continue, false to stop with an exception set.
+    */
+   virtual bool handleElement(monarch::rt::DynamicObject& element) = 0;
+};
+
+/**
+ * A DynoElementOutputStream parses a top-level JSON array that is written to
+ * it and passes each element to a DynoElementHandler as soon as the element
+ * is complete. Only the element being written is buffered, so an array of
+ * any length is handled in memory bound by its largest element.
+ *
+ * @author Dave Longley
+ */
+class DynoElementOutputStream : public monarch::io::OutputStream
+{
+protected:
+   /**
+    * The handler for elements.
+    */
+   DynoElementHandler* mHandler;
+
+   /**
+    * The JSON of the element being written, as a single-element array.
+    */
+   monarch::io::ByteBuffer mElement;
+
+   /**
+    * The nesting depth, 1 inside the top-level array.
+    */
+   int mDepth;
+
+   /**
+    * True once the top-level array has started.
+    */
+   bool mStarted;
+
+   /**
+    * True once the top-level array has ended.
+    */
+   bool mDone;
+
+   /**
+    * True while inside a string.
+    */
+   bool mInString;
+
+   /**
+    * True if the last string character was an escape.
+    */
+   bool mEscape;
+
+   /**
+    * The number of elements handled.
+    */
+   uint32_t mCount;
+
+public:
+   /**
+    * Creates a new DynoElementOutputStream.
+    *
+    * @param handler the handler for elements.
+    */
+   DynoElementOutputStream(DynoElementHandler* handler);
+
+   /**
+    * Destructs this DynoElementOutputStream.
+    */
+   virtual ~DynoElementOutputStream();
+
+   /**
+    * Writes some JSON, handling any elements it completes.
+    *
+    * @param b the array of bytes to write.
+    * @param length the number of bytes to write to the stream.
+    *
+    * @return true if successful, false if the JSON is not an array, could
+    *         not be parsed, or the handler stopped.
+    */
+   virtual bool write(const char* b, int length);
+
+   /**
+    * Ensures the whole top-level array was written.
+    *
+    * @return true if the array was complete, false if not.
+    */
+   virtual bool finish();
+
+   /**
+    * Gets the number of elements handled.
+    *
+    * @return the number of elements handled.
+    */
+   virtual uint32_t getCount();
+
+protected:
+   /**
+    * Parses and handles the buffered element, if any. There may only be no
+    * element at the end of an empty array.
+    *
+    * @param end true if the element ends the array, false if not.
+    *
+    * @return true if successful, false if not.
+    */
+   virtual bool handleElement(bool end);
+
+   /**
+    * Sets an exception for content that is not a valid JSON array.
+    *
+    * @param msg the exception message.
+    */
+   virtual void setFormatException(const char* msg);
+};
+
+} // end namespace protocol
+} // end namespace bitmunk
+#endif
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/protocol/HttpRange.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace std;
+using namespace monarch::http;
+using namespace bitmunk::protocol;
+
+int HttpRange::getStatus(
+   HttpRequestHeader* header, const char* etag,
+   uint64_t length, uint64_t& start, uint64_t& end)
+{
+   int rval = 200;
+
+   // send the whole content by default
+   start = 0;
+   end = (length > 0) ? length - 1 : 0;
+
+   string value;
+   string ifRange;
+   if(header->getField("If-None-Match", value) &&
+      matchesETag(value.c_str(), etag))
+   {
+      // client already has the content
+      rval = 304;
+   }
+   // only honor a range if the client's copy is still current
+   else if(header->getField("Range", value) &&
+      (!header->getField("If-Range", ifRange) ||
+       strcmp(ifRange.c_str(), etag) == 0))
+   {
+      switch(parseRange(value.c_str(), length, start, end))
+      {
+         case 1:
+            rval = 206;
+            break;
+         case -1:
+            rval = 416;
+            break;
+         default:
+            start = 0;
+            end = (length > 0) ? length - 1 : 0;
+            break;
+      }
+   }
+
+   return rval;
+}
+
+bool HttpRange::matchesETag(const char* value, const char* etag)
+{
+   return (strcmp(value, "*") == 0) || (strstr(value, etag) != NULL);
+}
+
+int HttpRange::parseRange(
+   const char* value, uint64_t length, uint64_t& start, uint64_t& end)
+{
+   int rval = 0;
+
+   if(strncmp(value, "bytes=", 6) == 0 && strchr(value, ',') == NULL)
+   {
+      const char* first = value + 6;
+      const char* dash = strchr(first, '-');
+      char* tail;
+      if(dash == NULL || (dash[1] != 0 && !isdigit(dash[1])))
+      {
+         // invalid range
+      }
+      else if(dash == first)
+      {
+         // the last n bytes
+         uint64_t n = strtoull(dash + 1, &tail, 10);
+         if(tail != dash + 1 && *tail == 0)
+         {
+            rval = (n > 0 && length > 0) ? 1 : -1;
+            start = (n < length) ? length - n : 0;
+            end = length - 1;
+         }
+      }
+      else if(isdigit(first[0]))
+      {
+         start = strtoull(first, &tail, 10);
+         end = (length > 0) ? length - 1 : 0;
+         if(tail == dash && dash[1] == 0)
+         {
+            // from start to the end of the content
+            rval = (start < length) ? 1 : -1;
+         }
+         else if(tail == dash)
+         {
+            uint64_t last = strtoull(dash + 1, &tail, 10);
+            if(*tail == 0 && last >= start)
+            {
+               rval = (start < length) ? 1 : -1;
+               end = (last < end) ? last : end;
+            }
+         }
+      }
+   }
+
+   return rval;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_protocol_HttpRange_H
+#define bitmunk_protocol_HttpRange_H
+
+#include "monarch/http/HttpRequestHeader.h"
+
+namespace bitmunk
+{
+namespace protocol
+{
+
+/**
+ * HttpRange decides how to respond to a conditional or byte range request
+ * for content that is fully known (its length and strong ETag), such as a
+ * rendered sample.
+ *
+ * A client whose If-None-Match matches the ETag already has the content. A
+ * request for a single byte range is sent that range, unless its If-Range
+ * names an older version of the content. Multiple ranges are not supported,
+ * so they are ignored like any other invalid Range.
+ *
+ * @author Dave Longley
+ */
+class HttpRange
+{
+public:
+   /**
+    * Gets the status to respond to a request with and the range of the
+    * content to send.
+    *
+    * @param header the request header.
+    * @param etag the quoted ETag of the content.
+    * @param length the length of the content.
+    * @param start to be set to the first byte to send.
+    * @param end to be set to the last byte to send.
+    *
+    * @return 304 if the client has the content, 206 if a range is to be
+    *         sent, 416 if the range is not satisfiable, otherwise 200.
+    */
+   static int getStatus(
+      monarch::http::HttpRequestHeader* header, const char* etag,
+      uint64_t length, uint64_t& start, uint64_t& end);
+
+   /**
+    * Checks an If-None-Match header value against an ETag.
+    *
+    * @param value the header value, "*" or a list of ETags.
+    * @param etag the quoted ETag.
+    *
+    * @return true if the ETag matches, false if not.
+    */
+   static bool matchesETag(const char* value, const char* etag);
+
+   /**
+    * Parses a Range header value with a single byte range.
+    *
+    * @param value the header value (ie: "bytes=0-499", "bytes=500-" or
+    *              "bytes=-500").
+    * @param length the length of the content.
+    * @param start to be set to the first byte in the range.
+    * @param end to be set to the last byte in the range.
+    *
+    * @return 1 if the range is satisfiable, -1 if it is not, 0 if the value
+    *         is invalid and must be ignored.
+    */
+   static int parseRange(
+      const char* value, uint64_t length, uint64_t& start, uint64_t& end);
+};
+
+} // end namespace protocol
+} // end namespace bitmunk
+#endif
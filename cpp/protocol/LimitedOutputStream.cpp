@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/protocol/LimitedOutputStream.h"
+
+#include "bitmunk/protocol/ContentLimits.h"
+
+using namespace monarch::io;
+using namespace bitmunk::protocol;
+
+LimitedOutputStream::LimitedOutputStream(
+   OutputStream* os, bool cleanup, uint64_t maxLength, int maxDepth) :
+   FilterOutputStream(os, cleanup),
+   mMaxLength(maxLength),
+   mMaxDepth(maxDepth),
+   mLength(0),
+   mDepth(0),
+   mInString(false),
+   mEscape(false)
+{
+}
+
+LimitedOutputStream::~LimitedOutputStream()
+{
+}
+
+bool LimitedOutputStream::write(const char* b, int length)
+{
+   bool rval = true;
+
+   mLength += length;
+   if(mMaxLength > 0 && mLength > mMaxLength)
+   {
+      ContentLimits::setTooLargeException(
+         "Content is too large.", "maxLength", mMaxLength);
+      rval = false;
+   }
+   else if(mMaxDepth > 0)
+   {
+      // track nesting outside of strings
+      for(int i = 0; rval && i < length; ++i)
+      {
+         if(mInString)
+         {
+            if(mEscape)
+            {
+               mEscape = false;
+            }
+            else if(b[i] == '\\')
+            {
+               mEscape = true;
+            }
+            else if(b[i] == '"')
+            {
+               mInString = false;
+            }
+         }
+         else if(b[i] == '"')
+         {
+            mInString = true;
+         }
+         else if(b[i] == '{' || b[i] == '[')
+         {
+            if(++mDepth > mMaxDepth)
+            {
+               ContentLimits::setTooLargeException(
+                  "Content is nested too deeply.", "maxDepth", mMaxDepth);
+               rval = false;
+            }
+         }
+         else if(b[i] == '}' || b[i] == ']')
+         {
+            --mDepth;
+         }
+      }
+   }
+
+   return rval && mOutputStream->write(b, length);
+}
+
+uint64_t LimitedOutputStream::getLength()
+{
+   return mLength;
+}
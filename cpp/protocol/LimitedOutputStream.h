@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_protocol_LimitedOutputStream_H
+#define bitmunk_protocol_LimitedOutputStream_H
+
+#include "monarch/io/FilterOutputStream.h"
+
+namespace bitmunk
+{
+namespace protocol
+{
+
+/**
+ * A LimitedOutputStream fails as soon as more than a maximum number of bytes
+ * is written to it or, for JSON, as soon as maps and arrays are nested more
+ * deeply than a maximum depth. Nesting is tracked with a scan of the bytes
+ * as they pass through, so it is detected before the JSON is parsed.
+ *
+ * The exception set is a "bitmunk.protocol.ContentTooLarge" with code 413.
+ *
+ * @author Dave Longley
+ */
+class LimitedOutputStream : public monarch::io::FilterOutputStream
+{
+protected:
+   /**
+    * The maximum number of bytes, 0 for no limit.
+    */
+   uint64_t mMaxLength;
+
+   /**
+    * The maximum JSON nesting depth, 0 for no limit.
+    */
+   int mMaxDepth;
+
+   /**
+    * The number of bytes written so far.
+    */
+   uint64_t mLength;
+
+   /**
+    * The current JSON nesting depth.
+    */
+   int mDepth;
+
+   /**
+    * True while inside a JSON string.
+    */
+   bool mInString;
+
+   /**
+    * True if the last JSON string character was an escape.
+    */
+   bool mEscape;
+
+public:
+   /**
+    * Creates a new LimitedOutputStream.
+    *
+    * @param os the OutputStream to write to.
+    * @param cleanup true to clean up the OutputStream when destructing.
+    * @param maxLength the maximum number of bytes, 0 for no limit.
+    * @param maxDepth the maximum JSON nesting depth, 0 not to check the
+    *                 bytes as JSON.
+    */
+   LimitedOutputStream(
+      monarch::io::OutputStream* os, bool cleanup,
+      uint64_t maxLength, int maxDepth);
+
+   /**
+    * Destructs this LimitedOutputStream.
+    */
+   virtual ~LimitedOutputStream();
+
+   /**
+    * Writes some bytes to the stream if no limit is exceeded.
+    *
+    * @param b the array of bytes to write.
+    * @param length the number of bytes to write to the stream.
+    *
+    * @return true if the write was successful, false if a limit was
+    *         exceeded or an IO exception occurred.
+    */
+   virtual bool write(const char* b, int length);
+
+   /**
+    * Gets the number of bytes written so far.
+    *
+    * @return the number of bytes written.
+    */
+   virtual uint64_t getLength();
+};
+
+} // end namespace protocol
+} // end namespace bitmunk
+#endif
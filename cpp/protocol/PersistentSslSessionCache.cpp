@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/protocol/PersistentSslSessionCache.h"
+
+#include "monarch/data/json/JsonReader.h"
+#include "monarch/data/json/JsonWriter.h"
+#include "monarch/io/File.h"
+#include "monarch/io/FileInputStream.h"
+#include "monarch/io/FileOutputStream.h"
+#include "monarch/net/SslSession.h"
+#include "monarch/util/Convert.h"
+#include "monarch/util/StringTools.h"
+
+#include <openssl/ssl.h>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+using namespace monarch::data::json;
+using namespace monarch::io;
+using namespace monarch::net;
+using namespace monarch::rt;
+using namespace monarch::util;
+using namespace bitmunk::protocol;
+
+PersistentSslSessionCache::PersistentSslSessionCache(unsigned int capacity) :
+   SslSessionCache(capacity),
+   mCapacity(capacity),
+   mMaxPerHost(4),
+   mMaxAge(24 * 60 * 60),
+   mStored(0),
+   mHits(0),
+   mMisses(0),
+   mExpired(0),
+   mEvicted(0),
+   mLoaded(0)
+{
+}
+
+PersistentSslSessionCache::~PersistentSslSessionCache()
+{
+}
+
+void PersistentSslSessionCache::configure(DynamicObject& cfg)
+{
+   mLock.lock();
+   {
+      if(cfg->hasMember("capacity"))
+      {
+         mCapacity = cfg["capacity"]->getUInt32();
+      }
+      if(cfg->hasMember("maxPerHost"))
+      {
+         mMaxPerHost = cfg["maxPerHost"]->getUInt32();
+      }
+      if(cfg->hasMember("maxAge"))
+      {
+         mMaxAge = cfg["maxAge"]->getUInt32();
+      }
+   }
+   mLock.unlock();
+}
+
+void PersistentSslSessionCache::storeSession(
+   Url* url, SslSession& session, const char* virtualHost)
+{
+   if(mCapacity > 0 && !session.isNull())
+   {
+      uint64_t now = time(NULL);
+      Entry entry;
+      entry.session = session;
+      entry.host = url->getHost();
+      entry.stored = now;
+      entry.used = now;
+
+      mLock.lock();
+      {
+         addEntry(createKey(url, virtualHost), entry);
+         ++mStored;
+      }
+      mLock.unlock();
+   }
+}
+
+SslSession PersistentSslSessionCache::getSession(
+   Url* url, const char* virtualHost)
+{
+   SslSession rval(NULL);
+
+   uint64_t now = time(NULL);
+   mLock.lock();
+   {
+      EntryMap::iterator i = mEntries.find(createKey(url, virtualHost));
+      if(i != mEntries.end() && isExpired(i->second, now))
+      {
+         mEntries.erase(i);
+         i = mEntries.end();
+         ++mExpired;
+      }
+      if(i == mEntries.end())
+      {
+         ++mMisses;
+      }
+      else
+      {
+         i->second.used = now;
+         rval = i->second.session;
+         ++mHits;
+      }
+   }
+   mLock.unlock();
+
+   return rval;
+}
+
+bool PersistentSslSessionCache::save(const char* path)
+{
+   bool rval = true;
+
+   // serialize unexpired sessions
+   DynamicObject sessions;
+   sessions->setType(Array);
+   uint64_t now = time(NULL);
+   mLock.lock();
+   {
+      for(EntryMap::iterator i = mEntries.begin();
+          rval && i != mEntries.end(); ++i)
+      {
+         SSL_SESSION* s = i->second.session->session;
+         int length = isExpired(i->second, now) ?
+            0 : i2d_SSL_SESSION(s, NULL);
+         if(length > 0)
+         {
+            vector<unsigned char> der(length);
+            unsigned char* p = &der[0];
+            i2d_SSL_SESSION(s, &p);
+
+            DynamicObject& session = sessions->append();
+            session["key"] = i->first.c_str();
+            session["host"] = i->second.host.c_str();
+            session["stored"] = i->second.stored;
+            session["used"] = i->second.used;
+            session["session"] = Convert::bytesToHex(
+               (const char*)&der[0], length).c_str();
+         }
+      }
+   }
+   mLock.unlock();
+
+   // write to a temporary file and then replace the old file so a
+   // partially written file is never loaded
+   string tmpPath = path;
+   tmpPath.append(".tmp");
+   File tmp(tmpPath.c_str());
+   rval = tmp->mkdirs();
+#ifndef WIN32
+   if(rval)
+   {
+      // sessions include their master secrets, so create the temporary
+      // file readable by its owner only before anything is written to it,
+      // its mode is kept when it replaces the old file
+      int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+      rval = (fd != -1 && fchmod(fd, 0600) == 0);
+      if(!rval)
+      {
+         ExceptionRef e = new Exception(
+            "Could not create SSL session file.",
+            "bitmunk.protocol.SslSessionCacheError");
+         e->getDetails()["path"] = tmpPath.c_str();
+         e->getDetails()["error"] = strerror(errno);
+         Exception::set(e);
+      }
+      if(fd != -1)
+      {
+         close(fd);
+      }
+   }
+#endif
+   if(rval)
+   {
+      FileOutputStream fos(tmp);
+      JsonWriter writer;
+      writer.setCompact(true);
+      rval = writer.write(sessions, &fos);
+      fos.close();
+   }
+   if(rval)
+   {
+      File file(path);
+      rval = tmp->rename(file);
+   }
+
+   if(!rval)
+   {
+      ExceptionRef e = new Exception(
+         "Could not save SSL sessions.",
+         "bitmunk.protocol.SslSessionCacheError");
+      e->getDetails()["path"] = path;
+      Exception::push(e);
+   }
+
+   return rval;
+}
+
+bool PersistentSslSessionCache::load(const char* path)
+{
+   bool rval = true;
+
+   File file(path);
+   if(file->exists())
+   {
+      DynamicObject sessions;
+      FileInputStream fis(file);
+      JsonReader reader;
+      reader.start(sessions);
+      rval = reader.read(&fis) && reader.finish();
+      fis.close();
+
+      if(!rval || sessions->getType() != Array)
+      {
+         ExceptionRef e = new Exception(
+            "Could not load SSL sessions.",
+            "bitmunk.protocol.SslSessionCacheError");
+         e->getDetails()["path"] = path;
+         Exception::push(e);
+         rval = false;
+      }
+      else
+      {
+         uint64_t now = time(NULL);
+         mLock.lock();
+         {
+            DynamicObjectIterator i = sessions.getIterator();
+            while(i->hasNext())
+            {
+               DynamicObject& session = i->next();
+
+               // decode session, skipping any that are corrupt
+               const char* hex = session["session"]->getString();
+               unsigned int hexLength = session["session"]->length();
+               vector<char> der(hexLength / 2 + 1);
+               unsigned int length = 0;
+               SSL_SESSION* s = NULL;
+               if(Convert::hexToBytes(hex, hexLength, &der[0], length))
+               {
+                  const unsigned char* p = (const unsigned char*)&der[0];
+                  s = d2i_SSL_SESSION(NULL, &p, length);
+               }
+
+               if(s != NULL)
+               {
+                  Entry entry;
+                  entry.session = new SslSessionImpl(s);
+                  entry.host = session["host"]->getString();
+                  entry.stored = session["stored"]->getUInt64();
+                  entry.used = session["used"]->getUInt64();
+
+                  // do not replace sessions stored since starting up
+                  string key = session["key"]->getString();
+                  if(!isExpired(entry, now) &&
+                     mEntries.find(key) == mEntries.end())
+                  {
+                     addEntry(key, entry);
+                     ++mLoaded;
+                  }
+               }
+            }
+         }
+         mLock.unlock();
+      }
+   }
+
+   return rval;
+}
+
+DynamicObject PersistentSslSessionCache::getStats()
+{
+   DynamicObject rval;
+
+   mLock.lock();
+   {
+      rval["sessions"] = (uint32_t)mEntries.size();
+      rval["stored"] = mStored;
+      rval["hits"] = mHits;
+      rval["misses"] = mMisses;
+      rval["expired"] = mExpired;
+      rval["evicted"] = mEvicted;
+      rval["loaded"] = mLoaded;
+   }
+   mLock.unlock();
+
+   return rval;
+}
+
+bool PersistentSslSessionCache::isExpired(Entry& entry, uint64_t now)
+{
+   // the session itself may time out before the maximum age
+   SSL_SESSION* s = entry.session->session;
+   uint64_t timeout = (uint64_t)SSL_SESSION_get_time(s) +
+      (uint64_t)SSL_SESSION_get_timeout(s);
+   return (entry.stored + mMaxAge <= now) || (timeout <= now);
+}
+
+void PersistentSslSessionCache::addEntry(const string& key, Entry& entry)
+{
+   // replacing a session does not change the number of sessions
+   mEntries.erase(key);
+
+   // count sessions for the same host, noting the least recently used
+   unsigned int hostCount = 0;
+   EntryMap::iterator hostLru = mEntries.end();
+   EntryMap::iterator lru = mEntries.end();
+   for(EntryMap::iterator i = mEntries.begin(); i != mEntries.end(); ++i)
+   {
+      if(lru == mEntries.end() || i->second.used < lru->second.used)
+      {
+         lru = i;
+      }
+      if(i->second.host == entry.host)
+      {
+         ++hostCount;
+         if(hostLru == mEntries.end() ||
+            i->second.used < hostLru->second.used)
+         {
+            hostLru = i;
+         }
+      }
+   }
+
+   // evict for the host cap first since it may also make room overall
+   if(mMaxPerHost > 0 && hostCount >= mMaxPerHost)
+   {
+      if(lru == hostLru)
+      {
+         lru = mEntries.end();
+      }
+      mEntries.erase(hostLru);
+      ++mEvicted;
+   }
+   if(mEntries.size() >= mCapacity && lru != mEntries.end())
+   {
+      mEntries.erase(lru);
+      ++mEvicted;
+   }
+
+   if(mCapacity > 0)
+   {
+      mEntries[key] = entry;
+   }
+}
+
+string PersistentSslSessionCache::createKey(Url* url, const char* virtualHost)
+{
+   string rval = StringTools::format(
+      "%s:%d", url->getHost().c_str(), url->getPort());
+   if(virtualHost != NULL)
+   {
+      rval.push_back('/');
+      rval.append(virtualHost);
+   }
+   return rval;
+}
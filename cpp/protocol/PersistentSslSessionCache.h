@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_protocol_PersistentSslSessionCache_H
+#define bitmunk_protocol_PersistentSslSessionCache_H
+
+#include "monarch/net/SslSessionCache.h"
+#include "monarch/rt/DynamicObject.h"
+#include "monarch/rt/ExclusiveLock.h"
+
+#include <map>
+#include <string>
+
+namespace bitmunk
+{
+namespace protocol
+{
+
+/**
+ * A PersistentSslSessionCache is a client SslSessionCache whose sessions can
+ * be saved to and loaded from a file, so that a restarted node can resume its
+ * SSL sessions with sellers and Bitmunk instead of doing a full handshake
+ * with every one of them at once.
+ *
+ * Sessions expire after a maximum age or when the session itself times out,
+ * whichever is sooner. The number of sessions per host (across ports and
+ * virtual hosts) is capped, as is the total number of sessions; the least
+ * recently used session is evicted first.
+ *
+ * The session file contains secret session keys, so it is written with the
+ * same care as a profile (in the node's home, which is private to the user).
+ *
+ * @author Dave Longley
+ */
+class PersistentSslSessionCache : public monarch::net::SslSessionCache
+{
+protected:
+   /**
+    * A cached session.
+    */
+   struct Entry
+   {
+      monarch::net::SslSession session;
+      std::string host;
+      uint64_t stored;
+      uint64_t used;
+   };
+   typedef std::map<std::string, Entry> EntryMap;
+
+   /**
+    * The cached sessions, keyed by host, port and virtual host.
+    */
+   EntryMap mEntries;
+
+   /**
+    * The maximum number of sessions.
+    */
+   unsigned int mCapacity;
+
+   /**
+    * The maximum number of sessions per host, 0 for no limit.
+    */
+   unsigned int mMaxPerHost;
+
+   /**
+    * The maximum age of a session in seconds.
+    */
+   uint32_t mMaxAge;
+
+   /**
+    * A lock for the cached sessions.
+    */
+   monarch::rt::ExclusiveLock mLock;
+
+   /**
+    * Statistics.
+    */
+   uint64_t mStored;
+   uint64_t mHits;
+   uint64_t mMisses;
+   uint64_t mExpired;
+   uint64_t mEvicted;
+   uint64_t mLoaded;
+
+public:
+   /**
+    * Creates a new PersistentSslSessionCache.
+    *
+    * @param capacity the maximum number of sessions.
+    */
+   PersistentSslSessionCache(unsigned int capacity = 50);
+
+   /**
+    * Destructs this PersistentSslSessionCache.
+    */
+   virtual ~PersistentSslSessionCache();
+
+   /**
+    * Configures this cache.
+    *
+    * @param cfg the configuration with optional "capacity", "maxPerHost"
+    *            and "maxAge" (in seconds) members.
+    */
+   virtual void configure(monarch::rt::DynamicObject& cfg);
+
+   /**
+    * Stores a session for a url.
+    *
+    * @param url the url the session is for.
+    * @param session the session to store.
+    * @param virtualHost the virtual host the session is for, NULL for none.
+    */
+   virtual void storeSession(
+      monarch::net::Url* url, monarch::net::SslSession& session,
+      const char* virtualHost = NULL);
+
+   /**
+    * Gets an unexpired session for a url.
+    *
+    * @param url the url to get a session for.
+    * @param virtualHost the virtual host to get a session for, NULL for none.
+    *
+    * @return the session, NULL if there is none.
+    */
+   virtual monarch::net::SslSession getSession(
+      monarch::net::Url* url, const char* virtualHost = NULL);
+
+   /**
+    * Saves all unexpired sessions to a file.
+    *
+    * @param path the path to the file.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool save(const char* path);
+
+   /**
+    * Loads unexpired sessions from a file, if it exists, in addition to any
+    * sessions that are already cached.
+    *
+    * @param path the path to the file.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool load(const char* path);
+
+   /**
+    * Gets the statistics for this cache:
+    *
+    * {
+    *    "sessions": sessions cached,
+    *    "stored": sessions stored,
+    *    "hits": sessions offered for resumption,
+    *    "misses": connections with no session to offer,
+    *    "expired": sessions dropped because they expired,
+    *    "evicted": sessions dropped to make room for others,
+    *    "loaded": sessions loaded from a file
+    * }
+    *
+    * @return the statistics.
+    */
+   virtual monarch::rt::DynamicObject getStats();
+
+protected:
+   /**
+    * Checks whether a session has expired. The lock must be held.
+    *
+    * @param entry the session.
+    * @param now the current time in seconds.
+    *
+    * @return true if the session has expired, false if not.
+    */
+   virtual bool isExpired(Entry& entry, uint64_t now);
+
+   /**
+    * Adds a session, evicting other sessions as required by the caps. The
+    * lock must be held.
+    *
+    * @param key the key for the session.
+    * @param entry the session.
+    */
+   virtual void addEntry(const std::string& key, Entry& entry);
+
+   /**
+    * Creates the key for a url.
+    *
+    * @param url the url.
+    * @param virtualHost the virtual host, NULL for none.
+    *
+    * @return the key.
+    */
+   static std::string createKey(
+      monarch::net::Url* url, const char* virtualHost);
+};
+
+} // end namespace protocol
+} // end namespace bitmunk
+#endif
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/protocol/ServerSslContext.h"
+
+#include <openssl/ssl.h>
+
+using namespace monarch::net;
+using namespace monarch::rt;
+using namespace bitmunk::protocol;
+
+ServerSslContext::ServerSslContext(const char* protocol) :
+   SslContext(protocol, false)
+{
+}
+
+ServerSslContext::~ServerSslContext()
+{
+}
+
+void ServerSslContext::setSessionTimeout(uint32_t seconds)
+{
+   SSL_CTX_set_timeout(mContext, seconds);
+}
+
+DynamicObject ServerSslContext::getSessionStats()
+{
+   // session resumption happens against this context even for virtual
+   // hosts, so its counters cover all handshakes
+   DynamicObject rval;
+   rval["accepted"] = (uint64_t)SSL_CTX_sess_accept_good(mContext);
+   rval["resumed"] = (uint64_t)SSL_CTX_sess_hits(mContext);
+   rval["misses"] = (uint64_t)SSL_CTX_sess_misses(mContext);
+   rval["timeouts"] = (uint64_t)SSL_CTX_sess_timeouts(mContext);
+   rval["cacheFull"] = (uint64_t)SSL_CTX_sess_cache_full(mContext);
+   rval["sessions"] = (uint64_t)SSL_CTX_sess_number(mContext);
+   rval["timeout"] = (uint64_t)SSL_CTX_get_timeout(mContext);
+   return rval;
+}
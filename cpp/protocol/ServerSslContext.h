@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_protocol_ServerSslContext_H
+#define bitmunk_protocol_ServerSslContext_H
+
+#include "monarch/net/SslContext.h"
+#include "monarch/rt/DynamicObject.h"
+
+namespace bitmunk
+{
+namespace protocol
+{
+
+/**
+ * A ServerSslContext is a server SslContext that reports how often clients
+ * resume their SSL sessions instead of doing a full handshake and that
+ * allows the lifetime of its cached sessions to be set.
+ *
+ * @author Dave Longley
+ */
+class ServerSslContext : public monarch::net::SslContext
+{
+public:
+   /**
+    * Creates a new ServerSslContext.
+    *
+    * @param protocol the SSL protocol to use.
+    */
+   ServerSslContext(const char* protocol);
+
+   /**
+    * Destructs this ServerSslContext.
+    */
+   virtual ~ServerSslContext();
+
+   /**
+    * Sets how long a session is cached for resumption.
+    *
+    * @param seconds the session lifetime in seconds.
+    */
+   virtual void setSessionTimeout(uint32_t seconds);
+
+   /**
+    * Gets the session statistics for this context:
+    *
+    * {
+    *    "accepted": handshakes completed,
+    *    "resumed": handshakes that resumed a cached session,
+    *    "misses": sessions clients offered that were not cached,
+    *    "timeouts": sessions clients offered that had expired,
+    *    "cacheFull": sessions dropped because the cache was full,
+    *    "sessions": sessions cached,
+    *    "timeout": the session lifetime in seconds
+    * }
+    *
+    * @return the session statistics.
+    */
+   virtual monarch::rt::DynamicObject getSessionStats();
+};
+
+} // end namespace protocol
+} // end namespace bitmunk
+#endif
@@ -6,8 +6,10 @@
 #include "bitmunk/purchase/DownloadManager.h"
 
 #include "bitmunk/common/Tools.h"
+#include "bitmunk/purchase/Endgame.h"
 #include "bitmunk/purchase/Negotiator.h"
 #include "bitmunk/purchase/PieceDownloader.h"
+#include "bitmunk/purchase/PieceSizer.h"
 #include "bitmunk/purchase/PurchaseModule.h"
 #include "bitmunk/purchase/SellerPicker.h"
 #include "bitmunk/purchase/SellerPoolUpdater.h"
@@ -18,6 +20,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <vector>
 
 using namespace bitmunk::common;
 using namespace bitmunk::purchase;
@@ -56,6 +59,7 @@ enum
    MsgNegotiateComplete,
    MsgPauseDownload,
    MsgProgressPoll,
+   MsgPieceNearlyDone,
    MsgIgnore
 };
 
@@ -313,6 +317,10 @@ static int getMessageType(DynamicObject& msg, FiberId fiberId)
    {
       rval = MsgPieceUpdate;
    }
+   else if(msg->hasMember("pieceNearlyDone"))
+   {
+      rval = MsgPieceNearlyDone;
+   }
    else if(msg->hasMember("negotiationComplete") ||
            msg->hasMember("negotiationError"))
    {
@@ -534,6 +542,9 @@ bool DownloadManager::handleMessage(DynamicObject& msg)
       case MsgPieceUpdate:
          rval = pieceUpdate(msg);
          break;
+      case MsgPieceNearlyDone:
+         rval = pipelinePiece(msg);
+         break;
       case MsgPoolTimeout:
          rval = poolTimeout(msg);
          break;
@@ -636,6 +647,12 @@ bool DownloadManager::tryAssignPiece()
       }
    }
 
+   // duplicate the last outstanding pieces onto idle sellers if appropriate
+   if(rval && !mNegotiating)
+   {
+      rval = startEndgame();
+   }
+
    return rval;
 }
 
@@ -729,17 +746,25 @@ bool DownloadManager::pickSeller(SellerData& sd, bool must)
    BigDecimal budget;
    budget.setPrecision(7, Down);
    int sellerCount = 0;
+   Config cfg = getConfig(mNode, BM_USER_ID(mDownloadState["userId"]));
+   uint32_t window = cfg->hasMember("pieceWindow") ?
+      cfg["pieceWindow"]->getUInt32() : 1;
    FileProgressIterator fpi = mDownloadState["progress"].getIterator();
    while(fpi->hasNext())
    {
       FileProgress& fp = fpi->next();
 
-      // count pieces already downloaded
+      // count standard pieces already downloaded
       uint32_t downloaded = 0;
+      uint32_t minSize = fp["sellerPool"]["pieceSize"]->getUInt32();
       DynamicObjectIterator i = fp["downloaded"].getIterator();
       while(i->hasNext())
       {
-         downloaded += i->next()->length();
+         FilePieceIterator pi = i->next().getIterator();
+         while(pi->hasNext())
+         {
+            downloaded += PieceSizer::getUnitCount(pi->next(), minSize);
+         }
       }
 
       // if there are more pieces to be downloaded for this
@@ -759,12 +784,14 @@ bool DownloadManager::pickSeller(SellerData& sd, bool must)
          {
             SellerData& fpsd = i->next();
             key = Tools::createSellerServerKey(fpsd["seller"]);
-            // FIXME: "activeSellers" contains # of connections to
-            // sellers, could allow the number to go higher than 1 in
-            // the future by checking its value instead of ->hasMember()
+            // "activeSellers" contains # of outstanding pieces for
+            // sellers, only include sellers with room in their window
+            uint32_t active =
+               mDownloadState["activeSellers"]->hasMember(key.c_str()) ?
+               mDownloadState["activeSellers"][key.c_str()]->getUInt32() : 0;
             if(key.length() > 0 &&
                !mDownloadState["blacklist"]->hasMember(key.c_str()) &&
-               !mDownloadState["activeSellers"]->hasMember(key.c_str()))
+               active < getSellerWindow(key.c_str(), window))
             {
                price = fpsd["price"]->getString();
                if(price <= budget)
@@ -871,7 +898,6 @@ bool DownloadManager::assignPiece(SellerData& sd)
       {
          // set true here to simplify checks below
          rval = true;
-         fp = i->next();
          const char* csHash = cs["hash"]->getString();
          // check start date not set or initialized to empty string
          if(!mDownloadState->hasMember("startDate") ||
@@ -906,10 +932,16 @@ bool DownloadManager::assignPiece(SellerData& sd)
                   mDownloadState["startDate"]->getString());
             }
          }
+
+         uint32_t minSize = progress["sellerPool"]["pieceSize"]->getUInt32();
          if(rval)
          {
+            // take the next piece, sized according to the seller's rate
+            fp = PieceSizer::takePiece(
+               progress["unassigned"],
+               PieceSizer::choosePieceSize(sd, progress["sellerPool"], cfg),
+               minSize);
             progress["assigned"][csHash]->append(fp);
-            i->remove();
             assigned = true;
 
             // add seller connection to active list
@@ -919,8 +951,9 @@ bool DownloadManager::assignPiece(SellerData& sd)
             mDownloadState["activeSellers"][key.c_str()] = conns + 1;
          }
 
-         // get piece index and file extension
-         uint32_t pieceIndex = fp["index"]->getUInt32();
+         // get index of the first standard piece covered and file extension
+         uint32_t pieceIndex =
+            assigned ? PieceSizer::getFirstUnit(fp, minSize) : 0;
          const char* extension = fi["extension"]->getString();
 
          // generate the filename for the file piece
@@ -951,26 +984,14 @@ bool DownloadManager::assignPiece(SellerData& sd)
             // log piece downloader creation
             MO_CAT_DEBUG(BM_PURCHASE_CAT,
                "UserId %" PRIu64 ", DownloadState %" PRIu64 ": "
-               "creating piece downloader for file ID %s, piece %u",
+               "creating piece downloader for file ID %s, piece %u, "
+               "size %u",
                BM_USER_ID(mDownloadState["userId"]),
                mDownloadState["id"]->getUInt64(),
-               fileId, pieceIndex);
+               fileId, pieceIndex, PieceSizer::getPieceSize(fp, minSize));
 
             // create and add piece downloader
-            PieceDownloader* pd = new PieceDownloader(getNode(), getId());
-            RateAverager* pa = new RateAverager(WINDOW_LENGTH);
-            pd->initialize(
-               ++mPieceDownloaderId,
-               progress["sellerPool"]["pieceSize"]->getUInt32(),
-               cs, fileId, fp, pa, &mDownloadRate);
-            pd->setUserId(userId);
-            pd->setDownloadState(mDownloadState);
-            PieceDownloaderEntry pde;
-            pde.fiberId = getNode()->getFiberScheduler()->addFiber(pd);
-            pde.fileId = fileId;
-            pde.pieceIndex = pieceIndex;
-            pde.rateAverager = pa;
-            mPieceDownloaders.insert(make_pair(mPieceDownloaderId, pde));
+            startPieceDownloader(sd, fileId, fp);
          }
       }
 
@@ -982,7 +1003,8 @@ bool DownloadManager::assignPiece(SellerData& sd)
          Event e;
          e["type"] = EVENT_DOWNLOAD_STATE ".pieceAssigned";
          BM_ID_SET(e["details"]["fileId"], fileId);
-         e["details"]["index"] = fp["index"]->getUInt32();
+         e["details"]["index"] = PieceSizer::getFirstUnit(
+            fp, progress["sellerPool"]["pieceSize"]->getUInt32());
          sendDownloadStateEvent(e);
       }
    }
@@ -990,122 +1012,446 @@ bool DownloadManager::assignPiece(SellerData& sd)
    return rval;
 }
 
-bool DownloadManager::pieceUpdate(DynamicObject& msg)
+uint32_t DownloadManager::startPieceDownloader(
+   SellerData& sd, FileId fileId, FilePiece& fp)
+{
+   ContractSection& cs = sd["section"];
+   FileProgress& progress = mDownloadState["progress"][fileId];
+
+   PieceDownloader* pd = new PieceDownloader(getNode(), getId());
+   RateAverager* pa = new RateAverager(WINDOW_LENGTH);
+   pd->initialize(
+      ++mPieceDownloaderId,
+      progress["sellerPool"]["pieceSize"]->getUInt32(),
+      cs, fileId, fp, pa, &mDownloadRate);
+   pd->setUserId(BM_USER_ID(mDownloadState["userId"]));
+   pd->setDownloadState(mDownloadState);
+   PieceDownloaderEntry pde;
+   pde.fiberId = getNode()->getFiberScheduler()->addFiber(pd);
+   pde.fileId = fileId;
+   pde.pieceIndex = PieceSizer::getFirstUnit(
+      fp, progress["sellerPool"]["pieceSize"]->getUInt32());
+   pde.sellerKey = Tools::createSellerServerKey(sd["seller"]);
+   pde.csHash = cs["hash"]->getString();
+   pde.rateAverager = pa;
+   pde.twinId = 0;
+   pde.duplicate = false;
+   pde.cancelled = false;
+   pde.piece = fp;
+   mPieceDownloaders.insert(make_pair(mPieceDownloaderId, pde));
+
+   return mPieceDownloaderId;
+}
+
+bool DownloadManager::startEndgame()
 {
    bool rval = true;
 
-   // get message details
-   FileId fileId = BM_FILE_ID(msg["fileId"]);
-   FilePiece fp = msg["piece"];
-   FileProgress progress = mDownloadState["progress"][fileId];
-   ContractSection cs = msg["section"];
+   // get the number of outstanding pieces at which to start endgame mode
+   Config cfg = getConfig(mNode, BM_USER_ID(mDownloadState["userId"]));
+   uint32_t endgamePieces = cfg->hasMember("endgamePieces") ?
+      cfg["endgamePieces"]->getUInt32() : 0;
+   if(endgamePieces > 0 && !mInterrupted && !mPieceDownloaders.empty())
+   {
+      // endgame only starts once every piece has been assigned
+      bool unassigned = false;
+      FileProgressIterator fpi = mDownloadState["progress"].getIterator();
+      while(!unassigned && fpi->hasNext())
+      {
+         unassigned = (fpi->next()["unassigned"]->length() > 0);
+      }
 
-   // get section hash
-   const char* csHash = cs["hash"]->getString();
+      // duplicate pieces onto idle sellers
+      Endgame::CopyList copies;
+      for(PieceDownloaderMap::iterator i = mPieceDownloaders.begin();
+          i != mPieceDownloaders.end(); ++i)
+      {
+         Endgame::Copy copy;
+         copy.id = i->first;
+         copy.rate = i->second.rateAverager->getItemsPerSecond();
+         copy.twinId = i->second.twinId;
+         copy.duplicate = i->second.duplicate;
+         copy.cancelled = i->second.cancelled;
+         copies.push_back(copy);
+      }
+      vector<uint32_t> ids;
+      Endgame::choosePieces(copies, endgamePieces, unassigned, ids);
+      for(vector<uint32_t>::iterator i = ids.begin();
+          rval && i != ids.end(); ++i)
+      {
+         rval = duplicatePiece(*i);
+      }
+   }
+
+   return rval;
+}
 
-   // remove piece from assigned list
-   bool removed = false;
-   FilePieceIterator fpi = progress["assigned"][csHash].getIterator();
-   while(!removed && fpi->hasNext())
+bool DownloadManager::duplicatePiece(uint32_t id)
+{
+   bool rval = true;
+
+   PieceDownloaderEntry& pde = mPieceDownloaders[id];
+   FileId fileId = pde.fileId.c_str();
+   FileProgress& progress = mDownloadState["progress"][fileId];
+
+   // pick the fastest idle seller for the file
+   SellerData best = Endgame::chooseSeller(
+      mDownloadState, progress, pde.sellerKey.c_str());
+
+   // find the assigned piece
+   FilePiece original(NULL);
+   FilePieceIterator fpi =
+      progress["assigned"][pde.csHash.c_str()].getIterator();
+   while(original.isNull() && fpi->hasNext())
    {
       FilePiece& next = fpi->next();
-      if(next["index"] == fp["index"])
+      if(PieceSizer::isSamePiece(next, pde.piece))
       {
-         fpi->remove();
-         removed = true;
+         original = next;
       }
    }
 
-   // clean up assigned entry for section hash if it is now empty
-   if(progress["assigned"][csHash]->length() == 0)
+   if(!best.isNull() && !original.isNull())
    {
-      progress["assigned"]->removeMember(csHash);
+      MO_CAT_DEBUG(BM_PURCHASE_CAT,
+         "UserId %" PRIu64 ", DownloadState %" PRIu64 ": "
+         "endgame, duplicating file ID %s, piece %u",
+         BM_USER_ID(mDownloadState["userId"]),
+         mDownloadState["id"]->getUInt64(),
+         fileId, pde.pieceIndex);
+      logDownloadStateMessage("endgame, duplicating piece on idle seller");
+
+      // the duplicate downloads to its own file, it is not recorded as
+      // assigned unless the original fails
+      FilePiece fp = original.clone();
+      string path = original["path"]->getString();
+      path.append(".endgame");
+      fp["path"] = path.c_str();
+
+      // add seller connection to active list
+      string key = Tools::createSellerServerKey(best["seller"]);
+      mDownloadState["activeSellers"][key.c_str()] = 1;
+
+      // start duplicate and link it with the original
+      uint32_t twinId = startPieceDownloader(best, fileId, fp);
+      PieceDownloaderEntry& twin = mPieceDownloaders[twinId];
+      twin.twinId = id;
+      twin.duplicate = true;
+      mPieceDownloaders[id].twinId = twinId;
+   }
+
+   return rval;
+}
+
+void DownloadManager::cancelPieceDownloader(uint32_t id)
+{
+   PieceDownloaderMap::iterator i = mPieceDownloaders.find(id);
+   if(i != mPieceDownloaders.end())
+   {
+      i->second.cancelled = true;
+      i->second.twinId = 0;
+
+      // interrupt without an error
+      DynamicObject msg;
+      msg["interrupt"] = true;
+      msg["pause"] = true;
+      BM_ID_SET(msg["userId"], BM_USER_ID(mDownloadState["userId"]));
+      msg["downloadStateId"] = mDownloadState["id"]->getUInt64();
+      msg["pieceDownloaderId"] = id;
+      sendMessage(i->second.fiberId, msg);
    }
+}
 
+bool DownloadManager::updateAssignment(
+   FileId fileId, const char* csHash, FilePiece& fp, bool assigned)
+{
+   FileProgress& progress = mDownloadState["progress"][fileId];
+
+   if(assigned)
+   {
+      progress["assigned"][csHash]->append(fp);
+   }
+   else
+   {
+      // remove piece from assigned list
+      bool removed = false;
+      FilePieceIterator fpi = progress["assigned"][csHash].getIterator();
+      while(!removed && fpi->hasNext())
+      {
+         FilePiece& next = fpi->next();
+         if(PieceSizer::isSamePiece(next, fp))
+         {
+            fpi->remove();
+            removed = true;
+         }
+      }
+      if(progress["assigned"][csHash]->length() == 0)
+      {
+         progress["assigned"]->removeMember(csHash);
+      }
+   }
+
+   // create database entry
+   DynamicObject entries;
+   DynamicObject& entry = entries->append();
+   BM_ID_SET(entry["fileId"], fileId);
+   entry["csHash"] = csHash;
+   entry["status"] = assigned ? "assigned" : "removed";
+   entry["piece"] = fp;
+
+   return mPurchaseDatabase->updateFileProgress(mDownloadState, entries);
+}
+
+void DownloadManager::releaseSeller(const char* key)
+{
    // remove seller connection from active list
-   string key = Tools::createSellerServerKey(cs["seller"]);
-   if(mDownloadState["activeSellers"]->hasMember(key.c_str()))
+   if(mDownloadState["activeSellers"]->hasMember(key))
    {
-      uint32_t conns =
-         mDownloadState["activeSellers"][key.c_str()]->getUInt32();
+      uint32_t conns = mDownloadState["activeSellers"][key]->getUInt32();
       if(conns > 1)
       {
          // decrement entry
-         mDownloadState["activeSellers"][key.c_str()] = --conns;
+         mDownloadState["activeSellers"][key] = --conns;
       }
       else
       {
          // remove entry entirely
-         mDownloadState["activeSellers"]->removeMember(key.c_str());
+         mDownloadState["activeSellers"]->removeMember(key);
       }
    }
+}
 
-   // create database entry
-   DynamicObject entries;
-   DynamicObject& dbe = entries->append();
-   BM_ID_SET(dbe["fileId"], fileId);
-   dbe["csHash"] = csHash;
-   dbe["piece"] = fp;
+void DownloadManager::blacklistSeller(ContractSection& cs)
+{
+   // download from seller failed, add to bad sellers list
+   string key = Tools::createSellerServerKey(cs["seller"]);
+   DynamicObject blacklistEntry;
+   blacklistEntry["seller"] = cs["seller"].clone();
+   blacklistEntry["time"] = System::getCurrentMilliseconds();
+   mDownloadState["blacklist"][key.c_str()] = blacklistEntry;
+}
+
+bool DownloadManager::endgameUpdate(DynamicObject& msg, bool& done)
+{
+   bool rval = true;
 
+   // get message details
+   FileId fileId = BM_FILE_ID(msg["fileId"]);
+   FilePiece fp = msg["piece"];
+   ContractSection cs = msg["section"];
+   string key = Tools::createSellerServerKey(cs["seller"]);
    bool pieceReceived = msg->hasMember("pieceReceived");
-   if(pieceReceived)
+   PieceDownloaderEntry& pde =
+      mPieceDownloaders[msg["pieceDownloaderId"]->getUInt32()];
+   PieceDownloaderMap::iterator twin = mPieceDownloaders.find(pde.twinId);
+
+   Endgame::Copy copy;
+   copy.id = msg["pieceDownloaderId"]->getUInt32();
+   copy.rate = 0;
+   copy.twinId = pde.twinId;
+   copy.duplicate = pde.duplicate;
+   copy.cancelled = pde.cancelled;
+   Endgame::Outcome outcome = Endgame::getOutcome(
+      copy, twin != mPieceDownloaders.end(), pieceReceived);
+
+   done = true;
+   switch(outcome)
    {
-      // add state to db entry
-      dbe["status"] = "downloaded";
+      case Endgame::Discard:
+      {
+         // this copy lost, discard it
+         releaseSeller(key.c_str());
+         File file(fp["path"]->getString());
+         file->remove();
+         break;
+      }
+      case Endgame::Unpaired:
+      {
+         // no longer has a twin, handle as usual
+         done = false;
+         break;
+      }
+      case Endgame::Won:
+      {
+         // this copy won, cancel the other copy
+         MO_CAT_DEBUG(BM_PURCHASE_CAT,
+            "UserId %" PRIu64 ", DownloadState %" PRIu64 ": "
+            "endgame, piece %u won by %s copy",
+            BM_USER_ID(mDownloadState["userId"]),
+            mDownloadState["id"]->getUInt64(),
+            pde.pieceIndex, pde.duplicate ? "duplicate" : "original");
+         string twinHash = twin->second.csHash;
+         cancelPieceDownloader(twin->first);
 
-      // add piece to downloaded list
-      progress["downloaded"][csHash]->append(fp);
+         // if the duplicate won, record the piece under its section only
+         if(pde.duplicate)
+         {
+            rval = updateAssignment(
+               fileId, twinHash.c_str(), twin->second.piece, false);
+            pde.duplicate = false;
+         }
+         done = false;
+         break;
+      }
+      case Endgame::DuplicateFailed:
+      {
+         // the duplicate failed, the original continues
+         twin->second.twinId = 0;
+         releaseSeller(key.c_str());
+         blacklistSeller(cs);
+         File file(fp["path"]->getString());
+         file->remove();
+         break;
+      }
+      case Endgame::OriginalFailed:
+      {
+         // the original failed, the duplicate replaces it
+         PieceDownloaderEntry& dup = twin->second;
+         dup.twinId = 0;
+         dup.duplicate = false;
+         rval =
+            updateAssignment(fileId, pde.csHash.c_str(), fp, false) &&
+            updateAssignment(fileId, dup.csHash.c_str(), dup.piece, true);
+         releaseSeller(key.c_str());
+         blacklistSeller(cs);
+         break;
+      }
+   }
 
-      MO_CAT_DEBUG(BM_PURCHASE_CAT,
-         "received piece %i of size %s, "
-         "uid: %" PRIu64 ", dsid: %" PRIu64,
-         fp["index"]->getInt32(),
-         fp["size"]->getString(),
-         BM_USER_ID(mDownloadState["userId"]),
-         mDownloadState["id"]->getUInt64());
+   return rval;
+}
 
-      // update bytes downloaded
-      uint64_t tmp = progress["bytesDownloaded"]->getUInt64();
-      progress["bytesDownloaded"] = tmp + fp["size"]->getUInt32();
+uint32_t DownloadManager::getSellerWindow(const char* key, uint32_t window)
+{
+   // sum the current rates of the active sellers
+   map<string, double> rates;
+   for(PieceDownloaderMap::iterator i = mPieceDownloaders.begin();
+       i != mPieceDownloaders.end(); ++i)
+   {
+      rates[i->second.sellerKey] +=
+         i->second.rateAverager->getItemsPerSecond();
+   }
+
+   return SellerPicker::getSellerWindow(rates, key, window);
+}
 
-      // decrement remaining pieces by 1
-      mDownloadState["remainingPieces"] =
-         mDownloadState["remainingPieces"]->getUInt32() - 1;
+bool DownloadManager::pieceUpdate(DynamicObject& msg)
+{
+   bool rval = true;
 
-      // update download rate for seller
-      SellerData& sd = progress["sellerData"][csHash];
-      sd["downloadRate"] = msg["pieceRate"]->getDouble();
+   // get message details
+   FileId fileId = BM_FILE_ID(msg["fileId"]);
+   FilePiece fp = msg["piece"];
+   FileProgress progress = mDownloadState["progress"][fileId];
+   ContractSection cs = msg["section"];
+
+   // get section hash
+   const char* csHash = cs["hash"]->getString();
+
+   // get piece downloader with matching ID
+   PieceDownloaderMap::iterator i = mPieceDownloaders.find(
+      msg["pieceDownloaderId"]->getUInt32());
+
+   // handle pieces that were duplicated in endgame mode
+   bool done = false;
+   if(i != mPieceDownloaders.end() &&
+      (i->second.twinId != 0 || i->second.cancelled))
+   {
+      rval = endgameUpdate(msg, done);
    }
-   else
+
+   if(!done)
    {
-      // add state to db entry
-      dbe["status"] = "unassigned";
+      // remove piece from assigned list
+      bool removed = false;
+      FilePieceIterator fpi = progress["assigned"][csHash].getIterator();
+      while(!removed && fpi->hasNext())
+      {
+         FilePiece& next = fpi->next();
+         if(PieceSizer::isSamePiece(next, fp))
+         {
+            fpi->remove();
+            removed = true;
+         }
+      }
+
+      // clean up assigned entry for section hash if it is now empty
+      if(progress["assigned"][csHash]->length() == 0)
+      {
+         progress["assigned"]->removeMember(csHash);
+      }
 
-      // add piece to unassigned list
-      progress["unassigned"]->append(fp);
+      // remove seller connection from active list
+      string key = Tools::createSellerServerKey(cs["seller"]);
+      releaseSeller(key.c_str());
 
-      // download from seller failed, add to bad sellers list
-      DynamicObject blacklistEntry;
-      blacklistEntry["seller"] = cs["seller"].clone();
-      blacklistEntry["time"] = System::getCurrentMilliseconds();
-      mDownloadState["blacklist"][key.c_str()] = blacklistEntry;
+      // create database entry
+      DynamicObject entries;
+      DynamicObject& dbe = entries->append();
+      BM_ID_SET(dbe["fileId"], fileId);
+      dbe["csHash"] = csHash;
+      dbe["piece"] = fp;
 
-      MO_CAT_DEBUG(BM_PURCHASE_CAT,
-         "piece %i receive failed and will be re-assigned, "
-         "uid: %" PRIu64 ", dsid: %" PRIu64,
-         fp["index"]->getInt32(),
-         BM_USER_ID(mDownloadState["userId"]),
-         mDownloadState["id"]->getUInt64());
+      bool pieceReceived = msg->hasMember("pieceReceived");
+      if(pieceReceived)
+      {
+         // add state to db entry
+         dbe["status"] = "downloaded";
+
+         // add piece to downloaded list
+         progress["downloaded"][csHash]->append(fp);
+
+         MO_CAT_DEBUG(BM_PURCHASE_CAT,
+            "received piece %i of size %s, "
+            "uid: %" PRIu64 ", dsid: %" PRIu64,
+            fp["index"]->getInt32(),
+            fp["size"]->getString(),
+            BM_USER_ID(mDownloadState["userId"]),
+            mDownloadState["id"]->getUInt64());
+
+         // update bytes downloaded
+         uint64_t tmp = progress["bytesDownloaded"]->getUInt64();
+         progress["bytesDownloaded"] = tmp + fp["size"]->getUInt32();
+
+         // decrement remaining pieces by the number of standard pieces
+         // the piece covers
+         mDownloadState["remainingPieces"] =
+            mDownloadState["remainingPieces"]->getUInt32() -
+            PieceSizer::getUnitCount(
+               fp, progress["sellerPool"]["pieceSize"]->getUInt32());
+
+         // update download rate for seller
+         SellerData& sd = progress["sellerData"][csHash];
+         sd["downloadRate"] = msg["pieceRate"]->getDouble();
+      }
+      else
+      {
+         // add state to db entry
+         dbe["status"] = "unassigned";
+
+         // add piece to unassigned list
+         progress["unassigned"]->append(fp);
+
+         // download from seller failed, add to bad sellers list
+         blacklistSeller(cs);
+
+         MO_CAT_DEBUG(BM_PURCHASE_CAT,
+            "piece %i receive failed and will be re-assigned, "
+            "uid: %" PRIu64 ", dsid: %" PRIu64,
+            fp["index"]->getInt32(),
+            BM_USER_ID(mDownloadState["userId"]),
+            mDownloadState["id"]->getUInt64());
+      }
+
+      // insert entry into database
+      rval = rval && mPurchaseDatabase->updateFileProgress(
+         mDownloadState, entries);
    }
 
-   // insert entry into database and update download state flags
-   rval =
-      mPurchaseDatabase->updateFileProgress(mDownloadState, entries) &&
-      mPurchaseDatabase->updateDownloadStateFlags(mDownloadState);
+   // update download state flags
+   rval = rval && mPurchaseDatabase->updateDownloadStateFlags(mDownloadState);
 
-   // remove piece downloader with matching ID
-   PieceDownloaderMap::iterator i = mPieceDownloaders.find(
-      msg["pieceDownloaderId"]->getUInt32());
+   // remove piece downloader
    if(i != mPieceDownloaders.end())
    {
       delete i->second.rateAverager;
@@ -1115,6 +1461,55 @@ bool DownloadManager::pieceUpdate(DynamicObject& msg)
    return rval;
 }
 
+bool DownloadManager::pipelinePiece(DynamicObject& msg)
+{
+   bool rval = true;
+
+   // only pipeline if the piece downloader is still active
+   PieceDownloaderMap::iterator i = mPieceDownloaders.find(
+      msg["pieceDownloaderId"]->getUInt32());
+   if(!mInterrupted && i != mPieceDownloaders.end())
+   {
+      // get the seller data for the piece's section
+      FileId fileId = BM_FILE_ID(msg["fileId"]);
+      const char* csHash = msg["section"]["hash"]->getString();
+      FileProgress& progress = mDownloadState["progress"][fileId];
+      if(progress["unassigned"]->length() > 0 &&
+         progress["sellerData"]->hasMember(csHash))
+      {
+         SellerData& sd = progress["sellerData"][csHash];
+         string key = i->second.sellerKey;
+
+         // check seller's window, maximum concurrent pieces (0 = unlimited),
+         // and the file budget
+         Config cfg = getConfig(mNode, BM_USER_ID(mDownloadState["userId"]));
+         uint32_t window = cfg->hasMember("pieceWindow") ?
+            cfg["pieceWindow"]->getUInt32() : 1;
+         uint32_t maxPieces = cfg["maxPieces"]->getUInt32();
+         uint32_t active =
+            mDownloadState["activeSellers"]->hasMember(key.c_str()) ?
+            mDownloadState["activeSellers"][key.c_str()]->getUInt32() : 0;
+         BigDecimal price;
+         price.setPrecision(7, Down);
+         price = sd["price"]->getString();
+         BigDecimal budget;
+         budget.setPrecision(7, Down);
+         budget = progress["budget"]->getString();
+         if(!mDownloadState["blacklist"]->hasMember(key.c_str()) &&
+            active < getSellerWindow(key.c_str(), window) &&
+            (maxPieces == 0 || mPieceDownloaders.size() < maxPieces) &&
+            price <= budget)
+         {
+            logDownloadStateMessage(
+               "piece nearly done, pipelining next piece to seller");
+            rval = assignPiece(sd);
+         }
+      }
+   }
+
+   return rval;
+}
+
 bool DownloadManager::poolTimeout(DynamicObject& msg)
 {
    // only bother updating pools if they aren't already being updated
@@ -1341,35 +1736,43 @@ bool DownloadManager::progressPolled(DynamicObject& msg)
    for(PieceDownloaderMap::iterator i = mPieceDownloaders.begin();
        i != mPieceDownloaders.end(); ++i)
    {
-      FileId fileId = i->second.fileId.c_str();
-      DynamicObject& entry = fpMap[fileId];
-
-      // get piece size
-      FileProgress& fp = mDownloadState["progress"][fileId];
-      uint64_t size = fp["sellerPool"]["pieceSize"]->getUInt64();
+      // skip endgame duplicates and cancelled pieces, the original
+      // piece reports the progress
+      if(!i->second.duplicate && !i->second.cancelled)
+      {
+         FileId fileId = i->second.fileId.c_str();
+         DynamicObject& entry = fpMap[fileId];
 
-      // get piece stats
-      // calculate ETA (delta in seconds until download complete)
-      uint64_t downloaded = i->second.rateAverager->getTotalItemCount();
-      uint64_t remaining = (downloaded > size) ? 0 : (size - downloaded);
-      double rate = i->second.rateAverager->getItemsPerSecond();
-      double totalRate = i->second.rateAverager->getTotalItemsPerSecond();
-      uint64_t eta = (remaining == 0) ?
-         0 : (uint64_t)roundl(remaining / totalRate);
-
-      // save piece stats
-      DynamicObject& piece = entry["pieces"]->append();
-      piece["index"] = i->second.pieceIndex;
-      piece["downloaded"] = downloaded;
-      piece["size"] = size;
-      piece["eta"] = eta;
-      piece["rate"] = rate;
-      piece["totalRate"] = totalRate;
-
-      // increment total file stats
-      entry["downloaded"] = entry["downloaded"]->getUInt64() + downloaded;
-      entry["rate"] = entry["rate"]->getDouble() + rate;
-      entry["totalRate"] = entry["totalRate"]->getDouble() + totalRate;
+         // get piece size
+         FileProgress& fp = mDownloadState["progress"][fileId];
+         uint64_t size = fp["sellerPool"]["pieceSize"]->getUInt64();
+
+         // get piece stats
+         // calculate ETA (delta in seconds until download complete)
+         uint64_t downloaded = i->second.rateAverager->getTotalItemCount();
+         uint64_t remaining =
+            (downloaded > size) ? 0 : (size - downloaded);
+         double rate = i->second.rateAverager->getItemsPerSecond();
+         double totalRate =
+            i->second.rateAverager->getTotalItemsPerSecond();
+         uint64_t eta = (remaining == 0) ?
+            0 : (uint64_t)roundl(remaining / totalRate);
+
+         // save piece stats
+         DynamicObject& piece = entry["pieces"]->append();
+         piece["index"] = i->second.pieceIndex;
+         piece["downloaded"] = downloaded;
+         piece["size"] = size;
+         piece["eta"] = eta;
+         piece["rate"] = rate;
+         piece["totalRate"] = totalRate;
+
+         // increment total file stats
+         entry["downloaded"] =
+            entry["downloaded"]->getUInt64() + downloaded;
+         entry["rate"] = entry["rate"]->getDouble() + rate;
+         entry["totalRate"] = entry["totalRate"]->getDouble() + totalRate;
+      }
    }
 
    // calculate download progress for all files
@@ -1386,6 +1789,7 @@ bool DownloadManager::progressPolled(DynamicObject& msg)
       DynamicObject& perFile = e["details"]["files"][fileId];
 
       // add indexes of pieces that are downloaded already
+      uint32_t minSize = fp["sellerPool"]["pieceSize"]->getUInt32();
       DynamicObject& downloadedPieces = perFile["pieces"]["downloaded"];
       downloadedPieces->setType(Array);
       DynamicObjectIterator fpli = fp["downloaded"].getIterator();
@@ -1395,7 +1799,14 @@ bool DownloadManager::progressPolled(DynamicObject& msg)
          FilePieceIterator fpi = fpl.getIterator();
          while(fpi->hasNext())
          {
-            downloadedPieces->append() = fpi->next()["index"]->getUInt32();
+            // add every standard piece covered by the piece
+            FilePiece& piece = fpi->next();
+            uint32_t first = PieceSizer::getFirstUnit(piece, minSize);
+            uint32_t count = PieceSizer::getUnitCount(piece, minSize);
+            for(uint32_t n = first; n < first + count; ++n)
+            {
+               downloadedPieces->append() = n;
+            }
          }
       }
 
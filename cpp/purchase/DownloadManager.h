@@ -74,7 +74,13 @@ protected:
       monarch::fiber::FiberId fiberId;
       std::string fileId;
       uint32_t pieceIndex;
+      std::string sellerKey;
+      std::string csHash;
       monarch::util::RateAverager* rateAverager;
+      uint32_t twinId;
+      bool duplicate;
+      bool cancelled;
+      bitmunk::common::FilePiece piece;
    };
    typedef std::map<uint32_t, PieceDownloaderEntry> PieceDownloaderMap;
    PieceDownloaderMap mPieceDownloaders;
@@ -210,7 +216,10 @@ protected:
    virtual bool pickSeller(bitmunk::common::SellerData& sd, bool must);
 
    /**
-    * Assigns a piece to a particular seller and starts its download.
+    * Assigns a piece to a particular seller and starts its download. The
+    * size of the piece is chosen according to the seller's download rate
+    * (see PieceSizer), a fast seller may be assigned a piece that covers
+    * several consecutive standard pieces.
     *
     * @param sd the SellerData of the seller to assign the piece to.
     *
@@ -218,6 +227,90 @@ protected:
     */
    virtual bool assignPiece(bitmunk::common::SellerData& sd);
 
+   /**
+    * Starts a PieceDownloader for a piece.
+    *
+    * @param sd the SellerData of the seller to download the piece from.
+    * @param fileId the ID of the file the piece is for.
+    * @param fp the FilePiece to download.
+    *
+    * @return the unique ID of the new PieceDownloader.
+    */
+   virtual uint32_t startPieceDownloader(
+      bitmunk::common::SellerData& sd, bitmunk::common::FileId fileId,
+      bitmunk::common::FilePiece& fp);
+
+   /**
+    * Enters endgame mode if appropriate. Once every piece has been assigned
+    * and no more than the configured "endgamePieces" are outstanding, each
+    * outstanding piece, slowest first, is duplicated onto the fastest idle
+    * seller. Whichever copy finishes first is recorded and the other is
+    * interrupted.
+    *
+    * @return true if successful, false if error.
+    */
+   virtual bool startEndgame();
+
+   /**
+    * Duplicates an outstanding piece onto the fastest idle seller, if there
+    * is one. The duplicate is not recorded in the database unless it wins.
+    *
+    * @param id the unique ID of the PieceDownloader for the piece.
+    *
+    * @return true if successful, false if error.
+    */
+   virtual bool duplicatePiece(uint32_t id);
+
+   /**
+    * Cancels a PieceDownloader that lost an endgame race by interrupting it.
+    * Its result will be discarded.
+    *
+    * @param id the unique ID of the PieceDownloader.
+    */
+   virtual void cancelPieceDownloader(uint32_t id);
+
+   /**
+    * Adds or removes a piece from the assigned pieces for a contract
+    * section, both in memory and in the database.
+    *
+    * @param fileId the ID of the file the piece is for.
+    * @param csHash the contract section hash.
+    * @param fp the FilePiece.
+    * @param assigned true to add the piece, false to remove it.
+    *
+    * @return true if successful, false if error.
+    */
+   virtual bool updateAssignment(
+      bitmunk::common::FileId fileId, const char* csHash,
+      bitmunk::common::FilePiece& fp, bool assigned);
+
+   /**
+    * Removes a connection to a seller from the active sellers.
+    *
+    * @param key the seller server key.
+    */
+   virtual void releaseSeller(const char* key);
+
+   /**
+    * Adds the seller for a contract section to the blacklist.
+    *
+    * @param cs the contract section.
+    */
+   virtual void blacklistSeller(bitmunk::common::ContractSection& cs);
+
+   /**
+    * Gets the number of outstanding piece requests that may be assigned to
+    * a seller. Sellers that are downloading at less than half of the
+    * average rate of the active sellers are limited to a single outstanding
+    * piece so that the remaining work shifts to faster sellers.
+    *
+    * @param key the seller server key.
+    * @param window the configured piece request window.
+    *
+    * @return the number of outstanding pieces allowed for the seller.
+    */
+   virtual uint32_t getSellerWindow(const char* key, uint32_t window);
+
    /**
     * Handles a message by calling its more specific message handling function.
     *
@@ -236,6 +329,30 @@ protected:
     */
    virtual bool pieceUpdate(monarch::rt::DynamicObject& msg);
 
+   /**
+    * Handles a piece update message for a piece that was duplicated in
+    * endgame mode. If the piece won, the other copy is cancelled. If it
+    * lost or failed while the other copy continues, it is discarded.
+    *
+    * @param msg the message to handle.
+    * @param done set to true if the update is complete, false if it should
+    *             be handled as a regular piece update.
+    *
+    * @return true if successful, false if error.
+    */
+   virtual bool endgameUpdate(monarch::rt::DynamicObject& msg, bool& done);
+
+   /**
+    * Handles a piece nearly done message by assigning the next piece to the
+    * same seller, if its request window allows, so that the request is
+    * pipelined behind the piece that is finishing.
+    *
+    * @param msg the message to handle.
+    *
+    * @return true if successful, false if error.
+    */
+   virtual bool pipelinePiece(monarch::rt::DynamicObject& msg);
+
    /**
     * Handles a seller pool timeout message.
     *
@@ -25,7 +25,10 @@ DownloadStateFiber::DownloadStateFiber(
    mBitmunkNode(node),
    mExitData(exitData),
    mPurchaseDatabase(NULL),
-   mDownloadState(NULL)
+   mDownloadState(NULL),
+   mTotalDownloadRate(NULL),
+   mDownloadThrottler(NULL),
+   mIOMonitor(NULL)
 {
    mName = strdup(name);
    mPurchaseDatabase = PurchaseDatabase::getInstance(node);
@@ -56,6 +59,7 @@ void DownloadStateFiber::setDownloadState(DownloadState& ds)
       mBitmunkNode->getModuleApi("bitmunk.purchase.Purchase"));
    mTotalDownloadRate = ipm->getTotalDownloadRate();
    mDownloadThrottler = ipm->getDownloadThrottler(userId);
+   mIOMonitor = ipm->getIOMonitor();
 }
 
 DownloadState& DownloadStateFiber::getDownloadState()
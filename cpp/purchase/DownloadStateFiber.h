@@ -4,6 +4,7 @@
 #ifndef bitmunk_purchase_DownloadStateFiber_H
 #define bitmunk_purchase_DownloadStateFiber_H
 
+#include "bitmunk/purchase/IOMonitor.h"
 #include "bitmunk/purchase/PurchaseDatabase.h"
 #include "bitmunk/purchase/TypeDefinitions.h"
 #include "bitmunk/node/Node.h"
@@ -59,6 +60,11 @@ protected:
     */
    monarch::net::BandwidthThrottler* mDownloadThrottler;
 
+   /**
+    * The purchase module's IOMonitor.
+    */
+   IOMonitor* mIOMonitor;
+
 public:
    /**
     * Creates a new DownloadStateFiber.
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/purchase/Endgame.h"
+
+#include "bitmunk/common/Tools.h"
+#include "monarch/crypto/BigDecimal.h"
+
+#include <algorithm>
+#include <string>
+
+using namespace std;
+using namespace monarch::crypto;
+using namespace monarch::rt;
+using namespace bitmunk::common;
+using namespace bitmunk::purchase;
+
+void Endgame::choosePieces(
+   CopyList& copies, uint32_t endgamePieces, bool unassigned,
+   vector<uint32_t>& ids)
+{
+   if(endgamePieces > 0 && !unassigned)
+   {
+      // get the outstanding pieces that have not been duplicated yet,
+      // ordered by their current rate, slowest first
+      uint32_t outstanding = 0;
+      vector<pair<double, uint32_t> > pieces;
+      for(CopyList::iterator i = copies.begin(); i != copies.end(); ++i)
+      {
+         if(!i->duplicate && !i->cancelled)
+         {
+            ++outstanding;
+            if(i->twinId == 0)
+            {
+               pieces.push_back(make_pair(i->rate, i->id));
+            }
+         }
+      }
+      sort(pieces.begin(), pieces.end());
+
+      if(outstanding <= endgamePieces)
+      {
+         for(vector<pair<double, uint32_t> >::iterator i = pieces.begin();
+             i != pieces.end(); ++i)
+         {
+            ids.push_back(i->second);
+         }
+      }
+   }
+}
+
+SellerData Endgame::chooseSeller(
+   DownloadState& ds, FileProgress& progress, const char* sellerKey)
+{
+   SellerData rval(NULL);
+
+   // pick the fastest idle seller for the file
+   double bestRate = -1;
+   BigDecimal price;
+   price.setPrecision(7, Down);
+   BigDecimal budget;
+   budget.setPrecision(7, Down);
+   budget = progress["budget"]->getString();
+   SellerDataIterator si = progress["sellerData"].getIterator();
+   while(si->hasNext())
+   {
+      SellerData& sd = si->next();
+      string key = Tools::createSellerServerKey(sd["seller"]);
+      price = sd["price"]->getString();
+      if(key.length() > 0 && key != sellerKey &&
+         !ds["blacklist"]->hasMember(key.c_str()) &&
+         !ds["activeSellers"]->hasMember(key.c_str()) &&
+         price <= budget)
+      {
+         double rate = sd->hasMember("downloadRate") ?
+            sd["downloadRate"]->getDouble() : 0;
+         if(rate > bestRate)
+         {
+            rval = sd;
+            bestRate = rate;
+         }
+      }
+   }
+
+   return rval;
+}
+
+Endgame::Outcome Endgame::getOutcome(Copy& copy, bool paired, bool received)
+{
+   Outcome rval;
+
+   if(copy.cancelled)
+   {
+      rval = Discard;
+   }
+   else if(!paired)
+   {
+      rval = Unpaired;
+   }
+   else if(received)
+   {
+      rval = Won;
+   }
+   else if(copy.duplicate)
+   {
+      rval = DuplicateFailed;
+   }
+   else
+   {
+      rval = OriginalFailed;
+   }
+
+   return rval;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_purchase_Endgame_H
+#define bitmunk_purchase_Endgame_H
+
+#include "bitmunk/common/TypeDefinitions.h"
+#include "bitmunk/purchase/TypeDefinitions.h"
+
+#include <vector>
+
+namespace bitmunk
+{
+namespace purchase
+{
+
+/**
+ * The Endgame class provides the decisions a DownloadManager makes in
+ * endgame mode, where the last outstanding pieces of a download are
+ * duplicated onto idle sellers so that a slow seller cannot hold up the
+ * whole download.
+ *
+ * Each duplicated piece has two copies, the original and the duplicate,
+ * that are twins of one another. The first copy to finish wins and the
+ * other copy is cancelled. Only the winning copy is recorded as downloaded,
+ * so only one copy of a piece is paid for.
+ *
+ * @author Dave Longley
+ */
+class Endgame
+{
+public:
+   /**
+    * A copy of a piece that is being downloaded.
+    */
+   struct Copy
+   {
+      /**
+       * The ID of the PieceDownloader for the copy.
+       */
+      uint32_t id;
+
+      /**
+       * The current download rate of the copy.
+       */
+      double rate;
+
+      /**
+       * The ID of the twin of the copy, 0 if it has none.
+       */
+      uint32_t twinId;
+
+      /**
+       * True if the copy is a duplicate.
+       */
+      bool duplicate;
+
+      /**
+       * True if the copy has been cancelled.
+       */
+      bool cancelled;
+   };
+   typedef std::vector<Copy> CopyList;
+
+   /**
+    * The ways a copy of a piece can finish.
+    */
+   enum Outcome
+   {
+      /**
+       * The copy lost and was cancelled, its result is discarded.
+       */
+      Discard,
+
+      /**
+       * The copy has no twin (anymore), its result is handled as usual.
+       */
+      Unpaired,
+
+      /**
+       * The copy received the piece first, its twin is cancelled.
+       */
+      Won,
+
+      /**
+       * The duplicate failed, the original continues.
+       */
+      DuplicateFailed,
+
+      /**
+       * The original failed, the duplicate replaces it.
+       */
+      OriginalFailed
+   };
+
+   /**
+    * Chooses the pieces to duplicate. Endgame mode starts once every piece
+    * has been assigned and no more than the given number of pieces are
+    * outstanding. Pieces that already have a twin are not duplicated again.
+    *
+    * @param copies the copies that are being downloaded.
+    * @param endgamePieces the number of outstanding pieces at which endgame
+    *                      mode starts, 0 to disable it.
+    * @param unassigned true if there are still unassigned pieces.
+    * @param ids to be appended to with the PieceDownloader IDs of the
+    *            pieces to duplicate, slowest first.
+    */
+   static void choosePieces(
+      CopyList& copies, uint32_t endgamePieces, bool unassigned,
+      std::vector<uint32_t>& ids);
+
+   /**
+    * Chooses the seller to download a duplicate from: the seller with the
+    * best recorded download rate that is not already downloading from this
+    * download state, is not blacklisted, is not the seller of the original,
+    * and fits in the file's budget.
+    *
+    * @param ds the DownloadState with the blacklist and active sellers.
+    * @param progress the FileProgress for the piece's file.
+    * @param sellerKey the seller server key of the original's seller.
+    *
+    * @return the SellerData for the seller or NULL if there is none.
+    */
+   static bitmunk::common::SellerData chooseSeller(
+      DownloadState& ds, FileProgress& progress, const char* sellerKey);
+
+   /**
+    * Gets the outcome of a copy of a piece that has finished.
+    *
+    * @param copy the copy that finished.
+    * @param paired true if the copy's twin is still being downloaded.
+    * @param received true if the copy received the piece, false if it
+    *                 failed.
+    *
+    * @return the outcome.
+    */
+   static Outcome getOutcome(Copy& copy, bool paired, bool received);
+};
+
+} // end namespace purchase
+} // end namespace bitmunk
+#endif
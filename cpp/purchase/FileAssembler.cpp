@@ -455,6 +455,23 @@ bool FileAssembler::assemblePieces(FileInfo& fi)
          mDownloadState["id"]->getUInt64(),
          fi["id"]->getString());
 
+      // pieces are stored at the index of the first standard piece they
+      // cover, so pieces that are larger than the standard piece size leave
+      // gaps in the piece list, remove them so that the pieces (of mixed
+      // sizes) are read back to back in file order
+      FilePieceList pieces;
+      pieces->setType(Array);
+      FilePieceIterator pi = fi["pieces"].getIterator();
+      while(pi->hasNext())
+      {
+         FilePiece& fp = pi->next();
+         if(fp->hasMember("index"))
+         {
+            pieces->append(fp);
+         }
+      }
+      fi["pieces"] = pieces;
+
       // prepare peerbuy file
       rval = mBfp->preparePeerBuyFile(fi);
 
@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/purchase/IOMonitor.h"
+
+#include "bitmunk/purchase/PurchaseModule.h"
+#include "monarch/net/SocketTools.h"
+#include "monarch/rt/System.h"
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#endif
+
+using namespace std;
+using namespace bitmunk::node;
+using namespace bitmunk::purchase;
+using namespace monarch::modest;
+using namespace monarch::net;
+using namespace monarch::rt;
+
+/* Note: On posix systems a dispatcher waits with poll() and is woken up via
+   a pipe whenever a new watch is added. On windows, select() only works on
+   sockets, so the dispatcher instead polls its watch list at a short
+   interval. A windows fd_set holds at most FD_SETSIZE sockets, so each
+   dispatcher accepts at most that many watches. */
+#ifdef WIN32
+#define DISPATCH_INTERVAL 10
+#else
+#define DISPATCH_INTERVAL 1000
+#endif
+
+IOMonitor::Dispatcher::Dispatcher() :
+   running(false)
+{
+   wakeFds[0] = wakeFds[1] = -1;
+#ifndef WIN32
+   if(pipe(wakeFds) == 0)
+   {
+      fcntl(wakeFds[0], F_SETFL, O_NONBLOCK);
+      fcntl(wakeFds[1], F_SETFL, O_NONBLOCK);
+   }
+   else
+   {
+      wakeFds[0] = wakeFds[1] = -1;
+   }
+#endif
+}
+
+IOMonitor::Dispatcher::~Dispatcher()
+{
+#ifndef WIN32
+   if(wakeFds[0] != -1)
+   {
+      close(wakeFds[0]);
+      close(wakeFds[1]);
+   }
+#endif
+}
+
+void IOMonitor::Dispatcher::wakeup()
+{
+#ifndef WIN32
+   if(wakeFds[1] != -1)
+   {
+      char c = 0;
+      if(write(wakeFds[1], &c, 1) < 0)
+      {
+         // pipe is full, dispatcher is already awake
+      }
+   }
+#endif
+}
+
+void IOMonitor::Dispatcher::run()
+{
+#ifdef WIN32
+   fd_set rfds;
+   fd_set wfds;
+   fd_set efds;
+#else
+   // poll() is used since select() cannot watch descriptors >= FD_SETSIZE
+   vector<struct pollfd> pfds;
+   map<int, short> ready;
+#endif
+
+   lock.lock();
+   while(running)
+   {
+      if(watches.empty())
+      {
+         // wait for a watch to be added
+         lock.wait(DISPATCH_INTERVAL);
+         continue;
+      }
+
+      // build descriptor sets
+#ifdef WIN32
+      FD_ZERO(&rfds);
+      FD_ZERO(&wfds);
+      FD_ZERO(&efds);
+      int maxFd = -1;
+      for(WatchMap::iterator i = watches.begin(); i != watches.end(); ++i)
+      {
+         if(i->second.events & IOMonitor::Read)
+         {
+            FD_SET(i->first, &rfds);
+         }
+         if(i->second.events & IOMonitor::Write)
+         {
+            FD_SET(i->first, &wfds);
+         }
+         FD_SET(i->first, &efds);
+         maxFd = (i->first > maxFd) ? i->first : maxFd;
+      }
+#else
+      pfds.clear();
+      struct pollfd pfd;
+      if(wakeFds[0] != -1)
+      {
+         pfd.fd = wakeFds[0];
+         pfd.events = POLLIN;
+         pfd.revents = 0;
+         pfds.push_back(pfd);
+      }
+      for(WatchMap::iterator i = watches.begin(); i != watches.end(); ++i)
+      {
+         pfd.fd = i->first;
+         pfd.events = 0;
+         pfd.revents = 0;
+         if(i->second.events & IOMonitor::Read)
+         {
+            pfd.events |= POLLIN;
+         }
+         if(i->second.events & IOMonitor::Write)
+         {
+            pfd.events |= POLLOUT;
+         }
+         pfds.push_back(pfd);
+      }
+#endif
+
+      // wait for IO without holding the lock so watches can be added
+      lock.unlock();
+#ifdef WIN32
+      int rc = SocketTools::select(
+         maxFd + 1, &rfds, &wfds, &efds, DISPATCH_INTERVAL);
+#else
+      int rc = poll(&pfds[0], pfds.size(), DISPATCH_INTERVAL);
+#endif
+      lock.lock();
+
+#ifdef WIN32
+      if(rc < 0)
+      {
+         // a descriptor was likely closed without being unwatched, report
+         // an error to every watcher so it can check its own descriptor
+         Exception::clear();
+      }
+#else
+      // collect ready descriptors, watches may have changed while the lock
+      // was not held, an interrupted poll() only dispatches timeouts
+      ready.clear();
+      for(vector<struct pollfd>::iterator i = pfds.begin();
+          rc > 0 && i != pfds.end(); ++i)
+      {
+         if(i->revents != 0)
+         {
+            ready[i->fd] = i->revents;
+         }
+      }
+
+      // drain wake up pipe
+      if(wakeFds[0] != -1 && ready.find(wakeFds[0]) != ready.end())
+      {
+         char b[64];
+         while(read(wakeFds[0], b, 64) > 0);
+      }
+#endif
+
+      // dispatch events and timeouts, watches are one-shot
+      uint64_t now = System::getCurrentMilliseconds();
+      for(WatchMap::iterator i = watches.begin(); i != watches.end();)
+      {
+         int fd = i->first;
+         int events = 0;
+#ifdef WIN32
+         if(rc < 0)
+         {
+            events = IOMonitor::Error;
+         }
+         else if(rc > 0)
+         {
+            if((i->second.events & IOMonitor::Read) && FD_ISSET(fd, &rfds))
+            {
+               events |= IOMonitor::Read;
+            }
+            if((i->second.events & IOMonitor::Write) && FD_ISSET(fd, &wfds))
+            {
+               events |= IOMonitor::Write;
+            }
+            if(FD_ISSET(fd, &efds))
+            {
+               events |= IOMonitor::Error;
+            }
+         }
+#else
+         map<int, short>::iterator r = ready.find(fd);
+         if(r != ready.end())
+         {
+            // a hang up is reported as readable so the watcher reads the
+            // end of the stream
+            short revents = r->second;
+            if((i->second.events & IOMonitor::Read) &&
+               (revents & (POLLIN | POLLHUP)))
+            {
+               events |= IOMonitor::Read;
+            }
+            if((i->second.events & IOMonitor::Write) && (revents & POLLOUT))
+            {
+               events |= IOMonitor::Write;
+            }
+            if(revents & (POLLERR | POLLNVAL))
+            {
+               events |= IOMonitor::Error;
+            }
+            if(events == 0 && (revents & POLLHUP))
+            {
+               events |= IOMonitor::Error;
+            }
+         }
+#endif
+         if(events == 0 && i->second.expires != 0 && now >= i->second.expires)
+         {
+            events = IOMonitor::Timeout;
+         }
+
+         if(events != 0)
+         {
+            IOWatcher* watcher = i->second.watcher;
+            watches.erase(i++);
+            watcher->fdUpdated(fd, events);
+         }
+         else
+         {
+            ++i;
+         }
+      }
+   }
+   lock.unlock();
+}
+
+IOMonitor::IOMonitor()
+{
+}
+
+IOMonitor::~IOMonitor()
+{
+   IOMonitor::cleanup();
+}
+
+bool IOMonitor::initialize(Node* node, uint32_t threads)
+{
+   bool rval = true;
+
+   MO_CAT_DEBUG(BM_PURCHASE_CAT,
+      "IOMonitor starting %u IO thread(s)", threads);
+
+   // start dispatchers
+   for(uint32_t i = 0; i < ((threads == 0) ? 1 : threads); ++i)
+   {
+      Dispatcher* d = new Dispatcher();
+      d->running = true;
+      mDispatchers.push_back(d);
+
+      // operation owns the dispatcher
+      RunnableRef r = d;
+      Operation op = r;
+      mOperations.push_back(op);
+      node->runOperation(op);
+   }
+
+   return rval;
+}
+
+void IOMonitor::cleanup()
+{
+   // stop dispatchers
+   for(DispatcherList::iterator i = mDispatchers.begin();
+       i != mDispatchers.end(); ++i)
+   {
+      Dispatcher* d = *i;
+      d->lock.lock();
+      {
+         d->running = false;
+         d->watches.clear();
+         d->lock.notifyAll();
+         d->wakeup();
+      }
+      d->lock.unlock();
+   }
+
+   // wait for dispatchers to exit, dropping the operations frees them
+   mDispatchers.clear();
+   for(OperationList::iterator i = mOperations.begin();
+       i != mOperations.end(); ++i)
+   {
+      (*i)->waitFor(false);
+   }
+   mOperations.clear();
+}
+
+void IOMonitor::watch(int fd, int events, IOWatcher* watcher, uint32_t timeout)
+{
+   bool added = false;
+
+   if(!mDispatchers.empty())
+   {
+      Dispatcher* d = getDispatcher(fd);
+      d->lock.lock();
+#ifdef WIN32
+      // the descriptor must fit in the dispatcher's fd_set
+      added =
+         d->watches.size() < FD_SETSIZE ||
+         d->watches.find(fd) != d->watches.end();
+#else
+      added = true;
+#endif
+      if(added)
+      {
+         Watch& w = d->watches[fd];
+         w.watcher = watcher;
+         w.events = events;
+         w.expires = (timeout == 0) ?
+            0 : System::getCurrentMilliseconds() + timeout;
+         d->lock.notifyAll();
+         d->wakeup();
+      }
+      d->lock.unlock();
+   }
+
+   if(!added)
+   {
+      // not monitoring, report an error so the watcher does not hang
+      watcher->fdUpdated(fd, Error);
+   }
+}
+
+void IOMonitor::unwatch(int fd)
+{
+   // once the lock is acquired, no dispatch is in progress for the fd
+   if(!mDispatchers.empty())
+   {
+      Dispatcher* d = getDispatcher(fd);
+      d->lock.lock();
+      {
+         d->watches.erase(fd);
+      }
+      d->lock.unlock();
+   }
+}
+
+IOMonitor::Dispatcher* IOMonitor::getDispatcher(int fd)
+{
+   return mDispatchers[fd % mDispatchers.size()];
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_purchase_IOMonitor_H
+#define bitmunk_purchase_IOMonitor_H
+
+#include "bitmunk/node/Node.h"
+#include "monarch/modest/Operation.h"
+#include "monarch/rt/ExclusiveLock.h"
+#include "monarch/rt/Runnable.h"
+
+#include <map>
+#include <vector>
+
+namespace bitmunk
+{
+namespace purchase
+{
+
+/**
+ * An IOWatcher is notified by an IOMonitor when IO events occur on a file
+ * descriptor that it is watching.
+ *
+ * @author Dave Longley
+ */
+class IOWatcher
+{
+public:
+   /**
+    * Creates a new IOWatcher.
+    */
+   IOWatcher() {};
+
+   /**
+    * Destructs this IOWatcher.
+    */
+   virtual ~IOWatcher() {};
+
+   /**
+    * Called by an IOMonitor when IO events occur. This method is called
+    * on an IOMonitor thread and must return quickly, typically by sending
+    * a message to the fiber that will handle the IO.
+    *
+    * @param fd the file descriptor the events occurred on.
+    * @param events the IO events (a combination of IOMonitor::Events).
+    */
+   virtual void fdUpdated(int fd, int events) = 0;
+};
+
+/**
+ * An IOMonitor watches file descriptors for IO readiness on behalf of many
+ * IOWatchers using a small, fixed number of threads. This allows fibers to
+ * wait for network IO without holding a thread for the duration of the
+ * wait.
+ *
+ * Watches are one-shot: once an event (or a timeout) has been delivered
+ * for a file descriptor, it is no longer watched. An IOWatcher must call
+ * watch() again once it has consumed all of the available data and needs
+ * to wait for more.
+ *
+ * @author Dave Longley
+ */
+class IOMonitor
+{
+public:
+   /**
+    * Types of IO events.
+    */
+   enum Events
+   {
+      Read    = 1 << 0,
+      Write   = 1 << 1,
+      Error   = 1 << 2,
+      Timeout = 1 << 3
+   };
+
+protected:
+   /**
+    * A single watch on a file descriptor.
+    */
+   struct Watch
+   {
+      IOWatcher* watcher;
+      int events;
+      uint64_t expires;
+   };
+   typedef std::map<int, Watch> WatchMap;
+
+   /**
+    * An IOMonitor thread. Each thread monitors the file descriptors that
+    * hash to it.
+    */
+   class Dispatcher : public monarch::rt::Runnable
+   {
+   public:
+      /**
+       * The watches for this dispatcher.
+       */
+      WatchMap watches;
+
+      /**
+       * A lock for manipulating watches and dispatching events.
+       */
+      monarch::rt::ExclusiveLock lock;
+
+      /**
+       * Set to true while this dispatcher should keep running.
+       */
+      bool running;
+
+      /**
+       * A pipe used to wake up the dispatcher when a watch is added.
+       */
+      int wakeFds[2];
+
+   public:
+      /**
+       * Creates a new Dispatcher.
+       */
+      Dispatcher();
+
+      /**
+       * Destructs this Dispatcher.
+       */
+      virtual ~Dispatcher();
+
+      /**
+       * Wakes up this dispatcher if it is waiting for IO.
+       */
+      virtual void wakeup();
+
+      /**
+       * Waits for IO events and dispatches them to their watchers.
+       */
+      virtual void run();
+   };
+   typedef std::vector<Dispatcher*> DispatcherList;
+   typedef std::vector<monarch::modest::Operation> OperationList;
+
+   /**
+    * The dispatchers (one per IO thread).
+    */
+   DispatcherList mDispatchers;
+
+   /**
+    * The operations the dispatchers run on, these own the dispatchers.
+    */
+   OperationList mOperations;
+
+public:
+   /**
+    * Creates a new IOMonitor.
+    */
+   IOMonitor();
+
+   /**
+    * Destructs this IOMonitor.
+    */
+   virtual ~IOMonitor();
+
+   /**
+    * Starts this IOMonitor's threads.
+    *
+    * @param node the Node to run the IO threads on.
+    * @param threads the number of IO threads to use.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool initialize(bitmunk::node::Node* node, uint32_t threads);
+
+   /**
+    * Stops this IOMonitor's threads. Any pending watches are dropped.
+    */
+   virtual void cleanup();
+
+   /**
+    * Starts watching a file descriptor for the given events. If the file
+    * descriptor is already being watched, its watch is replaced. If the
+    * file descriptor cannot be watched, the watcher is notified with an
+    * Error event right away.
+    *
+    * @param fd the file descriptor to watch.
+    * @param events the events to watch for (Read and/or Write).
+    * @param watcher the IOWatcher to notify.
+    * @param timeout the number of milliseconds to wait before notifying the
+    *                watcher with a Timeout event, 0 for no timeout.
+    */
+   virtual void watch(
+      int fd, int events, IOWatcher* watcher, uint32_t timeout = 0);
+
+   /**
+    * Stops watching a file descriptor. Once this method returns, the
+    * watcher for the file descriptor will not be notified again.
+    *
+    * @param fd the file descriptor to stop watching.
+    */
+   virtual void unwatch(int fd);
+
+protected:
+   /**
+    * Gets the dispatcher for the given file descriptor.
+    *
+    * @param fd the file descriptor.
+    *
+    * @return the dispatcher.
+    */
+   virtual Dispatcher* getDispatcher(int fd);
+};
+
+} // end namespace purchase
+} // end namespace bitmunk
+#endif
@@ -5,6 +5,7 @@
 #define bitmunk_purchase_IPurchaseModule_H
 
 #include "bitmunk/purchase/DownloadThrottlerMap.h"
+#include "bitmunk/purchase/IOMonitor.h"
 #include "bitmunk/purchase/PurchaseDatabase.h"
 #include "monarch/kernel/MicroKernelModuleApi.h"
 #include "monarch/util/RateAverager.h"
@@ -56,6 +57,13 @@ public:
    virtual monarch::net::BandwidthThrottler* getDownloadThrottler(
       bitmunk::common::UserId userId) = 0;
    
+   /**
+    * Gets the IOMonitor used to wait for network IO on download connections.
+    * 
+    * @return the IOMonitor.
+    */
+   virtual IOMonitor* getIOMonitor() = 0;
+   
    /**
     * Gets a specific DownloadState according to its IDs. Its contract,
     * seller data, and file progress will all be populated.
@@ -9,9 +9,10 @@ using namespace monarch::net;
 using namespace monarch::util;
 
 IPurchaseModuleImpl::IPurchaseModuleImpl(
-   PurchaseDatabase* pd, DownloadThrottlerMap* dt) :
+   PurchaseDatabase* pd, DownloadThrottlerMap* dt, IOMonitor* iom) :
    mDatabase(pd),
-   mDownloadThrottlerMap(dt)
+   mDownloadThrottlerMap(dt),
+   mIOMonitor(iom)
 {
 }
 
@@ -34,6 +35,11 @@ BandwidthThrottler* IPurchaseModuleImpl::getDownloadThrottler(UserId userId)
    return mDownloadThrottlerMap->getUserThrottler(userId);
 }
 
+IOMonitor* IPurchaseModuleImpl::getIOMonitor()
+{
+   return mIOMonitor;
+}
+
 bool IPurchaseModuleImpl::populateDownloadState(DownloadState& ds)
 {
    return mDatabase->populateDownloadState(ds);
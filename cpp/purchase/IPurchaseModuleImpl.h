@@ -34,14 +34,21 @@ protected:
     */
    DownloadThrottlerMap* mDownloadThrottlerMap;
    
+   /**
+    * The IOMonitor for download connections.
+    */
+   IOMonitor* mIOMonitor;
+   
 public:
    /**
     * Creates a new IPurchaseModuleImpl.
     * 
     * @param pd the purchase database to use.
     * @param dm the download throttler map to use.
+    * @param iom the IOMonitor to use.
     */
-   IPurchaseModuleImpl(PurchaseDatabase* pd, DownloadThrottlerMap* dm);
+   IPurchaseModuleImpl(
+      PurchaseDatabase* pd, DownloadThrottlerMap* dm, IOMonitor* iom);
    
    /**
     * Destructs this IPurchaseModuleImpl.
@@ -72,6 +79,13 @@ public:
    virtual monarch::net::BandwidthThrottler* getDownloadThrottler(
       bitmunk::common::UserId userId);
    
+   /**
+    * Gets the IOMonitor used to wait for network IO on download connections.
+    * 
+    * @return the IOMonitor.
+    */
+   virtual IOMonitor* getIOMonitor();
+   
    /**
     * Gets a specific DownloadState according to its IDs. Its contract,
     * seller data, and file progress will all be populated.
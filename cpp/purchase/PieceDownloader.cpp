@@ -5,17 +5,22 @@
 
 #include "bitmunk/purchase/PieceDownloader.h"
 
+#include "bitmunk/purchase/PieceSizer.h"
 #include "bitmunk/purchase/PurchaseModule.h"
 #include "monarch/event/ObserverDelegate.h"
+#include "monarch/io/FileInputStream.h"
 #include "monarch/io/FileOutputStream.h"
 #include "monarch/rt/RunnableDelegate.h"
 #include "monarch/util/Timer.h"
 
+#include <algorithm>
+
 using namespace std;
 using namespace bitmunk::common;
 using namespace bitmunk::protocol;
 using namespace bitmunk::purchase;
 using namespace bitmunk::node;
+using namespace monarch::config;
 using namespace monarch::event;
 using namespace monarch::fiber;
 using namespace monarch::http;
@@ -27,20 +32,30 @@ using namespace monarch::util;
 
 #define EVENT_DOWNLOAD_STATE "bitmunk.purchase.DownloadState"
 
+/* The amount of time, in seconds, before a piece is expected to finish
+   downloading at which the next piece request to the same seller should be
+   issued. This hides the round trip between back to back pieces. */
+#define PIPELINE_LEAD_TIME 2.0
+
 PieceDownloader::PieceDownloader(Node* node, FiberId parentId) :
    NodeFiber(node, parentId),
    DownloadStateFiber(node, "PieceDownloader", &mFiberExitData),
    mUniqueId(0),
    mPieceSize(0),
+   mOffset(0),
    mSection(NULL),
    mFileId(NULL),
    mFilePiece(NULL),
    mConnection(NULL),
+   mFd(-1),
+   mResponseReceived(false),
+   mOperation(NULL),
    mRequest(NULL),
    mResponse(NULL),
    mPieceDownloadRate(NULL),
    mDownloadRate(NULL),
-   mInterrupted(false)
+   mInterrupted(false),
+   mNearlyDoneSent(false)
 {
 }
 
@@ -59,7 +74,7 @@ void PieceDownloader::initialize(
    RateAverager* pa, RateAverager* ra)
 {
    mUniqueId = id;
-   mPieceSize = pieceSize;
+   mPieceSize = PieceSizer::getPieceSize(fp, pieceSize);
    mSection = cs.clone();
    mFileId = strdup(fileId);
    mFilePiece = fp.clone();
@@ -71,47 +86,40 @@ void PieceDownloader::download()
 {
    /* Algorithm:
 
-   1. If download failed, send event, notify parent, exit.
-   2. If download would block, register with IOWatcher.
-   3. If download finished, send event, notify parent, exit.
+   1. If not connected, connect and send piece request, then wait for IO.
+   2. If response not received, receive response header.
+   3. Read as much data as possible.
+   4. If download failed, notify self.
+   5. If download would block, notify self to register with IOMonitor.
+   6. If download finished, notify self.
 
    */
 
    bool error = false;
+   bool wouldBlock = false;
 
-   // connect if not already connected
    if(mConnection == NULL)
    {
-      if(connect())
-      {
-         // FIXME: set connection to asynchronous IO when writing optimization
-         // to use IOMonitor (and maybe even move this out of an operation)
-
-         // add bandwidth throttler to connection
-         mConnection->setBandwidthThrottler(mDownloadThrottler, true);
-      }
-      else
-      {
-         error = true;
-      }
+      // connect and send request, response will come later
+      error = !connect();
+      wouldBlock = !error;
    }
-
-   if(!error)
+   else if(!mResponseReceived)
    {
-      logDownloadStateMessage("downloading piece from seller...");
-
-      // send an event that the download has started
-      sendEvent(false, EVENT_DOWNLOAD_STATE ".pieceStarted");
-
-      // FIXME: when switching to IOMonitor this will be done in the fiber
-      // with IO scheduling handled at the appropriate layer
+      // response has arrived
+      error = !receiveResponse();
+   }
 
+   if(!error && !wouldBlock)
+   {
       // keep receiving and writing data while success
       bool success = true;
-      char b[2048];
-      int numBytes;
+      bool breach = false;
+      char* b = mTransferBuffer.data();
+      int length = mTransferBuffer.size();
+      int numBytes = 0;
       uint64_t start = System::getCurrentMilliseconds();
-      while(success && (numBytes = mInputStream->read(b, 2048)) > 0)
+      while(success && (numBytes = mInputStream->read(b, length)) > 0)
       {
          mTotalDownloadRate->addItems(numBytes, start);
          mDownloadRate->addItems(numBytes, start);
@@ -120,12 +128,30 @@ void PieceDownloader::download()
          start = System::getCurrentMilliseconds();
       }
 
-      if(success && numBytes == 0)
+      if(numBytes < 0)
+      {
+         ExceptionRef e = Exception::get();
+         if(!e.isNull() && e->getDetails()->hasMember("wouldBlock"))
+         {
+            // no more data available yet, wait for IO
+            Exception::clear();
+            wouldBlock = true;
+         }
+         else
+         {
+            success = false;
+         }
+      }
+      else if(success)
       {
          // check content security
          mInMessage.checkContentSecurity(
             mResponse->getHeader(), &(*mTrailer), &(*mSignature));
-         if(mInMessage.getSecurityStatus() == BtpMessage::Breach)
+         // a resumed piece must have a content signature, it is the only
+         // check on the data that was already received
+         BtpMessage::SecurityStatus status = mInMessage.getSecurityStatus();
+         if(status == BtpMessage::Breach ||
+            (mOffset > 0 && status != BtpMessage::Secure))
          {
             // set exception
             ExceptionRef e = new Exception(
@@ -134,45 +160,27 @@ void PieceDownloader::download()
             e->getDetails()["resource"] = mUrl.toString().c_str();
             Exception::set(e);
             success = false;
+            breach = true;
          }
       }
 
-      if(numBytes < 0 || !success)
+      if(!success)
       {
-         ExceptionRef e = Exception::get();
-         if(true)//!e->getDetails()->hasMember("wouldBlock"))
-         {
-            // download failed:
-            error = true;
-
-            // disconnect
-            mConnection->close();
+         // download failed
+         error = true;
+         disconnect(false);
 
-            // clean up
-            delete mConnection;
-            delete mRequest;
-            delete mResponse;
-            mOutputStream->close();
-            mOutputStream.setNull();
-         }
-         else
+         // only data interrupted by a transport error may be resumed, data
+         // that failed the security check must be downloaded again
+         if(breach)
          {
-            // download would block, register with IOWatcher (which
-            // will wakeup piece downloader to run step 2 again)
-            // FIXME: use &PieceDownloader::fdUpdated;
+            discardPartialPiece();
          }
       }
-      else
+      else if(!wouldBlock)
       {
-         // disconnect
-         mConnection->close();
-
-         // clean up
-         delete mConnection;
-         delete mRequest;
-         delete mResponse;
-         mOutputStream->close();
-         mOutputStream.setNull();
+         // release connection so it can be reused for the next piece
+         disconnect(true);
 
          // download finished
          logDownloadStateMessage("piece download finished");
@@ -194,6 +202,29 @@ void PieceDownloader::download()
          mFilePiece["size"]->setType(UInt32);
          // FIXME: check errno
 
+         // the resumed and received data must make up the whole piece
+         uint64_t received =
+            mOffset + mPieceDownloadRate->getTotalItemCount();
+         if(received != mFilePiece["size"]->getUInt32())
+         {
+            ExceptionRef e = new Exception(
+               "Received piece size does not match the piece size sent "
+               "by the seller.",
+               "bitmunk.purchase.PieceDownloader.InvalidPieceSize");
+            e->getDetails()["received"] = received;
+            e->getDetails()["offset"] = mOffset;
+            e->getDetails()["size"] = mFilePiece["size"]->getUInt32();
+            Exception::set(e);
+            error = true;
+
+            // do not try to resume the piece
+            discardPartialPiece();
+         }
+         else
+         {
+            mFilePiece->removeMember("partial");
+         }
+
          // bfp signature on piece
          mTrailer->getField("Bitmunk-Bfp-Signature", value);
          mFilePiece["bfpSignature"] = value.c_str();
@@ -235,10 +266,17 @@ void PieceDownloader::download()
 
    // create message regarding operation completion
    DynamicObject msg;
-   msg["pieceReceived"] = !error;
-   if(error)
+   if(wouldBlock)
    {
-      msg["exception"] = Exception::getAsDynamicObject();
+      msg["pieceWouldBlock"] = true;
+   }
+   else
+   {
+      msg["pieceReceived"] = !error;
+      if(error)
+      {
+         msg["exception"] = Exception::getAsDynamicObject();
+      }
    }
 
    // send message to self
@@ -247,24 +285,13 @@ void PieceDownloader::download()
 
 void PieceDownloader::fdUpdated(int fd, int events)
 {
-   // FIXME: this code must be changed to send a message to self like the
-   // download operation does -- this ensures that interrupting this fiber
-   // happens cleanly
-
-   /*
-   // FIXME: determine if error based on events
-   bool error = false;
-
-   if(error)
-   {
-      // create exception for given IO error event
-      // FIXME: get specific event error
-      ExceptionRef e = new Exception(
-         "FIXME: I am an exception that occurred while waiting for IO "
-         "in the purchase module's PieceDownloader class");
-      sendEvent(true, NULL);
-   }
-   */
+   // send a message to self, like the download operation does, this
+   // ensures that interrupting this fiber happens cleanly
+   DynamicObject msg;
+   msg["fdUpdated"] = true;
+   msg["fd"] = fd;
+   msg["events"] = events;
+   messageSelf(msg);
 }
 
 void PieceDownloader::processMessages()
@@ -282,22 +309,19 @@ void PieceDownloader::processMessages()
    BM_ID_SET(msg["fileId"], mFileId);
    messageParent(msg);
 
-   // run a new download operation
-   RunnableRef r = new RunnableDelegate<PieceDownloader>(
-      this, &PieceDownloader::download);
-   Operation op = r;
-   getNode()->runOperation(op);
+   // run a new download operation to connect
+   runDownloadOperation();
 
    // wait for messages
    const char* keys[] =
-      {"interrupt", "pieceReceived", "pieceFailed", NULL};
+      {"interrupt", "pieceReceived", "pieceWouldBlock", "fdUpdated", NULL};
    bool pieceReceived = false;
    bool done = false;
    while(!done)
    {
       DynamicObject list = waitForMessages(keys);
       DynamicObjectIterator i = list.getIterator();
-      while(i->hasNext())
+      while(!done && i->hasNext())
       {
          DynamicObject& msg = i->next();
 
@@ -320,19 +344,75 @@ void PieceDownloader::processMessages()
                   sendEvent(true, NULL);
                }
 
-               // interrupt download operation
-               op->interrupt();
+               if(mOperation.isNull())
+               {
+                  // waiting on IO, stop now
+                  disconnect(false);
+                  done = true;
+               }
+               else
+               {
+                  // interrupt download operation
+                  mOperation->interrupt();
+               }
+            }
+         }
+         // download operation would block, wait for IO
+         else if(msg->hasMember("pieceWouldBlock"))
+         {
+            mOperation.setNull();
+            if(mInterrupted)
+            {
+               disconnect(false);
+               done = true;
+            }
+            else
+            {
+               // let parent pipeline the next piece if this one is nearly
+               // finished
+               checkNearlyDone();
+
+               // bfp->startReading() may take more than 30 seconds to
+               // execute on seller side, so wait for up to 2 minutes
+               mIOMonitor->watch(mFd, IOMonitor::Read, this, 120000);
+            }
+         }
+         // IO is ready or timed out
+         else if(msg->hasMember("fdUpdated"))
+         {
+            if(msg["events"]->getInt32() & IOMonitor::Timeout)
+            {
+               disconnect(false);
+
+               ExceptionRef e = new Exception(
+                  "Timed out while waiting for seller to send piece.",
+                  "bitmunk.purchase.PieceDownloader.Timeout");
+               e->getDetails()["resource"] = mUrl.toString().c_str();
+               Exception::set(e);
+               if(!mInterrupted)
+               {
+                  sendEvent(true, NULL);
+               }
+               done = true;
+            }
+            else if(!mInterrupted)
+            {
+               // run a new download operation to handle the IO
+               runDownloadOperation();
             }
          }
          // message regards receiving piece
          else if(msg["pieceReceived"]->getBoolean())
          {
+            mOperation.setNull();
             sendEvent(false, EVENT_DOWNLOAD_STATE ".pieceFinished");
             pieceReceived = done = true;
          }
          // piece failed message
          else
          {
+            mOperation.setNull();
+
             // only send an error event if there was no interruption
             if(!mInterrupted)
             {
@@ -367,6 +447,22 @@ void PieceDownloader::processMessages()
    {
       logDownloadStateMessage("finished with error");
 
+      // once the response is received the piece file only contains data
+      // from this section, so unless the data was discarded because it
+      // could not be trusted, remember that it can be resumed from it
+      if(mResponseReceived)
+      {
+         File file(mFilePiece["path"]->getString());
+         if(file->exists() && file->getLength() > 0)
+         {
+            mFilePiece["partial"]["csHash"] = mSection["hash"]->getString();
+         }
+         else
+         {
+            mFilePiece->removeMember("partial");
+         }
+      }
+
       // send message to parent that piece has failed
       DynamicObject msg;
       msg["pieceDownloaderId"] = mUniqueId;
@@ -381,6 +477,32 @@ void PieceDownloader::processMessages()
    }
 }
 
+void PieceDownloader::checkNearlyDone()
+{
+   if(!mNearlyDoneSent && mResponseReceived)
+   {
+      // estimate the time until the piece is finished
+      uint64_t received = mOffset + mPieceDownloadRate->getTotalItemCount();
+      uint64_t remaining =
+         (received >= mPieceSize) ? 0 : mPieceSize - received;
+      double rate = mPieceDownloadRate->getItemsPerSecond();
+      if(rate > 0 && remaining / rate < PIPELINE_LEAD_TIME)
+      {
+         mNearlyDoneSent = true;
+
+         // send message to parent that piece is nearly done
+         DynamicObject msg;
+         msg["pieceDownloaderId"] = mUniqueId;
+         msg["downloadStateId"] = mDownloadState["id"]->getUInt64();
+         BM_ID_SET(msg["userId"], BM_USER_ID(mDownloadState["userId"]));
+         msg["pieceNearlyDone"] = true;
+         msg["section"] = mSection;
+         BM_ID_SET(msg["fileId"], mFileId);
+         messageParent(msg);
+      }
+   }
+}
+
 bool PieceDownloader::connect()
 {
    bool rval = false;
@@ -408,7 +530,8 @@ bool PieceDownloader::connect()
       BM_ID_SET(pieceRequest["fileId"], mFileId);
       BM_ID_SET(pieceRequest["mediaId"], mediaId);
       pieceRequest["index"] = mFilePiece["index"]->getUInt32();
-      // use full standard piece size, seller may truncate if last piece
+      // use full piece size (the index is relative to it), seller may
+      // truncate if last piece
       pieceRequest["size"] = mPieceSize;
       pieceRequest["peerbuyKey"] = mSection["peerbuyKey"]->getString();
       BM_ID_SET(
@@ -416,6 +539,21 @@ bool PieceDownloader::connect()
          BM_PROFILE_ID(mSection["seller"]["profileId"]));
       BM_ID_SET(pieceRequest["bfpId"], BM_BFP_ID(mFilePiece["bfpId"]));
 
+      // resume partial piece data if it came from the same section, data
+      // from any other seller or section is different
+      mOffset = 0;
+      if(mFilePiece->hasMember("partial") &&
+         strcmp(mFilePiece["partial"]["csHash"]->getString(),
+            mSection["hash"]->getString()) == 0)
+      {
+         File file(mFilePiece["path"]->getString());
+         if(file->exists() && file->getLength() < mPieceSize)
+         {
+            mOffset = file->getLength();
+            pieceRequest["offset"] = mOffset;
+         }
+      }
+
       // setup btp messages
       mOutMessage.setDynamicObject(pieceRequest);
       mOutMessage.setType(BtpMessage::Post);
@@ -437,66 +575,226 @@ bool PieceDownloader::connect()
          BM_SERVER_ID(mSection["seller"]["serverId"]),
          mUrl.toString().c_str());
 
-      // connect to seller
+      // ask seller to keep the connection alive for the next piece
+      mOutMessage.getCustomHeaders()["Connection"] = "keep-alive";
+
+      // connect to seller, reusing an idle connection if possible
       // bfp->startReading() may take more than 30 seconds to execute
-      // on seller side, so clients should set their read timeouts to
-      // something high like 2-5 minutes
-      // FIXME: this may need to be done in the IOMonitor/IOWatcher, not
-      // on the connection
+      // on seller side, the response is waited for using the IOMonitor
+      // so that no thread is held while the seller prepares the piece
       BtpClient* btpc = getNode()->getMessenger()->getBtpClient();
-      mConnection = btpc->createConnection(
-         BM_USER_ID(mSection["seller"]["userId"]), &mUrl, 120);
-      if((rval = (mConnection != NULL)))
+      bool reused = true;
+      rval = false;
+      for(int tries = 0; !rval && reused && tries < 2; ++tries)
       {
-         logDownloadStateMessage("connected to seller...");
+         mConnection = btpc->getConnection(
+            BM_USER_ID(mSection["seller"]["userId"]), &mUrl, 120, &reused);
+         if((rval = (mConnection != NULL)))
+         {
+            logDownloadStateMessage(reused ?
+               "reusing connection to seller..." : "connected to seller...");
 
-         // create request and response
-         mRequest = mConnection->createRequest();
-         mResponse = mRequest->createResponse();
+            // add bandwidth throttler to connection
+            mConnection->setBandwidthThrottler(mDownloadThrottler, true);
+            mFd = mConnection->getSocket()->getFileDescriptor();
 
-         // send message
-         if((rval = btpc->sendMessage(
-            &mUrl, &mOutMessage, mRequest, &mInMessage, mResponse)))
-         {
-            logDownloadStateMessage("preparing to download piece...");
+            // create request and response
+            mRequest = mConnection->createRequest();
+            mResponse = mRequest->createResponse();
 
-            // get receive content stream
-            mInMessage.getContentReceiveStream(
-               mResponse, mInputStream, mTrailer, mSignature);
+            // send message, response will be received once it is available
+            rval = mOutMessage.send(&mUrl, mRequest);
+         }
 
-            // set up output stream
-            File file(mFilePiece["path"]->getString());
-            if(!(rval = file->mkdirs()))
-            {
-               ExceptionRef e = new Exception(
-                  "Failed to create output directory for downloading file "
-                  "pieces.",
-                  "bitmunk.purchase.PieceDownloader.OutputFileWriteError");
-               e->getDetails()["path"] = file->getPath();
-               Exception::push(e);
-            }
-            else
+         if(!rval)
+         {
+            // clean up, a reused connection may have been closed by the
+            // seller while it was idle, so try again with a new one
+            disconnect(false);
+            if(reused)
             {
-               mOutputStream = new FileOutputStream(file);
+               Exception::clear();
             }
          }
       }
+   }
+
+   return rval;
+}
+
+bool PieceDownloader::receiveResponse()
+{
+   bool rval = false;
+   bool unreadable = false;
+
+   // receive response
+   BtpClient* btpc = getNode()->getMessenger()->getBtpClient();
+   if((rval = btpc->receiveMessage(&mUrl, mRequest, &mInMessage, mResponse)))
+   {
+      logDownloadStateMessage("downloading piece from seller...");
+      mResponseReceived = true;
+
+      // get receive content stream
+      mInMessage.getContentReceiveStream(
+         mResponse, mInputStream, mTrailer, mSignature);
 
-      if(!rval)
+      // set up output stream
+      File file(mFilePiece["path"]->getString());
+      if(!(rval = file->mkdirs()))
       {
-         // clean up
-         if(mConnection != NULL)
+         ExceptionRef e = new Exception(
+            "Failed to create output directory for downloading file "
+            "pieces.",
+            "bitmunk.purchase.PieceDownloader.OutputFileWriteError");
+         e->getDetails()["path"] = file->getPath();
+         Exception::push(e);
+      }
+      else
+      {
+         // allocate transfer buffer
+         Config cfg = getNode()->getConfigManager()->getModuleUserConfig(
+            "bitmunk.purchase.Purchase",
+            BM_USER_ID(mDownloadState["userId"]));
+         rval = mTransferBuffer.allocate(
+            TransferBuffer::getConfiguredSize(cfg));
+      }
+
+      if(rval)
+      {
+         // the seller may not be able to resume at the requested offset
+         string value;
+         uint32_t offset = 0;
+         if(mResponse->getHeader()->getField("Bitmunk-Piece-Offset", value))
          {
-            mConnection->close();
-            delete mConnection;
-            delete mRequest;
-            delete mResponse;
+            offset = strtoul(value.c_str(), NULL, 10);
+         }
+         if(mOffset > 0 && offset == mOffset)
+         {
+            MO_CAT_DEBUG(BM_PURCHASE_CAT,
+               "UserId %" PRIu64 ", DownloadState %" PRIu64 ": "
+               "resuming piece at offset %u",
+               BM_USER_ID(mDownloadState["userId"]),
+               mDownloadState["id"]->getUInt64(), mOffset);
+
+            // the seller's content signature covers the whole piece, so
+            // the data being resumed from must be added to it, otherwise
+            // that data would never be checked
+            if(!mSignature.isNull())
+            {
+               FileInputStream fis(file);
+               char* b = mTransferBuffer.data();
+               uint32_t remaining = mOffset;
+               int numBytes = 0;
+               while(remaining > 0 && (numBytes = fis.read(
+                  b, std::min((uint32_t)mTransferBuffer.size(), remaining)))
+                  > 0)
+               {
+                  mSignature->update(b, numBytes);
+                  remaining -= numBytes;
+               }
+               fis.close();
+
+               if(remaining > 0)
+               {
+                  ExceptionRef e = new Exception(
+                     "Could not read partially downloaded piece data.",
+                     "bitmunk.purchase.PieceDownloader.InputFileReadError");
+                  e->getDetails()["path"] = file->getPath();
+                  Exception::push(e);
+                  unreadable = true;
+                  rval = false;
+               }
+            }
+         }
+         else
+         {
+            mOffset = 0;
          }
       }
+
+      if(rval)
+      {
+         // append to a resumed piece, otherwise start a new piece file
+         mOutputStream = new FileOutputStream(file, mOffset > 0);
+
+         // read piece data without blocking from now on
+         mConnection->getSocket()->setNonBlocking(true);
+
+         // send an event that the download has started
+         sendEvent(false, EVENT_DOWNLOAD_STATE ".pieceStarted");
+      }
+   }
+
+   if(!rval)
+   {
+      // clean up
+      disconnect(false);
+
+      // the data to resume from could not be checked
+      if(unreadable)
+      {
+         discardPartialPiece();
+      }
    }
 
    return rval;
 }
+
+void PieceDownloader::disconnect(bool keepAlive)
+{
+   if(mConnection != NULL)
+   {
+      // stop watching for IO
+      mIOMonitor->unwatch(mFd);
+      mFd = -1;
+
+      if(keepAlive)
+      {
+         // give connection back to the client for the next piece
+         mConnection->getSocket()->setNonBlocking(false);
+         BtpClient* btpc = getNode()->getMessenger()->getBtpClient();
+         btpc->releaseConnection(
+            BM_USER_ID(mSection["seller"]["userId"]), &mUrl,
+            mConnection, mResponse);
+      }
+      else
+      {
+         // disconnect
+         mConnection->close();
+         delete mConnection;
+      }
+
+      // clean up
+      delete mRequest;
+      delete mResponse;
+      mConnection = NULL;
+      mRequest = NULL;
+      mResponse = NULL;
+   }
+
+   if(!mOutputStream.isNull())
+   {
+      mOutputStream->close();
+      mOutputStream.setNull();
+   }
+}
+
+void PieceDownloader::discardPartialPiece()
+{
+   mOffset = 0;
+   mFilePiece->removeMember("partial");
+   File file(mFilePiece["path"]->getString());
+   file->remove();
+}
+
+void PieceDownloader::runDownloadOperation()
+{
+   RunnableRef r = new RunnableDelegate<PieceDownloader>(
+      this, &PieceDownloader::download);
+   mOperation = r;
+   getNode()->runOperation(mOperation);
+}
+
 // FIXME: clean these parameters up, its ugly
 void PieceDownloader::sendEvent(bool error, const char* type)
 {
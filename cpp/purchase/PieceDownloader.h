@@ -6,6 +6,7 @@
 
 #include "bitmunk/purchase/DownloadStateFiber.h"
 #include "bitmunk/node/NodeFiber.h"
+#include "bitmunk/common/TransferBuffer.h"
 #include "monarch/event/ObserverList.h"
 #include "monarch/http/HttpConnection.h"
 
@@ -17,21 +18,41 @@ namespace purchase
 /**
  * A PieceDownloader is used to download a file piece from a seller that has
  * a negotiated contract section in the sqlite3 database. The data is pulled
- * using nonblocking IO and libev and then written to disk in a piece file.
+ * using nonblocking IO and the purchase module's IOMonitor and then written
+ * to disk in a piece file.
+ *
+ * To connect, the PieceDownloader spawns an Operation that connects to the
+ * seller and sends the piece request. It then registers the connection with
+ * the IOMonitor and goes inactive until the seller's response arrives.
  *
  * To read, the PieceDownloader spawns an Operation that reads as much as it
  * can from the seller and then goes inactive. The Operation may reach a
- * "wouldBlock" exception. If it does, then it simply returns and unloops the
- * libev event.
+ * "wouldBlock" exception. If it does, then it simply returns and the
+ * PieceDownloader registers with the IOMonitor again.
+ *
+ * When new data arrives, the IOMonitor calls fdUpdated() which sends a
+ * message to the PieceDownloader -- which, in turn, will cause another
+ * Operation to be spawned to handle the IO. If the Operation actually
+ * finishes the piece download, then the PieceDownloader exits. No thread is
+ * held while waiting for the seller.
  *
- * When a new libev event occurs, the PieceDownloader will be activated by
- * an IOWatcher -- which, in turn, will cause another Operation to be spawned
- * to handle the IO. If the Operation actually finishes the piece download,
- * then the PieceDownloader exits.
+ * If a download fails after some data was received, the piece is marked
+ * with the contract section the partial data came from. If the piece is
+ * later assigned to the same section, the download is resumed by requesting
+ * the remaining data and appending it to the piece file. A seller can only
+ * resume from its cached output for the piece (any new output uses new
+ * keys), so it reports the offset it actually used and the piece file is
+ * truncated if that offset differs. When resuming, the seller's content
+ * signature covers the whole piece, so the data already in the piece file
+ * is added to the signature before the rest is received and the piece is
+ * discarded if the signature does not match.
  *
  * @author Dave Longley
  */
-class PieceDownloader : public bitmunk::node::NodeFiber, public DownloadStateFiber
+class PieceDownloader :
+public bitmunk::node::NodeFiber,
+public DownloadStateFiber,
+public IOWatcher
 {
 protected:
    /**
@@ -45,6 +66,12 @@ protected:
     */
    uint32_t mPieceSize;
 
+   /**
+    * The offset into the piece data that the download started at when a
+    * partial piece is being resumed.
+    */
+   uint32_t mOffset;
+
    /**
     * The contract section this piece downloader is assigned to.
     */
@@ -70,6 +97,21 @@ protected:
     */
    monarch::http::HttpConnection* mConnection;
 
+   /**
+    * The file descriptor for the connection, -1 if not connected.
+    */
+   int mFd;
+
+   /**
+    * Set to true once the seller's response header has been received.
+    */
+   bool mResponseReceived;
+
+   /**
+    * The current IO Operation, NULL if none is running.
+    */
+   monarch::modest::Operation mOperation;
+
    /**
     * The http request.
     */
@@ -110,6 +152,11 @@ protected:
     */
    monarch::io::OutputStreamRef mOutputStream;
 
+   /**
+    * The buffer used to move data from the seller to the piece file.
+    */
+   bitmunk::common::TransferBuffer mTransferBuffer;
+
    /**
     * A rate averager for receiving a piece.
     */
@@ -125,6 +172,12 @@ protected:
     */
    bool mInterrupted;
 
+   /**
+    * Set to true once the parent has been told that this piece is nearly
+    * finished so that it can pipeline the next piece request.
+    */
+   bool mNearlyDoneSent;
+
 public:
    /**
     * Creates a new PieceDownloader.
@@ -144,7 +197,8 @@ public:
     * called before starting the piece downloader.
     *
     * @param id a unique ID assigned by a download manager.
-    * @param pieceSize the standard (maximum) piece size.
+    * @param pieceSize the standard (minimum) piece size, the piece's own
+    *                  "pieceSize" is used instead if it has one.
     * @param cs the ContractSection to download pieces for.
     * @param fileId the ID of the file to download.
     * @param fp the FilePiece to download.
@@ -161,12 +215,17 @@ public:
       monarch::util::RateAverager* ra);
 
    /**
-    * Downloads a file piece.
+    * Downloads a file piece. This method is run in an Operation and performs
+    * as much IO as it can without blocking. It will connect to the seller and
+    * send the piece request if not already connected, receive the seller's
+    * response once it is available, and then read piece data until the
+    * piece is finished or no more data is available.
     */
    virtual void download();
 
    /**
-    * Called when IO events occur.
+    * Called by the IOMonitor when IO events occur. Sends a message to this
+    * fiber so that the IO can be handled in a new Operation.
     *
     * @param fd the file descriptor the events occurred on.
     * @param events the IO events.
@@ -181,12 +240,50 @@ protected:
    virtual void processMessages();
 
    /**
-    * Connects to the seller to download a file piece.
+    * Sends a "pieceNearlyDone" message to the parent once the remaining
+    * piece data is expected to arrive shortly. This allows the parent to
+    * issue the next piece request to the same seller before this one
+    * finishes.
+    */
+   virtual void checkNearlyDone();
+
+   /**
+    * Connects to the seller and sends the request for a file piece. The
+    * response must be received via receiveResponse() once it is available.
     *
     * @return true if successful, false if an exception occurred.
     */
    virtual bool connect();
 
+   /**
+    * Receives the seller's response to the piece request and prepares to
+    * receive the piece data using nonblocking IO.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool receiveResponse();
+
+   /**
+    * Stops watching the connection for IO and cleans up. The connection is
+    * either closed or, if the piece was fully received and the seller
+    * permits it, given back to the BtpClient to be reused.
+    *
+    * @param keepAlive true to try to reuse the connection, false to close it.
+    */
+   virtual void disconnect(bool keepAlive);
+
+   /**
+    * Discards any partially downloaded data for the piece so that it will
+    * not be resumed. Used when the received data cannot be trusted. Must be
+    * called after disconnecting.
+    */
+   virtual void discardPartialPiece();
+
+   /**
+    * Runs a new download Operation.
+    */
+   virtual void runDownloadOperation();
+
    /**
     * Sends an event about piece download.
     *
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#include "bitmunk/purchase/PieceSizer.h"
+
+#include "bitmunk/purchase/PurchaseModule.h"
+
+#include <map>
+
+using namespace std;
+using namespace monarch::rt;
+using namespace bitmunk::common;
+using namespace bitmunk::purchase;
+
+uint32_t PieceSizer::getPieceSize(FilePiece& fp, uint32_t minSize)
+{
+   return fp->hasMember("pieceSize") ?
+      fp["pieceSize"]->getUInt32() : minSize;
+}
+
+uint32_t PieceSizer::getFirstUnit(FilePiece& fp, uint32_t minSize)
+{
+   return fp["index"]->getUInt32() * getUnitCount(fp, minSize);
+}
+
+uint32_t PieceSizer::getUnitCount(FilePiece& fp, uint32_t minSize)
+{
+   uint32_t rval = 1;
+
+   uint32_t pieceSize = getPieceSize(fp, minSize);
+   if(minSize > 0 && pieceSize > minSize)
+   {
+      rval = pieceSize / minSize;
+   }
+
+   return rval;
+}
+
+bool PieceSizer::isSamePiece(FilePiece& fp1, FilePiece& fp2)
+{
+   uint32_t size1 = fp1->hasMember("pieceSize") ?
+      fp1["pieceSize"]->getUInt32() : 0;
+   uint32_t size2 = fp2->hasMember("pieceSize") ?
+      fp2["pieceSize"]->getUInt32() : 0;
+   return
+      size1 == size2 &&
+      fp1["index"]->getUInt32() == fp2["index"]->getUInt32();
+}
+
+uint32_t PieceSizer::choosePieceSize(
+   SellerData& sd, SellerPool& sp, DynamicObject& cfg)
+{
+   uint32_t rval = sp["pieceSize"]->getUInt32();
+
+   // larger pieces can only be paid for if the SVA accepts them for the
+   // file, in which case it sets the largest piece size it accepts in the
+   // seller pool, otherwise only standard pieces are used
+   uint64_t maxSize = sp->hasMember("maxPieceSize") ?
+      sp["maxPieceSize"]->getUInt64() : 0;
+   if(cfg->hasMember("maxPieceSize") &&
+      cfg["maxPieceSize"]->getUInt64() < maxSize)
+   {
+      maxSize = cfg["maxPieceSize"]->getUInt64();
+   }
+
+   // a seller without an observed rate always gets standard pieces
+   double rate = sd->hasMember("downloadRate") ?
+      sd["downloadRate"]->getDouble() : 0.0;
+   double time = cfg->hasMember("targetPieceTime") ?
+      cfg["targetPieceTime"]->getDouble() : 0.0;
+   if(rval > 0 && rate > 0 && time > 0)
+   {
+      // double the piece size while the seller can deliver it in time
+      double target = rate * time;
+      while((uint64_t)rval * 2 <= maxSize && rval * 2.0 <= target)
+      {
+         rval *= 2;
+      }
+   }
+
+   return rval;
+}
+
+FilePiece PieceSizer::takePiece(
+   FilePieceList& unassigned, uint32_t pieceSize, uint32_t minSize)
+{
+   FilePiece rval = unassigned[0];
+
+   // only standard pieces can be merged, a larger piece that was unassigned
+   // (ie: because its download failed) is reassigned as-is
+   bool merged = false;
+   uint32_t count = (minSize == 0) ? 1 : pieceSize / minSize;
+   if(count > 1 && !rval->hasMember("pieceSize"))
+   {
+      // map the unassigned standard units to their sizes
+      map<uint32_t, uint32_t> units;
+      FilePieceIterator i = unassigned.getIterator();
+      while(i->hasNext())
+      {
+         FilePiece& fp = i->next();
+         if(!fp->hasMember("pieceSize"))
+         {
+            units[fp["index"]->getUInt32()] = fp["size"]->getUInt32();
+         }
+      }
+
+      // find the largest aligned run of unassigned units, note that a size
+      // of 0 means the full file size so such a unit is never merged
+      uint32_t first = rval["index"]->getUInt32();
+      uint64_t size = 0;
+      while(!merged && count > 1)
+      {
+         if(first % count == 0)
+         {
+            size = 0;
+            uint32_t n = 0;
+            map<uint32_t, uint32_t>::iterator ui = units.find(first);
+            for(; n < count && ui != units.end() &&
+                ui->first == first + n && ui->second > 0; ++n, ++ui)
+            {
+               size += ui->second;
+            }
+            merged = (n == count);
+         }
+         if(!merged)
+         {
+            count /= 2;
+         }
+      }
+
+      if(merged)
+      {
+         // remove the merged units
+         i = unassigned.getIterator();
+         while(i->hasNext())
+         {
+            FilePiece& fp = i->next();
+            uint32_t index = fp["index"]->getUInt32();
+            if(!fp->hasMember("pieceSize") &&
+               index >= first && index < first + count)
+            {
+               i->remove();
+            }
+         }
+
+         // create merged piece, its index is relative to its own size
+         FilePiece piece;
+         piece["index"] = first / count;
+         piece["pieceSize"] = minSize * count;
+         piece["size"] = (uint32_t)size;
+         BM_ID_SET(piece["bfpId"], BM_BFP_ID(rval["bfpId"]));
+         rval = piece;
+
+         MO_CAT_DEBUG(BM_PURCHASE_CAT,
+            "PieceSizer merged %u pieces starting at piece %u into "
+            "a piece of size %u",
+            count, first, minSize * count);
+      }
+   }
+
+   if(!merged)
+   {
+      // take first piece as-is
+      FilePieceIterator i = unassigned.getIterator();
+      i->next();
+      i->remove();
+   }
+
+   return rval;
+}
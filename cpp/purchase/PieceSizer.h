@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_purchase_PieceSizer_H
+#define bitmunk_purchase_PieceSizer_H
+
+#include "bitmunk/common/TypeDefinitions.h"
+#include "bitmunk/purchase/TypeDefinitions.h"
+
+namespace bitmunk
+{
+namespace purchase
+{
+
+/**
+ * The PieceSizer class provides shared utility algorithms for adaptive piece
+ * sizing.
+ *
+ * A SellerPool's "pieceSize" is the minimum piece size for a file. A fast
+ * seller may be assigned a larger piece that covers several consecutive
+ * minimum-sized pieces (units) so that fewer requests, signatures, and
+ * payments are needed per megabyte. A larger piece's size is always a power
+ * of two multiple of the minimum piece size and it always starts on a
+ * multiple of its own size, so the seller can locate it using its index and
+ * piece size alone, just like a standard piece.
+ *
+ * A FilePiece with a larger size stores it in its "pieceSize" member and its
+ * "index" is relative to that size. A FilePiece without a "pieceSize" member
+ * is a standard, minimum-sized piece.
+ *
+ * Sellers already locate any piece using the requested index and size, but
+ * the SVA must also accept larger pieces when they are paid for. It does so
+ * by setting a "maxPieceSize" in the file's SellerPool. Without it, only
+ * standard pieces are assigned and downloads behave exactly as before.
+ *
+ * @author Dave Longley
+ */
+class PieceSizer
+{
+public:
+   /**
+    * Gets the piece size that a piece's index is relative to.
+    *
+    * @param fp the FilePiece.
+    * @param minSize the minimum piece size for the file.
+    *
+    * @return the piece size.
+    */
+   static uint32_t getPieceSize(
+      bitmunk::common::FilePiece& fp, uint32_t minSize);
+
+   /**
+    * Gets the index of the first unit (minimum-sized piece) that a piece
+    * covers.
+    *
+    * @param fp the FilePiece.
+    * @param minSize the minimum piece size for the file.
+    *
+    * @return the index of the first unit.
+    */
+   static uint32_t getFirstUnit(
+      bitmunk::common::FilePiece& fp, uint32_t minSize);
+
+   /**
+    * Gets the number of units (minimum-sized pieces) that a piece covers.
+    *
+    * @param fp the FilePiece.
+    * @param minSize the minimum piece size for the file.
+    *
+    * @return the number of units.
+    */
+   static uint32_t getUnitCount(
+      bitmunk::common::FilePiece& fp, uint32_t minSize);
+
+   /**
+    * Returns true if the two FilePieces refer to the same piece of a file.
+    *
+    * @param fp1 the first FilePiece.
+    * @param fp2 the second FilePiece.
+    *
+    * @return true if the pieces are the same, false if not.
+    */
+   static bool isSamePiece(
+      bitmunk::common::FilePiece& fp1, bitmunk::common::FilePiece& fp2);
+
+   /**
+    * Chooses the piece size to use for a seller based on its observed
+    * download rate. The largest piece size that the seller is expected to
+    * deliver within the target piece time is chosen.
+    *
+    * Larger pieces are only chosen if the seller pool has a "maxPieceSize",
+    * which the SVA sets when it accepts them for data purchases of the
+    * file. Otherwise the standard piece size is always chosen.
+    *
+    * @param sd the SellerData for the seller.
+    * @param sp the SellerPool for the file.
+    * @param cfg the purchase configuration with optional "maxPieceSize"
+    *            (in bytes) and "targetPieceTime" (in seconds) members.
+    *
+    * @return the piece size to use.
+    */
+   static uint32_t choosePieceSize(
+      bitmunk::common::SellerData& sd, bitmunk::common::SellerPool& sp,
+      monarch::rt::DynamicObject& cfg);
+
+   /**
+    * Takes the first piece from a list of unassigned pieces, merging it with
+    * the consecutive unassigned units that follow it into a single piece of
+    * up to the given size. The piece size is reduced until the first piece
+    * is aligned to it and all of the units it would cover are unassigned.
+    * The taken pieces are removed from the list.
+    *
+    * @param unassigned the list of unassigned pieces (must not be empty).
+    * @param pieceSize the desired piece size.
+    * @param minSize the minimum piece size for the file.
+    *
+    * @return the piece to assign.
+    */
+   static bitmunk::common::FilePiece takePiece(
+      bitmunk::common::FilePieceList& unassigned,
+      uint32_t pieceSize, uint32_t minSize);
+};
+
+} // end namespace purchase
+} // end namespace bitmunk
+#endif
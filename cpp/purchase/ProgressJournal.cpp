@@ -0,0 +1,663 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#define __STDC_FORMAT_MACROS
+
+#include "bitmunk/purchase/ProgressJournal.h"
+
+#include "bitmunk/purchase/PurchaseDatabase.h"
+#include "bitmunk/purchase/PurchaseModule.h"
+#include "monarch/data/json/JsonReader.h"
+#include "monarch/data/json/JsonWriter.h"
+#include "monarch/io/ByteArrayInputStream.h"
+#include "monarch/io/ByteBuffer.h"
+#include "monarch/io/File.h"
+#include "monarch/io/FileOutputStream.h"
+#include "monarch/rt/System.h"
+
+#include <cerrno>
+#include <cstring>
+#include <list>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+using namespace std;
+using namespace monarch::data::json;
+using namespace monarch::io;
+using namespace monarch::modest;
+using namespace monarch::rt;
+using namespace monarch::sql;
+using namespace bitmunk::common;
+using namespace bitmunk::node;
+using namespace bitmunk::purchase;
+
+#define JOURNAL_EXCEPTION "bitmunk.purchase.ProgressJournal"
+
+ProgressJournal::Flusher::Flusher() :
+   journal(NULL),
+   running(false)
+{
+}
+
+ProgressJournal::Flusher::~Flusher()
+{
+}
+
+void ProgressJournal::Flusher::run()
+{
+   lock.lock();
+   while(running)
+   {
+      lock.wait(journal->mFlushInterval);
+      if(running)
+      {
+         journal->flushExpired();
+      }
+   }
+   lock.unlock();
+}
+
+ProgressJournal::ProgressJournal(PurchaseDatabase* db) :
+   mNode(NULL),
+   mDatabase(db),
+   mMaxEntries(0),
+   mFlushInterval(0),
+   mFlusher(NULL),
+   mFlusherOp(NULL),
+   mRecords(0),
+   mCoalesced(0),
+   mFlushes(0)
+{
+}
+
+ProgressJournal::~ProgressJournal()
+{
+   ProgressJournal::cleanup();
+}
+
+bool ProgressJournal::initialize(Node* node, DynamicObject& cfg)
+{
+   bool rval = true;
+
+   mNode = node;
+   mPath = cfg->hasMember("path") ?
+      cfg["path"]->getString() :
+      "bitmunk.purchase.Purchase/purchase.journal";
+   mMaxEntries = cfg->hasMember("maxEntries") ?
+      cfg["maxEntries"]->getUInt32() : 0;
+   mFlushInterval = cfg->hasMember("flushInterval") ?
+      cfg["flushInterval"]->getUInt32() : 0;
+
+   if(mMaxEntries > 0 && mFlushInterval > 0)
+   {
+      MO_CAT_DEBUG(BM_PURCHASE_CAT,
+         "ProgressJournal flushing every %u entries or %u ms",
+         mMaxEntries, mFlushInterval);
+
+      // operation owns the flusher
+      mFlusher = new Flusher();
+      mFlusher->journal = this;
+      mFlusher->running = true;
+      RunnableRef r = mFlusher;
+      mFlusherOp = r;
+      node->runOperation(mFlusherOp);
+   }
+
+   return rval;
+}
+
+void ProgressJournal::cleanup()
+{
+   // stop flusher
+   if(mFlusher != NULL)
+   {
+      mFlusher->lock.lock();
+      {
+         mFlusher->running = false;
+         mFlusher->lock.notifyAll();
+      }
+      mFlusher->lock.unlock();
+      mFlusherOp->waitFor(false);
+      mFlusherOp.setNull();
+      mFlusher = NULL;
+   }
+
+   // flush everything that is still pending
+   if(mMaxEntries > 0)
+   {
+      list<UserId> users;
+      mLock.lock();
+      {
+         for(UserJournalMap::iterator i = mJournals.begin();
+             i != mJournals.end(); ++i)
+         {
+            users.push_back(i->first);
+         }
+      }
+      mLock.unlock();
+
+      for(list<UserId>::iterator i = users.begin(); i != users.end(); ++i)
+      {
+         if(!flush(*i))
+         {
+            // records remain in the journal file and will be replayed
+            Exception::clear();
+         }
+      }
+      mMaxEntries = 0;
+   }
+}
+
+bool ProgressJournal::isEnabled()
+{
+   return mMaxEntries > 0;
+}
+
+bool ProgressJournal::add(UserId userId, DynamicObject& records)
+{
+   bool rval = false;
+   bool full = false;
+
+   mLock.lock();
+   {
+      UserJournal* uj = getJournal(userId);
+      if(uj != NULL &&
+         (rval = writeRecords(uj->path.c_str(), records, true)))
+      {
+         if(uj->pending.empty())
+         {
+            uj->since = System::getCurrentMilliseconds();
+         }
+
+         DynamicObjectIterator i = records.getIterator();
+         while(i->hasNext())
+         {
+            DynamicObject& record = i->next();
+            ++mRecords;
+            if(coalesce(uj->pending, record))
+            {
+               ++mCoalesced;
+            }
+         }
+         full = (uj->pending.size() >= mMaxEntries);
+      }
+   }
+   mLock.unlock();
+
+   if(full && !flush(userId))
+   {
+      // the records are safe in the journal file, try again later
+      MO_CAT_ERROR(BM_PURCHASE_CAT,
+         "UserId %" PRIu64 ": could not flush progress journal: %s",
+         userId,
+         JsonWriter::writeToString(Exception::getAsDynamicObject()).c_str());
+      Exception::clear();
+   }
+
+   return rval;
+}
+
+bool ProgressJournal::flush(UserId userId, Connection* conn)
+{
+   bool rval = true;
+
+   // check for pending records
+   bool pending = false;
+   mLock.lock();
+   {
+      UserJournalMap::iterator i = mJournals.find(userId);
+      pending = (i != mJournals.end() && !i->second.pending.empty());
+   }
+   mLock.unlock();
+
+   // Note: The connection must be obtained before the flush lock, a thread
+   // that already holds a connection may be waiting for the flush lock.
+   Connection* c = NULL;
+   if(pending)
+   {
+      c = (conn == NULL ? mDatabase->getConnection(userId) : conn);
+      rval = (c != NULL);
+   }
+
+   if(pending && rval)
+   {
+      // hold flush lock so that batches for a user are written in order
+      mFlushLock.lock();
+
+      // take pending records
+      map<string, DynamicObject> batch;
+      mLock.lock();
+      {
+         batch.swap(mJournals[userId].pending);
+      }
+      mLock.unlock();
+
+      if(!batch.empty())
+      {
+         DynamicObject records;
+         records->setType(Array);
+         for(map<string, DynamicObject>::iterator i = batch.begin();
+             i != batch.end(); ++i)
+         {
+            records->append(i->second);
+         }
+
+         rval = mDatabase->writeFileProgress(userId, records, c);
+
+         mLock.lock();
+         {
+            UserJournal& uj = mJournals[userId];
+            if(rval)
+            {
+               // the journal only needs the records added since the take
+               ++mFlushes;
+               if(!rewrite(uj))
+               {
+                  // the flushed records will be replayed, which is harmless
+                  Exception::clear();
+               }
+            }
+            else
+            {
+               // put records back unless newer ones have been added
+               if(uj.pending.empty())
+               {
+                  uj.since = System::getCurrentMilliseconds();
+               }
+               for(map<string, DynamicObject>::iterator i = batch.begin();
+                   i != batch.end(); ++i)
+               {
+                  uj.pending.insert(*i);
+               }
+            }
+         }
+         mLock.unlock();
+
+         if(rval)
+         {
+            MO_CAT_DEBUG(BM_PURCHASE_CAT,
+               "UserId %" PRIu64 ": flushed %u progress journal entries",
+               userId, (uint32_t)batch.size());
+         }
+      }
+
+      mFlushLock.unlock();
+   }
+
+   if(c != NULL && conn == NULL)
+   {
+      // close connection
+      c->close();
+   }
+
+   return rval;
+}
+
+void ProgressJournal::discard(UserId userId, DownloadStateId dsId)
+{
+   mFlushLock.lock();
+   mLock.lock();
+   {
+      UserJournalMap::iterator i = mJournals.find(userId);
+      if(i != mJournals.end())
+      {
+         map<string, DynamicObject>& pending = i->second.pending;
+         for(map<string, DynamicObject>::iterator pi = pending.begin();
+             pi != pending.end();)
+         {
+            if(pi->second["dsId"]->getUInt64() == dsId)
+            {
+               pending.erase(pi++);
+            }
+            else
+            {
+               ++pi;
+            }
+         }
+
+         if(!rewrite(i->second))
+         {
+            Exception::clear();
+         }
+      }
+   }
+   mLock.unlock();
+   mFlushLock.unlock();
+}
+
+bool ProgressJournal::replay(UserId userId, Connection* conn)
+{
+   bool rval = true;
+
+   if(isEnabled())
+   {
+      mFlushLock.lock();
+      mLock.lock();
+      {
+         UserJournal* uj = getJournal(userId);
+         rval = (uj != NULL);
+         File file(rval ? uj->path.c_str() : "");
+         if(rval && file->exists() && file->getLength() > 0)
+         {
+            // read journal file
+            ByteBuffer b(file->getLength());
+            rval = file.readBytes(&b);
+
+            // coalesce records in the order they were written, a torn final
+            // line (from a crash while appending) is ignored
+            map<string, DynamicObject> pending;
+            const char* start = b.data();
+            const char* end = b.data() + b.length();
+            uint32_t count = 0;
+            JsonReader reader;
+            while(rval && start < end)
+            {
+               const char* eol = (const char*)memchr(start, '\n', end - start);
+               if(eol == NULL)
+               {
+                  break;
+               }
+
+               DynamicObject record;
+               ByteArrayInputStream bais(start, eol - start);
+               reader.start(record);
+               if(!(reader.read(&bais) && reader.finish()))
+               {
+                  MO_CAT_WARNING(BM_PURCHASE_CAT,
+                     "UserId %" PRIu64 ": ignoring corrupt progress journal "
+                     "entry in '%s'", userId, uj->path.c_str());
+                  Exception::clear();
+                  break;
+               }
+               coalesce(pending, record);
+               ++count;
+               start = eol + 1;
+            }
+
+            if(rval && !pending.empty())
+            {
+               DynamicObject records;
+               records->setType(Array);
+               for(map<string, DynamicObject>::iterator i = pending.begin();
+                   i != pending.end(); ++i)
+               {
+                  records->append(i->second);
+               }
+               rval = mDatabase->writeFileProgress(userId, records, conn);
+            }
+
+            if(rval)
+            {
+               MO_CAT_INFO(BM_PURCHASE_CAT,
+                  "UserId %" PRIu64 ": replayed %u progress journal entries",
+                  userId, count);
+               rval = rewrite(*uj);
+            }
+         }
+      }
+      mLock.unlock();
+      mFlushLock.unlock();
+
+      if(!rval)
+      {
+         ExceptionRef e = new Exception(
+            "Could not replay purchase progress journal.",
+            JOURNAL_EXCEPTION ".ReplayError");
+         BM_ID_SET(e->getDetails()["userId"], userId);
+         Exception::push(e);
+      }
+   }
+
+   return rval;
+}
+
+DynamicObject ProgressJournal::getStats()
+{
+   DynamicObject rval;
+
+   mLock.lock();
+   {
+      uint32_t pending = 0;
+      for(UserJournalMap::iterator i = mJournals.begin();
+          i != mJournals.end(); ++i)
+      {
+         pending += i->second.pending.size();
+      }
+      rval["pending"] = pending;
+      rval["records"] = mRecords;
+      rval["coalesced"] = mCoalesced;
+      rval["flushes"] = mFlushes;
+   }
+   mLock.unlock();
+
+   return rval;
+}
+
+string ProgressJournal::createKey(DynamicObject& record)
+{
+   // key is "<dsId>|<fileId>|<csHash>|<index>[|paid]"
+   char tmp[22];
+   snprintf(tmp, 22, "%" PRIu64, record["dsId"]->getUInt64());
+   string key = tmp;
+   key.push_back('|');
+   key.append(record["fileId"]->getString());
+   key.push_back('|');
+   key.append(record["csHash"]->getString());
+   snprintf(tmp, 22, "|%" PRIu32, record["index"]->getUInt32());
+   key.append(tmp);
+   if(strcmp(record["status"]->getString(), "paid") == 0)
+   {
+      key.append("|paid");
+   }
+   return key;
+}
+
+void ProgressJournal::flushExpired()
+{
+   // find users with expired records
+   list<UserId> users;
+   uint64_t now = System::getCurrentMilliseconds();
+   mLock.lock();
+   {
+      for(UserJournalMap::iterator i = mJournals.begin();
+          i != mJournals.end(); ++i)
+      {
+         if(!i->second.pending.empty() &&
+            now - i->second.since >= mFlushInterval)
+         {
+            users.push_back(i->first);
+         }
+      }
+   }
+   mLock.unlock();
+
+   for(list<UserId>::iterator i = users.begin(); i != users.end(); ++i)
+   {
+      if(!flush(*i))
+      {
+         MO_CAT_ERROR(BM_PURCHASE_CAT,
+            "UserId %" PRIu64 ": could not flush progress journal: %s",
+            *i,
+            JsonWriter::writeToString(
+               Exception::getAsDynamicObject()).c_str());
+         Exception::clear();
+      }
+   }
+}
+
+ProgressJournal::UserJournal* ProgressJournal::getJournal(UserId userId)
+{
+   UserJournal* rval = NULL;
+
+   UserJournalMap::iterator i = mJournals.find(userId);
+   if(i != mJournals.end())
+   {
+      rval = &i->second;
+   }
+   else
+   {
+      string path;
+      if(mNode->getConfigManager()->expandUserDataPath(
+         mPath.c_str(), userId, path))
+      {
+         rval = &mJournals[userId];
+         rval->path = path;
+         rval->since = 0;
+      }
+      else
+      {
+         ExceptionRef e = new Exception(
+            "Could not get purchase progress journal path.",
+            JOURNAL_EXCEPTION ".InvalidPath");
+         BM_ID_SET(e->getDetails()["userId"], userId);
+         e->getDetails()["path"] = mPath.c_str();
+         Exception::push(e);
+      }
+   }
+
+   return rval;
+}
+
+bool ProgressJournal::coalesce(
+   map<string, DynamicObject>& pending, DynamicObject& record)
+{
+   bool rval;
+
+   string key = createKey(record);
+   map<string, DynamicObject>::iterator i = pending.find(key);
+   if((rval = (i != pending.end())))
+   {
+      i->second = record;
+   }
+   else
+   {
+      pending.insert(make_pair(key, record));
+   }
+
+   return rval;
+}
+
+bool ProgressJournal::rewrite(UserJournal& uj)
+{
+   bool rval;
+
+   DynamicObject records;
+   records->setType(Array);
+   for(map<string, DynamicObject>::iterator i = uj.pending.begin();
+       i != uj.pending.end(); ++i)
+   {
+      records->append(i->second);
+   }
+
+   // write to a temporary file first so a crash never truncates the journal,
+   // the temporary file is synced before it replaces the journal and the
+   // directory is synced afterwards so that the rename itself is durable
+   string tmp = uj.path + ".tmp";
+   File tmpFile(tmp.c_str());
+   File file(uj.path.c_str());
+   rval =
+      writeRecords(tmp.c_str(), records, false) &&
+      tmpFile->rename(file) &&
+      syncDirectory(File::dirname(uj.path.c_str()).c_str());
+
+   return rval;
+}
+
+bool ProgressJournal::writeRecords(
+   const char* path, DynamicObject& records, bool append)
+{
+   bool rval = true;
+
+   // one compact json record per line
+   string lines;
+   DynamicObjectIterator i = records.getIterator();
+   while(i->hasNext())
+   {
+      lines.append(JsonWriter::writeToString(i->next(), true));
+      lines.push_back('\n');
+   }
+
+#ifndef WIN32
+   // the records are synced to disk before returning, a record that was
+   // only written to the page cache would be lost in a power failure
+   int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+   int fd = open(path, flags, 0644);
+   rval = (fd != -1);
+   const char* data = lines.c_str();
+   size_t length = lines.length();
+   while(rval && length > 0)
+   {
+      ssize_t written = write(fd, data, length);
+      if(written > 0)
+      {
+         data += written;
+         length -= written;
+      }
+      else
+      {
+         rval = (written == -1 && errno == EINTR);
+      }
+   }
+   rval = rval && (fsync(fd) == 0);
+   if(fd != -1 && close(fd) != 0)
+   {
+      rval = false;
+   }
+
+   if(!rval)
+   {
+      ExceptionRef e = new Exception(
+         "Could not write purchase progress journal.",
+         JOURNAL_EXCEPTION ".WriteError");
+      e->getDetails()["path"] = path;
+      e->getDetails()["error"] = strerror(errno);
+      Exception::set(e);
+   }
+#else
+   File file(path);
+   FileOutputStream fos(file, append);
+   rval =
+      fos.write(lines.c_str(), lines.length()) &&
+      fos.finish();
+   fos.close();
+
+   if(!rval)
+   {
+      ExceptionRef e = new Exception(
+         "Could not write purchase progress journal.",
+         JOURNAL_EXCEPTION ".WriteError");
+      e->getDetails()["path"] = path;
+      Exception::push(e);
+   }
+#endif
+
+   return rval;
+}
+
+bool ProgressJournal::syncDirectory(const char* path)
+{
+   bool rval = true;
+
+#ifndef WIN32
+   int fd = open(path, O_RDONLY);
+   rval = (fd != -1 && fsync(fd) == 0);
+   if(!rval)
+   {
+      ExceptionRef e = new Exception(
+         "Could not sync purchase progress journal directory.",
+         JOURNAL_EXCEPTION ".WriteError");
+      e->getDetails()["path"] = path;
+      e->getDetails()["error"] = strerror(errno);
+      Exception::set(e);
+   }
+   if(fd != -1)
+   {
+      close(fd);
+   }
+#endif
+
+   return rval;
+}
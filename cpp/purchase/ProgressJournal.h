@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#ifndef bitmunk_purchase_ProgressJournal_H
+#define bitmunk_purchase_ProgressJournal_H
+
+#include "bitmunk/common/TypeDefinitions.h"
+#include "bitmunk/node/Node.h"
+#include "monarch/modest/Operation.h"
+#include "monarch/rt/ExclusiveLock.h"
+#include "monarch/sql/Connection.h"
+
+#include <map>
+#include <string>
+
+namespace bitmunk
+{
+namespace purchase
+{
+
+// forward declarations
+class PurchaseDatabase;
+
+/**
+ * A ProgressJournal batches file piece progress updates for a
+ * PurchaseDatabase.
+ *
+ * Every piece state change is first appended to a per-user journal file and
+ * then kept in memory, where it replaces any older pending change for the
+ * same piece. The pending changes for a user are written to the database in
+ * a single transaction once enough of them have accumulated or once the
+ * oldest of them has waited for the flush interval. After a successful flush
+ * the journal file is rewritten to contain only the changes that are still
+ * pending.
+ *
+ * If the node stops without flushing, the journal file is replayed the next
+ * time the user's database is initialized. Replaying a change that has
+ * already been written is harmless because each change replaces the
+ * database entry for its piece.
+ *
+ * A journal record is a normalized database entry stored as a single line
+ * of compact JSON:
+ *
+ * {
+ *    "dsId": the DownloadStateId,
+ *    "fileId": the FileId,
+ *    "csHash": the ContractSection hash,
+ *    "index": the index of the first standard piece covered,
+ *    "pieceSize": the size the piece's index is relative to,
+ *    "status": the piece status,
+ *    "piece": the FilePiece
+ * }
+ *
+ * @author Dave Longley
+ */
+class ProgressJournal
+{
+protected:
+   /**
+    * The journal state for a single user.
+    */
+   struct UserJournal
+   {
+      /**
+       * The path to the journal file.
+       */
+      std::string path;
+
+      /**
+       * The pending records, keyed by piece.
+       */
+      std::map<std::string, monarch::rt::DynamicObject> pending;
+
+      /**
+       * The time at which the oldest pending record was added.
+       */
+      uint64_t since;
+   };
+   typedef std::map<bitmunk::common::UserId, UserJournal> UserJournalMap;
+
+   /**
+    * The flusher thread, which flushes pending records that have waited for
+    * the flush interval.
+    */
+   class Flusher : public monarch::rt::Runnable
+   {
+   public:
+      /**
+       * The journal to flush.
+       */
+      ProgressJournal* journal;
+
+      /**
+       * A lock to wait on between flushes.
+       */
+      monarch::rt::ExclusiveLock lock;
+
+      /**
+       * Set to true while this flusher should keep running.
+       */
+      bool running;
+
+   public:
+      /**
+       * Creates a new Flusher.
+       */
+      Flusher();
+
+      /**
+       * Destructs this Flusher.
+       */
+      virtual ~Flusher();
+
+      /**
+       * Periodically flushes expired records.
+       */
+      virtual void run();
+   };
+
+   /**
+    * The Node.
+    */
+   bitmunk::node::Node* mNode;
+
+   /**
+    * The database to flush records to.
+    */
+   PurchaseDatabase* mDatabase;
+
+   /**
+    * The journal file path, relative to the user data path.
+    */
+   std::string mPath;
+
+   /**
+    * The number of pending records for a user that triggers a flush, 0 if
+    * journaling is disabled.
+    */
+   uint32_t mMaxEntries;
+
+   /**
+    * The maximum number of milliseconds a record may stay pending.
+    */
+   uint32_t mFlushInterval;
+
+   /**
+    * The per-user journals.
+    */
+   UserJournalMap mJournals;
+
+   /**
+    * A lock for manipulating the journals.
+    */
+   monarch::rt::ExclusiveLock mLock;
+
+   /**
+    * A lock held while writing records to the database so that flushes are
+    * applied in order.
+    */
+   monarch::rt::ExclusiveLock mFlushLock;
+
+   /**
+    * The flusher and the operation it runs on.
+    */
+   Flusher* mFlusher;
+   monarch::modest::Operation mFlusherOp;
+
+   /**
+    * Statistics.
+    */
+   uint64_t mRecords;
+   uint64_t mCoalesced;
+   uint64_t mFlushes;
+
+public:
+   /**
+    * Creates a new ProgressJournal.
+    *
+    * @param db the PurchaseDatabase to flush records to.
+    */
+   ProgressJournal(PurchaseDatabase* db);
+
+   /**
+    * Destructs this ProgressJournal.
+    */
+   virtual ~ProgressJournal();
+
+   /**
+    * Initializes this journal. Journaling is disabled (and every update is
+    * written through) if the configuration has no "maxEntries".
+    *
+    * @param node the Node.
+    * @param cfg the journal configuration with "path" (relative to the user
+    *            data path), "maxEntries", and "flushInterval" (in
+    *            milliseconds) members.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool initialize(
+      bitmunk::node::Node* node, monarch::rt::DynamicObject& cfg);
+
+   /**
+    * Stops the flusher and flushes all pending records.
+    */
+   virtual void cleanup();
+
+   /**
+    * Returns true if journaling is enabled.
+    *
+    * @return true if journaling is enabled, false if not.
+    */
+   virtual bool isEnabled();
+
+   /**
+    * Adds records to a user's journal. A flush is performed if the user
+    * now has too many pending records.
+    *
+    * @param userId the ID of the user.
+    * @param records the records to add.
+    *
+    * @return true if the records were journaled, false if not.
+    */
+   virtual bool add(
+      bitmunk::common::UserId userId, monarch::rt::DynamicObject& records);
+
+   /**
+    * Writes all of a user's pending records to the database.
+    *
+    * @param userId the ID of the user.
+    * @param conn the connection to use, NULL to open and close one.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool flush(
+      bitmunk::common::UserId userId, monarch::sql::Connection* conn = NULL);
+
+   /**
+    * Drops all of a user's pending records for a download state that is
+    * being deleted.
+    *
+    * @param userId the ID of the user.
+    * @param dsId the ID of the DownloadState.
+    */
+   virtual void discard(
+      bitmunk::common::UserId userId, bitmunk::common::DownloadStateId dsId);
+
+   /**
+    * Replays the records left in a user's journal file by a previous run.
+    *
+    * @param userId the ID of the user.
+    * @param conn the connection to use.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool replay(
+      bitmunk::common::UserId userId, monarch::sql::Connection* conn);
+
+   /**
+    * Gets statistics for this journal:
+    *
+    * {
+    *    "pending": the number of pending records,
+    *    "records": the number of records added,
+    *    "coalesced": records replaced by a newer record before a flush,
+    *    "flushes": the number of successful flushes
+    * }
+    *
+    * @return the statistics.
+    */
+   virtual monarch::rt::DynamicObject getStats();
+
+   /**
+    * Creates the key for a record. Paid records have their own keys because
+    * updating a piece does not replace its paid database entry.
+    *
+    * @param record the record.
+    *
+    * @return the key.
+    */
+   static std::string createKey(monarch::rt::DynamicObject& record);
+
+protected:
+   /**
+    * Flushes the pending records of every user whose oldest pending record
+    * has waited for the flush interval.
+    */
+   virtual void flushExpired();
+
+   /**
+    * Gets the journal for a user, creating it if necessary. The journal lock
+    * must be held.
+    *
+    * @param userId the ID of the user.
+    *
+    * @return the journal or NULL if an exception occurred.
+    */
+   virtual UserJournal* getJournal(bitmunk::common::UserId userId);
+
+   /**
+    * Adds a record to a map of pending records, replacing any older record
+    * for the same piece.
+    *
+    * @param pending the pending records.
+    * @param record the record to add.
+    *
+    * @return true if an older record was replaced, false if not.
+    */
+   virtual bool coalesce(
+      std::map<std::string, monarch::rt::DynamicObject>& pending,
+      monarch::rt::DynamicObject& record);
+
+   /**
+    * Rewrites a journal file so that it only contains the pending records.
+    * The journal lock must be held.
+    *
+    * @param uj the journal.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool rewrite(UserJournal& uj);
+
+   /**
+    * Appends records to a journal file and syncs them to disk.
+    *
+    * @param path the path to the journal file.
+    * @param records the records to append.
+    * @param append false to replace the file.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool writeRecords(
+      const char* path, monarch::rt::DynamicObject& records, bool append);
+
+   /**
+    * Syncs a directory to disk so that a file renamed into it is durable.
+    *
+    * @param path the path to the directory.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool syncDirectory(const char* path);
+
+   friend class Flusher;
+};
+
+} // end namespace purchase
+} // end namespace bitmunk
+#endif
@@ -7,6 +7,8 @@
 
 #include "bitmunk/common/Tools.h"
 #include "bitmunk/purchase/IPurchaseModule.h"
+#include "bitmunk/purchase/PieceSizer.h"
+#include "bitmunk/purchase/ProgressJournal.h"
 #include "bitmunk/purchase/PurchaseModule.h"
 #include "monarch/data/json/JsonReader.h"
 #include "monarch/data/json/JsonWriter.h"
@@ -37,16 +39,29 @@ using namespace monarch::util;
 #define DOWNLOAD_STATES_V3_1_TABLE "download_states_v3_1"
 #define SELLER_DATA_V3_1_TABLE     "seller_data_v3_1"
 #define SELLER_POOLS_V3_1_TABLE    "seller_pools_v3_1"
+#define SELLER_DATA_V3_3_TABLE     "seller_data_v3_3"
+#define SELLER_POOLS_V3_3_TABLE    "seller_pools_v3_3"
+#define FILE_PIECES_V3_3_TABLE     "file_pieces_v3_3"
+
+// sub-query for the file key of the file ID bound as ":fileId"
+#define FILE_KEY_SELECT \
+   "(SELECT file_key FROM file_keys WHERE file_id=:fileId)"
 
 PurchaseDatabase::PurchaseDatabase() :
    mNode(NULL),
    mPerUserDB(NULL),
-   mConnectionGroupId(0)
+   mConnectionGroupId(0),
+   mProgressJournal(NULL)
 {
+   mProgressJournal = new ProgressJournal(this);
 }
 
 PurchaseDatabase::~PurchaseDatabase()
 {
+   // write batched progress while the database is still available
+   mProgressJournal->cleanup();
+   delete mProgressJournal;
+
    if(mConnectionGroupId != 0)
    {
       // unregister connection group
@@ -112,6 +127,21 @@ bool PurchaseDatabase::initialize(Node* node)
       }
    }
 
+   if(rval)
+   {
+      // initialize progress journal, progress is written through if it
+      // is not configured
+      Config cfg = mNode->getConfigManager()->getModuleConfig(
+         "bitmunk.purchase.Purchase");
+      DynamicObject journalCfg;
+      journalCfg->setType(Map);
+      if(!cfg.isNull() && cfg->hasMember("progressJournal"))
+      {
+         journalCfg = cfg["progressJournal"];
+      }
+      rval = mProgressJournal->initialize(mNode, journalCfg);
+   }
+
    return rval;
 }
 
@@ -384,32 +414,31 @@ static bool _createTables(Connection* conn)
       }
    }
 
-   // FIXME: create separate table to map file keys to file IDs
-   // to allow sharing between seller_data, seller_pools, and
-   // file_pieces tables
-
-   // statement to create seller data table
+   // statement to create file keys table, which maps file IDs to small
+   // integer keys that are shared between the seller_data, seller_pools,
+   // and file_pieces tables
    if(rval)
    {
       Statement* s = conn->prepare(
-         "CREATE TABLE IF NOT EXISTS seller_data ("
-         "download_state_id BIGINT UNSIGNED,"
-         "user_id BIGINT UNSIGNED,"
-         "file_id VARCHAR(40),"
-         "price VARCHAR(20),"
-         "section TEXT)");
+         "CREATE TABLE IF NOT EXISTS file_keys ("
+         "file_key INTEGER PRIMARY KEY AUTOINCREMENT,"
+         "file_id VARCHAR(40) UNIQUE)");
       if((rval = (s != NULL)))
       {
          rval = s->execute();
       }
    }
 
-   // statement to create index for seller data table
+   // statement to create seller data table
    if(rval)
    {
       Statement* s = conn->prepare(
-         "CREATE INDEX IF NOT EXISTS seller_data_index ON seller_data ("
-         "download_state_id,user_id,file_id)");
+         "CREATE TABLE IF NOT EXISTS seller_data ("
+         "download_state_id BIGINT UNSIGNED,"
+         "user_id BIGINT UNSIGNED,"
+         "file_key INTEGER UNSIGNED,"
+         "price VARCHAR(20),"
+         "section TEXT)");
       if((rval = (s != NULL)))
       {
          rval = s->execute();
@@ -425,11 +454,11 @@ static bool _createTables(Connection* conn)
          "CREATE TABLE IF NOT EXISTS seller_pools ("
          "download_state_id BIGINT UNSIGNED,"
          "user_id BIGINT UNSIGNED,"
-         "file_id VARCHAR(40),"
+         "file_key INTEGER UNSIGNED,"
          "seller_pool TEXT,"
          "micro_payment_cost TEXT,"
          "budget TEXT,"
-         "PRIMARY KEY(download_state_id,user_id,file_id))");
+         "PRIMARY KEY(download_state_id,user_id,file_key))");
       if((rval = (s != NULL)))
       {
          rval = s->execute();
@@ -445,12 +474,13 @@ static bool _createTables(Connection* conn)
          "CREATE TABLE IF NOT EXISTS file_pieces ("
          "download_state_id BIGINT UNSIGNED,"
          "user_id BIGINT UNSIGNED,"
-         "file_id VARCHAR(40),"
+         "file_key INTEGER UNSIGNED,"
          "piece_index INTEGER UNSIGNED,"
          "valid TINYINT UNSIGNED,"
          "section_hash VARCHAR(40),"
          "status VARCHAR(12),"
-         "file_piece TEXT)");
+         "file_piece TEXT,"
+         "piece_size INTEGER UNSIGNED DEFAULT 0)");
       if((rval = (s != NULL)))
       {
          rval = s->execute();
@@ -495,6 +525,61 @@ static bool _createTables(Connection* conn)
    return rval;
 }
 
+/**
+ * Create the indexes for the purchase tables if they don't exist. The tables
+ * must already be in the latest format, so during a migration this must only
+ * be called once every table that stores file keys has been migrated. This
+ * method should be called inside a transaction and not call commit().
+ *
+ * @param conn an open connection to use to initialize the database which
+ *           should not be closed.
+ *
+ * @return true if successful, false if an exception occurred.
+ */
+static bool _createIndexes(Connection* conn)
+{
+   bool rval;
+
+   // statement to create index for looking up a user's download states
+   {
+      Statement* s = conn->prepare(
+         "CREATE INDEX IF NOT EXISTS download_states_user_index "
+         "ON download_states (user_id)");
+      if((rval = (s != NULL)))
+      {
+         rval = s->execute();
+      }
+   }
+
+   // statement to create index for seller data table
+   if(rval)
+   {
+      Statement* s = conn->prepare(
+         "CREATE INDEX IF NOT EXISTS seller_data_key_index ON seller_data ("
+         "download_state_id,user_id,file_key)");
+      if((rval = (s != NULL)))
+      {
+         rval = s->execute();
+      }
+   }
+
+   // statement to create index for file pieces table, it covers the
+   // columns used to find the entry for a piece when it is updated
+   if(rval)
+   {
+      Statement* s = conn->prepare(
+         "CREATE INDEX IF NOT EXISTS file_pieces_index ON file_pieces ("
+         "download_state_id,user_id,file_key,piece_index,section_hash,"
+         "status)");
+      if((rval = (s != NULL)))
+      {
+         rval = s->execute();
+      }
+   }
+
+   return rval;
+}
+
 /**
  * Drop tables used for migration. This should only be called when it is safe
  * to drop migration tables. Due to locking issues this has to be called
@@ -508,6 +593,9 @@ static bool _dropMigrationTables(Connection* conn)
       DOWNLOAD_STATES_V3_1_TABLE,
       SELLER_DATA_V3_1_TABLE,
       SELLER_POOLS_V3_1_TABLE,
+      SELLER_DATA_V3_3_TABLE,
+      SELLER_POOLS_V3_3_TABLE,
+      FILE_PIECES_V3_3_TABLE,
       NULL
    };
 
@@ -531,6 +619,105 @@ static bool _dropMigrationTables(Connection* conn)
    return rval;
 }
 
+/**
+ * Adds a file ID to the file keys table if it is not already present. The
+ * key for a file ID can then be selected using the FILE_KEY_SELECT
+ * sub-query with the file ID bound as ":fileId".
+ *
+ * @param conn the connection to use.
+ * @param fileId the file ID.
+ *
+ * @return true if successful, false if an exception occurred.
+ */
+static bool _insertFileKey(Connection* conn, FileId fileId)
+{
+   Statement* s = conn->prepare(
+      "INSERT OR IGNORE INTO file_keys (file_id) VALUES (:fileId)");
+   return
+      (s != NULL) &&
+      s->setText(":fileId", fileId) &&
+      s->execute() &&
+      s->reset();
+}
+
+/**
+ * Migrates a table that stores file IDs to the version 3.4 format, which
+ * stores file keys instead. The table is renamed to its migration table, the
+ * new tables must then be created and the rows copied with
+ * _copyMigratedFileKeys(). Does nothing if the table already stores file
+ * keys.
+ *
+ * @param conn the connection to use.
+ * @param table the name of the table.
+ * @param migrationTable the name to rename the table to.
+ * @param migrated set to true if the table was renamed.
+ *
+ * @return true if successful, false if an exception occurred.
+ */
+static bool _renameFileIdTable(
+   Connection* conn, const char* table, const char* migrationTable,
+   bool& migrated)
+{
+   bool rval = true;
+
+   // the table may have been created in the latest format by an earlier
+   // migration step
+   DynamicObject sql;
+   sql->format("SELECT file_key FROM %s LIMIT 1", table);
+   Statement* s = conn->prepare(sql->getString());
+   migrated = (s == NULL);
+   if(migrated)
+   {
+      Exception::clear();
+      sql->format("ALTER TABLE %s RENAME TO %s", table, migrationTable);
+      s = conn->prepare(sql->getString());
+      rval = (s != NULL) && s->execute();
+   }
+
+   return rval;
+}
+
+/**
+ * Copies rows from a migration table that stores file IDs into a table that
+ * stores file keys.
+ *
+ * @param conn the connection to use.
+ * @param table the name of the table.
+ * @param migrationTable the name of the migration table.
+ * @param columns the columns to insert into.
+ * @param values the values to select for the columns from the migration
+ *               table, where "file_keys.file_key" is the file key.
+ *
+ * @return true if successful, false if an exception occurred.
+ */
+static bool _copyMigratedFileKeys(
+   Connection* conn, const char* table, const char* migrationTable,
+   const char* columns, const char* values)
+{
+   bool rval;
+
+   // add keys for every file ID
+   DynamicObject sql;
+   sql->format(
+      "INSERT OR IGNORE INTO file_keys (file_id) "
+      "SELECT DISTINCT file_id FROM %s", migrationTable);
+   Statement* s = conn->prepare(sql->getString());
+   rval = (s != NULL) && s->execute();
+
+   // copy rows, the file key is looked up via the old file ID column
+   if(rval)
+   {
+      sql->format(
+         "INSERT INTO %s (%s) SELECT %s FROM %s "
+         "JOIN file_keys ON file_keys.file_id=%s.file_id",
+         table, columns, values, migrationTable, migrationTable);
+      s = conn->prepare(sql->getString());
+      rval = (s != NULL) && s->execute();
+   }
+
+   return rval;
+}
+
 bool PurchaseDatabase::initializePerUserDatabase(
    ConnectionGroupId id, UserId userId, Connection* conn,
    DatabaseClientRef& dbc)
@@ -550,12 +737,15 @@ bool PurchaseDatabase::initializePerUserDatabase(
       // Known versions:
       //    "empty" if new
       //    "< 3.2" for pre-3.2
-      //    "3.2" or greater
+      //    "3.2"
+      //    "3.3" adds file_pieces.piece_size
+      //    "3.4" adds file_keys, replaces file IDs with file keys in
+      //          seller_data, seller_pools, and file_pieces, adds indexes
 
       // The version we are starting from.
       string fromVersion;
       // The current version we are initializing to.
-      const char* toVersion = "3.2";
+      const char* toVersion = "3.4";
 
       rval =
          _createMetaTable(conn) &&
@@ -571,7 +761,7 @@ bool PurchaseDatabase::initializePerUserDatabase(
          {
             // create new tables
             MO_CAT_INFO(BM_PURCHASE_CAT, "Creating purchase database.");
-            rval = _createTables(conn);
+            rval = _createTables(conn) && _createIndexes(conn);
          }
          else
          {
@@ -653,35 +843,126 @@ bool PurchaseDatabase::initializePerUserDatabase(
                // copy seller_data data
                if(rval)
                {
-                  // column changes are compatible, just copy over rows
-                  Statement* s = conn->prepare(
-                     "INSERT INTO seller_data "
-                     "SELECT * FROM " SELLER_DATA_V3_1_TABLE);
-                  rval = (s != NULL) && s->execute();
+                  // new tables are created in the latest format, so file
+                  // IDs are replaced with file keys
+                  rval = _copyMigratedFileKeys(
+                     conn, "seller_data", SELLER_DATA_V3_1_TABLE,
+                     "download_state_id,user_id,file_key,price,section",
+                     "download_state_id,user_id,file_keys.file_key,"
+                     "price,section");
                }
 
                // copy seller_pools data
                if(rval)
                {
                   // column changes require us to insert defaults
-                  Statement* s = conn->prepare(
-                     "INSERT INTO seller_pools "
-                     "SELECT "
-                     "download_state_id,"
-                     "user_id,"
-                     "file_id,"
+                  rval = _copyMigratedFileKeys(
+                     conn, "seller_pools", SELLER_POOLS_V3_1_TABLE,
+                     "download_state_id,user_id,file_key,seller_pool,"
+                     "micro_payment_cost,budget",
+                     "download_state_id,user_id,file_keys.file_key,"
                      "seller_pool,"
                      "'0.00'," // micro_payment_cost (will be updated)
-                     "'0.00' " // budget (will be updated)
-                     "FROM " SELLER_POOLS_V3_1_TABLE);
-                  rval = (s != NULL) && s->execute();
+                     "'0.00'"); // budget (will be updated)
                }
 
                // Note: old table removed outside of transaction below
                currentVersion = "3.2";
             }
+            if(rval && strcmp(currentVersion, "3.2") == 0)
+            {
+               // Add the piece size to file_pieces so that pieces that
+               // are larger than the standard piece size can be stored.
+               MO_CAT_INFO(BM_PURCHASE_CAT,
+                  "Upgrading purchase database to version 3.3.");
+
+               // database alteration section
+               {
+                  // file_pieces may have just been created with the column
+                  Statement* s = conn->prepare(
+                     "SELECT piece_size FROM file_pieces LIMIT 1");
+                  if(s == NULL)
+                  {
+                     Exception::clear();
+                     s = conn->prepare(
+                        "ALTER TABLE file_pieces ADD COLUMN "
+                        "piece_size INTEGER UNSIGNED DEFAULT 0");
+                     rval = (s != NULL) && s->execute();
+                  }
+               }
+
+               currentVersion = "3.3";
+            }
+            if(rval && strcmp(currentVersion, "3.3") == 0)
+            {
+               // Replace file IDs with keys from the shared file_keys table
+               // and add indexes so that piece lookups do not require
+               // full table scans.
+               MO_CAT_INFO(BM_PURCHASE_CAT,
+                  "Upgrading purchase database to version 3.4.");
+
+               // database alteration section
+               bool sellerData = false;
+               bool sellerPools = false;
+               bool filePieces = false;
+               {
+                  // old index would stay with the renamed table
+                  Statement* s = conn->prepare(
+                     "DROP INDEX IF EXISTS seller_data_index");
+                  rval = (s != NULL) && s->execute();
+               }
+               rval = rval &&
+                  _renameFileIdTable(
+                     conn, "seller_data", SELLER_DATA_V3_3_TABLE,
+                     sellerData) &&
+                  _renameFileIdTable(
+                     conn, "seller_pools", SELLER_POOLS_V3_3_TABLE,
+                     sellerPools) &&
+                  _renameFileIdTable(
+                     conn, "file_pieces", FILE_PIECES_V3_3_TABLE,
+                     filePieces);
+
+               // create new table(s)
+               rval = rval && _createTables(conn);
+
+               // copy data
+               if(rval && sellerData)
+               {
+                  rval = _copyMigratedFileKeys(
+                     conn, "seller_data", SELLER_DATA_V3_3_TABLE,
+                     "download_state_id,user_id,file_key,price,section",
+                     "download_state_id,user_id,file_keys.file_key,"
+                     "price,section");
+               }
+               if(rval && sellerPools)
+               {
+                  rval = _copyMigratedFileKeys(
+                     conn, "seller_pools", SELLER_POOLS_V3_3_TABLE,
+                     "download_state_id,user_id,file_key,seller_pool,"
+                     "micro_payment_cost,budget",
+                     "download_state_id,user_id,file_keys.file_key,"
+                     "seller_pool,micro_payment_cost,budget");
+               }
+               if(rval && filePieces)
+               {
+                  rval = _copyMigratedFileKeys(
+                     conn, "file_pieces", FILE_PIECES_V3_3_TABLE,
+                     "download_state_id,user_id,file_key,piece_index,"
+                     "valid,section_hash,status,file_piece,piece_size",
+                     "download_state_id,user_id,file_keys.file_key,"
+                     "piece_index,valid,section_hash,status,file_piece,"
+                     "piece_size");
+               }
+
+               // every table stores file keys now, so it is safe to index
+               // them
+               rval = rval && _createIndexes(conn);
+
+               // Note: old tables removed outside of transaction below
+               currentVersion = "3.4";
+            }
             // Further migrations can be done in sequence as:
-            //if(rval && strcmp(currentVersion, "3.2") == 0)
+            //if(rval && strcmp(currentVersion, "3.4") == 0)
             //{
             //   ...
             //   currentVersion = "3.x";
@@ -711,6 +992,9 @@ bool PurchaseDatabase::initializePerUserDatabase(
 
       // clear all processing download states
       rval = rval && clearProcessingDownloadStates(userId, conn);
+
+      // replay progress left in the journal by a previous run
+      rval = rval && mProgressJournal->replay(userId, conn);
    }
 
    // close connection
@@ -810,6 +1094,9 @@ bool PurchaseDatabase::deleteDownloadState(DownloadState& ds, Connection* conn)
    UserId userId = BM_USER_ID(ds["userId"]);
    DownloadStateId dsId = ds["id"]->getUInt64();
 
+   // batched progress for the download state is no longer needed
+   mProgressJournal->discard(userId, dsId);
+
    // get database connection
    Connection* c = (conn == NULL ? getConnection(userId) : conn);
    if(c != NULL)
@@ -1301,10 +1588,11 @@ bool PurchaseDatabase::insertSellerPools(DownloadState& ds, Connection* conn)
       // prepare statement
       Statement* s = c->prepare(
          "REPLACE INTO seller_pools "
-         "(download_state_id,user_id,file_id,seller_pool,"
+         "(download_state_id,user_id,file_key,seller_pool,"
          "micro_payment_cost,budget) "
          "VALUES "
-         "(:dsId,:userId,:fileId,:sellerPool,:microPaymentCost,:budget)");
+         "(:dsId,:userId," FILE_KEY_SELECT ","
+         ":sellerPool,:microPaymentCost,:budget)");
       if((rval = (s != NULL)))
       {
          FileInfoIterator fii = ds["ware"]["fileInfos"].getIterator();
@@ -1328,6 +1616,7 @@ bool PurchaseDatabase::insertSellerPools(DownloadState& ds, Connection* conn)
 
             // set parameters, execute statement, reset for next execution
             rval =
+               _insertFileKey(c, fileId) &&
                s->setUInt64(":dsId", dsId) &&
                s->setUInt64(":userId", userId) &&
                s->setText(":fileId", fileId) &&
@@ -1378,7 +1667,7 @@ bool PurchaseDatabase::updateSellerPool(
          "micro_payment_cost=:microPaymentCost,"
          "budget=:budget "
          "WHERE user_id=:userId AND download_state_id=:dsId "
-         "AND file_id=:fileId");
+         "AND file_key=" FILE_KEY_SELECT);
       if(s != NULL)
       {
          string json = JsonWriter::writeToString(sp, true);
@@ -1446,7 +1735,7 @@ bool PurchaseDatabase::populateSellerPools(DownloadState& ds, Connection* conn)
       // prepare statement
       Statement* s = c->prepare(
          "SELECT file_id,seller_pool,micro_payment_cost,budget "
-         "FROM seller_pools "
+         "FROM seller_pools JOIN file_keys USING (file_key) "
          "WHERE download_state_id=:dsId AND user_id=:userId");
       if(s != NULL)
       {
@@ -1811,14 +2100,84 @@ bool PurchaseDatabase::populateContract(DownloadState& ds, Connection* conn)
    return rval;
 }
 
+/**
+ * Gets the standard (minimum) piece size for a file in a download state.
+ *
+ * @param ds the DownloadState.
+ * @param fileId the ID of the file.
+ *
+ * @return the standard piece size or 0 if it is not known.
+ */
+static uint32_t _getMinPieceSize(DownloadState& ds, FileId fileId)
+{
+   uint32_t rval = 0;
+
+   if(ds["progress"]->hasMember(fileId) &&
+      ds["progress"][fileId]->hasMember("sellerPool"))
+   {
+      rval = ds["progress"][fileId]["sellerPool"]["pieceSize"]->getUInt32();
+   }
+
+   return rval;
+}
+
 bool PurchaseDatabase::updateFileProgress(
    DownloadState& ds, DynamicObject& entries, Connection* conn)
 {
-   bool rval = false;
+   bool rval;
 
    UserId userId = BM_USER_ID(ds["userId"]);
    DownloadStateId dsId = ds["id"]->getUInt64();
 
+   // normalize entries so they can be written without the download state
+   DynamicObject records;
+   records->setType(Array);
+   DynamicObjectIterator ei = entries.getIterator();
+   while(ei->hasNext())
+   {
+      DynamicObject& entry = ei->next();
+      FileId fileId = entry["fileId"]->getString();
+      FilePiece& fp = entry["piece"];
+      uint32_t minSize = _getMinPieceSize(ds, fileId);
+
+      DynamicObject& record = records->append();
+      record["dsId"] = dsId;
+      record["fileId"] = fileId;
+      record["csHash"] = entry["csHash"]->getString();
+      record["index"] = PieceSizer::getFirstUnit(fp, minSize);
+      record["pieceSize"] = PieceSizer::getPieceSize(fp, minSize);
+      record["status"] = entry["status"]->getString();
+      record["piece"] = fp.clone();
+   }
+
+   // batch updates in the journal unless a connection was given
+   if(conn == NULL && mProgressJournal->isEnabled())
+   {
+      rval = mProgressJournal->add(userId, records);
+   }
+   else
+   {
+      rval = writeFileProgress(userId, records, conn);
+   }
+
+   if(!rval)
+   {
+      ExceptionRef e = new Exception(
+         "Could not update DownloadState file progress.",
+         PURCHASEDB_EXCEPTION);
+      e->getDetails()["downloadStateId"] = dsId;
+      BM_ID_SET(e->getDetails()["userId"], userId);
+      Exception::push(e);
+   }
+
+   return rval;
+}
+
+bool PurchaseDatabase::writeFileProgress(
+   UserId userId, DynamicObject& records, Connection* conn)
+{
+   bool rval = false;
+
    // get database connection
    Connection* c = (conn == NULL ? getConnection(userId) : conn);
    if(c != NULL)
@@ -1833,28 +2192,25 @@ bool PurchaseDatabase::updateFileProgress(
             "DELETE FROM file_pieces WHERE "
             "download_state_id=:dsId AND "
             "user_id=:userId AND "
-            "file_id=:fileId AND "
+            "file_key=" FILE_KEY_SELECT " AND "
             "piece_index=:index AND "
             "section_hash=:csHash AND "
             "status<>:paid");
          rval = (s != NULL);
 
          // set parameters and execute each file piece update
-         DynamicObjectIterator ei = entries.getIterator();
-         while(rval && ei->hasNext())
+         DynamicObjectIterator ri = records.getIterator();
+         while(rval && ri->hasNext())
          {
-            DynamicObject& entry = ei->next();
-            FileId fileId = entry["fileId"]->getString();
-            uint32_t index = entry["piece"]["index"]->getUInt32();
-            const char* hash = entry["csHash"]->getString();
+            DynamicObject& record = ri->next();
 
             // set parameters, execute statement, reset statement
             rval =
-               s->setUInt64(":dsId", dsId) &&
+               s->setUInt64(":dsId", record["dsId"]->getUInt64()) &&
                s->setUInt64(":userId", userId) &&
-               s->setText(":fileId", fileId) &&
-               s->setUInt32(":index", index) &&
-               s->setText(":csHash", hash) &&
+               s->setText(":fileId", record["fileId"]->getString()) &&
+               s->setUInt32(":index", record["index"]->getUInt32()) &&
+               s->setText(":csHash", record["csHash"]->getString()) &&
                s->setText(":paid", "paid") &&
                s->execute() &&
                s->reset();
@@ -1866,37 +2222,41 @@ bool PurchaseDatabase::updateFileProgress(
       {
          Statement* s = c->prepare(
             "INSERT INTO file_pieces "
-            "(download_state_id,user_id,file_id,piece_index,"
-            "valid,section_hash,status,file_piece) "
+            "(download_state_id,user_id,file_key,piece_index,"
+            "valid,section_hash,status,file_piece,piece_size) "
             "VALUES "
-            "(:dsId,:userId,:fileId,:index,:valid,:csHash,"
-            ":status,:filePiece)");
+            "(:dsId,:userId," FILE_KEY_SELECT ",:index,:valid,:csHash,"
+            ":status,:filePiece,:pieceSize)");
          rval = (s != NULL);
 
          // set parameters and execute each file piece update
-         DynamicObjectIterator ei = entries.getIterator();
-         while(rval && ei->hasNext())
+         DynamicObjectIterator ri = records.getIterator();
+         while(rval && ri->hasNext())
          {
-            DynamicObject& entry = ei->next();
-            FileId fileId = entry["fileId"]->getString();
-            const char* hash = entry["csHash"]->getString();
-            FilePiece& fp = entry["piece"];
-            string json = JsonWriter::writeToString(fp, true);
-            uint32_t index = fp["index"]->getUInt32();
-            const char* status = entry["status"]->getString();
+            DynamicObject& record = ri->next();
+            string json = JsonWriter::writeToString(record["piece"], true);
+            const char* status = record["status"]->getString();
             uint32_t valid = (strcmp(status, "unassigned") == 0) ? 0 : 1;
 
-            // set parameters, execute statement, reset statement
-            rval =
-               s->setUInt64(":dsId", dsId) &&
-               s->setUInt64(":userId", userId) &&
-               s->setText(":fileId", fileId) &&
-               s->setUInt32(":index", index) &&
-               s->setUInt32(":valid", valid) &&
-               s->setText(":csHash", hash) &&
-               s->setText(":status", status) &&
-               s->setText(":filePiece", json.c_str()) &&
-               s->execute();
+            // "removed" entries are only deleted
+            if(strcmp(status, "removed") != 0)
+            {
+               // set parameters, execute statement, reset statement
+               rval =
+                  _insertFileKey(c, record["fileId"]->getString()) &&
+                  s->setUInt64(":dsId", record["dsId"]->getUInt64()) &&
+                  s->setUInt64(":userId", userId) &&
+                  s->setText(":fileId", record["fileId"]->getString()) &&
+                  s->setUInt32(":index", record["index"]->getUInt32()) &&
+                  s->setUInt32(":valid", valid) &&
+                  s->setText(":csHash", record["csHash"]->getString()) &&
+                  s->setText(":status", status) &&
+                  s->setText(":filePiece", json.c_str()) &&
+                  s->setUInt32(
+                     ":pieceSize", record["pieceSize"]->getUInt32()) &&
+                  s->execute() &&
+                  s->reset();
+            }
          }
       }
 
@@ -1913,10 +2273,10 @@ bool PurchaseDatabase::updateFileProgress(
    if(!rval)
    {
       ExceptionRef e = new Exception(
-         "Could not update DownloadState file progress.",
+         "Could not write file progress.",
          PURCHASEDB_EXCEPTION);
-      e->getDetails()["downloadStateId"] = dsId;
       BM_ID_SET(e->getDetails()["userId"], userId);
+      e->getDetails()["count"] = records->length();
       Exception::push(e);
    }
 
@@ -1938,8 +2298,11 @@ bool PurchaseDatabase::populateFileProgress(DownloadState& ds, Connection* conn)
    Connection* c = (conn == NULL ? getConnection(userId) : conn);
    if((rval = (c != NULL)))
    {
-      // populate download state's seller pools
-      rval = populateSellerPools(ds, c);
+      // write any batched progress before reading it, then populate
+      // download state's seller pools
+      rval =
+         mProgressJournal->flush(userId, c) &&
+         populateSellerPools(ds, c);
    }
 
    if(rval)
@@ -1950,7 +2313,7 @@ bool PurchaseDatabase::populateFileProgress(DownloadState& ds, Connection* conn)
 
       // prepare statement to load file pieces
       Statement* s = c->prepare(
-         "SELECT * FROM file_pieces "
+         "SELECT * FROM file_pieces JOIN file_keys USING (file_key) "
          "WHERE download_state_id=:dsId AND user_id=:userId");
       if((rval = (s != NULL)))
       {
@@ -1969,6 +2332,7 @@ bool PurchaseDatabase::populateFileProgress(DownloadState& ds, Connection* conn)
          string status;
          uint32_t index;
          uint32_t valid;
+         uint32_t pieceSize;
          JsonReader reader;
          Row* row;
          while(rval && (row = s->fetch()) != NULL)
@@ -1989,6 +2353,7 @@ bool PurchaseDatabase::populateFileProgress(DownloadState& ds, Connection* conn)
                row->getUInt32("piece_index", index);
                row->getText("status", status);
                row->getUInt32("valid", valid);
+               row->getUInt32("piece_size", pieceSize);
 
                // get appropriate file progress and initialize fields
                FileProgress& fp = ds["progress"][fileId.c_str()];
@@ -1999,8 +2364,23 @@ bool PurchaseDatabase::populateFileProgress(DownloadState& ds, Connection* conn)
                fp["assigned"]->setType(Map);
                fp["downloaded"]->setType(Map);
 
-               // update found piece map
-               pieces[fileId.c_str()][index] = piece;
+               // pieces larger than the standard piece size are stored at
+               // the index of the first standard piece they cover
+               uint32_t minSize = fp["sellerPool"]["pieceSize"]->getUInt32();
+               if(pieceSize > minSize && !piece->hasMember("pieceSize"))
+               {
+                  piece["pieceSize"] = pieceSize;
+               }
+               uint32_t count = PieceSizer::getUnitCount(piece, minSize);
+
+               // update found piece map, a piece found with another status
+               // is not replaced by a stale unassigned piece
+               DynamicObject& found = pieces[fileId.c_str()][index];
+               if(strcmp(status.c_str(), "unassigned") != 0 ||
+                  !found->hasMember("index"))
+               {
+                  found = piece;
+               }
 
                if(strcmp(status.c_str(), "paid") == 0)
                {
@@ -2035,6 +2415,16 @@ bool PurchaseDatabase::populateFileProgress(DownloadState& ds, Connection* conn)
                   Exception::set(e);
                   rval = false;
                }
+
+               // the other standard pieces covered by a larger piece are
+               // also found (unless it is unassigned and will be split up)
+               if(rval && piece->hasMember("index"))
+               {
+                  for(uint32_t n = 1; n < count; ++n)
+                  {
+                     pieces[fileId.c_str()][index + n]["index"] = index + n;
+                  }
+               }
             }
 
             if(!rval)
@@ -2219,8 +2609,8 @@ bool PurchaseDatabase::insertSellerData(
       // prepare statement
       Statement* s = c->prepare(
          "INSERT INTO seller_data "
-         "(download_state_id,user_id,file_id,price,section) "
-         "VALUES (:dsId,:userId,:fileId,:price,:section) ");
+         "(download_state_id,user_id,file_key,price,section) "
+         "VALUES (:dsId,:userId," FILE_KEY_SELECT ",:price,:section) ");
 
       if(s != NULL)
       {
@@ -2228,6 +2618,7 @@ bool PurchaseDatabase::insertSellerData(
 
          // set parameters and execute statement
          rval =
+            _insertFileKey(c, fileId) &&
             s->setUInt64(":userId", userId) &&
             s->setUInt64(":dsId", dsId) &&
             s->setText(":fileId", fileId) &&
@@ -2269,7 +2660,8 @@ bool PurchaseDatabase::populateSellerData(DownloadState& ds, Connection* conn)
    {
       // prepare statement
       Statement* s = c->prepare(
-         "SELECT file_id,price,section FROM seller_data "
+         "SELECT file_id,price,section "
+         "FROM seller_data JOIN file_keys USING (file_key) "
          "WHERE download_state_id=:dsId AND user_id=:userId");
       if(s != NULL)
       {
@@ -15,6 +15,9 @@ namespace bitmunk
 namespace purchase
 {
 
+// forward declarations
+class ProgressJournal;
+
 /**
  * The PurchaseDatabase stores the data a purchase module needs to accomplish
  * its tasks.
@@ -39,6 +42,11 @@ protected:
     */
    bitmunk::peruserdb::ConnectionGroupId mConnectionGroupId;
 
+   /**
+    * The journal that batches file progress updates.
+    */
+   ProgressJournal* mProgressJournal;
+
 public:
    /**
     * Creates a new PurchaseDatabase.
@@ -289,18 +297,40 @@ public:
     * Updates multiple file piece entries and the number of remaining
     * pieces in the download state.
     *
+    * If the progress journal is enabled and no connection is given, the
+    * entries are written to the journal and batched with other updates,
+    * they will be in the database before the file progress is next
+    * populated.
+    *
     * @param ds the DownloadState to update.
     * @param entries a map of database entries with update info:
     *                "fileId" => FileId,
     *                "csHash" => ContractSection hash,
-    *                "status" => "unassigned","assigned","downloaded"
+    *                "status" => "unassigned","assigned","downloaded",
+    *                   "removed" (deletes the entry for the section)
     *                "piece" => FilePiece
     * @param conn the connection to use, NULL to open and close one.
+    *
+    * @return true if successful, false if an exception occurred.
     */
    virtual bool updateFileProgress(
       DownloadState& ds, monarch::rt::DynamicObject& entries,
       monarch::sql::Connection* conn = NULL);
 
+   /**
+    * Writes normalized file piece records (see ProgressJournal) to the
+    * database in a single transaction.
+    *
+    * @param userId the ID of the user.
+    * @param records the records to write.
+    * @param conn the connection to use, NULL to open and close one.
+    *
+    * @return true if successful, false if an exception occurred.
+    */
+   virtual bool writeFileProgress(
+      bitmunk::common::UserId userId, monarch::rt::DynamicObject& records,
+      monarch::sql::Connection* conn = NULL);
+
    /**
     * Populates each DownloadStates' file progresses.
     *
@@ -430,6 +460,8 @@ protected:
     * @return a connection or NULL if an exception occurred.
     */
    virtual monarch::sql::Connection* getConnection(bitmunk::common::UserId userId);
+
+   friend class ProgressJournal;
 };
 
 } // end namespace purchase
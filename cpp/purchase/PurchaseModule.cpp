@@ -23,6 +23,7 @@ PurchaseModule::PurchaseModule() :
    BitmunkModule("bitmunk.purchase.Purchase", "1.0"),
    mDatabase(NULL),
    mDownloadThrottlerMap(NULL),
+   mIOMonitor(NULL),
    mInterface(NULL)
 {
 }
@@ -83,10 +84,19 @@ bool PurchaseModule::initialize(Node* node)
          rval = mDownloadThrottlerMap->initialize(node);
       }
 
+      if(rval)
+      {
+         // create and start IO monitor for piece downloads
+         mIOMonitor = new IOMonitor();
+         rval = mIOMonitor->initialize(node, cfg->hasMember("ioThreads") ?
+            cfg["ioThreads"]->getUInt32() : 2);
+      }
+
       if(rval)
       {
          // create interface
-         mInterface = new IPurchaseModuleImpl(mDatabase, mDownloadThrottlerMap);
+         mInterface = new IPurchaseModuleImpl(
+            mDatabase, mDownloadThrottlerMap, mIOMonitor);
 
          // create and add contract service
          BtpServiceRef bs = new ContractService(
@@ -108,6 +118,13 @@ bool PurchaseModule::initialize(Node* node)
             delete mDownloadThrottlerMap;
             mDownloadThrottlerMap = NULL;
          }
+
+         // clean up IO monitor
+         if(mIOMonitor != NULL)
+         {
+            delete mIOMonitor;
+            mIOMonitor = NULL;
+         }
       }
    }
 
@@ -140,6 +157,14 @@ void PurchaseModule::cleanup(Node* node)
       mDownloadThrottlerMap = NULL;
    }
 
+   // clean up IO monitor
+   if(mIOMonitor != NULL)
+   {
+      mIOMonitor->cleanup();
+      delete mIOMonitor;
+      mIOMonitor = NULL;
+   }
+
    delete BM_PURCHASE_CAT;
    BM_PURCHASE_CAT = NULL;
 }
@@ -6,6 +6,7 @@
 
 #include "bitmunk/node/BitmunkModule.h"
 #include "bitmunk/purchase/DownloadThrottlerMap.h"
+#include "bitmunk/purchase/IOMonitor.h"
 #include "bitmunk/purchase/IPurchaseModule.h"
 #include "bitmunk/purchase/PurchaseDatabase.h"
 
@@ -36,6 +37,11 @@ protected:
     */
    DownloadThrottlerMap* mDownloadThrottlerMap;
 
+   /**
+    * The IOMonitor for download connections.
+    */
+   IOMonitor* mIOMonitor;
+
    /**
     * The interface instance.
     */
@@ -5,6 +5,7 @@
 
 #include "bitmunk/common/Logging.h"
 #include "bitmunk/common/Signer.h"
+#include "bitmunk/purchase/PieceSizer.h"
 #include "monarch/rt/RunnableDelegate.h"
 
 using namespace std;
@@ -157,20 +158,27 @@ void Purchaser::runPurchaseDataOp()
                {
                   FilePiece& fp = fpi->next();
 
-                  // find piece to update
+                  // find piece to update (pieces of different sizes may
+                  // share an index, but never an index and a size)
                   bool found = false;
                   uint32_t index = fp["index"]->getUInt32();
+                  uint32_t size = fp["size"]->getUInt32();
                   FilePieceIterator i =
                      progress["downloaded"][csHash.c_str()].getIterator();
                   while(!found && i->hasNext())
                   {
                      FilePiece& piece = i->next();
-                     if(piece["index"]->getUInt32() == index)
+                     if(piece["index"]->getUInt32() == index &&
+                        piece["size"]->getUInt32() == size)
                      {
                         found = true;
 
-                        // restore path
+                        // restore path and piece size
                         fp["path"] = piece["path"]->getString();
+                        if(piece->hasMember("pieceSize"))
+                        {
+                           fp["pieceSize"] = piece["pieceSize"]->getUInt32();
+                        }
 
                         // create database entry
                         DynamicObject& entry = mDbEntries->append();
@@ -179,8 +187,12 @@ void Purchaser::runPurchaseDataOp()
                         entry["status"] = "paid";
                         entry["piece"] = fp;
 
-                        // update piece in file progress for later assembly
-                        toUpdate["pieces"][index] = fp;
+                        // update piece in file progress for later assembly,
+                        // pieces are stored at the index of the first
+                        // standard piece they cover
+                        toUpdate["pieces"][PieceSizer::getFirstUnit(
+                           fp, progress["sellerPool"]["pieceSize"]
+                              ->getUInt32())] = fp;
                      }
                   }
                }
@@ -122,3 +122,28 @@ bool SellerPicker::pickSeller(
 
    return rval;
 }
+
+uint32_t SellerPicker::getSellerWindow(
+   map<string, double>& rates, const char* key, uint32_t window)
+{
+   uint32_t rval = (window == 0) ? 1 : window;
+
+   // limit slow sellers to a single outstanding piece
+   map<string, double>::iterator ri = rates.find(key);
+   if(rval > 1 && ri != rates.end() && rates.size() > 1)
+   {
+      double average = 0;
+      for(map<string, double>::iterator i = rates.begin();
+          i != rates.end(); ++i)
+      {
+         average += i->second;
+      }
+      average /= rates.size();
+      if(ri->second < average / 2)
+      {
+         rval = 1;
+      }
+   }
+
+   return rval;
+}
@@ -7,6 +7,9 @@
 #include "bitmunk/common/TypeDefinitions.h"
 #include "bitmunk/purchase/TypeDefinitions.h"
 
+#include <map>
+#include <string>
+
 namespace bitmunk
 {
 namespace purchase
@@ -36,6 +39,23 @@ public:
       PurchasePreferences& prefs,
       bitmunk::common::SellerDataList& list,
       bitmunk::common::SellerData& pick);
+
+   /**
+    * Gets the number of outstanding piece requests that may be assigned to
+    * a seller. Sellers that are downloading at less than half of the
+    * average rate of the active sellers are limited to a single outstanding
+    * piece so that the remaining work shifts to faster sellers.
+    * 
+    * @param rates the current download rates of the active sellers, keyed
+    *              by seller server key.
+    * @param key the seller server key.
+    * @param window the configured piece request window.
+    * 
+    * @return the number of outstanding pieces allowed for the seller.
+    */
+   static uint32_t getSellerWindow(
+      std::map<std::string, double>& rates, const char* key,
+      uint32_t window);
 };
 
 } // end namespace purchase
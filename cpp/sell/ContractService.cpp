@@ -11,14 +11,18 @@
 #include "bitmunk/common/NegotiateInterface.h"
 #include "bitmunk/common/Signer.h"
 #include "bitmunk/common/Tools.h"
+#include "bitmunk/common/TransferBuffer.h"
 #include "bitmunk/node/BtpActionDelegate.h"
 #include "bitmunk/node/RestResourceHandler.h"
+#include "bitmunk/protocol/BtpTrailer.h"
+#include "bitmunk/sell/SellModule.h"
 #include "monarch/crypto/AsymmetricKeyFactory.h"
 #include "monarch/io/FileInputStream.h"
 #include "monarch/util/Convert.h"
 #include "monarch/validation/Validation.h"
 
 using namespace std;
+using namespace monarch::config;
 using namespace monarch::crypto;
 using namespace monarch::http;
 using namespace monarch::io;
@@ -54,6 +58,17 @@ bool ContractService::initialize()
    mUploadThrottlerMap = new UploadThrottlerMap();
    rval = mUploadThrottlerMap->initialize(mNode);
 
+   // configure piece cache
+   if(rval)
+   {
+      Config cfg = mNode->getConfigManager()->getModuleConfig(
+         "bitmunk.sell.Sell");
+      if(!cfg.isNull() && cfg->hasMember("pieceCache"))
+      {
+         mPieceCache.configure(cfg["pieceCache"]);
+      }
+   }
+
    // negotiate
    if(rval)
    {
@@ -197,8 +212,10 @@ bool ContractService::initialize()
                NULL),
             "mediaId", new v::Int(v::Int::Positive),
             "index", new v::Int(v::Int::NonNegative),
-            // Note: This must be the standard piece size, the seller may
-            // truncate if this is the last piece.
+            // Note: This must be the full piece size that the index is
+            // relative to (the standard piece size or a power of two
+            // multiple of it), the seller may truncate if this is the last
+            // piece.
             "size", new v::Int(v::Int::NonNegative),
             "peerbuyKey", new v::All(
                new v::Type(String),
@@ -207,6 +224,9 @@ bool ContractService::initialize()
                NULL),
             "sellerProfileId", new v::Int(v::Int::Positive),
             "bfpId", new v::Int(v::Int::Positive),
+            // Note: An offset into the piece data to resume a partial
+            // download at, the seller may start from 0 instead.
+            "offset", new v::Optional(new v::Int(v::Int::NonNegative)),
             NULL);
 
          filePiece->addHandler(h, BtpMessage::Post, 0, &qValidator, &validator);
@@ -228,6 +248,9 @@ void ContractService::cleanup()
       delete mUploadThrottlerMap;
       mUploadThrottlerMap = NULL;
    }
+
+   // clear piece cache
+   mPieceCache.clear();
 }
 
 bool ContractService::negotiateContract(
@@ -331,10 +354,11 @@ bool ContractService::getFilePiece(
    // fileId          - ID of the file the piece is a part of
    // mediaId         - ID of the media the file is for
    // index           - the index of the piece
-   // size            - the *standard* piece size for all pieces
+   // size            - the *full* piece size the index is relative to
    // peerbuyKey      - the key to get access to download the piece
    // sellerProfileId - the profile the seller used to sign the section
    // bfpId           - ID of the bfp to use
+   // offset          - optional offset into the piece data to resume at
 
    const char* hash = in["csHash"]->getString();
    FileId fileId = BM_FILE_ID(in["fileId"]);
@@ -344,6 +368,7 @@ bool ContractService::getFilePiece(
    const char* key = in["peerbuyKey"]->getString();
    ProfileId profileId = BM_PROFILE_ID(in["sellerProfileId"]);
    BfpId bfpId = BM_BFP_ID(in["bfpId"]);
+   uint32_t offset = in->hasMember("offset") ? in["offset"]->getUInt32() : 0;
 
    // verify that the key is valid
    if((rval = verifyPeerBuyKey(key, hash, nodeuser, profileId)))
@@ -406,7 +431,7 @@ bool ContractService::getFilePiece(
                      // send piece (do not send "out")
                      out.setNull();
                      rval = sendPiece(
-                        action, bfp, nodeuser, fi, index, size, hash);
+                        action, bfp, nodeuser, fi, index, size, offset, hash);
 
                      // free bfp
                      ibm->freeBfp(bfp);
@@ -471,7 +496,6 @@ void ContractService::addPeerBuyKey(ContractSection& cs, ProfileRef& profile)
 
    // get hex-encoded contract section hash as bytes
    string hex = Tools::getContractSectionHash(cs);
-   cs["hash"] = hex.c_str();
 
    // sign hash
    DigitalSignature* ds = profile->createSignature();
@@ -527,7 +551,7 @@ bool ContractService::verifyPeerBuyKey(
 bool ContractService::sendPiece(
    BtpAction* action,
    Bfp* bfp, UserId sellerId, FileInfo& fi, uint32_t index, uint32_t size,
-   const char* csHash)
+   uint32_t offset, const char* csHash)
 {
    bool rval;
 
@@ -547,8 +571,35 @@ bool ContractService::sendPiece(
       HttpResponse* response = action->getResponse();
       HttpResponseHeader* header = response->getHeader();
       header->setStatus(200, "OK");
+      header->setField("Content-Type", "application/octet-stream");
       header->setField("Transfer-Encoding", "chunked");
 
+      // allow buyer to reuse the connection for its next piece request
+      setKeepAlive(action);
+
+      // set up file piece
+      FilePiece fp;
+      fp["index"] = index;
+      fp["size"] = size;
+
+      // check the piece cache for the bfp output of a previous request
+      // for this piece under the same contract section (a retry or resume
+      // by the same buyer), if found, then the expensive bfp transform can
+      // be skipped
+      string cacheKey = PieceCache::createKey(
+         sellerId, csHash, BM_FILE_ID(fi["id"]), bfp->getId(), index, size);
+      CacheBufferRef cached;
+      bool hit = mPieceCache.getPiece(cacheKey.c_str(), fp, cached);
+
+      // a partial download can only be resumed using the cached output, a
+      // new bfp transform encrypts the piece with different keys, at least
+      // one byte must be sent so that the content signature is checked
+      if(!hit || offset >= (uint32_t)cached->length())
+      {
+         offset = 0;
+      }
+      header->setField("Bitmunk-Piece-Offset", offset);
+
       // get connection and set bandwidth throttler
       HttpConnection* hc = response->getConnection();
       hc->setBandwidthThrottler(
@@ -559,20 +610,56 @@ bool ContractService::sendPiece(
       HttpTrailerRef trailer;
       if((rval = action->getOutMessage()->sendHeader(hc, header, os, trailer)))
       {
-         // set up file piece
-         FilePiece fp;
-         fp["index"] = index;
-         fp["size"] = size;
-
+         if(hit)
+         {
+            MO_CAT_DEBUG(BM_SELL_CAT,
+               "Sending cached file piece: %s, offset: %u",
+               cacheKey.c_str(), offset);
+
+            // the content signature covers the whole piece, including the
+            // part the buyer already has, so that the buyer can check the
+            // data it is resuming from
+            DigitalSignature* ds =
+               static_cast<BtpTrailer*>(&(*trailer))->getSignature();
+            if(ds != NULL && offset > 0)
+            {
+               ds->update(cached->data(), offset);
+            }
+            rval = os->write(
+               cached->data() + offset, cached->length() - offset);
+         }
          // prepare and start reading file
-         if((rval = bfp->preparePeerSellFile(fi) && bfp->startReading(fp)))
+         else if((rval =
+            bfp->preparePeerSellFile(fi) && bfp->startReading(fp)))
          {
-            // write data to output stream
-            char b[2048];
-            int numBytes;
-            while(rval && (numBytes = bfp->read(b, 2048)) > 0)
+            // only capture the piece if it can be cached
+            bool capture = mPieceCache.isCacheable(size);
+            if(capture)
+            {
+               cached = new ByteBuffer(size);
+            }
+
+            // write data to output stream using a large buffer so that
+            // fewer chunks (and fewer writes) are sent per megabyte
+            Config cfg = mNode->getConfigManager()->getModuleUserConfig(
+               "bitmunk.sell.Sell", sellerId);
+            TransferBuffer tb;
+            int numBytes = 0;
+            if((rval = tb.allocate(TransferBuffer::getConfiguredSize(cfg))))
             {
-               rval = os->write(b, numBytes);
+               // stop reading as soon as the buyer disconnects, the
+               // transform is too expensive to finish for a buyer that
+               // may never come back
+               char* b = tb.data();
+               int length = tb.size();
+               while(rval && (numBytes = bfp->read(b, length)) > 0)
+               {
+                  rval = os->write(b, numBytes);
+                  if(capture)
+                  {
+                     cached->put(b, numBytes, true);
+                  }
+               }
             }
 
             if(numBytes == -1)
@@ -581,18 +668,38 @@ bool ContractService::sendPiece(
                // read error
                rval = false;
             }
-            else
+            else if(rval && capture)
             {
-               // sign the file piece as the seller
-               if(!Signer::signFilePiece(
-                  csHash, fi["id"]->getString(), fp, sellerProfile, true))
+               // cache the piece, spilling it to the seller's cache
+               // directory if memory runs out
+               string path;
+               if(cfg->hasMember("pieceCache") &&
+                  cfg["pieceCache"]->hasMember("path"))
                {
-                  ExceptionRef e = new Exception(
-                     "Seller could not sign file piece.",
-                     "bitmunk.sell.FilePieceSignError");
-                  Exception::push(e);
-                  rval = false;
+                  path = cfg["pieceCache"]["path"]->getString();
+                  if(!mNode->getConfigManager()->expandUserDataPath(
+                     path.c_str(), sellerId, path))
+                  {
+                     path.erase();
+                     Exception::clear();
+                  }
                }
+               mPieceCache.addPiece(
+                  cacheKey.c_str(), fp, cached, path.c_str());
+            }
+         }
+
+         if(rval)
+         {
+            // sign the file piece as the seller
+            if(!Signer::signFilePiece(
+               csHash, fi["id"]->getString(), fp, sellerProfile, true))
+            {
+               ExceptionRef e = new Exception(
+                  "Seller could not sign file piece.",
+                  "bitmunk.sell.FilePieceSignError");
+               Exception::push(e);
+               rval = false;
             }
          }
 
@@ -6,6 +6,7 @@
 
 #include "bitmunk/bfp/Bfp.h"
 #include "bitmunk/node/NodeService.h"
+#include "bitmunk/node/PieceCache.h"
 #include "bitmunk/sell/UploadThrottlerMap.h"
 
 namespace bitmunk
@@ -34,6 +35,11 @@ protected:
     */
    UploadThrottlerMap* mUploadThrottlerMap;
 
+   /**
+    * A cache of bfp output for recently sent file pieces.
+    */
+   bitmunk::node::PieceCache mPieceCache;
+
 public:
    /**
     * Creates a new ContractService.
@@ -154,6 +160,12 @@ protected:
     * @param fi the FileInfo for the piece.
     * @param index the index of the piece.
     * @param size the size of the piece.
+    * @param offset the offset into the piece data to resume sending at,
+    *               it is only honored if the piece's data is cached since
+    *               the bfp produces different data (keys) for each
+    *               request, the offset used is sent to the client in the
+    *               "Bitmunk-Piece-Offset" header and the content signature
+    *               still covers the whole piece.
     * @param csHash the ContractSection hash.
     *
     * @return true if successful, false if an exception occurred.
@@ -162,7 +174,7 @@ protected:
       bitmunk::protocol::BtpAction* action,
       bitmunk::bfp::Bfp* bfp, bitmunk::common::UserId sellerId,
       bitmunk::common::FileInfo& fi, uint32_t index, uint32_t size,
-      const char* csHash);
+      uint32_t offset, const char* csHash);
 };
 
 } // end namespace sell
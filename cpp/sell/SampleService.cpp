@@ -9,17 +9,25 @@
 #include "bitmunk/data/Id3v2Tag.h"
 #include "bitmunk/data/Id3v2TagWriter.h"
 #include "bitmunk/data/MpegAudioTimeParser.h"
+#include "bitmunk/medialibrary/IMediaLibrary.h"
 #include "bitmunk/node/BtpActionDelegate.h"
 #include "bitmunk/node/RestResourceHandler.h"
+#include "bitmunk/protocol/HttpRange.h"
 #include "bitmunk/common/CatalogInterface.h"
+#include "bitmunk/sell/SellModule.h"
 #include "monarch/io/ByteArrayInputStream.h"
 #include "monarch/io/FileInputStream.h"
+#include "monarch/io/FilterInputStream.h"
 #include "monarch/io/MutatorInputStream.h"
+#include "monarch/rt/System.h"
 #include "monarch/util/StringTokenizer.h"
 
+#include <cstdlib>
+
 using namespace std;
 using namespace monarch::config;
 using namespace monarch::data::id3v2;
+using namespace monarch::event;
 using namespace monarch::http;
 using namespace monarch::io;
 using namespace monarch::net;
@@ -27,14 +35,77 @@ using namespace monarch::rt;
 using namespace monarch::util;
 using namespace bitmunk::common;
 using namespace bitmunk::data;
+using namespace bitmunk::medialibrary;
 using namespace bitmunk::protocol;
 using namespace bitmunk::node;
 using namespace bitmunk::sell;
 
 typedef BtpActionDelegate<SampleService> Handler;
 
+#define EVENT_MEDIA_UPDATED "bitmunk.medialibrary.Media.updated"
+
+// the size of the chunks a sample is rendered in
+#define SAMPLE_BUFFER_SIZE 16384
+
+/**
+ * A RangeInputStream reads a range of bytes from an underlying stream.
+ */
+class RangeInputStream : public FilterInputStream
+{
+protected:
+   uint64_t mSkipBytes;
+   uint64_t mRemaining;
+
+public:
+   RangeInputStream(InputStream* is, uint64_t offset, uint64_t length) :
+      FilterInputStream(is, false),
+      mSkipBytes(offset),
+      mRemaining(length)
+   {
+   };
+   virtual ~RangeInputStream() {};
+
+   virtual int read(char* b, int length)
+   {
+      int rval = 0;
+
+      // skip to the start of the range
+      while(rval != -1 && mSkipBytes > 0)
+      {
+         int64_t numBytes = mInputStream->skip(mSkipBytes);
+         if(numBytes > 0)
+         {
+            mSkipBytes -= numBytes;
+         }
+         else
+         {
+            // end of stream before the range
+            rval = (numBytes == 0) ? 0 : -1;
+            mSkipBytes = 0;
+            mRemaining = 0;
+         }
+      }
+
+      if(rval != -1 && mRemaining > 0)
+      {
+         if((uint64_t)length > mRemaining)
+         {
+            length = mRemaining;
+         }
+         rval = mInputStream->read(b, length);
+         if(rval > 0)
+         {
+            mRemaining -= rval;
+         }
+      }
+
+      return rval;
+   };
+};
+
 SampleService::SampleService(Node* node, const char* path) :
-   NodeService(node, path)
+   NodeService(node, path),
+   mMediaUpdatedObserver(NULL)
 {
 }
 
@@ -52,8 +123,30 @@ bool SampleService::initialize()
    // FIXME: get number from config instead of just using "100"
    // configure sample range cache
    mSampleRangeCache["capacity"] = 100;
+   mSampleRangeCache["ttl"] = 300000;
    mSampleRangeCache["cache"]->setType(Map);
 
+   // configure sample cache
+   Config cfg = mNode->getConfigManager()->getModuleConfig(
+      "bitmunk.sell.Sell");
+   if(!cfg.isNull() && cfg->hasMember("sampleCache"))
+   {
+      mSampleCache.configure(cfg["sampleCache"]);
+      if(cfg["sampleCache"]->hasMember("sampleRangeTtl"))
+      {
+         mSampleRangeCache["ttl"] =
+            cfg["sampleCache"]["sampleRangeTtl"]->getUInt32();
+      }
+   }
+
+   // drop cached sample ranges of updated media
+   mMediaUpdatedObserver = new ObserverDelegate<SampleService>(
+      this, &SampleService::mediaUpdated);
+   mNode->getEventController()->registerObserver(
+      &(*mMediaUpdatedObserver), EVENT_MEDIA_UPDATED);
+   MO_CAT_DEBUG(BM_SELL_CAT,
+      "SampleService registered for " EVENT_MEDIA_UPDATED);
+
    // file
    {
       RestResourceHandlerRef file = new RestResourceHandler();
@@ -105,6 +198,35 @@ void SampleService::cleanup()
    removeResource("/file");
    removeResource("/media");
    removeResource("/playlist");
+
+   // stop watching for media updates
+   if(!mMediaUpdatedObserver.isNull())
+   {
+      mNode->getEventController()->unregisterObserver(
+         &(*mMediaUpdatedObserver), EVENT_MEDIA_UPDATED);
+      mMediaUpdatedObserver.setNull();
+      MO_CAT_DEBUG(BM_SELL_CAT,
+         "SampleService unregistered for " EVENT_MEDIA_UPDATED);
+   }
+
+   // clear sample cache
+   mSampleCache.clear();
+}
+
+void SampleService::mediaUpdated(Event& e)
+{
+   // the next sample request gets the current sample range, which changes
+   // the version of the media's samples so that stale ones are replaced
+   mSampleRangeCacheLock.lock();
+   {
+      DynamicObject& cache = mSampleRangeCache["cache"];
+      const char* id = e["details"]["mediaId"]->getString();
+      if(cache->hasMember(id))
+      {
+         cache->removeMember(id);
+      }
+   }
+   mSampleRangeCacheLock.unlock();
 }
 
 bool SampleService::getSampleFileByIds(
@@ -116,69 +238,33 @@ bool SampleService::getSampleFileByIds(
    // do not send dyno as response
    out.setNull();
 
-   // determine if too busy or not
-   bool permit = false;
-   mSampleSemaphoreLock.lock();
+   // get catalog interface
+   CatalogInterface* ci = dynamic_cast<CatalogInterface*>(
+      mNode->getModuleApiByType("bitmunk.catalog"));
+
+   // get targeted node user
+   DynamicObject vars;
+   action->getResourceQuery(vars);
+   if(!vars->hasMember("nodeuser"))
    {
-      int current = mSampleSemaphore["current"]->getInt32();
-      if(current < mSampleSemaphore["max"]->getInt32())
-      {
-         mSampleSemaphore["current"] = current + 1;
-         permit = true;
-      }
+      BM_ID_SET(vars["nodeuser"], mNode->getDefaultUserId());
    }
-   mSampleSemaphoreLock.unlock();
 
-   // ensure permit was granted to stream sample
-   if(!permit)
+   FileInfo fi;
+   BM_ID_SET(fi["mediaId"], mediaId);
+   BM_ID_SET(fi["id"], fileId);
+   if((rval = ci->populateFileInfo(BM_USER_ID(vars["nodeuser"]), fi)))
    {
-      // too many samples streaming
-      action->getResponse()->getHeader()->setStatus(503, "Service Unavailable");
-      action->sendResult();
-      rval = true;
+      // send the sample
+      rval = sendFile(action, BM_USER_ID(vars["nodeuser"]), fi);
    }
-   else
-   {
-      // get catalog interface
-      CatalogInterface* ci = dynamic_cast<CatalogInterface*>(
-         mNode->getModuleApiByType("bitmunk.catalog"));
-
-      // get targeted node user
-      DynamicObject vars;
-      action->getResourceQuery(vars);
-      if(!vars->hasMember("nodeuser"))
-      {
-         BM_ID_SET(vars["nodeuser"], mNode->getDefaultUserId());
-      }
-
-      // get resource parameters
-      DynamicObject params;
-      action->getResourceParams(params);
-
-      FileInfo fi;
-      BM_ID_SET(fi["mediaId"], mediaId);
-      BM_ID_SET(fi["id"], fileId);
-      if((rval = ci->populateFileInfo(BM_USER_ID(vars["nodeuser"]), fi)))
-      {
-         // send the sample
-         rval = sendFile(action, fi);
-      }
 
-      // release permit
-      mSampleSemaphoreLock.lock();
-      {
-         int current = mSampleSemaphore["current"]->getInt32();
-         mSampleSemaphore["current"] = current - 1;
-      }
-      mSampleSemaphoreLock.unlock();
-
-      if(!rval)
-      {
-         // sample not found
-         action->getResponse()->getHeader()->setStatus(404, "Not Found");
-         action->sendResult();
-         rval = true;
-      }
+   if(!rval)
+   {
+      // sample not found
+      action->getResponse()->getHeader()->setStatus(404, "Not Found");
+      action->sendResult();
+      rval = true;
    }
 
    return rval;
@@ -316,10 +402,21 @@ bool SampleService::getSampleRange(Media& media)
    bool found = false;
    mSampleRangeCacheLock.lock();
    {
-      if(mSampleRangeCache["cache"]->hasMember(media["id"]->getString()))
+      DynamicObject& cache = mSampleRangeCache["cache"];
+      const char* id = media["id"]->getString();
+      if(cache->hasMember(id))
       {
-         media = mSampleRangeCache["cache"][media["id"]->getString()];
-         rval = found = true;
+         if(cache[id]["expires"]->getUInt64() >
+            System::getCurrentMilliseconds())
+         {
+            media = cache[id]["media"];
+            rval = found = true;
+         }
+         else
+         {
+            // refresh expired sample range
+            cache->removeMember(id);
+         }
       }
    }
    mSampleRangeCacheLock.unlock();
@@ -357,14 +454,18 @@ bool SampleService::getSampleRange(Media& media)
             // update cache
             mSampleRangeCacheLock.lock();
             {
-               if(mSampleRangeCache["cache"]->length() + 1 >=
+               DynamicObject& cache = mSampleRangeCache["cache"];
+               if(cache->length() + 1 >=
                   mSampleRangeCache["capacity"]->getInt32())
                {
                   // clear cache, capacity reached
-                  mSampleRangeCache->clear();
+                  cache->clear();
                }
 
-               mSampleRangeCache["cache"][media["id"]->getString()] = media;
+               DynamicObject& entry = cache[media["id"]->getString()];
+               entry["media"] = media;
+               entry["expires"] = System::getCurrentMilliseconds() +
+                  mSampleRangeCache["ttl"]->getUInt32();
             }
             mSampleRangeCacheLock.unlock();
          }
@@ -374,9 +475,6 @@ bool SampleService::getSampleRange(Media& media)
             media["sampleRange"][0] = 0;
             media["sampleRange"][1] = 0;
          }
-
-         // clear any sample content-length
-         media->removeMember("sampleContentLength");
       }
    }
 
@@ -463,7 +561,210 @@ bool SampleService::sendm3u(BtpAction* action, DynamicObject& fileInfos)
    return rval;
 }
 
-bool SampleService::sendFile(BtpAction* action, FileInfo& fi)
+bool SampleService::getSampleFrames(
+   UserId userId, FileInfo& fi, Media& media,
+   uint64_t& offset, uint64_t& length)
+{
+   bool rval = false;
+
+   // get the file's frame index from the media library
+   IMediaLibrary* iml = dynamic_cast<IMediaLibrary*>(
+      mNode->getModuleApiByType("bitmunk.medialibrary"));
+   if(iml != NULL)
+   {
+      MpegAudioFrameIndex index;
+      rval =
+         iml->getFrameIndex(userId, fi, index) &&
+         index.getRange(
+            media["sampleRange"][0]->getUInt32(),
+            media["sampleRange"][1]->getUInt32(),
+            offset, length);
+   }
+
+   if(!rval)
+   {
+      // the file will be parsed instead
+      Exception::clear();
+   }
+
+   return rval;
+}
+
+bool SampleService::acquireSamplePermit()
+{
+   bool rval = false;
+
+   mSampleSemaphoreLock.lock();
+   {
+      int current = mSampleSemaphore["current"]->getInt32();
+      if(current < mSampleSemaphore["max"]->getInt32())
+      {
+         mSampleSemaphore["current"] = current + 1;
+         rval = true;
+      }
+   }
+   mSampleSemaphoreLock.unlock();
+
+   return rval;
+}
+
+void SampleService::releaseSamplePermit()
+{
+   mSampleSemaphoreLock.lock();
+   {
+      int current = mSampleSemaphore["current"]->getInt32();
+      mSampleSemaphore["current"] = current - 1;
+   }
+   mSampleSemaphoreLock.unlock();
+}
+
+/**
+ * Reads all of the data from an input stream into a buffer.
+ *
+ * @param is the input stream.
+ * @param b the buffer to append the data to.
+ *
+ * @return true if successful, false if an exception occurred.
+ */
+static bool _readAll(InputStream* is, ByteBuffer& b)
+{
+   int numBytes;
+   do
+   {
+      b.allocateSpace(SAMPLE_BUFFER_SIZE, true);
+      numBytes = b.put(is);
+   }
+   while(numBytes > 0);
+
+   return (numBytes != -1);
+}
+
+bool SampleService::renderSample(
+   UserId userId, FileInfo& fi, Media& media, ByteBuffer& sample)
+{
+   bool rval;
+
+   File file(fi["path"]->getString());
+   Id3v2Tag tag(media);
+   Id3v2TagWriter embedder(&tag, false, tag.getFrameSource(), false);
+
+   // find the sample frames so they can be read directly
+   uint64_t offset = 0;
+   uint64_t length = 0;
+   if(getSampleFrames(userId, fi, media, offset, length))
+   {
+      // read only the sample frames, embed new id3 tag
+      FileInputStream fis(file);
+      RangeInputStream range(&fis, offset, length);
+      MutatorInputStream embed(&range, false, &embedder, false);
+      rval = _readAll(&embed, sample);
+      embed.close();
+   }
+   else
+   {
+      // create time parser to produce sample
+      MpegAudioTimeParser matp;
+      matp.addTimeSet(
+         media["sampleRange"][0]->getUInt32(),
+         media["sampleRange"][1]->getUInt32());
+
+      // read data, strip id3 tag, parse mp3 data, embed new id3 tag
+      Id3v2TagWriter stripper(NULL);
+      FileInputStream fis(file);
+      MutatorInputStream strip(&fis, false, &stripper, false);
+      MutatorInputStream parse(&strip, false, &matp, false);
+      MutatorInputStream embed(&parse, false, &embedder, false);
+      rval = _readAll(&embed, sample);
+      embed.close();
+   }
+
+   return rval;
+}
+
+bool SampleService::sendSample(
+   BtpAction* action, ByteBuffer& sample, const char* etag)
+{
+   bool rval = true;
+
+   // set up response header
+   HttpRequestHeader* reqHeader = action->getRequest()->getHeader();
+   HttpResponseHeader* header = action->getResponse()->getHeader();
+   header->setField("Content-Type", "audio/mpeg");
+   header->setField(
+      "Content-Disposition", "attachment; filename=bitmunk-sample.mp3");
+   header->setField("ETag", etag);
+   header->setField("Accept-Ranges", "bytes");
+
+   uint64_t length = sample.length();
+   uint64_t start;
+   uint64_t end;
+   int status = HttpRange::getStatus(reqHeader, etag, length, start, end);
+   if(status == 304)
+   {
+      // client already has the sample
+      header->setStatus(304, "Not Modified");
+      action->sendResult();
+   }
+   else
+   {
+      // always send the content length so players can seek
+      char tmp[70];
+      header->removeField("Transfer-Encoding");
+      if(status == 416)
+      {
+         snprintf(tmp, 70, "bytes */%" PRIu64, length);
+         header->setStatus(416, "Requested Range Not Satisfiable");
+         header->setField("Content-Range", tmp);
+         action->sendResult();
+      }
+      else
+      {
+         if(status == 206)
+         {
+            snprintf(tmp, 70, "bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64,
+               start, end, length);
+            header->setStatus(206, "Partial Content");
+            header->setField("Content-Range", tmp);
+         }
+         else
+         {
+            // send the whole sample
+            header->setStatus(200, "OK");
+         }
+         int64_t contentLength = (length > 0) ? end - start + 1 : 0;
+         header->setField("Content-Length", contentLength);
+
+         // send sample (the compression policy will not compress audio)
+         ByteArrayInputStream bais(sample.data() + start, (int)contentLength);
+         action->sendResult(&bais);
+      }
+   }
+
+   return rval;
+}
+
+/**
+ * Creates the version of a sample, which identifies what it is rendered
+ * from.
+ *
+ * @param media the Media with the sample range.
+ * @param file the sampled file.
+ *
+ * @return the version.
+ */
+static string _createSampleVersion(Media& media, File& file)
+{
+   // "<start>-<end>|<file size>|<file modification time>"
+   char tmp[70];
+   snprintf(tmp, 70, "%" PRIu32 "-%" PRIu32 "|%" PRIu64 "|%" PRIu64,
+      media["sampleRange"][0]->getUInt32(),
+      media["sampleRange"][1]->getUInt32(),
+      (uint64_t)file->getLength(),
+      (uint64_t)file->getModifiedDate().getSeconds());
+   return tmp;
+}
+
+bool SampleService::sendFile(BtpAction* action, UserId userId, FileInfo& fi)
 {
    bool rval = false;
 
@@ -479,89 +780,59 @@ bool SampleService::sendFile(BtpAction* action, FileInfo& fi)
       BM_ID_SET(media["id"], BM_MEDIA_ID(fi["mediaId"]));
       if((rval = (file->exists() && getSampleRange(media))))
       {
-         // set up response header
-         HttpResponseHeader* header = action->getResponse()->getHeader();
-         header->setField("Content-Type", "audio/mpeg");
-         header->setField(
-            "Content-Disposition", "attachment; filename=bitmunk-sample.mp3");
-
-         // calculate content length for sample for HTTP/1.0
-         if(strcmp(
-            action->getRequest()->getHeader()->getVersion(), "HTTP/1.0") == 0)
+         // check the sample cache for a sample of the current version
+         string key = SampleCache::createKey(
+            userId, BM_MEDIA_ID(fi["mediaId"]), BM_FILE_ID(fi["id"]));
+         string version = _createSampleVersion(media, file);
+         string etag;
+         SampleBufferRef sample;
+         if(mSampleCache.getSample(
+            key.c_str(), version.c_str(), etag, sample))
          {
-            // check for cached sample content length
-            int64_t contentLength = 0;
-            if(media->hasMember("sampleContentLength"))
-            {
-               contentLength = media["sampleContentLength"]->getUInt64();
-            }
-            else
+            MO_CAT_DEBUG(BM_SELL_CAT,
+               "Sending cached sample: %s", key.c_str());
+            rval = sendSample(action, *sample, etag.c_str());
+         }
+         // only a limited number of samples may be rendered at once
+         else if(!acquireSamplePermit())
+         {
+            // too many samples rendering
+            action->getResponse()->getHeader()->setStatus(
+               503, "Service Unavailable");
+            action->sendResult();
+         }
+         else
+         {
+            sample = new ByteBuffer();
+            rval = renderSample(userId, fi, media, *sample);
+            releaseSamplePermit();
+
+            if(rval)
             {
-               // create time parser to produce sample
-               MpegAudioTimeParser matp;
-               matp.addTimeSet(
-                  media["sampleRange"][0]->getUInt32(),
-                  media["sampleRange"][1]->getUInt32());
-
-               // FIXME: build a method into the catalog that will return
-               // the content-length for a sample
-
-               // read data, strip id3 tag, parse mp3 data, add new id3 tag
-               // get content length
-               Id3v2Tag tag(media);
-               Id3v2TagWriter stripper(NULL);
-               Id3v2TagWriter embedder(
-                  &tag, false, tag.getFrameSource(), false);
-
-               FileInputStream fis(file);
-               MutatorInputStream strip(&fis, false, &stripper, false);
-               MutatorInputStream parse(&strip, false, &matp, false);
-               MutatorInputStream embed(&parse, false, &embedder, false);
-               int64_t numBytes;
-               while((numBytes = embed.skip(file->getLength())) > 0)
+               // cache the sample, spilling it to the user's cache
+               // directory if memory runs out
+               Config cfg = mNode->getConfigManager()->getModuleUserConfig(
+                  "bitmunk.sell.Sell", userId);
+               string path;
+               if(!cfg.isNull() && cfg->hasMember("sampleCache") &&
+                  cfg["sampleCache"]->hasMember("path"))
                {
-                  contentLength += numBytes;
+                  path = cfg["sampleCache"]["path"]->getString();
+                  if(!mNode->getConfigManager()->expandUserDataPath(
+                     path.c_str(), userId, path))
+                  {
+                     path.erase();
+                     Exception::clear();
+                  }
                }
-               embed.close();
+               etag = SampleCache::createETag(*sample);
+               mSampleCache.addSample(
+                  key.c_str(), version.c_str(), etag.c_str(), sample,
+                  path.c_str());
 
-               if(numBytes != -1)
-               {
-                  // cache content length
-                  media["sampleContentLength"] = contentLength;
-               }
+               rval = sendSample(action, *sample, etag.c_str());
             }
-
-            // replace chunked encoding with content length
-            header->setField("Connection", "close");
-            header->removeField("Transfer-Encoding");
-            header->removeField("TE");
-            header->setField("Content-Length", contentLength);
          }
-
-         // create time parser to produce sample
-         MpegAudioTimeParser matp;
-         matp.addTimeSet(
-            media["sampleRange"][0]->getUInt32(),
-            media["sampleRange"][1]->getUInt32());
-
-         // read data, strip id3 tag, embed new id3 tag, produce sample
-         Id3v2Tag tag(media);
-         Id3v2TagWriter stripper(NULL);
-         Id3v2TagWriter embedder(
-            &tag, false, tag.getFrameSource(), false);
-
-         FileInputStream fis(file);
-         MutatorInputStream strip(&fis, false, &stripper, false);
-         MutatorInputStream parse(&strip, false, &matp, false);
-         MutatorInputStream embed(&parse, false, &embedder, false);
-
-         // send sample, remove any special encoding to prevent compression
-         action->getRequest()->getHeader()->removeField("Accept-Encoding");
-         action->getResponse()->getHeader()->setStatus(200, "OK");
-         action->sendResult(&embed);
-
-         // close stream
-         embed.close();
       }
    }
 
@@ -5,6 +5,8 @@
 #define bitmunk_sell_SampleService_H
 
 #include "bitmunk/node/NodeService.h"
+#include "bitmunk/node/SampleCache.h"
+#include "monarch/event/ObserverDelegate.h"
 
 namespace bitmunk
 {
@@ -31,7 +33,9 @@ protected:
    monarch::rt::ExclusiveLock mSampleSemaphoreLock;
    
    /**
-    * A cache for sample ranges.
+    * A cache for sample ranges. Entries are removed when their media is
+    * updated and otherwise expire so that a change to a media's sample range
+    * is picked up.
     */
    monarch::rt::DynamicObject mSampleRangeCache;
    
@@ -40,6 +44,16 @@ protected:
     */
    monarch::rt::ExclusiveLock mSampleRangeCacheLock;
    
+   /**
+    * A cache for rendered samples.
+    */
+   bitmunk::node::SampleCache mSampleCache;
+   
+   /**
+    * Observer for the media updated event.
+    */
+   monarch::event::ObserverRef mMediaUpdatedObserver;
+   
 public:
    /**
     * Creates a new SampleService.
@@ -68,6 +82,15 @@ public:
     */
    virtual void cleanup();
    
+   /**
+    * Event handler that removes the cached sample range of updated media,
+    * so that samples rendered from an old sample range are replaced right
+    * away.
+    * 
+    * @param e the media updated event.
+    */
+   virtual void mediaUpdated(monarch::event::Event& e);
+   
    /**
     * Serves sample files.
     * 
@@ -162,15 +185,76 @@ protected:
       monarch::rt::DynamicObject& fileInfos);
    
    /**
-    * Sends a sample for a single file.
+    * Gets the byte range of the frames in a sample of a file from the
+    * file's frame index, so the sample can be sent without parsing the file.
+    * 
+    * @param userId the ID of the user that owns the file.
+    * @param fi the FileInfo to get the sample range of.
+    * @param media the Media for the file with its sample range.
+    * @param offset to be set to the offset of the first sample frame.
+    * @param length to be set to the length of the sample frames.
+    * 
+    * @return true if the frames were found, false if the file must be parsed.
+    */
+   virtual bool getSampleFrames(
+      bitmunk::common::UserId userId, bitmunk::common::FileInfo& fi,
+      bitmunk::common::Media& media, uint64_t& offset, uint64_t& length);
+   
+   /**
+    * Tries to get a permit to render a sample. Only a limited number of
+    * samples may be rendered concurrently.
+    * 
+    * @return true if a permit was granted, false if too busy.
+    */
+   virtual bool acquireSamplePermit();
+   
+   /**
+    * Releases a permit granted by acquireSamplePermit().
+    */
+   virtual void releaseSamplePermit();
+   
+   /**
+    * Renders the sample for a file: the sample frames with a new ID3v2 tag.
+    * 
+    * @param userId the ID of the user that owns the file.
+    * @param fi the FileInfo to render a sample of.
+    * @param media the Media for the file with its sample range.
+    * @param sample the buffer to append the sample to.
+    * 
+    * @return true if successful, false if an Exception occurred.
+    */
+   virtual bool renderSample(
+      bitmunk::common::UserId userId, bitmunk::common::FileInfo& fi,
+      bitmunk::common::Media& media, monarch::io::ByteBuffer& sample);
+   
+   /**
+    * Sends a rendered sample. A client that has the sample is sent a 304
+    * response and a request for a single byte range is sent a 206 response
+    * with that range.
+    * 
+    * @param action the BtpAction.
+    * @param sample the rendered sample.
+    * @param etag the ETag for the sample.
+    * 
+    * @return true if successful, false if an Exception occurred.
+    */
+   virtual bool sendSample(
+      bitmunk::protocol::BtpAction* action, monarch::io::ByteBuffer& sample,
+      const char* etag);
+   
+   /**
+    * Sends a sample for a single file. The sample is served from the sample
+    * cache if possible, otherwise it is rendered and cached.
     * 
     * @param action the BtpAction.
+    * @param userId the ID of the user that owns the file.
     * @param fi the FileInfo to send a sample of.
     * 
     * @return true if successful, false if an Exception occurred.
     */
    virtual bool sendFile(
-      bitmunk::protocol::BtpAction* action, bitmunk::common::FileInfo& fi);
+      bitmunk::protocol::BtpAction* action, bitmunk::common::UserId userId,
+      bitmunk::common::FileInfo& fi);
    
    /**
     * Sends a sample playlist for the files in a ware.
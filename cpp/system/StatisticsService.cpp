@@ -5,6 +5,7 @@
 
 #include "bitmunk/common/Signer.h"
 #include "bitmunk/node/BtpActionDelegate.h"
+#include "bitmunk/node/BtpServer.h"
 #include "bitmunk/node/RestResourceHandler.h"
 
 using namespace monarch::net;
@@ -129,7 +130,18 @@ bool StatisticsService::getStats(
    // any logged in user can get the uptime
    if((rval = mNode->checkLogin(action)))
    {
-      out["stats"] = "FIXME";
+      // FIXME: add more statistics
+      out["stats"]["btpClient"]["connectionPool"] =
+         mNode->getMessenger()->getBtpClient()->getConnectionPool()->getStats();
+      out["stats"]["btpClient"]["sslSessionCache"] =
+         mNode->getMessenger()->getBtpClient()->
+            getPersistentSslSessionCache()->getStats();
+      out["stats"]["btpServer"]["sslSessions"] =
+         mNode->getBtpServer()->getSslSessionStats();
+      out["stats"]["btpServer"]["compression"] =
+         mNode->getBtpServer()->getCompressionPolicy()->getStats();
+      out["stats"]["messenger"]["responseCache"] =
+         mNode->getMessenger()->getResponseCache()->getStats();
    }
 
    return rval;
@@ -8,16 +8,41 @@
 #include "monarch/test/TestModule.h"
 
 
+#include "bitmunk/bfp/Bfp.h"
+#include "bitmunk/bfp/BfpStreamHasher.h"
 #include "bitmunk/common/CatalogInterface.h"
 #include "bitmunk/common/Logging.h"
 #include "bitmunk/common/Profile.h"
 #include "bitmunk/common/Tools.h"
+#include "bitmunk/data/FormatDetectorInputStream.h"
 #include "bitmunk/data/Id3v2TagWriter.h"
+#include "bitmunk/data/MpegAudioFrameIndexInputStream.h"
+#include "bitmunk/data/MpegAudioFrameParser.h"
 #include "bitmunk/data/MpegAudioTimeParser.h"
+#include "bitmunk/node/BtpServer.h"
 #include "bitmunk/node/Node.h"
+#include "bitmunk/node/PieceCache.h"
+#include "bitmunk/node/ResponseCache.h"
+#include "bitmunk/node/SampleCache.h"
+#include "bitmunk/protocol/BtpConnectionPool.h"
+#include "bitmunk/protocol/BtpMessage.h"
+#include "bitmunk/protocol/BtpRouteTrie.h"
+#include "bitmunk/protocol/BtpTrailer.h"
+#include "bitmunk/protocol/CompressionPolicy.h"
+#include "bitmunk/protocol/ContentLimits.h"
+#include "bitmunk/protocol/DynoElementOutputStream.h"
+#include "bitmunk/protocol/DynoBinaryReader.h"
+#include "bitmunk/protocol/DynoBinaryWriter.h"
+#include "bitmunk/protocol/HttpRange.h"
+#include "bitmunk/protocol/LimitedOutputStream.h"
+#include "bitmunk/protocol/PersistentSslSessionCache.h"
+#include "bitmunk/purchase/Endgame.h"
+#include "bitmunk/purchase/PieceSizer.h"
+#include "bitmunk/purchase/SellerPicker.h"
 #include "bitmunk/test/Tester.h"
 #include "monarch/config/ConfigManager.h"
 #include "monarch/crypto/AsymmetricKeyFactory.h"
+#include "monarch/crypto/MessageDigest.h"
 #include "monarch/data/DynamicObjectInputStream.h"
 #include "monarch/data/DynamicObjectOutputStream.h"
 #include "monarch/data/json/JsonReader.h"
@@ -29,23 +54,48 @@
 #include "monarch/event/Observer.h"
 #include "monarch/event/ObserverDelegate.h"
 #include "monarch/http/HttpConnectionServicer.h"
+#include "monarch/http/HttpResponseHeader.h"
+#include "monarch/io/ByteArrayInputStream.h"
+#include "monarch/io/ByteArrayOutputStream.h"
 #include "monarch/io/FileInputStream.h"
+#include "monarch/io/FileList.h"
 #include "monarch/io/FileOutputStream.h"
 #include "monarch/io/MutatorInputStream.h"
 #include "monarch/io/MutatorOutputStream.h"
 #include "monarch/io/OStreamOutputStream.h"
 #include "monarch/logging/OutputStreamLogger.h"
 #include "monarch/modest/Kernel.h"
+#include "monarch/net/Connection.h"
+#include "monarch/net/InternetAddress.h"
+#include "monarch/net/Url.h"
 #include "monarch/net/Server.h"
+#include "monarch/net/SslSession.h"
+#include "monarch/net/TcpSocket.h"
+#include "monarch/rt/SharedLock.h"
+#include "monarch/rt/System.h"
+#include "monarch/rt/Thread.h"
 #include "monarch/test/Test.h"
 #include "monarch/test/TestModule.h"
 #include "monarch/util/Convert.h"
+#include "monarch/util/StringTools.h"
+
+#include <openssl/ssl.h>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/stat.h>
+#endif
 
 using namespace std;
+using namespace bitmunk::bfp;
 using namespace bitmunk::common;
 using namespace bitmunk::data;
 using namespace bitmunk::node;
 using namespace bitmunk::protocol;
+using namespace bitmunk::purchase;
 using namespace bitmunk::test;
 using namespace monarch::config;
 using namespace monarch::crypto;
@@ -267,11 +317,2537 @@ static void runSampleTest(TestRunner& tr)
    tr.ungroup();
 }
 
-static bool run(TestRunner& tr)
+/**
+ * A BtpMessage that exposes how it applies its CompressionPolicy.
+ */
+class TestCompressionMessage : public BtpMessage
 {
-   if(tr.isDefaultEnabled())
+public:
+   using BtpMessage::applyCompressionPolicy;
+};
+
+static void runCompressionPolicyTest(TestRunner& tr)
+{
+   tr.group("CompressionPolicy");
+
+   tr.test("rules and size");
    {
-      runNodeTest(tr);
+      CompressionPolicy policy;
+      int level = 0;
+
+      HttpResponseHeader header;
+      header.setField("Content-Type", "audio/mpeg");
+      assert(!policy.checkHeader(&header, level));
+
+      header.setField("Content-Type", "application/json");
+      assert(policy.checkHeader(&header, level));
+      assert(level == -1);
+
+      header.setField("Content-Length", 100);
+      assert(!policy.checkHeader(&header, level));
+
+      // configured rules take precedence
+      DynamicObject cfg;
+      cfg["minSize"] = 0;
+      DynamicObject& rule = cfg["rules"]->append();
+      rule["type"] = "application/json";
+      rule["level"] = 9;
+      policy.configure(cfg);
+      assert(policy.checkHeader(&header, level));
+      assert(level == 9);
+
+      DynamicObject stats = policy.getStats();
+      assert(stats["skippedByRule"]->getUInt64() == 1);
+      assert(stats["skippedBySize"]->getUInt64() == 1);
+   }
+   tr.passIfNoException();
+
+   tr.test("filepiece response");
+   {
+      CompressionPolicy policy;
+      TestCompressionMessage msg;
+      msg.setCompressionPolicy(&policy);
+
+      // encrypted file pieces are sent header-first without a sample
+      HttpResponseHeader header;
+      header.setStatus(200, "OK");
+      header.setField("Content-Type", "application/octet-stream");
+      header.setField("Transfer-Encoding", "chunked");
+      header.setField("Content-Encoding", "gzip");
+      assert(msg.applyCompressionPolicy(&header, NULL, 0, false) == -1);
+      assert(!header.hasField("Content-Encoding"));
+
+      // a body of unknown type is not compressed without a sample
+      header.removeField("Content-Type");
+      header.setField("Content-Encoding", "gzip");
+      assert(msg.applyCompressionPolicy(&header, NULL, 0, false) == -1);
+      assert(!header.hasField("Content-Encoding"));
+
+      // but may be with one
+      string content;
+      for(int i = 0; i < 100; ++i)
+      {
+         content.append("{\"id\":\"1\",\"title\":\"Song\"}");
+      }
+      header.setField("Content-Encoding", "gzip");
+      msg.applyCompressionPolicy(
+         &header, content.c_str(), content.length(), true);
+      assert(header.hasField("Content-Encoding"));
+
+      DynamicObject stats = policy.getStats();
+      assert(stats["skippedByRule"]->getUInt64() == 2);
+   }
+   tr.passIfNoException();
+
+   tr.test("sampling");
+   {
+      CompressionPolicy policy;
+      int length = 4096;
+      char text[length];
+      char noise[length];
+      for(int i = 0; i < length; ++i)
+      {
+         text[i] = 'a' + (i % 7);
+         noise[i] = (char)(rand() & 0xff);
+      }
+
+      assert(policy.checkSample(text, length, false, -1));
+      assert(!policy.checkSample(noise, length, false, -1));
+      assert(!policy.checkSample(text, 100, true, -1));
+      assert(policy.checkSample(text, 100, false, -1));
+
+      DynamicObject stats = policy.getStats();
+      assert(stats["skippedBySample"]->getUInt64() == 1);
+      assert(stats["skippedBySize"]->getUInt64() == 1);
+   }
+   tr.passIfNoException();
+
+   tr.test("compressor statistics");
+   {
+      CompressionPolicy policy;
+      string content;
+      for(int i = 0; i < 1000; ++i)
+      {
+         content.append("{\"id\":\"1\",\"title\":\"Song\"}");
+      }
+
+      // statistics are reported when the compressor is freed
+      ByteBuffer b;
+      {
+         ByteArrayOutputStream baos(&b, true);
+         MutatorOutputStream mos(
+            &baos, false, policy.createCompressor("gzip", -1), true);
+         assert(mos.write(content.c_str(), content.length()));
+         mos.close();
+      }
+
+      DynamicObject stats = policy.getStats();
+      assert(stats["compressed"]->getUInt64() == 1);
+      assert(stats["bytesIn"]->getUInt64() == content.length());
+      assert(stats["bytesOut"]->getUInt64() == (uint64_t)b.length());
+      assert(stats["bytesSaved"]->getUInt64() > 0);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+static DynamicObject createWareSet(int count)
+{
+   DynamicObject rval;
+   rval["resources"]->setType(Array);
+   rval["total"] = (uint64_t)count;
+   rval["start"] = 0;
+   for(int i = 0; i < count; ++i)
+   {
+      DynamicObject& ware = rval["resources"]->append();
+      ware["id"] = "bitmunk:bundle:12345-1";
+      ware["mediaId"] = (uint64_t)(12345 + i);
+      ware["description"] = "This ware contains the song \"Title\".";
+      ware["fileInfos"]->setType(Array);
+      DynamicObject& fi = ware["fileInfos"]->append();
+      fi["id"] = "0123456789abcdef0123456789abcdef01234567";
+      fi["size"] = (uint64_t)4194304;
+      fi["mediaId"] = (uint64_t)(12345 + i);
+      fi["contentType"] = "audio/mpeg";
+      ware["payees"]->setType(Array);
+      DynamicObject& payee = ware["payees"]->append();
+      payee["id"] = (uint64_t)900;
+      payee["amountType"] = "flatFee";
+      payee["amount"] = "0.79";
+      payee["percentage"] = 0.15;
+      payee["min"] = -1;
+      payee["taxExempt"] = (i % 2 == 0);
+   }
+   return rval;
+}
+
+static void runDynoBinaryTest(TestRunner& tr)
+{
+   tr.group("DynoBinary");
+
+   tr.test("round trip");
+   {
+      DynamicObject dyno = createWareSet(3);
+      dyno["empty"]->setType(Map);
+      dyno["emptyList"]->setType(Array);
+      dyno["null"].setNull();
+      dyno["int32"] = (int32_t)-123456;
+      dyno["uint32"] = (uint32_t)4000000000U;
+      dyno["int64"] = (int64_t)-9000000000000LL;
+      dyno["uint64"] = (uint64_t)18000000000000000000ULL;
+      dyno["double"] = -3.25;
+      dyno["utf8"] = "h\xc3\xa9llo";
+      dyno["emptyString"] = "";
+
+      ByteBuffer b;
+      ByteArrayOutputStream baos(&b, true);
+      DynoBinaryWriter writer;
+      assertNoException(writer.write(dyno, &baos));
+
+      // parse in single bytes and in one piece
+      int sizes[] = {1, b.length()};
+      for(int s = 0; s < 2; ++s)
+      {
+         DynamicObject out;
+         DynoBinaryReader reader;
+         reader.start(out);
+         for(int i = 0; i < b.length(); i += sizes[s])
+         {
+            int length = (b.length() - i < sizes[s]) ?
+               b.length() - i : sizes[s];
+            ByteArrayInputStream bais(b.data() + i, length);
+            assertNoException(reader.read(&bais));
+         }
+         assertNoException(reader.finish());
+         assertStrCmp(
+            JsonWriter::writeToString(out).c_str(),
+            JsonWriter::writeToString(dyno).c_str());
+         assert(out["int32"]->getType() == Int32);
+         assert(out["uint64"]->getType() == UInt64);
+         assert(out["null"].isNull());
+      }
+   }
+   tr.passIfNoException();
+
+   tr.test("invalid input");
+   {
+      DynamicObject dyno = createWareSet(1);
+      ByteBuffer b;
+      ByteArrayOutputStream baos(&b, true);
+      DynoBinaryWriter writer;
+      assertNoException(writer.write(dyno, &baos));
+
+      // truncated
+      {
+         DynamicObject out;
+         DynoBinaryReader reader;
+         reader.start(out);
+         ByteArrayInputStream bais(b.data(), b.length() - 1);
+         assertNoException(reader.read(&bais));
+         assert(!reader.finish());
+         assert(Exception::isSet());
+         Exception::clear();
+      }
+
+      // not binary
+      {
+         DynamicObject out;
+         DynoBinaryReader reader;
+         reader.start(out);
+         ByteArrayInputStream bais("{\"a\":1}", 7);
+         assert(!reader.read(&bais));
+         assert(Exception::isSet());
+         Exception::clear();
+      }
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+static void runDynoBinaryBenchmark(TestRunner& tr)
+{
+   tr.group("DynoBinary benchmark");
+
+   int loops = 20;
+   DynamicObject dyno = createWareSet(2000);
+
+   tr.test("json");
+   {
+      uint64_t bytes = 0;
+      uint64_t start = System::getCurrentMilliseconds();
+      for(int i = 0; i < loops; ++i)
+      {
+         ByteBuffer b;
+         ByteArrayOutputStream baos(&b, true);
+         JsonWriter writer;
+         writer.setCompact(true);
+         writer.write(dyno, &baos);
+         bytes += b.length();
+
+         DynamicObject out;
+         JsonReader reader;
+         reader.start(out);
+         ByteArrayInputStream bais(&b);
+         reader.read(&bais);
+         reader.finish();
+      }
+      uint64_t time = System::getCurrentMilliseconds() - start;
+      printf("%d round trips, %" PRIu64 " bytes each, %" PRIu64 " ms ... ",
+         loops, bytes / loops, time);
+   }
+   tr.passIfNoException();
+
+   tr.test("binary");
+   {
+      uint64_t bytes = 0;
+      uint64_t start = System::getCurrentMilliseconds();
+      for(int i = 0; i < loops; ++i)
+      {
+         ByteBuffer b;
+         ByteArrayOutputStream baos(&b, true);
+         DynoBinaryWriter writer;
+         writer.write(dyno, &baos);
+         bytes += b.length();
+
+         DynamicObject out;
+         DynoBinaryReader reader;
+         reader.start(out);
+         ByteArrayInputStream bais(&b);
+         reader.read(&bais);
+         reader.finish();
+      }
+      uint64_t time = System::getCurrentMilliseconds() - start;
+      printf("%d round trips, %" PRIu64 " bytes each, %" PRIu64 " ms ... ",
+         loops, bytes / loops, time);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+static void runBtpRouteTrieTest(TestRunner& tr)
+{
+   tr.group("BtpRouteTrie");
+
+   BtpActionHandlerRef root = new BtpActionHandler(BtpAction::AuthOptional);
+   BtpActionHandlerRef api = new BtpActionHandler(BtpAction::AuthOptional);
+   BtpActionHandlerRef grant = new BtpActionHandler(BtpAction::AuthOptional);
+   BtpRouteTrie trie;
+   trie.add("/", root);
+   trie.add("/api/3.0/session", api);
+   trie.add("/api/3.0/session/access/grant", grant);
+
+   tr.test("longest prefix");
+   {
+      BtpRouteTrie::Route route;
+      assert(trie.find("/api/3.0/session/access/grant", route));
+      assert(route.handler == grant);
+      assertStrCmp(route.path, "/api/3.0/session/access/grant");
+      assert(route.params->length() == 0);
+
+      assert(trie.find("/api/3.0/session/access", route));
+      assert(route.handler == api);
+      assertStrCmp(route.path, "/api/3.0/session");
+
+      assert(trie.find("/api/3.0", route));
+      assert(route.handler == root);
+      assertStrCmp(route.path, "/");
+   }
+   tr.passIfNoException();
+
+   tr.test("params");
+   {
+      BtpRouteTrie::Route route;
+      assert(trie.find("/api/3.0/session/user%201/data?x=/a/b", route));
+      assert(route.handler == api);
+      assert(route.params->length() == 2);
+      assertStrCmp(route.params[0]->getString(), "user 1");
+      assertStrCmp(route.params[1]->getString(), "data");
+
+      assert(trie.find("/other/1", route));
+      assert(route.handler == root);
+      assert(route.params->length() == 2);
+      assertStrCmp(route.params[0]->getString(), "other");
+   }
+   tr.passIfNoException();
+
+   tr.test("clone and remove");
+   {
+      BtpRouteTrie* copy = trie.clone();
+      assert(copy->remove("/api/3.0/session/access/grant") == grant);
+      assert(copy->remove("/api/3.0/session/access/grant").isNull());
+      assert(copy->remove("/api/3.0").isNull());
+      assert(copy->size() == 2);
+      assert(trie.size() == 3);
+
+      DynamicObject paths;
+      copy->getPaths(paths);
+      assert(paths->length() == 2);
+      assertStrCmp(paths[0]->getString(), "/");
+      assertStrCmp(paths[1]->getString(), "/api/3.0/session");
+
+      BtpRouteTrie::Route route;
+      assert(copy->find("/api/3.0/session/access/grant", route));
+      assert(route.handler == api);
+      assert(route.params->length() == 2);
+      assert(trie.find("/api/3.0/session/access/grant", route));
+      assert(route.handler == grant);
+
+      copy->remove("/");
+      assert(!copy->find("/api", route));
+      assert(route.handler.isNull());
+      delete copy;
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+/**
+ * Routes resources the way BtpService did before it used a BtpRouteTrie: a
+ * resource is looked up in a map, under a shared lock, followed by each of
+ * its parents until a handler is found. The resource parameters are then
+ * parsed from the resource as BtpAction did.
+ */
+class MapRoutes
+{
+public:
+   typedef std::map<const char*, BtpActionHandlerRef, StringComparator>
+      HandlerMap;
+   HandlerMap handlers;
+   SharedLock lock;
+
+   virtual ~MapRoutes()
+   {
+      for(HandlerMap::iterator i = handlers.begin(); i != handlers.end(); ++i)
+      {
+         free((char*)i->first);
+      }
+   };
+
+   virtual void add(const char* path, BtpActionHandlerRef& handler)
+   {
+      handlers.insert(make_pair(strdup(path), handler));
+   };
+
+   virtual void findHandler(char* resource, BtpActionHandlerRef& h)
+   {
+      h.setNull();
+
+      // strip any query
+      if(resource != NULL)
+      {
+         char* end = strrchr(resource, '?');
+         if(end != NULL)
+         {
+            end[0] = 0;
+         }
+      }
+
+      lock.lockShared();
+
+      // try to find action handler for resource
+      HandlerMap::iterator i;
+      while(h.isNull() && resource != NULL)
+      {
+         i = handlers.find(resource);
+         if(i != handlers.end())
+         {
+            h = i->second;
+         }
+         else if(strlen(resource) > 1)
+         {
+            // try to find handler for parent resource
+            char* end = strrchr(resource, '/');
+            if(end != NULL)
+            {
+               // if parent is root (end == resource), set resource to "/"
+               // if parent is not root, clear last slash
+               end[(end == resource) ? 1 : 0] = 0;
+            }
+            else
+            {
+               // no resource left to search
+               resource = NULL;
+            }
+         }
+         else
+         {
+            // no resource left to search
+            resource = NULL;
+         }
+      }
+
+      lock.unlockShared();
+   };
+
+   virtual void route(
+      const char* path, BtpActionHandlerRef& h, DynamicObject& params)
+   {
+      // normalize request resource and find handler
+      char resource[strlen(path) + 2];
+      HttpRequestServicer::normalizePath(path, resource);
+      char res[strlen(resource) + 1];
+      strcpy(res, resource);
+      findHandler(resource, h);
+
+      if(!h.isNull())
+      {
+         // parse params relative to the base resource
+         int length = strlen(resource);
+         char base[length + 2];
+         strcpy(base, resource);
+         if(base[length - 1] != '/')
+         {
+            base[length] = '/';
+            base[length + 1] = 0;
+         }
+         Url url(res);
+         url.getTokenizedPath(params, base);
+      }
+   };
+};
+
+static void runBtpRouteBenchmark(TestRunner& tr)
+{
+   tr.group("BtpRoute benchmark");
+
+   // load and start node to get its registered services
+   Node* node = Tester::loadNode(tr);
+   assertNoException(
+      node->start());
+
+   {
+      const char* paths[] =
+      {
+         "/api/3.0/system/config",
+         "/api/3.0/system/control",
+         "/api/3.0/system/events",
+         "/api/3.0/system/directives",
+         "/api/3.0/system/statistics",
+         "/api/3.0/system/test",
+         "/api/3.0/system/version",
+         "/api/3.0/webui",
+         "/api/3.0/webui/proxy",
+         "/api/3.0/webui/status",
+         "/api/3.0/webui/config",
+         "/",
+         NULL
+      };
+      int loops = 10000;
+
+      // request every resource of each service, with params and a query
+      vector<BtpServiceRef> services;
+      vector<MapRoutes*> maps;
+      DynamicObject requests;
+      requests->setType(Array);
+      int count = 0;
+      for(int i = 0; paths[i] != NULL; ++i)
+      {
+         BtpServiceRef bs = node->getBtpServer()->getService(paths[i]);
+         if(!bs.isNull())
+         {
+            MapRoutes* routes = new MapRoutes();
+            DynamicObject resources;
+            bs->getResources(resources);
+            DynamicObject& reqs = requests->append();
+            reqs->setType(Array);
+            DynamicObjectIterator ri = resources.getIterator();
+            while(ri->hasNext())
+            {
+               const char* res = ri->next()->getString();
+               BtpRouteTrie::Route route;
+               bs->findRoute(res, route);
+               routes->add(res, route.handler);
+               reqs->append() = res;
+               reqs->append() = StringTools::format("%s/1/two", res).c_str();
+               reqs->append() = StringTools::format(
+                  "%s?nodeuser=1", res).c_str();
+            }
+            count += reqs->length();
+            services.push_back(bs);
+            maps.push_back(routes);
+         }
+      }
+      printf("%d services, %d resources ... ", (int)services.size(), count);
+
+      tr.test("map");
+      {
+         uint64_t start = System::getCurrentMilliseconds();
+         for(int i = 0; i < loops; ++i)
+         {
+            for(int n = 0; n < (int)maps.size(); ++n)
+            {
+               DynamicObjectIterator ri = requests[n].getIterator();
+               while(ri->hasNext())
+               {
+                  BtpActionHandlerRef h;
+                  DynamicObject params;
+                  maps[n]->route(ri->next()->getString(), h, params);
+               }
+            }
+         }
+         uint64_t time = System::getCurrentMilliseconds() - start;
+         printf("%d lookups, %" PRIu64 " ms ... ", loops * count, time);
+      }
+      tr.passIfNoException();
+
+      tr.test("trie");
+      {
+         uint64_t start = System::getCurrentMilliseconds();
+         for(int i = 0; i < loops; ++i)
+         {
+            for(int n = 0; n < (int)services.size(); ++n)
+            {
+               DynamicObjectIterator ri = requests[n].getIterator();
+               while(ri->hasNext())
+               {
+                  // normalize request resource and route it
+                  const char* path = ri->next()->getString();
+                  char resource[strlen(path) + 2];
+                  HttpRequestServicer::normalizePath(path, resource);
+                  BtpRouteTrie::Route route;
+                  services[n]->findRoute(resource, route);
+               }
+            }
+         }
+         uint64_t time = System::getCurrentMilliseconds() - start;
+         printf("%d lookups, %" PRIu64 " ms ... ", loops * count, time);
+      }
+      tr.passIfNoException();
+
+      for(vector<MapRoutes*>::iterator i = maps.begin(); i != maps.end(); ++i)
+      {
+         delete *i;
+      }
+   }
+
+   // stop and unload node
+   node->stop();
+   Tester::unloadNode(tr);
+
+   tr.ungroup();
+}
+
+/**
+ * A DynoElementHandler that collects elements.
+ */
+class CollectingElementHandler : public DynoElementHandler
+{
+public:
+   DynamicObject elements;
+   int max;
+
+   CollectingElementHandler() : max(-1)
+   {
+      elements->setType(Array);
+   };
+   virtual ~CollectingElementHandler() {};
+   virtual bool handleElement(DynamicObject& element)
+   {
+      bool rval = (max < 0 || elements->length() < max);
+      if(rval)
+      {
+         elements->append() = element;
+      }
+      else
+      {
+         ExceptionRef e = new Exception("Too many.", "bitmunk.tests.Test");
+         Exception::set(e);
+      }
+      return rval;
+   };
+};
+
+static void runContentLimitsTest(TestRunner& tr)
+{
+   tr.group("Content limits");
+
+   tr.test("limits by resource");
+   {
+      DynamicObject cfg;
+      cfg["maxLength"] = 1000;
+      cfg["resources"]["/api/3.0/system/events"]["maxLength"] = 10;
+      cfg["resources"]["/api/3.0/system/events"]["maxDepth"] = 2;
+      cfg["resources"]["/api/3.0/catalog"]["maxLength"] = 0;
+      ContentLimits cl;
+      cl.configure(cfg);
+
+      ContentLimits::Limits limits;
+      cl.getLimits("/api/3.0/system/events/daemon?nodeuser=1", limits);
+      assert(limits.maxLength == 10);
+      assert(limits.maxDepth == 2);
+      cl.getLimits("/api/3.0/system/eventsx", limits);
+      assert(limits.maxLength == 1000);
+      assert(limits.maxDepth == 64);
+      cl.getLimits("/api/3.0/catalog/wares", limits);
+      assert(limits.maxLength == 0);
+      assert(limits.maxDepth == 64);
+   }
+   tr.passIfNoException();
+
+   tr.test("length");
+   {
+      ByteBuffer b;
+      ByteArrayOutputStream baos(&b, true);
+      LimitedOutputStream los(&baos, false, 8, 0);
+      assert(los.write("1234", 4));
+      assert(los.write("5678", 4));
+      assert(!los.write("9", 1));
+      assert(Exception::get()->getCode() == 413);
+      assertStrCmp(
+         Exception::get()->getType(), "bitmunk.protocol.ContentTooLarge");
+      Exception::clear();
+      assert(b.length() == 8);
+   }
+   tr.passIfNoException();
+
+   tr.test("json depth");
+   {
+      ByteBuffer b;
+      ByteArrayOutputStream baos(&b, true);
+      LimitedOutputStream los(&baos, false, 0, 2);
+      const char* ok = "{\"a\":[1,\"[[[{\\\"\"],{}}";
+      assert(los.write(ok, strlen(ok)));
+
+      LimitedOutputStream los2(&baos, false, 0, 2);
+      assert(los2.write("[[", 2));
+      assert(!los2.write("[", 1));
+      assert(Exception::get()->getCode() == 413);
+      Exception::clear();
+   }
+   tr.passIfNoException();
+
+   tr.test("binary depth");
+   {
+      DynamicObject dyno;
+      dyno["a"]["b"]["c"] = 1;
+      ByteBuffer b;
+      ByteArrayOutputStream baos(&b, true);
+      DynoBinaryWriter writer;
+      writer.write(dyno, &baos);
+
+      DynamicObject out;
+      DynoBinaryReader reader;
+      reader.setMaxDepth(2);
+      reader.start(out);
+      ByteArrayInputStream bais(&b);
+      assert(!reader.read(&bais));
+      assert(Exception::get()->getCode() == 413);
+      Exception::clear();
+   }
+   tr.passIfNoException();
+
+   tr.test("json elements");
+   {
+      CollectingElementHandler handler;
+      DynoElementOutputStream deos(&handler);
+      const char* json =
+         " [ {\"id\":\"a,]\\\"\"}, [1, [2]] ,3,\"x\" , null ] ";
+
+      // write one byte at a time to split elements across writes
+      for(int i = 0, length = strlen(json); i < length; ++i)
+      {
+         assert(deos.write(json + i, 1));
+      }
+      assertNoException(
+         deos.finish());
+      assert(deos.getCount() == 5);
+      assertStrCmp(handler.elements[0]["id"]->getString(), "a,]\"");
+      assert(handler.elements[1][1][0]->getInt32() == 2);
+      assert(handler.elements[2]->getInt32() == 3);
+      assertStrCmp(handler.elements[3]->getString(), "x");
+      assert(handler.elements[4].isNull());
+   }
+   tr.passIfNoException();
+
+   tr.test("invalid json elements");
+   {
+      CollectingElementHandler handler;
+      DynoElementOutputStream deos(&handler);
+      assert(!deos.write("{}", 2));
+      Exception::clear();
+
+      DynoElementOutputStream deos2(&handler);
+      assert(deos2.write("[1,2", 4));
+      assert(!deos2.finish());
+      Exception::clear();
+
+      DynoElementOutputStream deos4(&handler);
+      assert(!deos4.write("[1,,2]", 6));
+      Exception::clear();
+
+      DynoElementOutputStream deos5(&handler);
+      assert(!deos5.write("[1, ]", 5));
+      Exception::clear();
+
+      DynoElementOutputStream deos6(&handler);
+      assert(!deos6.write("[,]", 3));
+      Exception::clear();
+
+      DynoElementOutputStream deos7(&handler);
+      assert(deos7.write("[ ]", 3));
+      assert(deos7.finish());
+      assert(deos7.getCount() == 0);
+
+      handler.max = 1;
+      handler.elements->clear();
+      DynoElementOutputStream deos3(&handler);
+      assert(!deos3.write("[1,2,3]", 7));
+      assert(handler.elements->length() == 1);
+      Exception::clear();
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+/**
+ * A ResponseFetcher that returns a canned response.
+ */
+class CannedFetcher : public ResponseFetcher
+{
+public:
+   int fetches;
+   int status;
+   const char* cacheControl;
+   const char* etag;
+   string ifNoneMatch;
+   bool fail;
+   ResponseCache* cache;
+   const char* invalidate;
+
+   CannedFetcher() :
+      fetches(0), status(200), cacheControl(NULL), etag(NULL), fail(false),
+      cache(NULL), invalidate(NULL)
+   {
+   };
+   virtual ~CannedFetcher() {};
+   virtual bool fetch(
+      DynamicObject& headers, DynamicObject& in, HttpResponseHeader& header)
+   {
+      ++fetches;
+      if(cache != NULL)
+      {
+         // the resource changes while the response is in flight
+         cache->invalidate(invalidate);
+      }
+      ifNoneMatch = headers->hasMember("If-None-Match") ?
+         headers["If-None-Match"]->getString() : "";
+      header.setStatus(status, (status == 304) ? "Not Modified" : "OK");
+      if(cacheControl != NULL)
+      {
+         header.setField("Cache-Control", cacheControl);
+      }
+      if(etag != NULL)
+      {
+         header.setField("ETag", etag);
+      }
+      if(status == 200)
+      {
+         in["fetch"] = fetches;
+      }
+      return !fail;
+   };
+};
+
+static void runResponseCacheTest(TestRunner& tr)
+{
+   tr.group("Response cache");
+
+   DynamicObject cfg;
+   cfg["enabled"] = true;
+   cfg["capacity"] = 2;
+   cfg["ttl"] = 60000;
+
+   tr.test("hit");
+   {
+      ResponseCache cache;
+      cache.configure(cfg);
+      CannedFetcher fetcher;
+      DynamicObject in;
+      assert(cache.get("/api/3.0/media/1 0:0", in, &fetcher));
+      assert(cache.get("/api/3.0/media/1 0:0", in, &fetcher));
+      assert(fetcher.fetches == 1);
+      assert(in["fetch"]->getInt32() == 1);
+
+      // changing a response does not change the cached copy
+      in["fetch"] = 100;
+      assert(cache.get("/api/3.0/media/1 0:0", in, &fetcher));
+      assert(in["fetch"]->getInt32() == 1);
+
+      // other users do not share responses
+      assert(cache.get("/api/3.0/media/1 900:0", in, &fetcher));
+      assert(fetcher.fetches == 2);
+
+      DynamicObject stats = cache.getStats();
+      assert(stats["hits"]->getUInt64() == 2);
+      assert(stats["misses"]->getUInt64() == 2);
+   }
+   tr.passIfNoException();
+
+   tr.test("cache-control");
+   {
+      ResponseCache cache;
+      cache.configure(cfg);
+      CannedFetcher fetcher;
+      DynamicObject in;
+      fetcher.cacheControl = "no-store";
+      assert(cache.get("/a", in, &fetcher));
+      assert(cache.get("/a", in, &fetcher));
+      assert(fetcher.fetches == 2);
+
+      fetcher.cacheControl = "max-age=0";
+      assert(cache.get("/b", in, &fetcher));
+      assert(cache.get("/b", in, &fetcher));
+      assert(fetcher.fetches == 4);
+   }
+   tr.passIfNoException();
+
+   tr.test("etag revalidation");
+   {
+      ResponseCache cache;
+      cache.configure(cfg);
+      CannedFetcher fetcher;
+      DynamicObject in;
+      fetcher.cacheControl = "no-cache";
+      fetcher.etag = "\"v1\"";
+      assert(cache.get("/a", in, &fetcher));
+      assert(fetcher.ifNoneMatch.length() == 0);
+
+      fetcher.status = 304;
+      assert(cache.get("/a", in, &fetcher));
+      assertStrCmp(fetcher.ifNoneMatch.c_str(), "\"v1\"");
+      assert(fetcher.fetches == 2);
+      assert(in["fetch"]->getInt32() == 1);
+      assert(cache.getStats()["revalidated"]->getUInt64() == 1);
+   }
+   tr.passIfNoException();
+
+   tr.test("invalidate and evict");
+   {
+      ResponseCache cache;
+      cache.configure(cfg);
+      CannedFetcher fetcher;
+      DynamicObject in;
+      assert(cache.get("/api/3.0/media/1 0:0", in, &fetcher));
+      assert(cache.get("/api/3.0/media/1?x=1 0:0", in, &fetcher));
+      cache.invalidate("/api/3.0/media/1");
+      assert(cache.getStats()["entries"]->getUInt64() == 0);
+
+      // prefixes only match on path segment boundaries
+      assert(cache.get("/api/3.0/media/1/files 0:0", in, &fetcher));
+      assert(cache.get("/api/3.0/media/12 0:0", in, &fetcher));
+      cache.invalidate("/api/3.0/media/1");
+      assert(cache.getStats()["entries"]->getUInt64() == 1);
+      int before = fetcher.fetches;
+      assert(cache.get("/api/3.0/media/12 0:0", in, &fetcher));
+      assert(fetcher.fetches == before);
+      cache.clear();
+
+      assert(cache.get("/a", in, &fetcher));
+      assert(cache.get("/b", in, &fetcher));
+      assert(cache.get("/a", in, &fetcher));
+      assert(cache.get("/c", in, &fetcher));
+      assert(cache.getStats()["entries"]->getUInt64() == 2);
+      int fetches = fetcher.fetches;
+      assert(cache.get("/a", in, &fetcher));
+      assert(fetcher.fetches == fetches);
+      assert(cache.get("/b", in, &fetcher));
+      assert(fetcher.fetches == fetches + 1);
+   }
+   tr.passIfNoException();
+
+   tr.test("invalidate during fetch");
+   {
+      ResponseCache cache;
+      cache.configure(cfg);
+      CannedFetcher fetcher;
+      DynamicObject in;
+
+      // a response fetched while its resource changed is not cached
+      fetcher.cache = &cache;
+      fetcher.invalidate = "/a";
+      assert(cache.get("/a", in, &fetcher));
+      assert(in["fetch"]->getInt32() == 1);
+      assert(cache.getStats()["entries"]->getUInt64() == 0);
+
+      fetcher.cache = NULL;
+      assert(cache.get("/a", in, &fetcher));
+      assert(cache.get("/a", in, &fetcher));
+      assert(fetcher.fetches == 2);
+      assert(in["fetch"]->getInt32() == 2);
+   }
+   tr.passIfNoException();
+
+   tr.test("failed fetch");
+   {
+      ResponseCache cache;
+      cache.configure(cfg);
+      CannedFetcher fetcher;
+      DynamicObject in;
+
+      // a failure without an exception is still a failure
+      fetcher.fail = true;
+      assert(!cache.get("/a", in, &fetcher));
+      assert(cache.getStats()["entries"]->getUInt64() == 0);
+      fetcher.fail = false;
+      assert(cache.get("/a", in, &fetcher));
+      assert(fetcher.fetches == 2);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+static void runHttpRangeTest(TestRunner& tr)
+{
+   tr.group("HTTP range");
+
+   uint64_t start;
+   uint64_t end;
+
+   tr.test("parse");
+   {
+      assert(HttpRange::parseRange("bytes=0-499", 1000, start, end) == 1);
+      assert(start == 0 && end == 499);
+
+      // suffix
+      assert(HttpRange::parseRange("bytes=-500", 1000, start, end) == 1);
+      assert(start == 500 && end == 999);
+      assert(HttpRange::parseRange("bytes=-5000", 1000, start, end) == 1);
+      assert(start == 0 && end == 999);
+
+      // open-ended
+      assert(HttpRange::parseRange("bytes=500-", 1000, start, end) == 1);
+      assert(start == 500 && end == 999);
+
+      // end past the content
+      assert(HttpRange::parseRange("bytes=900-5000", 1000, start, end) == 1);
+      assert(start == 900 && end == 999);
+
+      // multi-range and invalid values are ignored
+      assert(HttpRange::parseRange("bytes=0-1,5-6", 1000, start, end) == 0);
+      assert(HttpRange::parseRange("bytes=5-1", 1000, start, end) == 0);
+      assert(HttpRange::parseRange("bytes=a-", 1000, start, end) == 0);
+      assert(HttpRange::parseRange("items=0-1", 1000, start, end) == 0);
+
+      // not satisfiable
+      assert(HttpRange::parseRange("bytes=2000-", 1000, start, end) == -1);
+      assert(HttpRange::parseRange("bytes=1000-1001", 1000, start, end) == -1);
+      assert(HttpRange::parseRange("bytes=-0", 1000, start, end) == -1);
+   }
+   tr.passIfNoException();
+
+   tr.test("status");
+   {
+      const char* etag = "\"abc\"";
+
+      HttpRequestHeader h1;
+      assert(HttpRange::getStatus(&h1, etag, 1000, start, end) == 200);
+      assert(start == 0 && end == 999);
+
+      h1.setField("Range", "bytes=-100");
+      assert(HttpRange::getStatus(&h1, etag, 1000, start, end) == 206);
+      assert(start == 900 && end == 999);
+
+      h1.setField("Range", "bytes=0-1,5-6");
+      assert(HttpRange::getStatus(&h1, etag, 1000, start, end) == 200);
+      assert(start == 0 && end == 999);
+
+      h1.setField("Range", "bytes=2000-");
+      assert(HttpRange::getStatus(&h1, etag, 1000, start, end) == 416);
+
+      // If-None-Match
+      HttpRequestHeader h2;
+      h2.setField("If-None-Match", "\"old\", \"abc\"");
+      h2.setField("Range", "bytes=0-9");
+      assert(HttpRange::getStatus(&h2, etag, 1000, start, end) == 304);
+      h2.setField("If-None-Match", "*");
+      assert(HttpRange::getStatus(&h2, etag, 1000, start, end) == 304);
+      h2.setField("If-None-Match", "\"old\"");
+      assert(HttpRange::getStatus(&h2, etag, 1000, start, end) == 206);
+      assert(start == 0 && end == 9);
+
+      // If-Range
+      HttpRequestHeader h3;
+      h3.setField("Range", "bytes=10-19");
+      h3.setField("If-Range", etag);
+      assert(HttpRange::getStatus(&h3, etag, 1000, start, end) == 206);
+      assert(start == 10 && end == 19);
+      h3.setField("If-Range", "\"old\"");
+      assert(HttpRange::getStatus(&h3, etag, 1000, start, end) == 200);
+      assert(start == 0 && end == 999);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+/**
+ * Creates sample data for the sample cache test.
+ *
+ * @param c the character to fill the sample with.
+ * @param size the size of the sample.
+ *
+ * @return the sample.
+ */
+static SampleBufferRef createSample(char c, int size)
+{
+   SampleBufferRef rval = new ByteBuffer(size);
+   string data(size, c);
+   rval->put(data.c_str(), size, false);
+   return rval;
+}
+
+/**
+ * Counts the cache files in a directory.
+ *
+ * @param path the directory.
+ * @param extension the extension of the cache files.
+ *
+ * @return the number of cache files.
+ */
+static int countCacheFiles(const char* path, const char* extension)
+{
+   int rval = 0;
+   File dir(path);
+   FileList files;
+   dir->listFiles(files);
+   IteratorRef<File> i = files->getIterator();
+   while(i->hasNext())
+   {
+      File& f = i->next();
+      if(strcmp(f->getExtension(), extension) == 0)
+      {
+         ++rval;
+      }
+   }
+   return rval;
+}
+
+static void runSampleCacheTest(TestRunner& tr)
+{
+   tr.group("Sample cache");
+
+   const char* dir = "/tmp/bmtestsamplecache";
+   DynamicObject cfg;
+   cfg["maxMemorySize"] = 100;
+   cfg["maxDiskSize"] = 150;
+
+   tr.test("hit and version invalidation");
+   {
+      SampleCache cache;
+      cache.configure(cfg);
+      SampleBufferRef a = createSample('a', 60);
+      string etag = SampleCache::createETag(*a);
+      cache.addSample("a", "v1", etag.c_str(), a, "");
+
+      // the cached sample is shared, not copied
+      string e;
+      SampleBufferRef data;
+      assert(cache.getSample("a", "v1", e, data));
+      assert(&(*data) == &(*a));
+      assertStrCmp(e.c_str(), etag.c_str());
+
+      // a sample with another version is stale
+      assert(!cache.getSample("a", "v2", e, data));
+      assert(!cache.getSample("a", "v1", e, data));
+
+      DynamicObject stats = cache.getStats();
+      assert(stats["entries"]->getUInt32() == 0);
+      assert(stats["memoryUsed"]->getUInt64() == 0);
+      assert(stats["hits"]->getUInt64() == 1);
+      assert(stats["misses"]->getUInt64() == 2);
+      assert(stats["invalidations"]->getUInt64() == 1);
+
+      // samples over the memory budget are not added
+      SampleBufferRef big = createSample('b', 101);
+      cache.addSample("b", "v1", "\"b\"", big, "");
+      assert(!cache.getSample("b", "v1", e, data));
+
+      // without a directory samples are dropped from memory
+      SampleBufferRef b = createSample('b', 60);
+      cache.addSample("a", "v1", "\"a\"", a, "");
+      cache.addSample("b", "v1", "\"b\"", b, "");
+      stats = cache.getStats();
+      assert(stats["entries"]->getUInt32() == 1);
+      assert(stats["evictions"]->getUInt64() == 1);
+      assert(cache.getSample("b", "v1", e, data));
+   }
+   tr.passIfNoException();
+
+   tr.test("spill to disk");
+   {
+      SampleCache cache;
+      cache.configure(cfg);
+      SampleBufferRef a = createSample('a', 60);
+      SampleBufferRef b = createSample('b', 60);
+      cache.addSample("a", "v1", "\"a\"", a, dir);
+      cache.addSample("b", "v1", "\"b\"", b, dir);
+
+      // least recently used sample was moved to disk
+      DynamicObject stats = cache.getStats();
+      assert(stats["entries"]->getUInt32() == 2);
+      assert(stats["memoryUsed"]->getUInt64() == 60);
+      assert(stats["diskUsed"]->getUInt64() == 60);
+      assert(countCacheFiles(dir, ".sample") == 1);
+
+      // a sample on disk is loaded back into memory, which moves the other
+      // sample to disk
+      string e;
+      SampleBufferRef data;
+      assert(cache.getSample("a", "v1", e, data));
+      assertStrCmp(e.c_str(), "\"a\"");
+      assert(data->length() == 60);
+      assert(memcmp(data->data(), a->data(), 60) == 0);
+      stats = cache.getStats();
+      assert(stats["memoryUsed"]->getUInt64() == 60);
+      assert(stats["diskUsed"]->getUInt64() == 60);
+      assert(stats["evictions"]->getUInt64() == 0);
+      assert(countCacheFiles(dir, ".sample") == 1);
+
+      // exceeding the disk budget removes the least recently used sample
+      SampleBufferRef c = createSample('c', 60);
+      SampleBufferRef d = createSample('d', 60);
+      cache.addSample("c", "v1", "\"c\"", c, dir);
+      cache.addSample("d", "v1", "\"d\"", d, dir);
+      stats = cache.getStats();
+      assert(stats["entries"]->getUInt32() == 3);
+      assert(stats["memoryUsed"]->getUInt64() == 60);
+      assert(stats["diskUsed"]->getUInt64() == 120);
+      assert(stats["evictions"]->getUInt64() == 1);
+      assert(countCacheFiles(dir, ".sample") == 2);
+      assert(!cache.getSample("b", "v1", e, data));
+      assert(cache.getSample("c", "v1", e, data));
+      assert(memcmp(data->data(), c->data(), 60) == 0);
+
+      // stale samples on disk are removed
+      assert(!cache.getSample("a", "v2", e, data));
+      stats = cache.getStats();
+      assert(stats["invalidations"]->getUInt64() == 1);
+
+      // lowering the budgets removes samples
+      DynamicObject small;
+      small["maxMemorySize"] = 0;
+      small["maxDiskSize"] = 60;
+      cache.configure(small);
+      stats = cache.getStats();
+      assert(stats["entries"]->getUInt32() == 1);
+      assert(stats["memoryUsed"]->getUInt64() == 0);
+      assert(stats["diskUsed"]->getUInt64() == 60);
+
+      cache.clear();
+      assert(cache.getStats()["entries"]->getUInt32() == 0);
+      assert(countCacheFiles(dir, ".sample") == 0);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+static void runPieceCacheTest(TestRunner& tr)
+{
+   tr.group("Piece cache");
+
+   const char* dir = "/tmp/bmtestpiececache";
+   DynamicObject cfg;
+   cfg["maxMemorySize"] = 100;
+   cfg["maxDiskSize"] = 100;
+
+   FilePiece fp;
+   fp["index"] = 3;
+   fp["size"] = 60;
+   fp["bfpSignature"] = "signature";
+   string a = PieceCache::createKey(900, "cshash", "fileid", 1, 3, 256);
+   string b = PieceCache::createKey(900, "cshash", "fileid", 1, 4, 256);
+   string c = PieceCache::createKey(900, "cshash", "fileid", 1, 5, 256);
+
+   tr.test("key");
+   {
+      assertStrCmp(a.c_str(), "900|cshash|fileid|1|3|256");
+   }
+   tr.passIfNoException();
+
+   tr.test("hit and miss");
+   {
+      PieceCache cache;
+      cache.configure(cfg);
+      assert(cache.isCacheable(100));
+      assert(!cache.isCacheable(101));
+
+      FilePiece piece;
+      CacheBufferRef data;
+      assert(!cache.getPiece(a.c_str(), piece, data));
+      assert(data.isNull());
+
+      // the cached piece is shared, not copied
+      CacheBufferRef pa = createSample('a', 60);
+      cache.addPiece(a.c_str(), fp, pa, "");
+      assert(cache.getPiece(a.c_str(), piece, data));
+      assert(&(*data) == &(*pa));
+      assert(piece["index"]->getUInt32() == 3);
+      assertStrCmp(piece["bfpSignature"]->getString(), "signature");
+
+      // pieces over the memory budget are not added
+      CacheBufferRef big = createSample('b', 101);
+      cache.addPiece(b.c_str(), fp, big, "");
+      assert(!cache.getPiece(b.c_str(), piece, data));
+
+      DynamicObject stats = cache.getStats();
+      assert(stats["entries"]->getUInt32() == 1);
+      assert(stats["memoryUsed"]->getUInt64() == 60);
+      assert(stats["hits"]->getUInt64() == 1);
+      assert(stats["misses"]->getUInt64() == 2);
+   }
+   tr.passIfNoException();
+
+   tr.test("expiry");
+   {
+      DynamicObject expiring = cfg.clone();
+      expiring["maxAge"] = 50;
+      PieceCache cache;
+      cache.configure(expiring);
+      CacheBufferRef pa = createSample('a', 60);
+      cache.addPiece(a.c_str(), fp, pa, "");
+
+      FilePiece piece;
+      CacheBufferRef data;
+      assert(cache.getPiece(a.c_str(), piece, data));
+      Thread::sleep(100);
+      assert(!cache.getPiece(a.c_str(), piece, data));
+
+      DynamicObject stats = cache.getStats();
+      assert(stats["entries"]->getUInt32() == 0);
+      assert(stats["memoryUsed"]->getUInt64() == 0);
+      assert(stats["expirations"]->getUInt64() == 1);
+   }
+   tr.passIfNoException();
+
+   tr.test("spill to disk");
+   {
+      PieceCache cache;
+      cache.configure(cfg);
+      CacheBufferRef pa = createSample('a', 60);
+      CacheBufferRef pb = createSample('b', 60);
+      cache.addPiece(a.c_str(), fp, pa, dir);
+      cache.addPiece(b.c_str(), fp, pb, dir);
+
+      // least recently used piece was moved to disk under memory pressure,
+      // the data still in use is not freed
+      DynamicObject stats = cache.getStats();
+      assert(stats["entries"]->getUInt32() == 2);
+      assert(stats["memoryUsed"]->getUInt64() == 60);
+      assert(stats["diskUsed"]->getUInt64() == 60);
+      assert(countCacheFiles(dir, ".piece") == 1);
+      assert(pa->length() == 60);
+
+      // a piece on disk is loaded back into memory, which moves the other
+      // piece to disk
+      FilePiece piece;
+      CacheBufferRef data;
+      assert(cache.getPiece(a.c_str(), piece, data));
+      assert(data->length() == 60);
+      assert(memcmp(data->data(), pa->data(), 60) == 0);
+      assertStrCmp(piece["bfpSignature"]->getString(), "signature");
+      stats = cache.getStats();
+      assert(stats["memoryUsed"]->getUInt64() == 60);
+      assert(stats["diskUsed"]->getUInt64() == 60);
+      assert(stats["evictions"]->getUInt64() == 0);
+      assert(countCacheFiles(dir, ".piece") == 1);
+   }
+   tr.passIfNoException();
+
+   tr.test("disk budget");
+   {
+      PieceCache cache;
+      cache.configure(cfg);
+      CacheBufferRef pa = createSample('a', 60);
+      CacheBufferRef pb = createSample('b', 60);
+      CacheBufferRef pc = createSample('c', 60);
+      cache.addPiece(a.c_str(), fp, pa, dir);
+      cache.addPiece(b.c_str(), fp, pb, dir);
+      cache.addPiece(c.c_str(), fp, pc, dir);
+
+      // moving the second piece to disk exceeds the disk budget, so the
+      // least recently used piece on disk is removed
+      DynamicObject stats = cache.getStats();
+      assert(stats["entries"]->getUInt32() == 2);
+      assert(stats["memoryUsed"]->getUInt64() == 60);
+      assert(stats["diskUsed"]->getUInt64() == 60);
+      assert(stats["evictions"]->getUInt64() == 1);
+      assert(countCacheFiles(dir, ".piece") == 1);
+
+      FilePiece piece;
+      CacheBufferRef data;
+      assert(!cache.getPiece(a.c_str(), piece, data));
+      assert(cache.getPiece(b.c_str(), piece, data));
+      assert(memcmp(data->data(), pb->data(), 60) == 0);
+
+      cache.clear();
+      assert(cache.getStats()["entries"]->getUInt32() == 0);
+      assert(countCacheFiles(dir, ".piece") == 0);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+/**
+ * Appends synthetic MPEG-1 Layer III frames (128 kbps, 44.1 kHz, 417 bytes
+ * each) to a buffer. The audio data has no frame syncs, so there is as much
+ * data to scan between headers as possible.
+ *
+ * @param b the buffer to append to.
+ * @param frames the number of frames to append.
+ */
+static void appendMpegFrames(ByteBuffer& b, int frames)
+{
+   const unsigned char header[] = {0xff, 0xfb, 0x90, 0x00};
+   char data[413];
+   uint32_t seed = 1;
+   for(int i = 0; i < frames; ++i)
+   {
+      b.put((const char*)header, 4, true);
+      for(int n = 0; n < 413; ++n)
+      {
+         seed = seed * 1103515245 + 12345;
+         data[n] = (char)((seed >> 16) % 255);
+      }
+      b.put(data, 413, true);
+   }
+}
+
+static void runMpegAudioFrameParserTest(TestRunner& tr)
+{
+   tr.group("MpegAudioFrameParser");
+
+   tr.test("find frame");
+   {
+      // put a frame after junk at every offset around the 16 byte blocks
+      MpegAudioFrameParser parser;
+      for(int junk = 0; junk < 40; ++junk)
+      {
+         ByteBuffer b;
+         for(int i = 0; i < junk; ++i)
+         {
+            // 0xff not followed by a sync byte is not a frame
+            b.putByte((i % 3 == 0) ? (char)0xff : (char)0xdf, 1, true);
+         }
+         appendMpegFrames(b, 1);
+         assert(parser.findFrame(b.data(), b.length()) == 0);
+         assert(parser.getLastHeader() != NULL);
+         assert(parser.getLastOffset() == junk);
+         assert(parser.getLastHeader()->getFrameLength() == 417);
+
+         // partial frame
+         assert(parser.findFrame(b.data(), junk + 100) == 317);
+         assert(parser.getLastOffset() == junk);
+      }
+
+      // no frame
+      const char none[] = {0, 1, 2, 3, 4, (char)0xff};
+      assert(parser.findFrame(none, 6) == 0);
+      assert(parser.getLastHeader() == NULL);
+      assert(parser.getLastOffset() == -1);
+      assert(parser.findFrame(none, 2) == 2);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+static void runMpegAudioFrameIndexTest(TestRunner& tr)
+{
+   tr.group("MpegAudioFrameIndex");
+
+   // an id3v2 tag with 20 bytes of data, 1000 frames, junk, 1000 frames
+   ByteBuffer file;
+   const char tag[] = {'I', 'D', '3', 3, 0, 0, 0, 0, 0, 20};
+   file.put(tag, 10, true);
+   file.putByte(0, 20, true);
+   appendMpegFrames(file, 1000);
+   file.putByte('J', 7, true);
+   appendMpegFrames(file, 1000);
+
+   MpegAudioFrameIndex index;
+
+   tr.test("build");
+   {
+      ByteArrayInputStream bais(file.data(), file.length());
+      MpegAudioFrameIndexInputStream mis(&bais, false, &index);
+      char b[1000];
+      while(mis.read(b, 1000) > 0)
+      {
+         // read everything to index it
+      }
+      assert(mis.isComplete());
+      assert(index.getFrameCount() == 2000);
+      assert(index.getFileSize() == (uint64_t)file.length());
+      assert(index.getAudioTime() > 52.2 && index.getAudioTime() < 52.3);
+   }
+   tr.passIfNoException();
+
+   tr.test("range matches time parser");
+   {
+      // sample across the junk
+      uint64_t offset;
+      uint64_t length;
+      assert(index.getRange(10, 40, offset, length));
+      assert(offset == 30 + 382 * 417);
+
+      MpegAudioTimeParser matp;
+      matp.addTimeSet(10, 40);
+      Id3v2TagWriter stripper(NULL);
+      ByteArrayInputStream bais(file.data(), file.length());
+      MutatorInputStream strip(&bais, false, &stripper, false);
+      MutatorInputStream parse(&strip, false, &matp, false);
+      ByteBuffer sample;
+      char b[1000];
+      int numBytes;
+      while((numBytes = parse.read(b, 1000)) > 0)
+      {
+         sample.put(b, numBytes, true);
+      }
+      assert(length == (uint64_t)sample.length());
+      assert(memcmp(file.data() + offset, sample.data(), length) == 0);
+
+      // no frames in range
+      assert(!index.getRange(60, 90, offset, length));
+   }
+   tr.passIfNoException();
+
+   tr.test("encode");
+   {
+      MpegAudioFrameIndex decoded;
+      index.setFileModified(1262304000);
+      string encoded = index.encode();
+      assert(decoded.decode(encoded.data(), encoded.length()));
+      assert(decoded.getFrameCount() == 2000);
+      assert(decoded.getFileSize() == index.getFileSize());
+      assert(decoded.getFileModified() == 1262304000);
+      uint64_t offset1, length1, offset2, length2;
+      assert(index.getRange(20, 50, offset1, length1));
+      assert(decoded.getRange(20, 50, offset2, length2));
+      assert(offset1 == offset2 && length1 == length2);
+
+      // corrupt index
+      encoded.resize(encoded.length() - 4);
+      assert(!decoded.decode(encoded.data(), encoded.length()));
+      assert(decoded.getFrameCount() == 0);
+      Exception::clear();
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+/**
+ * A TestBfp only generates file IDs: the SHA-1 of the file's data.
+ */
+class TestBfp : public Bfp
+{
+public:
+   TestBfp() {};
+   virtual ~TestBfp() {};
+   virtual bool setFileInfoId(FileInfo& fi)
+   {
+      File file(fi["path"]->getString());
+      FileInputStream fis(file);
+      bool rval = hash(fi, &fis);
+      fis.close();
+      return rval;
+   };
+   virtual bool initializePeerSell(const char* csHash, const char* sellerKey)
+   {
+      return false;
+   };
+   virtual bool initializePeerBuy(Contract& c)
+   {
+      return false;
+   };
+   virtual bool initializeWebBuy(Contract& c, const char* csHash)
+   {
+      return false;
+   };
+   virtual bool preparePeerSellFile(FileInfo& fi)
+   {
+      return false;
+   };
+   virtual bool preparePeerBuyFile(FileInfo& fi, uint64_t* fileSize)
+   {
+      return false;
+   };
+   virtual bool prepareWebBuyFile(FileInfo& fi, uint64_t* fileSize)
+   {
+      return false;
+   };
+   virtual bool startReading(FilePiece& fp)
+   {
+      return false;
+   };
+   virtual int read(char* b, int length)
+   {
+      return -1;
+   };
+   virtual BfpId getId()
+   {
+      return 1;
+   };
+
+protected:
+   bool hash(FileInfo& fi, InputStream* is)
+   {
+      MessageDigest md;
+      md.start("SHA1");
+      uint64_t size = 0;
+      char b[4096];
+      int numBytes;
+      while((numBytes = is->read(b, 4096)) > 0)
+      {
+         md.update(b, numBytes);
+         size += numBytes;
+      }
+      if(numBytes == 0)
+      {
+         fi["id"] = md.getDigest().c_str();
+         fi["contentSize"] = size;
+      }
+      return numBytes == 0;
+   };
+};
+
+/**
+ * A TestStreamBfp also generates file IDs from streams.
+ */
+class TestStreamBfp : public TestBfp, public BfpStreamHasher
+{
+public:
+   TestStreamBfp() {};
+   virtual ~TestStreamBfp() {};
+   virtual bool setFileInfoIdFromStream(FileInfo& fi, InputStream* is)
+   {
+      return hash(fi, is);
+   };
+};
+
+static void runBfpStreamHasherTest(TestRunner& tr)
+{
+   tr.group("BfpStreamHasher");
+
+   // an id3v2 tag with 20 bytes of data and 1000 frames
+   ByteBuffer file;
+   const char tag[] = {'I', 'D', '3', 3, 0, 0, 0, 0, 0, 20};
+   file.put(tag, 10, true);
+   file.putByte(0, 20, true);
+   appendMpegFrames(file, 1000);
+
+   MessageDigest md;
+   md.start("SHA1");
+   md.update(file.data(), file.length());
+   string sha1 = md.getDigest();
+
+   tr.test("capability");
+   {
+      TestBfp plain;
+      TestStreamBfp streaming;
+      Bfp* bfp = &plain;
+      assert(dynamic_cast<BfpStreamHasher*>(bfp) == NULL);
+      bfp = &streaming;
+      assert(dynamic_cast<BfpStreamHasher*>(bfp) != NULL);
+   }
+   tr.passIfNoException();
+
+   tr.test("one pass");
+   {
+      // build the same streams the media library scans files with
+      MpegAudioFrameIndex index;
+      ByteArrayInputStream* bais =
+         new ByteArrayInputStream(file.data(), file.length());
+      MpegAudioFrameIndexInputStream* mis =
+         new MpegAudioFrameIndexInputStream(bais, true, &index);
+      InspectorInputStream* iis = new InspectorInputStream(mis, true);
+      FormatDetectorInputStream fdis(iis, true);
+      fdis.getDataFormatInspector("bitmunk.data.MpegAudioDetector")->
+         setKeepInspecting(true);
+
+      // the hasher reads all of the data, the inspectors see all of it
+      TestStreamBfp streaming;
+      Bfp* bfp = &streaming;
+      FileInfo fi;
+      BfpStreamHasher* hasher = dynamic_cast<BfpStreamHasher*>(bfp);
+      assert(hasher->setFileInfoIdFromStream(fi, &fdis));
+      assertStrCmp(fi["id"]->getString(), sha1.c_str());
+      assert(fi["contentSize"]->getUInt64() == (uint64_t)file.length());
+      assert(fdis.detect());
+      assert(fdis.isFormatRecognized());
+      assert(mis->isComplete());
+      assert(index.getFrameCount() == 1000);
+      fdis.close();
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+/**
+ * Signs the content of a resumed piece download like a seller does, only
+ * the data after the offset is sent but the signature covers all of it.
+ *
+ * @param profile the seller's profile.
+ * @param data the piece data.
+ * @param offset the offset the content starts at.
+ *
+ * @return the trailer sent after the content.
+ */
+static HttpTrailerRef signResumedContent(
+   Profile& profile, string& data, uint32_t offset)
+{
+   DigitalSignature* ds = profile.createSignature();
+   BtpTrailer* trailer = new BtpTrailer(ds);
+   HttpTrailerRef rval = trailer;
+   trailer->getSignature()->update(data.c_str(), offset);
+   trailer->getSignature()->update(
+      data.c_str() + offset, data.length() - offset);
+   trailer->update(data.length() - offset);
+   delete ds;
+   return rval;
+}
+
+/**
+ * Checks the content of a resumed piece download like a buyer does, the
+ * data the buyer already has is added to the signature before the content.
+ *
+ * @param publicKey the seller's public key.
+ * @param trailer the trailer received after the content.
+ * @param prefix the data the buyer already has.
+ * @param content the content received.
+ *
+ * @return the security status of the content.
+ */
+static BtpMessage::SecurityStatus checkResumedContent(
+   PublicKeyRef& publicKey, HttpTrailerRef& trailer,
+   string prefix, string content)
+{
+   DigitalSignature ds(publicKey);
+   ds.update(prefix.c_str(), prefix.length());
+   ds.update(content.c_str(), content.length());
+   BtpMessage msg;
+   HttpResponseHeader header;
+   msg.checkContentSecurity(&header, &(*trailer), &ds);
+   return msg.getSecurityStatus();
+}
+
+static void runPieceResumeSignatureTest(TestRunner& tr)
+{
+   tr.group("Piece resume signature");
+
+   Profile profile;
+   PublicKeyRef publicKey = profile.generate();
+
+   string piece;
+   for(int i = 0; i < 10000; ++i)
+   {
+      piece.push_back((char)(i * 31));
+   }
+
+   tr.test("whole piece");
+   {
+      HttpTrailerRef trailer = signResumedContent(profile, piece, 0);
+      assert(trailer->getContentLength() == (int64_t)piece.length());
+      assert(checkResumedContent(publicKey, trailer, "", piece) ==
+         BtpMessage::Secure);
+   }
+   tr.passIfNoException();
+
+   tr.test("resumed at offset");
+   {
+      HttpTrailerRef trailer = signResumedContent(profile, piece, 4000);
+      assert(trailer->getContentLength() == 6000);
+      assert(checkResumedContent(publicKey, trailer,
+         piece.substr(0, 4000), piece.substr(4000)) == BtpMessage::Secure);
+
+      // the resumed content alone is not enough
+      assert(checkResumedContent(publicKey, trailer,
+         "", piece.substr(4000)) == BtpMessage::Breach);
+   }
+   tr.passIfNoException();
+
+   tr.test("corrupt partial data");
+   {
+      // a byte the buyer received before the transfer failed is wrong
+      HttpTrailerRef trailer = signResumedContent(profile, piece, 4000);
+      string prefix = piece.substr(0, 4000);
+      prefix[1234] ^= 0x01;
+      assert(checkResumedContent(publicKey, trailer,
+         prefix, piece.substr(4000)) == BtpMessage::Breach);
+   }
+   tr.passIfNoException();
+
+   tr.test("seller ignores offset");
+   {
+      // the seller sends the whole piece, the buyer must start over
+      // instead of adding the data it has to the signature
+      HttpTrailerRef trailer = signResumedContent(profile, piece, 0);
+      assert(checkResumedContent(publicKey, trailer, "", piece) ==
+         BtpMessage::Secure);
+      assert(checkResumedContent(publicKey, trailer,
+         piece.substr(0, 4000), piece) == BtpMessage::Breach);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+/**
+ * Connects to a local server and accepts the connection.
+ *
+ * @param server the listening server socket.
+ * @param addr the address of the server.
+ * @param peers the list to add the accepted server side socket to.
+ *
+ * @return the client side connection.
+ */
+static HttpConnection* connectToServer(
+   TcpSocket& server, InternetAddress& addr, vector<Socket*>& peers)
+{
+   TcpSocket* s = new TcpSocket();
+   assert(s->connect(&addr));
+   Socket* peer = server.accept(1);
+   assert(peer != NULL);
+   peers.push_back(peer);
+   return new HttpConnection(new Connection(s, true), true);
+}
+
+static void runBtpConnectionPoolTest(TestRunner& tr)
+{
+   tr.group("BtpConnectionPool");
+
+   // start a local server to make connections to
+   InternetAddress addr("127.0.0.1", 0);
+   TcpSocket server;
+   assert(server.bind(&addr));
+   assert(server.listen());
+   assert(server.getLocalAddress(&addr));
+   vector<Socket*> peers;
+
+   Url url;
+   url.format("http://127.0.0.1:%u/api/3.0/test", addr.getPort());
+   Url other;
+   other.format("http://localhost:%u/api/3.0/test", addr.getPort());
+
+   tr.test("reuse");
+   {
+      BtpConnectionPool pool;
+      assert(pool.getConnection(1, &url) == NULL);
+      HttpConnection* hc = connectToServer(server, addr, peers);
+      pool.addConnection(1, &url, hc);
+
+      // connections are only shared with the same user and host
+      assert(pool.getConnection(2, &url) == NULL);
+      assert(pool.getConnection(1, &other) == NULL);
+      assert(pool.getConnection(1, &url) == hc);
+      assert(pool.getConnection(1, &url) == NULL);
+
+      DynamicObject stats = pool.getStats();
+      assert(stats["idle"]->getUInt32() == 0);
+      assert(stats["hits"]->getUInt64() == 1);
+      assert(stats["misses"]->getUInt64() == 4);
+
+      // the most recently used connection is reused first
+      HttpConnection* hc2 = connectToServer(server, addr, peers);
+      pool.addConnection(1, &url, hc);
+      pool.addConnection(1, &url, hc2);
+      assert(pool.getConnection(1, &url) == hc2);
+      assert(pool.getConnection(1, &url) == hc);
+      hc->close();
+      delete hc;
+      hc2->close();
+      delete hc2;
+   }
+   tr.passIfNoException();
+
+   tr.test("closed by peer");
+   {
+      BtpConnectionPool pool;
+      pool.addConnection(1, &url, connectToServer(server, addr, peers));
+      peers.back()->close();
+      Thread::sleep(100);
+
+      // a connection the peer closed is dropped instead of reused
+      assert(pool.getConnection(1, &url) == NULL);
+      assert(pool.getStats()["stale"]->getUInt64() == 1);
+   }
+   tr.passIfNoException();
+
+   tr.test("idle expiry");
+   {
+      BtpConnectionPool pool;
+      DynamicObject cfg;
+      cfg["maxIdleTime"] = 50;
+      pool.configure(cfg);
+      pool.addConnection(1, &url, connectToServer(server, addr, peers));
+      pool.evictIdleConnections();
+      assert(pool.getStats()["idle"]->getUInt32() == 1);
+
+      Thread::sleep(100);
+      pool.evictIdleConnections();
+      DynamicObject stats = pool.getStats();
+      assert(stats["idle"]->getUInt32() == 0);
+      assert(stats["evictions"]->getUInt64() == 1);
+      assert(pool.getConnection(1, &url) == NULL);
+   }
+   tr.passIfNoException();
+
+   tr.test("per-host cap");
+   {
+      BtpConnectionPool pool;
+      DynamicObject cfg;
+      cfg["maxIdlePerPeer"] = 2;
+      pool.configure(cfg);
+      HttpConnection* hc[3];
+      for(int i = 0; i < 3; ++i)
+      {
+         hc[i] = connectToServer(server, addr, peers);
+         pool.addConnection(1, &url, hc[i]);
+      }
+      pool.addConnection(1, &other, connectToServer(server, addr, peers));
+
+      // the oldest connection to the first host was closed
+      DynamicObject stats = pool.getStats();
+      assert(stats["idle"]->getUInt32() == 3);
+      assert(stats["evictions"]->getUInt64() == 1);
+      assert(pool.getConnection(1, &url) == hc[2]);
+      assert(pool.getConnection(1, &url) == hc[1]);
+      assert(pool.getConnection(1, &url) == NULL);
+      hc[1]->close();
+      delete hc[1];
+      hc[2]->close();
+      delete hc[2];
+   }
+   tr.passIfNoException();
+
+   tr.test("total cap");
+   {
+      BtpConnectionPool pool;
+      DynamicObject cfg;
+      cfg["maxIdle"] = 2;
+      pool.configure(cfg);
+      pool.addConnection(1, &url, connectToServer(server, addr, peers));
+      pool.addConnection(2, &url, connectToServer(server, addr, peers));
+      pool.addConnection(3, &url, connectToServer(server, addr, peers));
+
+      // the oldest idle connection of any host was closed
+      DynamicObject stats = pool.getStats();
+      assert(stats["idle"]->getUInt32() == 2);
+      assert(stats["evictions"]->getUInt64() == 1);
+      assert(pool.getConnection(1, &url) == NULL);
+   }
+   tr.passIfNoException();
+
+   for(vector<Socket*>::iterator i = peers.begin(); i != peers.end(); ++i)
+   {
+      (*i)->close();
+      delete *i;
+   }
+   server.close();
+
+   tr.ungroup();
+}
+
+/**
+ * Creates an SSL session for the SSL session cache test.
+ *
+ * @param timeout the session timeout in seconds.
+ *
+ * @return the session.
+ */
+static SslSession createSession(long timeout)
+{
+   SSL_SESSION* s = SSL_SESSION_new();
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+   SSL_SESSION_set_protocol_version(s, TLS1_VERSION);
+#else
+   s->ssl_version = TLS1_VERSION;
+#endif
+   SSL_SESSION_set_time(s, time(NULL));
+   SSL_SESSION_set_timeout(s, timeout);
+   return new SslSessionImpl(s);
+}
+
+static void runPersistentSslSessionCacheTest(TestRunner& tr)
+{
+   tr.group("PersistentSslSessionCache");
+
+   const char* path = "/tmp/bmtestsslsessions.json";
+   Url url1("https://127.0.0.1:19100/");
+   Url url2("https://127.0.0.1:19101/");
+   Url url3("https://127.0.0.1:19102/");
+   Url other("https://localhost:19100/");
+
+   tr.test("save and load");
+   {
+      File file(path);
+      file->remove();
+
+      SslSession s1 = createSession(300);
+      SslSession s2 = createSession(300);
+      PersistentSslSessionCache cache;
+      cache.storeSession(&url1, s1);
+      cache.storeSession(&url2, s2, "example.com");
+      assertNoException(
+         cache.save(path));
+
+      PersistentSslSessionCache loaded;
+      assertNoException(
+         loaded.load(path));
+      assert(loaded.getStats()["loaded"]->getUInt64() == 2);
+      assert(!loaded.getSession(&url1).isNull());
+      assert(!loaded.getSession(&url2, "example.com").isNull());
+      assert(loaded.getSession(&url2).isNull());
+
+      // a session stored since starting up is not replaced by a saved one
+      SslSession session = createSession(300);
+      PersistentSslSessionCache newer;
+      newer.storeSession(&url1, session);
+      assertNoException(
+         newer.load(path));
+      assert(newer.getStats()["loaded"]->getUInt64() == 1);
+      assert(newer.getSession(&url1)->session == session->session);
+
+      // a missing file is not an error
+      file->remove();
+      assertNoException(
+         loaded.load(path));
+   }
+   tr.passIfNoException();
+
+#ifndef WIN32
+   tr.test("file permissions");
+   {
+      // the session file holds master secrets, so it replaces any existing
+      // file readable by others with one readable by its owner only
+      File file(path);
+      FileOutputStream fos(file);
+      assert(fos.write("[]", 2));
+      fos.close();
+      chmod(path, 0644);
+
+      SslSession session = createSession(300);
+      PersistentSslSessionCache cache;
+      cache.storeSession(&url1, session);
+      assertNoException(
+         cache.save(path));
+      struct stat st;
+      assert(stat(path, &st) == 0);
+      assert((st.st_mode & 0777) == 0600);
+      file->remove();
+   }
+   tr.passIfNoException();
+#endif
+
+   tr.test("expiry");
+   {
+      // a session that has timed out has expired
+      SslSession timedOut = createSession(0);
+      PersistentSslSessionCache cache;
+      cache.storeSession(&url1, timedOut);
+      assert(cache.getSession(&url1).isNull());
+      assert(cache.getStats()["expired"]->getUInt64() == 1);
+
+      // a session older than the maximum age has expired
+      DynamicObject cfg;
+      cfg["maxAge"] = 0;
+      cache.configure(cfg);
+      SslSession old = createSession(300);
+      cache.storeSession(&url2, old);
+      assert(cache.getSession(&url2).isNull());
+      assert(cache.getStats()["expired"]->getUInt64() == 2);
+
+      // expired sessions are not saved
+      cache.storeSession(&url3, old);
+      assertNoException(
+         cache.save(path));
+      PersistentSslSessionCache loaded;
+      assertNoException(
+         loaded.load(path));
+      assert(loaded.getStats()["loaded"]->getUInt64() == 0);
+      File file(path);
+      file->remove();
+   }
+   tr.passIfNoException();
+
+   tr.test("per-host cap");
+   {
+      SslSession s1 = createSession(300);
+      SslSession s2 = createSession(300);
+      SslSession s3 = createSession(300);
+      SslSession s4 = createSession(300);
+      PersistentSslSessionCache cache;
+      DynamicObject cfg;
+      cfg["maxPerHost"] = 2;
+      cache.configure(cfg);
+      cache.storeSession(&other, s1);
+      cache.storeSession(&url1, s2);
+      cache.storeSession(&url2, s3);
+
+      // the least recently used session for the host is evicted, sessions
+      // for other hosts are kept
+      cache.storeSession(&url3, s4);
+      DynamicObject stats = cache.getStats();
+      assert(stats["sessions"]->getUInt32() == 3);
+      assert(stats["evicted"]->getUInt64() == 1);
+      assert(cache.getSession(&url1).isNull());
+      assert(!cache.getSession(&url2).isNull());
+      assert(!cache.getSession(&url3).isNull());
+      assert(!cache.getSession(&other).isNull());
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+/**
+ * Adds an unassigned standard piece for the piece sizer test.
+ *
+ * @param unassigned the list of unassigned pieces.
+ * @param index the index of the piece.
+ * @param size the size of the piece.
+ */
+static void addUnit(FilePieceList& unassigned, uint32_t index, uint32_t size)
+{
+   FilePiece& fp = unassigned->append();
+   fp["index"] = index;
+   fp["size"] = size;
+   BM_ID_SET(fp["bfpId"], 1);
+}
+
+static void runPieceSizerTest(TestRunner& tr)
+{
+   tr.group("PieceSizer");
+
+   tr.test("piece size");
+   {
+      SellerData sd;
+      sd["downloadRate"] = 1000.0;
+      SellerPool sp;
+      sp["pieceSize"] = 100;
+      DynamicObject cfg;
+      cfg["maxPieceSize"] = 10000;
+      cfg["targetPieceTime"] = 1;
+
+      // the SVA does not accept larger pieces for the file
+      assert(PieceSizer::choosePieceSize(sd, sp, cfg) == 100);
+
+      // the SVA's maximum piece size caps the seller's piece size
+      sp["maxPieceSize"] = 400;
+      assert(PieceSizer::choosePieceSize(sd, sp, cfg) == 400);
+
+      // the seller's rate caps the piece size
+      sp["maxPieceSize"] = 1600;
+      assert(PieceSizer::choosePieceSize(sd, sp, cfg) == 800);
+
+      // the configured maximum piece size caps the piece size
+      cfg["maxPieceSize"] = 200;
+      assert(PieceSizer::choosePieceSize(sd, sp, cfg) == 200);
+
+      // a seller without an observed rate gets standard pieces
+      sd->removeMember("downloadRate");
+      assert(PieceSizer::choosePieceSize(sd, sp, cfg) == 100);
+   }
+   tr.passIfNoException();
+
+   tr.test("merge");
+   {
+      FilePieceList unassigned;
+      unassigned->setType(Array);
+      for(uint32_t i = 0; i < 8; ++i)
+      {
+         addUnit(unassigned, i, 100);
+      }
+
+      // the first 4 units are merged into the first piece of size 400
+      FilePiece fp = PieceSizer::takePiece(unassigned, 400, 100);
+      assert(fp["index"]->getUInt32() == 0);
+      assert(fp["pieceSize"]->getUInt32() == 400);
+      assert(fp["size"]->getUInt32() == 400);
+      assert(unassigned->length() == 4);
+
+      // unit 4 is not aligned to 800, so the piece size is reduced
+      fp = PieceSizer::takePiece(unassigned, 800, 100);
+      assert(fp["index"]->getUInt32() == 1);
+      assert(fp["pieceSize"]->getUInt32() == 400);
+      assert(fp["size"]->getUInt32() == 400);
+      assert(unassigned->length() == 0);
+   }
+   tr.passIfNoException();
+
+   tr.test("merge boundaries");
+   {
+      // an unaligned unit is taken as-is
+      FilePieceList unassigned;
+      unassigned->setType(Array);
+      addUnit(unassigned, 1, 100);
+      addUnit(unassigned, 2, 100);
+      FilePiece fp = PieceSizer::takePiece(unassigned, 400, 100);
+      assert(fp["index"]->getUInt32() == 1);
+      assert(!fp->hasMember("pieceSize"));
+      assert(unassigned->length() == 1);
+
+      // an assigned unit stops a merge
+      unassigned->clear();
+      addUnit(unassigned, 0, 100);
+      addUnit(unassigned, 1, 100);
+      addUnit(unassigned, 3, 100);
+      fp = PieceSizer::takePiece(unassigned, 400, 100);
+      assert(fp["index"]->getUInt32() == 0);
+      assert(fp["pieceSize"]->getUInt32() == 200);
+      assert(fp["size"]->getUInt32() == 200);
+      assert(unassigned->length() == 1);
+
+      // a short last unit is merged, the piece size stays the full size
+      unassigned->clear();
+      addUnit(unassigned, 4, 100);
+      addUnit(unassigned, 5, 50);
+      fp = PieceSizer::takePiece(unassigned, 200, 100);
+      assert(fp["index"]->getUInt32() == 2);
+      assert(fp["pieceSize"]->getUInt32() == 200);
+      assert(fp["size"]->getUInt32() == 150);
+      assert(unassigned->length() == 0);
+
+      // a unit with a size of 0 covers the whole file and is never merged
+      unassigned->clear();
+      addUnit(unassigned, 0, 0);
+      addUnit(unassigned, 1, 100);
+      fp = PieceSizer::takePiece(unassigned, 200, 100);
+      assert(fp["index"]->getUInt32() == 0);
+      assert(!fp->hasMember("pieceSize"));
+
+      // a larger piece that was unassigned is reassigned as-is
+      unassigned->clear();
+      FilePiece& large = unassigned->append();
+      large["index"] = 1;
+      large["pieceSize"] = 400;
+      large["size"] = 400;
+      addUnit(unassigned, 8, 100);
+      fp = PieceSizer::takePiece(unassigned, 800, 100);
+      assert(fp["index"]->getUInt32() == 1);
+      assert(fp["pieceSize"]->getUInt32() == 400);
+      assert(unassigned->length() == 1);
+   }
+   tr.passIfNoException();
+
+   tr.test("split");
+   {
+      // a larger piece maps back to the standard pieces it covers
+      FilePiece fp;
+      fp["index"] = 3;
+      fp["pieceSize"] = 400;
+      fp["size"] = 150;
+      assert(PieceSizer::getPieceSize(fp, 100) == 400);
+      assert(PieceSizer::getFirstUnit(fp, 100) == 12);
+      assert(PieceSizer::getUnitCount(fp, 100) == 4);
+
+      // a standard piece covers only itself
+      FilePiece unit;
+      unit["index"] = 3;
+      unit["size"] = 100;
+      assert(PieceSizer::getPieceSize(unit, 100) == 100);
+      assert(PieceSizer::getFirstUnit(unit, 100) == 3);
+      assert(PieceSizer::getUnitCount(unit, 100) == 1);
+
+      // pieces of different sizes may share an index
+      assert(!PieceSizer::isSamePiece(fp, unit));
+      FilePiece copy = fp.clone();
+      assert(PieceSizer::isSamePiece(fp, copy));
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+static void runSellerWindowTest(TestRunner& tr)
+{
+   tr.group("Seller window");
+
+   tr.test("rebalance");
+   {
+      map<string, double> rates;
+      rates["1:1"] = 100.0;
+      rates["2:1"] = 90.0;
+      rates["3:1"] = 10.0;
+
+      // sellers at or above half of the average rate get the full window
+      assert(SellerPicker::getSellerWindow(rates, "1:1", 4) == 4);
+      assert(SellerPicker::getSellerWindow(rates, "2:1", 4) == 4);
+
+      // a slow seller is limited to a single outstanding piece
+      assert(SellerPicker::getSellerWindow(rates, "3:1", 4) == 1);
+
+      // a seller without pieces in flight gets the full window
+      assert(SellerPicker::getSellerWindow(rates, "4:1", 4) == 4);
+
+      // a single active seller is never compared with itself
+      map<string, double> one;
+      one["3:1"] = 10.0;
+      assert(SellerPicker::getSellerWindow(one, "3:1", 4) == 4);
+
+      // a window of 0 is treated as a window of 1
+      assert(SellerPicker::getSellerWindow(rates, "1:1", 0) == 1);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+/**
+ * Creates a copy of a piece for the endgame test.
+ *
+ * @param id the PieceDownloader ID.
+ * @param rate the current download rate.
+ * @param twinId the ID of the copy's twin, 0 for none.
+ * @param duplicate true if the copy is a duplicate.
+ * @param cancelled true if the copy was cancelled.
+ *
+ * @return the copy.
+ */
+static Endgame::Copy createCopy(
+   uint32_t id, double rate, uint32_t twinId, bool duplicate, bool cancelled)
+{
+   Endgame::Copy rval;
+   rval.id = id;
+   rval.rate = rate;
+   rval.twinId = twinId;
+   rval.duplicate = duplicate;
+   rval.cancelled = cancelled;
+   return rval;
+}
+
+/**
+ * Adds a seller to a FileProgress for the endgame test.
+ *
+ * @param progress the FileProgress.
+ * @param sellerId the ID of the seller, its server ID is always 1.
+ * @param price the seller's price.
+ * @param rate the seller's download rate, negative for none.
+ */
+static void addSeller(
+   FileProgress& progress, UserId sellerId, const char* price, double rate)
+{
+   SellerData& sd = progress["sellerData"]->append();
+   BM_ID_SET(sd["seller"]["userId"], sellerId);
+   BM_ID_SET(sd["seller"]["serverId"], 1);
+   sd["price"] = price;
+   if(rate >= 0)
+   {
+      sd["downloadRate"] = rate;
+   }
+}
+
+static void runEndgameTest(TestRunner& tr)
+{
+   tr.group("Endgame");
+
+   tr.test("duplicate pieces");
+   {
+      // piece 3 already has a duplicate (4) and piece 5 was cancelled, so
+      // 3 pieces are outstanding and only 1 and 2 can be duplicated
+      Endgame::CopyList copies;
+      copies.push_back(createCopy(1, 50.0, 0, false, false));
+      copies.push_back(createCopy(2, 10.0, 0, false, false));
+      copies.push_back(createCopy(3, 30.0, 4, false, false));
+      copies.push_back(createCopy(4, 40.0, 3, true, false));
+      copies.push_back(createCopy(5, 0.0, 0, false, true));
+
+      // the slowest piece is duplicated first
+      vector<uint32_t> ids;
+      Endgame::choosePieces(copies, 3, false, ids);
+      assert(ids.size() == 2);
+      assert(ids[0] == 2);
+      assert(ids[1] == 1);
+
+      // endgame waits until few enough pieces are outstanding
+      ids.clear();
+      Endgame::choosePieces(copies, 2, false, ids);
+      assert(ids.empty());
+
+      // endgame waits until every piece has been assigned
+      Endgame::choosePieces(copies, 3, true, ids);
+      assert(ids.empty());
+
+      // endgame is disabled
+      Endgame::choosePieces(copies, 0, false, ids);
+      assert(ids.empty());
+   }
+   tr.passIfNoException();
+
+   tr.test("duplicate seller");
+   {
+      DownloadState ds;
+      ds["blacklist"]->setType(Map);
+      ds["activeSellers"]->setType(Map);
+      FileProgress progress;
+      progress["budget"] = "1.00";
+      progress["sellerData"]->setType(Array);
+      addSeller(progress, 1, "0.10", 100.0);
+      addSeller(progress, 2, "0.10", 90.0);
+      addSeller(progress, 3, "0.10", 80.0);
+      addSeller(progress, 4, "2.00", 70.0);
+      addSeller(progress, 5, "0.10", 20.0);
+      addSeller(progress, 6, "0.10", -1);
+      ds["blacklist"]["2:1"]["time"] = (uint64_t)0;
+      ds["activeSellers"]["3:1"] = 1;
+
+      // the fastest seller that is not the original's seller, not
+      // blacklisted, not busy and within budget is picked
+      SellerData sd = Endgame::chooseSeller(ds, progress, "1:1");
+      assert(!sd.isNull());
+      assert(BM_USER_ID(sd["seller"]["userId"]) == 5);
+
+      // a seller without a recorded rate is picked last
+      ds["activeSellers"]["5:1"] = 1;
+      sd = Endgame::chooseSeller(ds, progress, "1:1");
+      assert(!sd.isNull());
+      assert(BM_USER_ID(sd["seller"]["userId"]) == 6);
+
+      // there is no idle seller left
+      ds["activeSellers"]["6:1"] = 1;
+      sd = Endgame::chooseSeller(ds, progress, "1:1");
+      assert(sd.isNull());
+   }
+   tr.passIfNoException();
+
+   tr.test("cancellation");
+   {
+      Endgame::Copy original = createCopy(1, 0.0, 2, false, false);
+      Endgame::Copy duplicate = createCopy(2, 0.0, 1, true, false);
+
+      // whichever copy receives the piece first wins and cancels its twin
+      assert(Endgame::getOutcome(original, true, true) == Endgame::Won);
+      assert(Endgame::getOutcome(duplicate, true, true) == Endgame::Won);
+
+      // the cancelled copy is discarded when it stops, even if it received
+      // the piece, so only the winning copy is recorded and paid for
+      Endgame::Copy loser = createCopy(2, 0.0, 0, true, true);
+      assert(Endgame::getOutcome(loser, false, true) == Endgame::Discard);
+      assert(Endgame::getOutcome(loser, false, false) == Endgame::Discard);
+
+      // a failed copy leaves the piece to its twin
+      assert(
+         Endgame::getOutcome(duplicate, true, false) ==
+         Endgame::DuplicateFailed);
+      assert(
+         Endgame::getOutcome(original, true, false) ==
+         Endgame::OriginalFailed);
+
+      // a copy whose twin is gone is handled like any other piece
+      assert(Endgame::getOutcome(original, false, true) == Endgame::Unpaired);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+static void runMpegAudioFrameParserBenchmark(TestRunner& tr)
+{
+   tr.group("MpegAudioFrameParser benchmark");
+
+   // ~32 MiB of frames
+   ByteBuffer corpus;
+   appendMpegFrames(corpus, 80000);
+   int loops = 10;
+
+   tr.test("scan");
+   {
+      // scan the audio data of the corpus (everything but the first header)
+      // for a sync as when inspecting a non-mpeg file
+      MpegAudioFrameParser parser;
+      uint64_t bytes = 0;
+      uint64_t start = System::getCurrentMilliseconds();
+      for(int i = 0; i < loops; ++i)
+      {
+         for(int offset = 4; offset < corpus.length(); offset += 417)
+         {
+            parser.findFrame(corpus.data() + offset, 413);
+            bytes += 413;
+         }
+      }
+      uint64_t time = System::getCurrentMilliseconds() - start;
+      double mb = (double)bytes / (1024 * 1024);
+      printf("%.0f MiB, %" PRIu64 " ms, %.1f MiB/s ... ",
+         mb, time, (time == 0) ? 0.0 : mb * 1000 / time);
+   }
+   tr.passIfNoException();
+
+   tr.test("frames");
+   {
+      // walk every frame of the corpus as when detecting or sampling
+      MpegAudioFrameParser parser;
+      int frames = 0;
+      uint64_t start = System::getCurrentMilliseconds();
+      for(int i = 0; i < loops; ++i)
+      {
+         int offset = 0;
+         while(offset < corpus.length() &&
+               parser.findFrame(
+                  corpus.data() + offset, corpus.length() - offset) == 0 &&
+               parser.getLastHeader() != NULL)
+         {
+            offset += parser.getLastOffset() +
+               parser.getLastHeader()->getFrameLength();
+            ++frames;
+         }
+      }
+      uint64_t time = System::getCurrentMilliseconds() - start;
+      assert(frames == 80000 * loops);
+      double mb = (double)corpus.length() * loops / (1024 * 1024);
+      printf("%d frames, %" PRIu64 " ms, %.1f MiB/s ... ",
+         frames, time, (time == 0) ? 0.0 : mb * 1000 / time);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+static bool run(TestRunner& tr)
+{
+   if(tr.isDefaultEnabled())
+   {
+      runNodeTest(tr);
+      runCompressionPolicyTest(tr);
+      runDynoBinaryTest(tr);
+      runBtpRouteTrieTest(tr);
+      runContentLimitsTest(tr);
+      runResponseCacheTest(tr);
+      runHttpRangeTest(tr);
+      runSampleCacheTest(tr);
+      runPieceCacheTest(tr);
+      runMpegAudioFrameParserTest(tr);
+      runMpegAudioFrameIndexTest(tr);
+      runBfpStreamHasherTest(tr);
+      runPieceResumeSignatureTest(tr);
+      runBtpConnectionPoolTest(tr);
+      runPersistentSslSessionCacheTest(tr);
+      runPieceSizerTest(tr);
+      runSellerWindowTest(tr);
+      runEndgameTest(tr);
+   }
+
+   if(tr.isTestEnabled("dyno-binary-benchmark"))
+   {
+      runDynoBinaryBenchmark(tr);
+   }
+
+   if(tr.isTestEnabled("mpeg-benchmark"))
+   {
+      runMpegAudioFrameParserBenchmark(tr);
+   }
+
+   if(tr.isTestEnabled("route-benchmark"))
+   {
+      runBtpRouteBenchmark(tr);
    }
 
    if(tr.isTestEnabled("login-required"))
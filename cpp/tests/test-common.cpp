@@ -9,17 +9,24 @@
 
 
 #include "bitmunk/common/BitmunkValidator.h"
+#include "bitmunk/common/PublicKeyCache.h"
+#include "bitmunk/common/SignatureCache.h"
 #include "bitmunk/common/Signer.h"
+#include "bitmunk/common/SyncStateMonitor.h"
 #include "bitmunk/common/Tools.h"
+#include "bitmunk/common/TransferBuffer.h"
 #include "bitmunk/test/Tester.h"
 #include "bitmunk/test/Test.h"
 #include "monarch/crypto/AsymmetricKeyFactory.h"
 #include "monarch/crypto/DefaultBlockCipher.h"
 #include "monarch/crypto/DigitalEnvelope.h"
+#include "monarch/crypto/MessageDigest.h"
 #include "monarch/data/json/JsonWriter.h"
 #include "monarch/io/ByteArrayInputStream.h"
 #include "monarch/io/ByteArrayOutputStream.h"
 #include "monarch/rt/Exception.h"
+#include "monarch/rt/System.h"
+#include "monarch/util/StringTools.h"
 #include "monarch/test/Test.h"
 #include "monarch/test/TestModule.h"
 
@@ -684,6 +691,435 @@ static void runPayeeResolveTest(TestRunner& tr)
    tr.ungroup();
 }
 
+/**
+ * A PublicKeySource that counts its fetches and only knows one key. Fetches
+ * for the failing ID fail as if the server could not be reached.
+ */
+class CountingKeySource : public PublicKeySource
+{
+public:
+   PublicKeyRef key;
+   UserId knownId;
+   UserId failingId;
+   int fetches;
+
+   CountingKeySource() : key(NULL), knownId(1), failingId(3), fetches(0) {};
+   virtual ~CountingKeySource() {};
+   virtual PublicKeyRef getPublicKey(
+      UserId uid, ProfileId pid, bool* isDelegate)
+   {
+      PublicKeyRef rval(NULL);
+      ++fetches;
+      if(uid == knownId)
+      {
+         rval = key;
+      }
+      else if(uid == failingId)
+      {
+         ExceptionRef e = new Exception(
+            "Server error.", "bitmunk.test.ServerError", 500);
+         Exception::set(e);
+      }
+      else
+      {
+         ExceptionRef e = new Exception(
+            "Public key not found.", "bitmunk.test.NotFound");
+         Exception::set(e);
+      }
+      if(isDelegate != NULL)
+      {
+         *isDelegate = false;
+      }
+      return rval;
+   }
+};
+
+static void runPublicKeyCacheTest(TestRunner& tr)
+{
+   tr.group("PublicKeyCache");
+
+   Profile p;
+   CountingKeySource source;
+   source.key = p.generate();
+
+   tr.test("hit");
+   {
+      PublicKeyCache cache;
+      cache.setPublicKeySource(&source);
+      source.fetches = 0;
+
+      bool isDelegate = true;
+      PublicKeyRef key = cache.getPublicKey(1, 1, &isDelegate);
+      assertNoExceptionSet();
+      assert(!key.isNull());
+      assert(!isDelegate);
+      key = cache.getPublicKey(1, 1, NULL);
+      assert(!key.isNull());
+      assert(source.fetches == 1);
+
+      DynamicObject stats = cache.getStats();
+      assert(stats["entries"]->getUInt64() == 1);
+      assert(stats["hits"]->getUInt64() == 1);
+      assert(stats["misses"]->getUInt64() == 1);
+      assert(stats["fetches"]->getUInt64() == 1);
+   }
+   tr.passIfNoException();
+
+   tr.test("negative entry");
+   {
+      PublicKeyCache cache;
+      cache.setPublicKeySource(&source);
+      source.fetches = 0;
+
+      // unknown key is fetched once and then remembered as missing
+      PublicKeyRef key = cache.getPublicKey(2, 1, NULL);
+      assert(key.isNull());
+      assert(Exception::isSet());
+      assert(strcmp(
+         Exception::get()->getType(), "bitmunk.test.NotFound") == 0);
+      Exception::clear();
+      key = cache.getPublicKey(2, 1, NULL);
+      assert(key.isNull());
+      assert(Exception::isSet());
+      Exception::clear();
+      assert(source.fetches == 1);
+
+      // without negative caching every lookup is fetched
+      cache.clear();
+      cache.setNegativeTtl(0);
+      cache.getPublicKey(2, 1, NULL);
+      cache.getPublicKey(2, 1, NULL);
+      Exception::clear();
+      assert(source.fetches == 3);
+   }
+   tr.passIfNoException();
+
+   tr.test("transient failure");
+   {
+      PublicKeyCache cache;
+      cache.setPublicKeySource(&source);
+      source.fetches = 0;
+
+      // a failure that does not mean the key is missing is not cached
+      PublicKeyRef key = cache.getPublicKey(3, 1, NULL);
+      assert(key.isNull());
+      assert(Exception::isSet());
+      Exception::clear();
+      key = cache.getPublicKey(3, 1, NULL);
+      assert(key.isNull());
+      Exception::clear();
+      assert(source.fetches == 2);
+      assert(cache.getStats()["entries"]->getUInt64() == 0);
+   }
+   tr.passIfNoException();
+
+   tr.test("monitor");
+   {
+      SyncStateMonitor monitor;
+      PublicKeyCache cache;
+      cache.setPublicKeySource(&source);
+      cache.setStateMonitor(&monitor);
+
+      // a fetch reports the shard's counters right away
+      uint64_t value = 0;
+      cache.getPublicKey(1, 1, NULL);
+      assert(monitor.getUInt64State(
+         "bitmunk.common.PublicKeyCache.fetches", value));
+      assert(value == 1);
+
+      // hits are only reported once published
+      cache.getPublicKey(1, 1, NULL);
+      cache.getPublicKey(1, 1, NULL);
+      assert(monitor.getUInt64State(
+         "bitmunk.common.PublicKeyCache.hits", value));
+      assert(value == 0);
+      cache.publishStats();
+      assert(monitor.getUInt64State(
+         "bitmunk.common.PublicKeyCache.hits", value));
+      assert(value == 2);
+      assert(monitor.getUInt64State(
+         "bitmunk.common.PublicKeyCache.misses", value));
+      assert(value == 1);
+      cache.setStateMonitor(NULL);
+   }
+   tr.passIfNoException();
+
+   tr.test("eviction");
+   {
+      // capacity of 16 gives each shard room for a single key
+      PublicKeyCache cache(16);
+      for(ProfileId pid = 1; pid <= 64; ++pid)
+      {
+         cache.addPublicKey(1, pid, source.key, false);
+      }
+      DynamicObject stats = cache.getStats();
+      assert(stats["entries"]->getUInt64() <= 16);
+
+      // the most recently added key is still cached
+      assert(!cache.getPublicKey(1, 64, NULL).isNull());
+      cache.clear();
+      stats = cache.getStats();
+      assert(stats["entries"]->getUInt64() == 0);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+static void runSignatureCacheTest(TestRunner& tr)
+{
+   tr.group("SignatureCache");
+
+   ProfileRef profile = new Profile();
+   PublicKeyRef publicKey = profile->generate();
+   assertNoExceptionSet();
+
+   tr.test("verify");
+   {
+      SignatureCache cache;
+      string content = "some data to sign";
+      string signature;
+      assertNoException(
+         Signer::sign(profile, content, signature));
+
+      // second verification is answered by the cache
+      assert(cache.verify(
+         publicKey, content.c_str(), content.length(), signature.c_str()));
+      assert(cache.verify(
+         publicKey, content.c_str(), content.length(), signature.c_str()));
+
+      // different content is not
+      string other = "other data";
+      assert(!cache.verify(
+         publicKey, other.c_str(), other.length(), signature.c_str()));
+
+      DynamicObject stats = cache.getStats();
+      assert(stats["entries"]->getUInt64() == 2);
+      assert(stats["hits"]->getUInt64() == 1);
+      assert(stats["misses"]->getUInt64() == 2);
+
+      // full cache evicts the least recently used result
+      cache.setCapacity(1);
+      stats = cache.getStats();
+      assert(stats["entries"]->getUInt64() == 1);
+   }
+   tr.passIfNoException();
+
+   tr.test("oversized signature");
+   {
+      // a signature longer than any key can produce is not decoded
+      SignatureCache cache;
+      string content = "some data to sign";
+      string signature(SignatureCache::MAX_SIGNATURE_LENGTH * 2 + 2, 'a');
+      assert(!cache.verify(
+         publicKey, content.c_str(), content.length(), signature.c_str()));
+   }
+   tr.passIfNoException();
+
+   tr.test("cached result");
+   {
+      SignatureCache cache;
+      bool verified = false;
+      assert(!cache.getResult(publicKey, "digest", "signature", verified));
+      cache.addResult(publicKey, "digest", "signature", true);
+      assert(cache.getResult(publicKey, "digest", "signature", verified));
+      assert(verified);
+
+      // the same key in another reference has the same fingerprint
+      PublicKeyRef copy = publicKey;
+      assert(cache.getResult(copy, "digest", "signature", verified));
+      assert(!cache.getResult(copy, "digest", "other", verified));
+   }
+   tr.passIfNoException();
+
+   tr.test("verify file pieces");
+   {
+      const char* csHash = "c0ffee";
+      FileId fileId = "0123456789abcdef0123456789abcdef01234567";
+      FilePieceList pieces;
+      pieces->setType(Array);
+      for(int i = 0; i < 16; ++i)
+      {
+         FilePiece& fp = pieces->append();
+         fp["index"] = i;
+         fp["size"] = 256 * 1024;
+         fp["ciphered"] = false;
+         assertNoException(
+            Signer::signFilePiece(csHash, fileId, fp, profile, true));
+      }
+
+      assertNoException(
+         Signer::verifyFilePieces(csHash, fileId, pieces, publicKey, true));
+      assertNoException(
+         Signer::verifyFilePieces(
+            csHash, fileId, pieces, publicKey, true, 1));
+
+      // tampered pieces are reported by index
+      pieces[3]["size"] = 1;
+      pieces[11]["size"] = 1;
+      assert(!Signer::verifyFilePieces(
+         csHash, fileId, pieces, publicKey, true, 4));
+      assert(Exception::isSet());
+      DynamicObject failed =
+         Exception::get()->getDetails()["failed"].clone();
+      Exception::clear();
+      assert(failed->length() == 2);
+      int sum = failed[0]->getInt32() + failed[1]->getInt32();
+      assert(sum == 14);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+/**
+ * Creates a ContractSection with the given number of file infos and payees.
+ */
+static ContractSection createContractSection(int fileInfos, int payees)
+{
+   ContractSection cs;
+   cs["buyer"]["profileId"] = 1;
+   cs["buyer"]["userId"] = 900;
+   cs["buyer"]["username"] = "buyer";
+   cs["seller"]["profileId"] = 1;
+   cs["seller"]["serverId"] = 1;
+   cs["seller"]["url"] = "https://localhost:19200/";
+   cs["seller"]["userId"] = 901;
+   cs["seller"]["username"] = "seller";
+   cs["negotiationTerms"]->setType(Map);
+   cs["ware"]["id"] = "bitmunk:bundle:1";
+   cs["ware"]["mediaId"] = 2;
+   cs["ware"]["fileInfos"]->setType(Array);
+   for(int i = 0; i < fileInfos; ++i)
+   {
+      FileInfo& fi = cs["ware"]["fileInfos"]->append();
+      fi["id"] = StringTools::format(
+         "%040x", (unsigned int)(0xfeed0000 + i)).c_str();
+      fi["contentSize"] = (uint64_t)(4000000 + i);
+      fi["mediaId"] = 2 + i;
+   }
+   cs["ware"]["payees"]->setType(Array);
+   for(int i = 0; i < payees; ++i)
+   {
+      Payee& p = cs["ware"]["payees"]->append();
+      p["id"] = 100 + i;
+      p["amountType"] = PAYEE_AMOUNT_TYPE_FLATFEE;
+      p["amount"] = "0.01";
+      p["taxExempt"] = false;
+      p["description"] = "Payee description";
+   }
+   return cs;
+}
+
+static void runContentSinkTest(TestRunner& tr)
+{
+   tr.group("ContentSink");
+
+   tr.test("streamed hash");
+   {
+      ContractSection cs = createContractSection(10, 10);
+
+      // hash of the built content string
+      string content;
+      StringContentSink ss(content);
+      Signer::appendContractSectionContent(cs, ss);
+      MessageDigest md;
+      md.start("SHA1");
+      md.update(content.c_str(), content.length());
+      string expected = md.getDigest();
+
+      // hash of the streamed content
+      MessageDigest md2;
+      md2.start("SHA1");
+      HashContentSink hs(&md2);
+      Signer::appendContractSectionContent(cs, hs);
+      assert(hs.getLength() == content.length());
+      assertStrCmp(md2.getDigest().c_str(), expected.c_str());
+
+      // section hash is always computed from the terms, a hash supplied
+      // with the section is ignored
+      cs["hash"] = "bogus";
+      string hash = Tools::getContractSectionHash(cs);
+      assertStrCmp(hash.c_str(), expected.c_str());
+      assertStrCmp(cs["hash"]->getString(), "bogus");
+      cs->removeMember("hash");
+   }
+   tr.passIfNoException();
+
+   tr.test("sign and verify section");
+   {
+      ContractSection cs = createContractSection(3, 3);
+      ProfileRef seller = new Profile();
+      PublicKeyRef sellerKey = seller->generate();
+      ProfileRef buyer = new Profile();
+      PublicKeyRef buyerKey = buyer->generate();
+      assertNoException(
+         Signer::signContractSection(cs, seller, true));
+      assertNoException(
+         Signer::signContractSection(cs, buyer, false));
+      assertNoException(
+         Signer::verifyContractSection(cs, sellerKey, &buyerKey));
+
+      // changed terms break both signatures
+      cs["ware"]["payees"][0]["amount"] = "0.02";
+      assert(!Signer::verifyContractSection(cs, sellerKey, &buyerKey));
+      assert(Exception::isSet());
+      Exception::clear();
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+static void runSignerBenchmark(TestRunner& tr)
+{
+   tr.group("Signer benchmark");
+
+   // a large section, as for a collection with many files and payees
+   ContractSection cs = createContractSection(200, 200);
+   int iterations = 2000;
+
+   tr.test("built string");
+   {
+      uint64_t bytes = 0;
+      uint64_t start = System::getCurrentMilliseconds();
+      for(int i = 0; i < iterations; ++i)
+      {
+         string content;
+         StringContentSink sink(content);
+         Signer::appendContractSectionContent(cs, sink);
+         MessageDigest md;
+         md.start("SHA1");
+         md.update(content.c_str(), content.length());
+         md.getDigest();
+         bytes += content.capacity();
+      }
+      uint64_t elapsed = System::getCurrentMilliseconds() - start;
+      printf("%.3f ms/hash, %" PRIu64 " bytes buffered/hash... ",
+         (double)elapsed / iterations, bytes / iterations);
+   }
+   tr.passIfNoException();
+
+   tr.test("streamed");
+   {
+      uint64_t start = System::getCurrentMilliseconds();
+      for(int i = 0; i < iterations; ++i)
+      {
+         MessageDigest md;
+         md.start("SHA1");
+         HashContentSink sink(&md);
+         Signer::appendContractSectionContent(cs, sink);
+         md.getDigest();
+      }
+      uint64_t elapsed = System::getCurrentMilliseconds() - start;
+      printf("%.3f ms/hash, 0 bytes buffered/hash... ",
+         (double)elapsed / iterations);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
 static void runValidatorTest(TestRunner& tr)
 {
    tr.group("Validators");
@@ -719,13 +1155,56 @@ static void runValidatorTest(TestRunner& tr)
    tr.ungroup();
 }
 
+static void runTransferBufferTest(TestRunner& tr)
+{
+   tr.group("TransferBuffer");
+
+   tr.test("default size");
+   {
+      DynamicObject cfg;
+      cfg["maxUploadRate"] = 0;
+      TransferBuffer tb;
+      assertNoException(
+         tb.allocate(TransferBuffer::getConfiguredSize(cfg)));
+      assert(tb.size() == TransferBuffer::DEFAULT_SIZE);
+      assert(((size_t)tb.data() % TransferBuffer::ALIGNMENT) == 0);
+   }
+   tr.passIfNoException();
+
+   tr.test("clamp and align");
+   {
+      TransferBuffer tb;
+      assertNoException(tb.allocate(1));
+      assert(tb.size() == 4096);
+      assertNoException(tb.allocate(5000));
+      assert(tb.size() == 8192);
+      assert(((size_t)tb.data() % TransferBuffer::ALIGNMENT) == 0);
+      assertNoException(tb.allocate(TransferBuffer::MAX_SIZE * 2));
+      assert(tb.size() == TransferBuffer::MAX_SIZE);
+      tb.free();
+      assert(tb.data() == NULL);
+      assert(tb.size() == 0);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
 static bool run(TestRunner& tr)
 {
    if(tr.isDefaultEnabled())
    {
       runProfileTest(tr);
       runPayeeResolveTest(tr);
+      runPublicKeyCacheTest(tr);
+      runSignatureCacheTest(tr);
+      runContentSinkTest(tr);
       runValidatorTest(tr);
+      runTransferBufferTest(tr);
+   }
+   if(tr.isTestEnabled("signer-benchmark"))
+   {
+      runSignerBenchmark(tr);
    }
    return true;
 }
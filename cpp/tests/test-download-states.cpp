@@ -11,17 +11,33 @@
 #include "bitmunk/common/Logging.h"
 #include "bitmunk/common/Tools.h"
 #include "bitmunk/node/Node.h"
+#include "bitmunk/purchase/IPurchaseModule.h"
+#include "bitmunk/purchase/PurchaseDatabase.h"
 #include "bitmunk/purchase/TypeDefinitions.h"
 #include "bitmunk/test/Tester.h"
 #include "monarch/data/json/JsonWriter.h"
 #include "monarch/event/EventWaiter.h"
+#include "monarch/io/ByteBuffer.h"
 #include "monarch/io/File.h"
 #include "monarch/io/FileOutputStream.h"
 #include "monarch/io/OStreamOutputStream.h"
 #include "monarch/rt/DynamicObject.h"
+#include "monarch/rt/ExclusiveLock.h"
 #include "monarch/rt/Exception.h"
+#include "monarch/rt/System.h"
+#include "monarch/sql/sqlite3/Sqlite3ConnectionPool.h"
+#include "monarch/sql/sqlite3/Sqlite3DatabaseClient.h"
 #include "monarch/test/Test.h"
 #include "monarch/test/TestModule.h"
+#include "monarch/util/StringTools.h"
+
+#include <algorithm>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 using namespace bitmunk::common;
@@ -35,7 +51,10 @@ using namespace monarch::event;
 using namespace monarch::io;
 using namespace monarch::net;
 using namespace monarch::rt;
+using namespace monarch::sql;
+using namespace monarch::sql::sqlite3;
 using namespace monarch::test;
+using namespace monarch::util;
 
 #define DEVUSER_ID    900
 #define TEST_SINGLE_MEDIA_ID 2
@@ -154,6 +173,628 @@ static void runDownloadStatesTest(
    tr.ungroup();
 }
 
+/**
+ * Creates normalized file piece records for the purchase database.
+ *
+ * @param dsId the download state ID.
+ * @param first the index of the first piece.
+ * @param count the number of pieces.
+ *
+ * @return the records.
+ */
+static DynamicObject createPieceRecords(
+   DownloadStateId dsId, uint32_t first, uint32_t count)
+{
+   DynamicObject records;
+   records->setType(Array);
+   for(uint32_t i = first; i < first + count; ++i)
+   {
+      DynamicObject& record = records->append();
+      record["dsId"] = dsId;
+      record["fileId"] = "0000000000000000000000000000000000000001";
+      record["csHash"] = "0000000000000000000000000000000000000003";
+      record["index"] = i;
+      record["pieceSize"] = 262144;
+      record["status"] = "downloaded";
+      record["piece"]["index"] = i;
+      record["piece"]["size"] = 262144;
+      record["piece"]["bfpId"] = 1;
+   }
+   return records;
+}
+
+static void runPurchaseDatabaseBenchmark(Node& node, TestRunner& tr)
+{
+   tr.group("PurchaseDatabase");
+
+   IPurchaseModule* ipm = dynamic_cast<IPurchaseModule*>(
+      node.getModuleApi("bitmunk.purchase.Purchase"));
+   assert(ipm != NULL);
+   PurchaseDatabase* pd = ipm->getPurchaseDatabase();
+   UserId userId = node.getDefaultUserId();
+
+   // use a download state ID that does not belong to a real download
+   DownloadState ds;
+   ds["id"] = (uint64_t)0xFFFFFFFFULL;
+   BM_ID_SET(ds["userId"], userId);
+   DownloadStateId dsId = ds["id"]->getUInt64();
+
+   tr.test("clean up");
+   {
+      pd->deleteDownloadState(ds);
+   }
+   tr.passIfNoException();
+
+   // per-update latency should stay flat as the number of pieces grows
+   uint32_t sizes[] = {1000, 10000, 100000, 0};
+   uint32_t updates = 200;
+   uint32_t count = 0;
+   for(int n = 0; sizes[n] != 0; ++n)
+   {
+      string name = StringTools::format("%u pieces", sizes[n]);
+      tr.test(name.c_str());
+      {
+         // grow table in large batches
+         while(count < sizes[n])
+         {
+            uint32_t batch = std::min(sizes[n] - count, (uint32_t)5000);
+            DynamicObject records = createPieceRecords(dsId, count, batch);
+            assertNoException(
+               pd->writeFileProgress(userId, records));
+            count += batch;
+         }
+
+         // time single piece updates spread across the table
+         uint64_t start = System::getCurrentMilliseconds();
+         for(uint32_t i = 0; i < updates; ++i)
+         {
+            DynamicObject records = createPieceRecords(
+               dsId, (i * 7919) % count, 1);
+            assertNoException(
+               pd->writeFileProgress(userId, records));
+         }
+         uint64_t elapsed = System::getCurrentMilliseconds() - start;
+         printf("%.3f ms/update... ", (double)elapsed / updates);
+      }
+      tr.passIfNoException();
+   }
+
+   tr.test("populate");
+   {
+      uint64_t start = System::getCurrentMilliseconds();
+      ds["progress"]->setType(Map);
+      assertNoException(
+         pd->populateFileProgress(ds));
+      printf("%u pieces in %" PRIu64 " ms... ",
+         count, System::getCurrentMilliseconds() - start);
+   }
+   tr.passIfNoException();
+
+   tr.test("delete");
+   {
+      assertNoException(
+         pd->deleteDownloadState(ds));
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+/**
+ * Executes a statement that does not return any rows.
+ *
+ * @param c the connection to use.
+ * @param sql the statement.
+ */
+static void executeSql(Connection* c, const char* sql)
+{
+   Statement* s = c->prepare(sql);
+   assert(s != NULL);
+   assertNoException(
+      s->execute());
+}
+
+/**
+ * Gets a single text value from a query.
+ *
+ * @param c the connection to use.
+ * @param sql the query.
+ * @param column the column to get.
+ *
+ * @return the value or an empty string if the query returned no rows.
+ */
+static string querySql(Connection* c, const char* sql, const char* column)
+{
+   string rval;
+   Statement* s = c->prepare(sql);
+   assert(s != NULL);
+   assertNoException(
+      s->execute());
+   Row* row = s->fetch();
+   if(row != NULL)
+   {
+      assert(row->getText(column, rval));
+      s->fetch();
+   }
+   return rval;
+}
+
+static void runPurchaseDatabaseMigrationTest(Node& node, TestRunner& tr)
+{
+   tr.group("PurchaseDatabase migration");
+
+   IPurchaseModule* ipm = dynamic_cast<IPurchaseModule*>(
+      node.getModuleApi("bitmunk.purchase.Purchase"));
+   assert(ipm != NULL);
+   PurchaseDatabase* pd = ipm->getPurchaseDatabase();
+   UserId userId = node.getDefaultUserId();
+
+   // initialize the user's own database first so that its progress journal
+   // has been replayed before the test database is initialized
+   Connection* c = pd->getConnection(userId);
+   assert(c != NULL);
+   c->close();
+
+   File file = File::createTempFile("purchasedb.");
+   string url = StringTools::format(
+      "sqlite3://%s", file->getAbsolutePath());
+   ConnectionPoolRef pool = new Sqlite3ConnectionPool(url.c_str(), 1);
+   DatabaseClientRef dbc = new Sqlite3DatabaseClient();
+   dbc->setReadConnectionPool(pool);
+   dbc->setWriteConnectionPool(pool);
+   dbc->initialize();
+
+   tr.test("create pre-3.2 schema");
+   {
+      c = pool->getConnection();
+      assert(c != NULL);
+      executeSql(c,
+         "CREATE TABLE download_states ("
+         "download_state_id INTEGER PRIMARY KEY,"
+         "user_id BIGINT UNSIGNED,"
+         "version VARCHAR(10),"
+         "ware TEXT,"
+         "total_med_price TEXT,"
+         "preferences TEXT,"
+         "start_date TEXT,"
+         "remaining_pieces INTEGER UNSIGNED,"
+         "initialized TINYINT UNSIGNED,"
+         "license_acquired TINYINT UNSIGNED,"
+         "download_started TINYINT UNSIGNED,"
+         "download_paused TINYINT UNSIGNED,"
+         "license_purchased TINYINT UNSIGNED,"
+         "data_purchased TINYINT UNSIGNED,"
+         "files_assembled TINYINT UNSIGNED)");
+      executeSql(c,
+         "CREATE TABLE seller_data ("
+         "download_state_id BIGINT UNSIGNED,"
+         "user_id BIGINT UNSIGNED,"
+         "file_id VARCHAR(40),"
+         "price VARCHAR(20),"
+         "section TEXT)");
+      executeSql(c,
+         "CREATE INDEX seller_data_index ON seller_data ("
+         "download_state_id,user_id,file_id)");
+      executeSql(c,
+         "CREATE TABLE seller_pools ("
+         "download_state_id BIGINT UNSIGNED,"
+         "user_id BIGINT UNSIGNED,"
+         "file_id VARCHAR(40),"
+         "seller_pool TEXT,"
+         "PRIMARY KEY(download_state_id,user_id,file_id))");
+      executeSql(c,
+         "CREATE TABLE file_pieces ("
+         "download_state_id BIGINT UNSIGNED,"
+         "user_id BIGINT UNSIGNED,"
+         "file_id VARCHAR(40),"
+         "piece_index INTEGER UNSIGNED,"
+         "valid TINYINT UNSIGNED,"
+         "section_hash VARCHAR(40),"
+         "status VARCHAR(12),"
+         "file_piece TEXT)");
+      executeSql(c,
+         "INSERT INTO download_states (download_state_id,user_id,version,"
+         "ware,total_med_price) VALUES (1,900,'3.0','{}','1.00')");
+      executeSql(c,
+         "INSERT INTO seller_data VALUES (1,900,"
+         "'0000000000000000000000000000000000000001','1.00','{}')");
+      executeSql(c,
+         "INSERT INTO seller_pools VALUES (1,900,"
+         "'0000000000000000000000000000000000000001','{}')");
+      executeSql(c,
+         "INSERT INTO file_pieces VALUES (1,900,"
+         "'0000000000000000000000000000000000000001',0,1,"
+         "'0000000000000000000000000000000000000003','downloaded','{}')");
+      c->close();
+   }
+   tr.passIfNoException();
+
+   tr.test("migrate");
+   {
+      c = pool->getConnection();
+      assert(c != NULL);
+      assertNoException(
+         pd->initializePerUserDatabase(0, userId, c, dbc));
+   }
+   tr.passIfNoException();
+
+   tr.test("check schema");
+   {
+      c = pool->getConnection();
+      assert(c != NULL);
+      assertStrCmp(
+         querySql(c,
+            "SELECT value FROM bitmunk_meta WHERE subject='database' "
+            "AND property='schema.version'", "value").c_str(),
+         "3.4");
+
+      // every file ID shares a single key
+      assertStrCmp(
+         querySql(c,
+            "SELECT COUNT(*) AS count FROM file_keys", "count").c_str(),
+         "1");
+      const char* tables[] = {
+         "seller_data",
+         "seller_pools",
+         "file_pieces",
+         NULL
+      };
+      for(int i = 0; tables[i] != NULL; ++i)
+      {
+         string sql = StringTools::format(
+            "SELECT COUNT(*) AS count FROM %s JOIN file_keys "
+            "ON file_keys.file_key=%s.file_key "
+            "WHERE file_keys.file_id="
+            "'0000000000000000000000000000000000000001'",
+            tables[i], tables[i]);
+         assertStrCmp(querySql(c, sql.c_str(), "count").c_str(), "1");
+      }
+      assertStrCmp(
+         querySql(c,
+            "SELECT piece_size FROM file_pieces", "piece_size").c_str(),
+         "0");
+
+      // the new indexes exist and the old one has been dropped
+      const char* indexes[] = {
+         "download_states_user_index",
+         "seller_data_key_index",
+         "file_pieces_index",
+         NULL
+      };
+      for(int i = 0; indexes[i] != NULL; ++i)
+      {
+         string sql = StringTools::format(
+            "SELECT tbl_name FROM sqlite_master "
+            "WHERE type='index' AND name='%s'", indexes[i]);
+         assert(querySql(c, sql.c_str(), "tbl_name").length() > 0);
+      }
+      assertStrCmp(
+         querySql(c,
+            "SELECT name FROM sqlite_master "
+            "WHERE name='seller_data_index'", "name").c_str(),
+         "");
+      c->close();
+   }
+   tr.passIfNoException();
+
+   file->remove();
+
+   tr.ungroup();
+}
+
+/**
+ * Counts the lines in a file.
+ *
+ * @param path the path to the file.
+ *
+ * @return the number of lines, 0 if the file does not exist.
+ */
+static uint32_t countLines(const char* path)
+{
+   uint32_t rval = 0;
+   File file(path);
+   if(file->exists() && file->getLength() > 0)
+   {
+      ByteBuffer b(file->getLength());
+      assert(file.readBytes(&b));
+      rval = (uint32_t)std::count(b.data(), b.data() + b.length(), '\n');
+   }
+   return rval;
+}
+
+static void runProgressJournalTest(Node& node, TestRunner& tr)
+{
+   tr.group("ProgressJournal");
+
+   IPurchaseModule* ipm = dynamic_cast<IPurchaseModule*>(
+      node.getModuleApi("bitmunk.purchase.Purchase"));
+   assert(ipm != NULL);
+   PurchaseDatabase* pd = ipm->getPurchaseDatabase();
+   UserId userId = node.getDefaultUserId();
+
+   // get the path to the user's journal file
+   string path;
+   assert(node.getConfigManager()->expandUserDataPath(
+      "bitmunk.purchase.Purchase/purchase.journal", userId, path));
+
+   // use a download state ID that does not belong to a real download
+   DownloadState ds;
+   ds["id"] = (uint64_t)0xFFFFFFFEULL;
+   BM_ID_SET(ds["userId"], userId);
+   DownloadStateId dsId = ds["id"]->getUInt64();
+
+   tr.test("clean up");
+   {
+      // flushes anything that is pending
+      pd->deleteDownloadState(ds);
+      ds["progress"]->setType(Map);
+      assertNoException(
+         pd->populateFileProgress(ds));
+      assert(countLines(path.c_str()) == 0);
+   }
+   tr.passIfNoException();
+
+   tr.test("append");
+   {
+      // piece 0 is updated twice and piece 1 once
+      const char* statuses[] = {"assigned", "assigned", "downloaded", NULL};
+      for(int i = 0; statuses[i] != NULL; ++i)
+      {
+         DynamicObject entries;
+         DynamicObject& entry = entries->append();
+         entry["fileId"] = "0000000000000000000000000000000000000001";
+         entry["csHash"] = "0000000000000000000000000000000000000003";
+         entry["status"] = statuses[i];
+         entry["piece"]["index"] = (i == 1) ? 1 : 0;
+         entry["piece"]["size"] = 262144;
+         entry["piece"]["bfpId"] = 1;
+         assertNoException(
+            pd->updateFileProgress(ds, entries));
+      }
+
+      // every update is in the journal
+      assert(countLines(path.c_str()) == 3);
+   }
+   tr.passIfNoException();
+
+   tr.test("compact");
+   {
+      // populating the file progress flushes the journal, which leaves it
+      // with only the records that are still pending
+      assertNoException(
+         pd->populateFileProgress(ds));
+      assert(countLines(path.c_str()) == 0);
+      assert(!File((path + ".tmp").c_str())->exists());
+
+      // only the latest update for each piece was written
+      Connection* c = pd->getConnection(userId);
+      assert(c != NULL);
+      string sql = StringTools::format(
+         "SELECT status FROM file_pieces WHERE download_state_id=%" PRIu64
+         " AND piece_index=0", dsId);
+      assertStrCmp(querySql(c, sql.c_str(), "status").c_str(), "downloaded");
+      sql = StringTools::format(
+         "SELECT COUNT(*) AS count FROM file_pieces "
+         "WHERE download_state_id=%" PRIu64, dsId);
+      assertStrCmp(querySql(c, sql.c_str(), "count").c_str(), "2");
+      c->close();
+   }
+   tr.passIfNoException();
+
+   tr.test("delete");
+   {
+      assertNoException(
+         pd->deleteDownloadState(ds));
+   }
+   tr.passIfNoException();
+
+   tr.test("replay truncated journal");
+   {
+      File file = File::createTempFile("purchasedb.");
+      string url = StringTools::format(
+         "sqlite3://%s", file->getAbsolutePath());
+      ConnectionPoolRef pool = new Sqlite3ConnectionPool(url.c_str(), 1);
+      DatabaseClientRef dbc = new Sqlite3DatabaseClient();
+      dbc->setReadConnectionPool(pool);
+      dbc->setWriteConnectionPool(pool);
+      dbc->initialize();
+
+      // write one complete record and a torn record, as if the node had
+      // crashed while appending the second record
+      DynamicObject records = createPieceRecords(dsId, 0, 2);
+      string lines = JsonWriter::writeToString(records[0], true);
+      lines.push_back('\n');
+      string torn = JsonWriter::writeToString(records[1], true);
+      lines.append(torn, 0, torn.length() / 2);
+      File journal(path.c_str());
+      FileOutputStream fos(journal);
+      assert(fos.write(lines.c_str(), lines.length()));
+      fos.close();
+
+      // the complete record is replayed and the torn record is dropped
+      Connection* c = pool->getConnection();
+      assert(c != NULL);
+      assertNoException(
+         pd->initializePerUserDatabase(0, userId, c, dbc));
+      c = pool->getConnection();
+      assert(c != NULL);
+      string sql = StringTools::format(
+         "SELECT COUNT(*) AS count FROM file_pieces "
+         "WHERE download_state_id=%" PRIu64, dsId);
+      assertStrCmp(querySql(c, sql.c_str(), "count").c_str(), "1");
+      sql = StringTools::format(
+         "SELECT piece_index FROM file_pieces "
+         "WHERE download_state_id=%" PRIu64, dsId);
+      assertStrCmp(querySql(c, sql.c_str(), "piece_index").c_str(), "0");
+      c->close();
+
+      // the replayed journal is compacted
+      assert(journal->getLength() == 0);
+
+      file->remove();
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+#ifndef WIN32
+/**
+ * An IOWatcher that records the events it is notified of.
+ */
+class TestIOWatcher : public IOWatcher
+{
+protected:
+   ExclusiveLock mLock;
+   int mFd;
+   int mEvents;
+
+public:
+   TestIOWatcher() : mFd(-1), mEvents(0) {};
+   virtual ~TestIOWatcher() {};
+
+   virtual void fdUpdated(int fd, int events)
+   {
+      mLock.lock();
+      {
+         mFd = fd;
+         mEvents = events;
+         mLock.notifyAll();
+      }
+      mLock.unlock();
+   }
+
+   /**
+    * Waits for the watcher to be notified.
+    *
+    * @param timeout the maximum number of milliseconds to wait.
+    * @param fd set to the file descriptor the events occurred on.
+    *
+    * @return the events, 0 if the watcher was not notified.
+    */
+   int waitForEvents(uint32_t timeout, int* fd = NULL)
+   {
+      int rval;
+      mLock.lock();
+      {
+         uint64_t start = System::getCurrentMilliseconds();
+         uint64_t elapsed = 0;
+         while(mEvents == 0 && elapsed < timeout)
+         {
+            mLock.wait(timeout - elapsed);
+            elapsed = System::getCurrentMilliseconds() - start;
+         }
+         rval = mEvents;
+         if(fd != NULL)
+         {
+            *fd = mFd;
+         }
+         mEvents = 0;
+      }
+      mLock.unlock();
+      return rval;
+   }
+};
+
+static void runIOMonitorTest(Node& node, TestRunner& tr)
+{
+   tr.group("IOMonitor");
+
+   IPurchaseModule* ipm = dynamic_cast<IPurchaseModule*>(
+      node.getModuleApi("bitmunk.purchase.Purchase"));
+   assert(ipm != NULL);
+   IOMonitor* iom = ipm->getIOMonitor();
+
+   int fds[2];
+   assert(pipe(fds) == 0);
+   TestIOWatcher watcher;
+
+   tr.test("readable");
+   {
+      iom->watch(fds[0], IOMonitor::Read, &watcher, 5000);
+      assert(watcher.waitForEvents(100) == 0);
+      assert(write(fds[1], "x", 1) == 1);
+      int fd = -1;
+      assert(watcher.waitForEvents(5000, &fd) == IOMonitor::Read);
+      assert(fd == fds[0]);
+
+      // watches are one-shot
+      assert(watcher.waitForEvents(100) == 0);
+      char b;
+      assert(read(fds[0], &b, 1) == 1);
+   }
+   tr.passIfNoException();
+
+   tr.test("writable");
+   {
+      iom->watch(fds[1], IOMonitor::Write, &watcher, 5000);
+      assert(watcher.waitForEvents(5000) == IOMonitor::Write);
+   }
+   tr.passIfNoException();
+
+   tr.test("timeout");
+   {
+      uint64_t start = System::getCurrentMilliseconds();
+      iom->watch(fds[0], IOMonitor::Read, &watcher, 200);
+      assert(watcher.waitForEvents(5000) == IOMonitor::Timeout);
+      assert(System::getCurrentMilliseconds() - start >= 200);
+   }
+   tr.passIfNoException();
+
+   tr.test("unwatch");
+   {
+      iom->watch(fds[0], IOMonitor::Read, &watcher);
+      iom->unwatch(fds[0]);
+      assert(write(fds[1], "x", 1) == 1);
+      assert(watcher.waitForEvents(300) == 0);
+      char b;
+      assert(read(fds[0], &b, 1) == 1);
+   }
+   tr.passIfNoException();
+
+   tr.test("descriptor >= FD_SETSIZE");
+   {
+      // raise the descriptor limit if needed to get a high descriptor
+      int high = FD_SETSIZE + 8;
+      struct rlimit rl;
+      assert(getrlimit(RLIMIT_NOFILE, &rl) == 0);
+      if(rl.rlim_cur <= (rlim_t)high && rl.rlim_max > (rlim_t)high)
+      {
+         rl.rlim_cur = high + 1;
+         setrlimit(RLIMIT_NOFILE, &rl);
+      }
+      if(dup2(fds[0], high) == high)
+      {
+         iom->watch(high, IOMonitor::Read, &watcher, 5000);
+         assert(write(fds[1], "x", 1) == 1);
+         int fd = -1;
+         assert(watcher.waitForEvents(5000, &fd) == IOMonitor::Read);
+         assert(fd == high);
+         char b;
+         assert(read(high, &b, 1) == 1);
+         close(high);
+      }
+      else
+      {
+         printf("skipped, descriptor limit too low... ");
+      }
+   }
+   tr.passIfNoException();
+
+   tr.test("hang up");
+   {
+      // the end of the stream is readable
+      close(fds[1]);
+      iom->watch(fds[0], IOMonitor::Read, &watcher, 5000);
+      assert(watcher.waitForEvents(5000) & IOMonitor::Read);
+      close(fds[0]);
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+#endif
+
 class BmDownloadStatesTesterObserver :
    public monarch::event::Observer
 {
@@ -191,6 +832,38 @@ static bool run(TestRunner& tr)
       Tester::unloadNode(tr);
    }
 
+   if(tr.isTestEnabled("login-required"))
+   {
+      // load and start node
+      Node* node = Tester::loadNode(tr, "common");
+      assertNoException(
+         node->start());
+
+      runPurchaseDatabaseMigrationTest(*node, tr);
+      runProgressJournalTest(*node, tr);
+#ifndef WIN32
+      runIOMonitorTest(*node, tr);
+#endif
+
+      // stop and unload node
+      node->stop();
+      Tester::unloadNode(tr);
+   }
+
+   if(tr.isTestEnabled("purchase-database-benchmark"))
+   {
+      // load and start node
+      Node* node = Tester::loadNode(tr, "common");
+      assertNoException(
+         node->start());
+
+      runPurchaseDatabaseBenchmark(*node, tr);
+
+      // stop and unload node
+      node->stop();
+      Tester::unloadNode(tr);
+   }
+
    return true;
 }
 
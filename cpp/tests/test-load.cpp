@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#define __STDC_FORMAT_MACROS
+
+#include "bitmunk/test/Tester.h"
+#include "monarch/test/Test.h"
+#include "monarch/test/TestModule.h"
+
+
+#include "bitmunk/common/TypeDefinitions.h"
+#include "bitmunk/node/Node.h"
+#include "monarch/data/json/JsonWriter.h"
+#include "monarch/io/File.h"
+#include "monarch/io/FileOutputStream.h"
+#include "monarch/io/OutputStream.h"
+#include "monarch/rt/DynamicObject.h"
+#include "monarch/rt/Exception.h"
+#include "monarch/rt/ExclusiveLock.h"
+#include "monarch/rt/Runnable.h"
+#include "monarch/rt/Thread.h"
+#include "monarch/util/Timer.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+using namespace bitmunk::common;
+using namespace bitmunk::node;
+using namespace bitmunk::protocol;
+using namespace bitmunk::test;
+using namespace monarch::config;
+using namespace monarch::data::json;
+using namespace monarch::io;
+using namespace monarch::net;
+using namespace monarch::rt;
+using namespace monarch::test;
+using namespace monarch::util;
+
+namespace bm_tests_load
+{
+
+/**
+ * An OutputStream that discards streamed responses, counting their bytes.
+ */
+class CountingOutputStream : public OutputStream
+{
+public:
+   uint64_t bytes;
+
+   CountingOutputStream() : bytes(0) {};
+   virtual ~CountingOutputStream() {};
+   virtual bool write(const char* b, int length)
+   {
+      bytes += length;
+      return true;
+   }
+};
+
+/**
+ * The results for one endpoint in the request mix.
+ */
+struct EndpointResults
+{
+   vector<uint64_t> latencies;
+   uint64_t errors;
+   uint64_t bytes;
+
+   EndpointResults() : errors(0), bytes(0) {};
+};
+typedef vector<EndpointResults> ResultsList;
+
+/**
+ * A WarmupBarrier holds workers that have finished their warmup requests
+ * until all of them have, so that only the measured requests are timed.
+ */
+class WarmupBarrier
+{
+public:
+   ExclusiveLock lock;
+   int waiting;
+   bool released;
+
+   WarmupBarrier() : waiting(0), released(false) {};
+   virtual ~WarmupBarrier() {};
+
+   /**
+    * Called by a worker when it has finished its warmup requests, waits
+    * until the measured phase is started.
+    */
+   virtual void arrive()
+   {
+      lock.lock();
+      ++waiting;
+      lock.notifyAll();
+      while(!released)
+      {
+         lock.wait();
+      }
+      lock.unlock();
+   }
+
+   /**
+    * Waits for all workers to finish their warmup requests and then starts
+    * the measured phase.
+    *
+    * @param workers the number of workers.
+    */
+   virtual void release(int workers)
+   {
+      lock.lock();
+      while(waiting < workers)
+      {
+         lock.wait();
+      }
+      released = true;
+      lock.notifyAll();
+      lock.unlock();
+   }
+};
+
+/**
+ * A LoadWorker sends requests from the request mix to the node until its
+ * share of requests has been sent, recording the latency of each one.
+ *
+ * The mix is expanded by weight into a schedule that every worker walks
+ * through from a different offset, so the overall mix matches the weights
+ * without any randomness between runs. Workers wait for each other after
+ * their warmup requests so that only measured requests are timed.
+ */
+class LoadWorker : public Runnable
+{
+public:
+   Node* node;
+   DynamicObject mix;
+   vector<int>* schedule;
+   int offset;
+   int warmup;
+   int requests;
+   WarmupBarrier* barrier;
+   ResultsList results;
+
+   LoadWorker() {};
+   virtual ~LoadWorker() {};
+   virtual void run()
+   {
+      results.resize(mix->length());
+      for(int i = 0; i < warmup + requests; ++i)
+      {
+         if(i == warmup)
+         {
+            barrier->arrive();
+         }
+
+         int index = (*schedule)[(offset + i) % schedule->size()];
+         EndpointResults& er = results[index];
+
+         uint64_t bytes = 0;
+         uint64_t start = Timer::startTiming();
+         bool success = sendRequest(mix[index], bytes);
+         uint64_t us = (uint64_t)(Timer::getSeconds(start) * 1000000.0);
+
+         // exceptions are per-thread so they are only counted
+         if(!success)
+         {
+            Exception::clear();
+         }
+         if(i >= warmup)
+         {
+            er.latencies.push_back(us);
+            er.bytes += bytes;
+            er.errors += success ? 0 : 1;
+         }
+      }
+   }
+
+   bool sendRequest(DynamicObject& endpoint, uint64_t& bytes)
+   {
+      bool rval;
+
+      Messenger* messenger = node->getMessenger();
+      bool secure = endpoint["secure"]->getBoolean();
+      UserId userId = secure ? node->getDefaultUserId() : 0;
+      Url url;
+      url.format("%s%s",
+         messenger->getSelfUrl(secure).c_str(),
+         endpoint["path"]->getString());
+
+      const char* method = endpoint["method"]->getString();
+      BtpMessage::Type type =
+         (strcmp(method, "POST") == 0) ? BtpMessage::Post :
+         (strcmp(method, "PUT") == 0) ? BtpMessage::Put :
+         (strcmp(method, "DELETE") == 0) ? BtpMessage::Delete :
+         BtpMessage::Get;
+
+      if(endpoint["stream"]->getBoolean())
+      {
+         // stream response content without buffering it
+         CountingOutputStream cos;
+         BtpMessage out;
+         BtpMessage in;
+         out.setType(type);
+         if(endpoint->hasMember("content"))
+         {
+            out.setDynamicObject(endpoint["content"]);
+         }
+         in.setContentSink(&cos, false);
+         rval = messenger->exchange(0, &url, &out, &in, userId);
+         bytes = cos.bytes;
+      }
+      else
+      {
+         DynamicObject in;
+         DynamicObject* out = endpoint->hasMember("content") ?
+            &endpoint["content"] : NULL;
+         rval = messenger->exchange(0, type, &url, out, &in, userId);
+      }
+
+      return rval;
+   }
+};
+
+/**
+ * Gets the latency at a percentile from sorted latencies (nearest rank).
+ *
+ * @param sorted the sorted latencies in microseconds.
+ * @param p the percentile, between 0 and 1.
+ *
+ * @return the latency in milliseconds.
+ */
+static double getPercentile(vector<uint64_t>& sorted, double p)
+{
+   double rval = 0;
+
+   if(!sorted.empty())
+   {
+      size_t rank = (size_t)(p * sorted.size() + 0.999999);
+      rank = (rank == 0) ? 1 : min(rank, sorted.size());
+      rval = sorted[rank - 1] / 1000.0;
+   }
+
+   return rval;
+}
+
+/**
+ * Creates the report for a set of results.
+ *
+ * @param er the results.
+ * @param seconds the time taken for the measured requests.
+ *
+ * @return the report.
+ */
+static DynamicObject createReport(EndpointResults& er, double seconds)
+{
+   DynamicObject rval;
+
+   sort(er.latencies.begin(), er.latencies.end());
+   uint64_t count = er.latencies.size();
+   rval["requests"] = count;
+   rval["errors"] = er.errors;
+   rval["bytes"] = er.bytes;
+   rval["throughput"] = (seconds > 0) ? count / seconds : 0.0;
+
+   DynamicObject& latency = rval["latency"];
+   latency["min"] = count > 0 ? er.latencies.front() / 1000.0 : 0.0;
+   latency["p50"] = getPercentile(er.latencies, 0.50);
+   latency["p99"] = getPercentile(er.latencies, 0.99);
+   latency["p999"] = getPercentile(er.latencies, 0.999);
+   latency["max"] = count > 0 ? er.latencies.back() / 1000.0 : 0.0;
+
+   return rval;
+}
+
+/**
+ * Negotiates a contract with the node for the media of a file piece
+ * endpoint and fills in the piece request with the negotiated contract
+ * section, so that every piece request in the mix is for the same section.
+ *
+ * @param node the node to negotiate with.
+ * @param endpoint the file piece endpoint with a "contract" to negotiate.
+ *
+ * @return true if successful, false if an exception occurred.
+ */
+static bool negotiatePiece(Node& node, DynamicObject& endpoint)
+{
+   bool rval;
+
+   Messenger* messenger = node.getMessenger();
+   DynamicObject& info = endpoint["contract"];
+   UserId buyerId = BM_USER_ID(info["buyerId"]);
+   MediaId mediaId = BM_MEDIA_ID(info["mediaId"]);
+
+   // create contract
+   Contract c;
+   c["version"] = "3.0";
+   c["id"] = 0;
+   BM_ID_SET(c["buyer"]["userId"], buyerId);
+   c["buyer"]["profileId"] = 1;
+
+   // create contract media
+   Media& media = c["media"];
+   BM_ID_SET(media["id"], mediaId);
+
+   // create contract section
+   ContractSection cs = c["sections"]["1"]->append();
+   BM_ID_SET(cs["contractId"], 0);
+   BM_ID_SET(cs["buyer"]["userId"], buyerId);
+   BM_ID_SET(cs["buyer"]["profileId"], 1);
+   cs["webbuy"] = false;
+   BM_ID_SET(cs["ware"]["id"], mediaId);
+
+   Seller& seller = cs["seller"];
+   BM_ID_SET(seller["userId"], BM_USER_ID(info["sellerId"]));
+   BM_ID_SET(seller["profileId"], 1);
+   BM_ID_SET(seller["serverId"], 1);
+   seller["url"] = messenger->getSecureBitmunkUrl()->toString().c_str();
+
+   // get a signed media and then negotiate the contract with the node
+   Url licenseUrl;
+   licenseUrl.format("/api/3.0/sva/contracts/media/%" PRIu64, mediaId);
+   Url negotiateUrl;
+   negotiateUrl.format(
+      "/api/3.0/sales/contract/negotiate?nodeuser=%" PRIu64,
+      BM_USER_ID(info["sellerId"]));
+   if((rval =
+      messenger->postSecureToBitmunk(&licenseUrl, NULL, &media, buyerId) &&
+      messenger->postSecureToBitmunk(&negotiateUrl, &c, &c, buyerId)))
+   {
+      // fill in piece request
+      cs = c["sections"]["1"][0];
+      DynamicObject& content = endpoint["content"];
+      content["csHash"] = cs["hash"]->getString();
+      BM_ID_SET(
+         content["fileId"], BM_FILE_ID(cs["ware"]["fileInfos"][0]["id"]));
+      content["peerbuyKey"] = cs["peerbuyKey"]->getString();
+      BM_ID_SET(
+         content["sellerProfileId"],
+         BM_PROFILE_ID(cs["seller"]["profileId"]));
+   }
+
+   return rval;
+}
+
+static void runLoadBenchmark(Node& node, TestRunner& tr)
+{
+   tr.group("load");
+
+   Config cfg = tr.getApp()->getConfig()["bitmunk.tests.load"];
+   int threads = cfg["threads"]->getInt32();
+   int requests = cfg["requests"]->getInt32();
+   int warmup = cfg["warmup"]->getInt32();
+   assert(threads > 0 && requests > 0);
+
+   // only use endpoints that are given some weight, filling in defaults
+   DynamicObject mix;
+   mix->setType(Array);
+   vector<int> schedule;
+   DynamicObjectIterator i = cfg["mix"].getIterator();
+   while(i->hasNext())
+   {
+      DynamicObject endpoint = i->next().clone();
+      int weight = endpoint["weight"]->getInt32();
+      if(weight > 0)
+      {
+         if(!endpoint->hasMember("method"))
+         {
+            endpoint["method"] = "GET";
+         }
+         if(!endpoint->hasMember("secure"))
+         {
+            endpoint["secure"] = true;
+         }
+         if(!endpoint->hasMember("stream"))
+         {
+            endpoint["stream"] = false;
+         }
+         schedule.insert(schedule.end(), weight, mix->length());
+         mix->append() = endpoint;
+      }
+   }
+   assert(mix->length() > 0);
+
+   tr.test("negotiate");
+   {
+      // negotiate contracts for file piece endpoints once, up front
+      DynamicObjectIterator ei = mix.getIterator();
+      while(ei->hasNext())
+      {
+         DynamicObject& endpoint = ei->next();
+         if(endpoint->hasMember("contract"))
+         {
+            assertNoException(
+               negotiatePiece(node, endpoint));
+         }
+      }
+   }
+   tr.passIfNoException();
+
+   DynamicObject report;
+   tr.test("request mix");
+   {
+      // create one worker per thread
+      WarmupBarrier barrier;
+      vector<LoadWorker*> workers;
+      vector<RunnableRef> refs;
+      for(int n = 0; n < threads; ++n)
+      {
+         LoadWorker* w = new LoadWorker();
+         refs.push_back(w);
+         w->node = &node;
+         w->mix = mix.clone();
+         w->schedule = &schedule;
+         w->offset = n * schedule.size() / threads;
+         w->warmup = warmup;
+         w->requests = requests;
+         w->barrier = &barrier;
+         workers.push_back(w);
+      }
+
+      // run all workers at once
+      vector<Thread*> started;
+      for(int n = 0; n < threads; ++n)
+      {
+         Thread* t = new Thread(refs[n]);
+         bool success = t->start();
+         assert(success);
+         started.push_back(t);
+      }
+
+      // time only the measured requests, once every worker has warmed up
+      barrier.release(threads);
+      uint64_t start = Timer::startTiming();
+      for(vector<Thread*>::iterator ti = started.begin();
+          ti != started.end(); ++ti)
+      {
+         (*ti)->join();
+         delete *ti;
+      }
+      double seconds = Timer::getSeconds(start);
+
+      // merge results per endpoint and for all endpoints
+      EndpointResults all;
+      report["threads"] = threads;
+      report["seconds"] = seconds;
+      report["endpoints"]->setType(Map);
+      for(int e = 0; e < mix->length(); ++e)
+      {
+         EndpointResults merged;
+         for(int n = 0; n < threads; ++n)
+         {
+            EndpointResults& er = workers[n]->results[e];
+            merged.latencies.insert(
+               merged.latencies.end(),
+               er.latencies.begin(), er.latencies.end());
+            merged.errors += er.errors;
+            merged.bytes += er.bytes;
+         }
+         all.latencies.insert(
+            all.latencies.end(),
+            merged.latencies.begin(), merged.latencies.end());
+         all.errors += merged.errors;
+         all.bytes += merged.bytes;
+         report["endpoints"][mix[e]["name"]->getString()] =
+            createReport(merged, seconds);
+      }
+      report["all"] = createReport(all, seconds);
+   }
+   tr.passIfNoException();
+
+   tr.test("report");
+   {
+      // write report to a file or stdout
+      const char* output = cfg["output"]->getString();
+      if(strlen(output) > 0)
+      {
+         File file(output);
+         FileOutputStream fos(file);
+         JsonWriter writer;
+         assertNoException(
+            writer.write(report, &fos));
+         fos.close();
+      }
+      else
+      {
+         printf("\n");
+         JsonWriter::writeToStdOut(report);
+      }
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+static bool run(TestRunner& tr)
+{
+   if(tr.isTestEnabled("load-benchmark"))
+   {
+      // load and start node
+      Node* node = Tester::loadNode(tr, "test-load");
+      assertNoException(
+         node->start());
+
+      // run benchmark
+      runLoadBenchmark(*node, tr);
+
+      // stop and unload node
+      node->stop();
+      Tester::unloadNode(tr);
+   }
+
+   return true;
+};
+
+} // end namespace
+
+MO_TEST_MODULE_FN(
+   "bitmunk.tests.load.test", "1.0", bm_tests_load::run)
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2010 Digital Bazaar, Inc. All rights reserved.
+ */
+#define __STDC_FORMAT_MACROS
+
+#include "bitmunk/test/Tester.h"
+#include "monarch/test/Test.h"
+#include "monarch/test/TestModule.h"
+
+
+#include "bitmunk/medialibrary/IMediaLibrary.h"
+#include "bitmunk/node/Node.h"
+#include "bitmunk/test/Tester.h"
+#include "monarch/event/EventWaiter.h"
+#include "monarch/io/File.h"
+#include "monarch/rt/DynamicObject.h"
+#include "monarch/rt/Exception.h"
+#include "monarch/test/Test.h"
+#include "monarch/test/TestModule.h"
+#include "monarch/util/StringTools.h"
+
+#include <cstring>
+
+using namespace std;
+using namespace bitmunk::common;
+using namespace bitmunk::medialibrary;
+using namespace bitmunk::node;
+using namespace bitmunk::test;
+using namespace monarch::config;
+using namespace monarch::event;
+using namespace monarch::io;
+using namespace monarch::rt;
+using namespace monarch::sql;
+using namespace monarch::test;
+using namespace monarch::util;
+
+#define EVENT_IMPORT_PROGRESS  "bitmunk.medialibrary.Import.progress"
+#define EVENT_IMPORT_COMPLETED "bitmunk.medialibrary.Import.completed"
+#define EVENT_FILE_SCANNED     "bitmunk.medialibrary.File.scanned"
+#define EVENT_FILE_UPDATED     "bitmunk.medialibrary.File.updated"
+
+namespace bm_tests_medialibrary
+{
+
+static UserId sUserId;
+static string sTestDataDir;
+
+/**
+ * Creates the FileInfos for the test files with the given numbers.
+ *
+ * @param first the number of the first file.
+ * @param last the number of the last file.
+ *
+ * @return the FileInfos.
+ */
+static FileInfoList createFiles(uint32_t first, uint32_t last)
+{
+   FileInfoList rval;
+   rval->setType(Array);
+   for(uint32_t i = first; i <= last; ++i)
+   {
+      File file(
+         StringTools::format("%s%u.mp3", sTestDataDir.c_str(), i).c_str());
+      FileInfo fi;
+      fi["path"] = file->getAbsolutePath();
+      rval->append(fi);
+   }
+   return rval;
+}
+
+/**
+ * Collects events until an import completes.
+ *
+ * @param ew the event waiter.
+ * @param importId the ID of the import.
+ *
+ * @return the events in the order they were received.
+ */
+static DynamicObject waitForImport(EventWaiter& ew, uint64_t importId)
+{
+   DynamicObject rval;
+   rval->setType(Array);
+
+   bool completed = false;
+   while(!completed)
+   {
+      assert(ew.waitForEvent(30*1000));
+      Event e = ew.popEvent();
+      while(!e.isNull())
+      {
+         rval->append(e);
+         completed = completed || (
+            strcmp(e["type"]->getString(), EVENT_IMPORT_COMPLETED) == 0 &&
+            e["details"]["importId"]->getUInt64() == importId);
+         e = ew.popEvent();
+      }
+   }
+
+   return rval;
+}
+
+/**
+ * Counts the events of a type.
+ *
+ * @param events the events.
+ * @param type the event type.
+ *
+ * @return the number of events of the type.
+ */
+static int countEvents(DynamicObject& events, const char* type)
+{
+   int rval = 0;
+   DynamicObjectIterator i = events.getIterator();
+   while(i->hasNext())
+   {
+      if(strcmp(i->next()["type"]->getString(), type) == 0)
+      {
+         ++rval;
+      }
+   }
+   return rval;
+}
+
+static void runImportTest(Node& node, TestRunner& tr)
+{
+   IMediaLibrary* iml = dynamic_cast<IMediaLibrary*>(
+      node.getModuleApiByType("bitmunk.medialibrary"));
+   assert(iml != NULL);
+
+   tr.group("import");
+
+   // the test config uses one worker, batches of 4 files and a progress
+   // event for every file
+   tr.test("progress and batches");
+   {
+      EventWaiter ew(node.getEventController());
+      ew.start(EVENT_IMPORT_PROGRESS);
+      ew.start(EVENT_IMPORT_COMPLETED);
+      ew.start(EVENT_FILE_UPDATED);
+
+      uint64_t batches = iml->getScanStats()["batches"]->getUInt64();
+      FileInfoList files = createFiles(2, 10);
+      DynamicObject userData;
+      userData["test"] = "progress";
+      uint64_t importId = 0;
+      assertNoException(
+         iml->importFiles(sUserId, files, &userData, &importId));
+      assert(importId != 0);
+
+      DynamicObject events = waitForImport(ew, importId);
+      assert(countEvents(events, EVENT_IMPORT_PROGRESS) == 8);
+      assert(countEvents(events, EVENT_FILE_UPDATED) == 9);
+
+      // progress increases and the time left is estimated until completed
+      uint32_t completed = 0;
+      DynamicObjectIterator i = events.getIterator();
+      while(i->hasNext())
+      {
+         Event& e = i->next();
+         if(strcmp(e["type"]->getString(), EVENT_FILE_UPDATED) != 0)
+         {
+            DynamicObject& d = e["details"];
+            assert(d["importId"]->getUInt64() == importId);
+            assert(d["total"]->getUInt32() == 9);
+            assert(d["completed"]->getUInt32() == completed + 1);
+            assert(d["failed"]->getUInt32() == 0);
+            assert(d->hasMember("elapsed"));
+            assert(d->hasMember("remaining"));
+            assertStrCmp(d["userData"]["test"]->getString(), "progress");
+            completed = d["completed"]->getUInt32();
+         }
+      }
+      assert(completed == 9);
+      assert(events.last()["details"]["remaining"]->getUInt64() == 0);
+
+      // 9 files are stored in batches of 4, 4 and 1
+      DynamicObject stats = iml->getScanStats();
+      assert(stats["batches"]->getUInt64() == batches + 3);
+      assert(stats["imports"]->getUInt32() == 0);
+   }
+   tr.passIfNoException();
+
+   tr.test("interactive priority");
+   {
+      EventWaiter ew(node.getEventController());
+      ew.start(EVENT_IMPORT_COMPLETED);
+      ew.start(EVENT_FILE_SCANNED);
+
+      FileInfoList files = createFiles(2, 10);
+      uint64_t importId = 0;
+      assertNoException(
+         iml->importFiles(sUserId, files, NULL, &importId));
+
+      // scan a file while the import is queued
+      FileInfo fi = createFiles(2, 2).first();
+      DynamicObject userData;
+      userData["interactive"] = true;
+      iml->scanFile(sUserId, fi, false, &userData);
+
+      // the interactive scan is run as soon as the worker is free, before
+      // the rest of the import
+      DynamicObject events = waitForImport(ew, importId);
+      int importScans = 0;
+      int interactive = -1;
+      for(int n = 0; interactive == -1 && n < events->length(); ++n)
+      {
+         Event& e = events[n];
+         if(strcmp(e["type"]->getString(), EVENT_FILE_SCANNED) == 0)
+         {
+            if(e["details"]->hasMember("userData"))
+            {
+               interactive = n;
+            }
+            else
+            {
+               ++importScans;
+            }
+         }
+      }
+      assert(interactive != -1);
+      assert(importScans <= 2);
+      assert(countEvents(events, EVENT_FILE_SCANNED) == 10);
+   }
+   tr.passIfNoException();
+
+   tr.test("batch fallback");
+   {
+      // make storing one of the files fail
+      Connection* c = iml->getConnection(sUserId);
+      assert(c != NULL);
+      Statement* s = c->prepare(
+         "CREATE TRIGGER test_medialibrary_fail "
+         "BEFORE INSERT ON bitmunk_medialibrary_files FOR EACH ROW "
+         "WHEN NEW.path LIKE '%/3.mp3' "
+         "BEGIN SELECT RAISE(ABORT, 'test failure'); END;");
+      assert(s != NULL);
+      assertNoException(s->execute());
+      c->close();
+
+      EventWaiter ew(node.getEventController());
+      ew.start(EVENT_IMPORT_COMPLETED);
+      ew.start(EVENT_FILE_UPDATED);
+
+      // the batch fails, so its files are stored one at a time and only
+      // the failing file is reported
+      uint64_t batches = iml->getScanStats()["batches"]->getUInt64();
+      FileInfoList files = createFiles(2, 4);
+      uint64_t importId = 0;
+      assertNoException(
+         iml->importFiles(sUserId, files, NULL, &importId));
+      DynamicObject events = waitForImport(ew, importId);
+      assert(countEvents(events, EVENT_FILE_UPDATED) == 2);
+      DynamicObject& d = events.last()["details"];
+      assert(d["completed"]->getUInt32() == 3);
+      assert(d["failed"]->getUInt32() == 1);
+      assert(iml->getScanStats()["batches"]->getUInt64() == batches + 1);
+
+      c = iml->getConnection(sUserId);
+      assert(c != NULL);
+      s = c->prepare("DROP TRIGGER test_medialibrary_fail");
+      assert(s != NULL);
+      assertNoException(s->execute());
+      c->close();
+   }
+   tr.passIfNoException();
+
+   tr.ungroup();
+}
+
+static bool run(TestRunner& tr)
+{
+   if(tr.isTestEnabled("login-required"))
+   {
+      // load and start node
+      Node* node = Tester::loadNode(tr, "test-medialibrary");
+      assertNoException(
+         node->start());
+
+      Config cfg = tr.getApp()->getConfig();
+      sTestDataDir = cfg["test"]["dataPath"]->getString();
+      sUserId = node->getDefaultUserId();
+      assert(sUserId != 0);
+
+      // run test(s)
+      runImportTest(*node, tr);
+
+      // stop and unload node
+      node->stop();
+      Tester::unloadNode(tr);
+   }
+
+   return true;
+}
+
+} // end namespace
+
+MO_TEST_MODULE_FN(
+   "bitmunk.tests.medialibrary.test", "1.0", bm_tests_medialibrary::run)
@@ -289,11 +289,16 @@ static void _setupRequestHeader(
       proxy->setField("Content-Type", value.c_str());
    }
 
-   // include accept field from client's request header
+   // include accept field from client's request header, the client
+   // cannot read the binary format so default to json
    if(client->getField("Accept", value))
    {
       proxy->setField("Accept", value.c_str());
    }
+   else
+   {
+      proxy->setField("Accept", "application/json");
+   }
 }
 
 /**